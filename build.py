@@ -1,9 +1,102 @@
 #!/usr/bin/env python3
 
 import os
+import shutil
+import subprocess
 import sys
 
-c = os.system("clang -Wall -Werror xcb_vulkan.c -o xcb_vulkan -g -lm -lxcb -lvulkan -DVK_USE_PLATFORM_XCB_KHR");
+# GLSL source, shader stage and the name of the array it is embedded as.
+SHADERS = [
+    ("vertex_shader.glsl", "vert", "g_vertex_shader_spv"),
+    ("vertex_shader_bindless.glsl", "vert", "g_vertex_shader_bindless_spv"),
+    ("fragment_shader.glsl", "frag", "g_fragment_shader_spv"),
+    ("procedural_geometry.glsl", "comp", "g_procedural_geometry_spv"),
+]
 
-if len(sys.argv) > 1 and sys.argv[1] == "run" and c == 0:
+# Generated files go here rather than next to the sources, so a build never touches anything that is checked in.
+BUILD_DIR = "build"
+
+# Compiles the GLSL into BUILD_DIR, optimizes and validates the result, returning the .spv path of every shader or
+# None on failure. glslangValidator, spirv-opt and spirv-val come with the Vulkan SDK. Without glslangValidator the
+# checked in .spv files are embedded as they are, a shader with none checked in gets None and is left out.
+def compile_shaders():
+    glslang = shutil.which("glslangValidator")
+    spirv_opt = shutil.which("spirv-opt")
+    spirv_val = shutil.which("spirv-val")
+
+    if glslang is None:
+        print("glslangValidator not found, embedding the checked in SPIR-V")
+        spvs = []
+
+        for glsl, _, _ in SHADERS:
+            spv = glsl.replace(".glsl", ".spv")
+
+            if os.path.exists(spv):
+                spvs.append(spv)
+            else:
+                print("%s isn't checked in, building without it" % spv)
+                spvs.append(None)
+
+        return spvs
+
+    spvs = []
+
+    for glsl, stage, _ in SHADERS:
+        spv = os.path.join(BUILD_DIR, glsl.replace(".glsl", ".spv"))
+
+        if subprocess.call([glslang, "-V", "-S", stage, glsl, "-o", spv]) != 0:
+            return None
+
+        if spirv_opt is not None and subprocess.call([spirv_opt, "-O", spv, "-o", spv]) != 0:
+            return None
+
+        if spirv_val is not None and subprocess.call([spirv_val, spv]) != 0:
+            return None
+
+        spvs.append(spv)
+
+    return spvs
+
+# Writes every .spv as a uint32_t array to BUILD_DIR/shaders.h, so startup doesn't read shader files. uint32_t keeps
+# the words aligned the way vkCreateShaderModule wants them. A shader that was left out is a single zero word,
+# which shader_embedded in xcb_vulkan.c checks for.
+def embed_shaders(spvs):
+    lines = ["// Generated by build.py from the .spv files, don't edit.", ""]
+
+    for (_, _, name), path in zip(SHADERS, spvs):
+        if path is None:
+            lines.append("static const uint32_t %s[] = {0}; // not built" % name)
+            lines.append("")
+            continue
+
+        with open(path, "rb") as f:
+            spv = f.read()
+
+        assert len(spv) % 4 == 0
+        words = [int.from_bytes(spv[i:i + 4], "little") for i in range(0, len(spv), 4)]
+        lines.append("static const uint32_t %s[] = {" % name)
+
+        for i in range(0, len(words), 8):
+            lines.append("    " + " ".join("0x%08x," % w for w in words[i:i + 8]))
+
+        lines.append("};")
+        lines.append("")
+
+    with open(os.path.join(BUILD_DIR, "shaders.h"), "w") as f:
+        f.write("\n".join(lines))
+
+# build.py [trace] [run], trace compiles in the --trace timeline export.
+defines = " -DXCB_VULKAN_TRACE" if "trace" in sys.argv[1:] else ""
+
+os.makedirs(BUILD_DIR, exist_ok=True)
+spvs = compile_shaders()
+
+if spvs is None:
+    sys.exit(1)
+
+embed_shaders(spvs)
+
+c = os.system("clang -Wall -Werror -I" + BUILD_DIR + " xcb_vulkan.c -o xcb_vulkan -g -pthread -lm -lxcb -lvulkan -DVK_USE_PLATFORM_XCB_KHR" + defines);
+
+if "run" in sys.argv[1:] and c == 0:
     os.system("./xcb_vulkan")
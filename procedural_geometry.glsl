@@ -0,0 +1,76 @@
+#version 450
+layout (local_size_x = 64) in;
+layout (std430, set = 0, binding = 0) writeonly buffer Geometry {
+    uint words[];
+} geometry;
+layout (push_constant) uniform Params {
+    uint resolution;
+    uint face_count;
+    uint first_axis;
+    uint row_size;
+    uint positions_offset;
+    uint index_offset;
+    float offset;
+    float amplitude;
+    float frequency;
+} params;
+
+// Component r of a vertex, counted from the face's axis: the height along it, then the two grid coordinates.
+float face_component(uint r, float d, float u, float v) {
+    return r == 0 ? d : (r == 1 ? u : v);
+}
+
+// One invocation per vertex, the first face_count * resolution^2 also write the two triangles of a quad. Each face
+// is a grid of (resolution + 1)^2 vertices from -1 to 1, moved out along its axis by offset and displaced by a
+// height function. Odd faces point the other way, their v is flipped so the winding stays the same.
+void main() {
+    uint id = gl_GlobalInvocationID.y * params.row_size + gl_GlobalInvocationID.x;
+    uint side = params.resolution + 1;
+    uint face_vertices = side * side;
+
+    if (id < params.face_count * face_vertices) {
+        uint face = id / face_vertices;
+        uint local = id % face_vertices;
+        float s = 1.0 - 2.0 * float(face & 1);
+        float u = 2.0 * float(local % side) / float(params.resolution) - 1.0;
+        float v = 2.0 * float(local / side) / float(params.resolution) - 1.0;
+        float d = params.offset * s + params.amplitude * sin(params.frequency * u) * sin(params.frequency * v);
+        uint axis = params.first_axis + face / 2;
+        vec3 p = vec3(face_component((3 - axis) % 3, d, u, v * s),
+                      face_component((4 - axis) % 3, d, u, v * s),
+                      face_component((5 - axis) % 3, d, u, v * s));
+
+        uint base = id * 8;
+        geometry.words[base + 0] = floatBitsToUint(p.x);
+        geometry.words[base + 1] = floatBitsToUint(p.y);
+        geometry.words[base + 2] = floatBitsToUint(p.z);
+        geometry.words[base + 3] = floatBitsToUint(1.0);
+        geometry.words[base + 4] = floatBitsToUint(0.5 + 0.5 * u);
+        geometry.words[base + 5] = floatBitsToUint(0.5 + 0.5 * v);
+        geometry.words[base + 6] = floatBitsToUint(0.75 + 0.25 * s);
+        geometry.words[base + 7] = floatBitsToUint(1.0);
+
+        if (params.positions_offset != 0) {
+            uint position = params.positions_offset + id * 4;
+            geometry.words[position + 0] = floatBitsToUint(p.x);
+            geometry.words[position + 1] = floatBitsToUint(p.y);
+            geometry.words[position + 2] = floatBitsToUint(p.z);
+            geometry.words[position + 3] = floatBitsToUint(1.0);
+        }
+    }
+
+    uint quads = params.resolution * params.resolution;
+
+    if (id < params.face_count * quads) {
+        uint face = id / quads;
+        uint quad = id % quads;
+        uint a = face * face_vertices + (quad / params.resolution) * side + quad % params.resolution;
+        uint index = params.index_offset + id * 6;
+        geometry.words[index + 0] = a;
+        geometry.words[index + 1] = a + side;
+        geometry.words[index + 2] = a + 1;
+        geometry.words[index + 3] = a + 1;
+        geometry.words[index + 4] = a + side;
+        geometry.words[index + 5] = a + side + 1;
+    }
+}
@@ -0,0 +1,16 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_EXT_nonuniform_qualifier : enable
+layout (std430, set = 0, binding = 0) readonly buffer Transforms {
+    mat4 mvp[];
+} transforms[];
+layout (push_constant) uniform PushConstants {
+    uint transform_buffer;
+} push;
+layout (location = 0) in vec4 pos;
+layout (location = 1) in vec4 inColor;
+layout (location = 0) out vec4 outColor;
+void main() {
+   outColor = inColor;
+   gl_Position = transforms[push.transform_buffer].mvp[gl_InstanceIndex] * pos;
+}
\ No newline at end of file
@@ -1,11 +1,24 @@
 #include <xcb/xcb.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
 #include <vulkan/vulkan.h>
 #include <math.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <semaphore.h>
+
+#include "shaders.h"
 
 typedef struct {
     VkImage image;
@@ -24,13 +37,17 @@ typedef struct
 
 const float pi = 3.1415926535897932;
 
+// Vertical field of view in degrees. Set from the config at startup.
+static float g_fov = 75.0f;
+static float g_near_plane = 0.01f;
+static float g_far_plane = 1000.0f;
+
 static mat4_t create_projection_matrix(float bb_width, float bb_height)
 {
-    float near_plane = 0.01f;
-    float far_plane = 1000.0f;
-    float fov = 75.0f;
+    float near_plane = g_near_plane;
+    float far_plane = g_far_plane;
     float aspect = bb_width / bb_height;
-    float y_scale = 1.0f / tanf((pi / 180.0f) * fov / 2);
+    float y_scale = 1.0f / tanf((pi / 180.0f) * g_fov / 2);
     float x_scale = y_scale / aspect;
     mat4_t proj = {
         {x_scale, 0, 0, 0},
@@ -41,6 +58,18 @@ static mat4_t create_projection_matrix(float bb_width, float bb_height)
     return proj;
 }
 
+// Height in pixels that length covers on screen when it is distance away from the camera and faces it, using the
+// same projection as create_projection_matrix.
+static float projected_size(float length, float distance, float bb_height)
+{
+    float y_scale = 1.0f / tanf((pi / 180.0f) * g_fov / 2);
+
+    if (distance < g_near_plane)
+        distance = g_near_plane;
+
+    return length * y_scale / distance * bb_height * 0.5f;
+}
+
 
 mat4_t mat4_identity()
 {
@@ -54,25 +83,41 @@ mat4_t mat4_identity()
     return i;
 }
 
-int memory_type_from_properties(const VkMemoryRequirements* memory_requirements, const VkPhysicalDeviceMemoryProperties* memory_properties, VkMemoryPropertyFlags memory_requirement_mask)
+// Returns the first queue family that has all of required_flags and none of excluded_flags, or -1.
+uint32_t queue_family_with_flags(const VkQueueFamilyProperties* queue_props, uint32_t queue_family_count, VkQueueFlags required_flags, VkQueueFlags excluded_flags)
 {
-    uint32_t type_bits = memory_requirements->memoryTypeBits;
-    for (uint32_t i = 0; i < memory_properties->memoryTypeCount; ++i)
+    for (uint32_t i = 0; i < queue_family_count; ++i)
     {
-        if ((type_bits & 1) == 1)
-        {
-            if ((memory_properties->memoryTypes[i].propertyFlags & memory_requirement_mask) == memory_requirement_mask)
-            {
-                return i;
-            }
-        }
+        if (queue_props[i].queueCount == 0)
+            continue;
 
-        type_bits >>= 1;
+        if ((queue_props[i].queueFlags & required_flags) == required_flags && (queue_props[i].queueFlags & excluded_flags) == 0)
+            return i;
     }
 
     return -1;
 }
 
+// Records one half of a queue family ownership transfer of a whole buffer. The release half is recorded on the
+// source queue with dst_access = 0, the acquire half on the destination queue with src_access = 0. Does nothing
+// when both queues are of the same family, since there is no ownership to transfer then.
+void cmd_buffer_ownership_barrier(VkCommandBuffer cmd, VkBuffer buffer, uint32_t src_queue_idx, uint32_t dst_queue_idx, VkPipelineStageFlags src_stage, VkAccessFlags src_access, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access)
+{
+    if (src_queue_idx == dst_queue_idx)
+        return;
+
+    VkBufferMemoryBarrier bmb = {};
+    bmb.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    bmb.srcAccessMask = src_access;
+    bmb.dstAccessMask = dst_access;
+    bmb.srcQueueFamilyIndex = src_queue_idx;
+    bmb.dstQueueFamilyIndex = dst_queue_idx;
+    bmb.buffer = buffer;
+    bmb.offset = 0;
+    bmb.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(cmd, src_stage, dst_stage, 0, 0, NULL, 1, &bmb, 0, NULL);
+}
+
 typedef struct {
     float x, y, z, w;
 } quat_t;
@@ -329,718 +374,2160 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL vulkan_debug_callback(
     return VK_FALSE;
 }
 
+// Linear allocator. Allocations are bumped out of one block and released all at once by arena_reset, or back
+// to an earlier point with arena_rewind. Used for everything at startup and for per-frame scratch memory.
 typedef struct
 {
-    char* data;
-    size_t size;
-} file_data_t;
+    uint8_t* base;
+    size_t capacity;
+    size_t used;
+    size_t high_water;
+} arena_t;
 
-typedef enum { 
-    FILE_LOAD_SUCCESS,
-    FILE_LOAD_DOES_NOT_EXIST
-} file_load_success_e;
+void arena_create(arena_t* a, size_t capacity)
+{
+    a->base = malloc(capacity);
+    assert(a->base);
+    a->capacity = capacity;
+    a->used = 0;
+    a->high_water = 0;
+}
 
-file_load_success_e file_load(const char* filename, file_data_t* file_data)
+void arena_destroy(arena_t* a)
 {
-    FILE* file_handle = fopen(filename, "rb");
+    free(a->base);
+    memset(a, 0, sizeof(arena_t));
+}
 
-    if (file_handle == NULL)
-        return FILE_LOAD_DOES_NOT_EXIST;
+void* arena_alloc(arena_t* a, size_t size, size_t alignment)
+{
+    size_t offset = (a->used + alignment - 1) & ~(alignment - 1);
+    assert(offset + size <= a->capacity && "arena out of memory");
+    a->used = offset + size;
 
-    fseek(file_handle, 0, SEEK_END);
-    unsigned filesize = ftell(file_handle);
-    fseek(file_handle, 0, SEEK_SET);
-    char* data = malloc(filesize);
-    fread(data, 1, filesize, file_handle);
-    fclose(file_handle);
-    file_data->data = data;
-    file_data->size = filesize;
-    return FILE_LOAD_SUCCESS;
+    if (a->used > a->high_water)
+        a->high_water = a->used;
+
+    return a->base + offset;
 }
 
-int main()
+#define arena_alloc_array(a, type, count) ((type*)arena_alloc((a), sizeof(type) * (count), _Alignof(type)))
+
+size_t arena_mark(const arena_t* a)
 {
-    xcb_connection_t* c = xcb_connect(NULL, NULL);
-    xcb_screen_t* screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
-    xcb_drawable_t win = xcb_generate_id(c);
-
-    uint32_t mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
-    uint32_t values[] = {screen->black_pixel,  XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS};
-    xcb_create_window(
-        c,
-        XCB_COPY_FROM_PARENT,
-        win,
-        screen->root,
-        0, 0, 640, 480,
-        10,
-        XCB_WINDOW_CLASS_INPUT_OUTPUT,
-        screen->root_visual,
-        mask, values);
-    xcb_map_window(c, win);
-    xcb_flush(c);
+    return a->used;
+}
 
-    VkApplicationInfo app_info = {};
-    app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-    app_info.pApplicationName = "VulkanTest";
-    app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
-    app_info.apiVersion = VK_API_VERSION_1_0;
+void arena_rewind(arena_t* a, size_t mark)
+{
+    assert(mark <= a->used);
+    a->used = mark;
+}
 
-    VkInstanceCreateInfo instance_info = {};
-    instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-    instance_info.pApplicationInfo = &app_info;
+void arena_reset(arena_t* a)
+{
+    a->used = 0;
+}
 
-    const char* const extensions[] = {VK_EXT_DEBUG_UTILS_EXTENSION_NAME, VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_XCB_SURFACE_EXTENSION_NAME};
-    instance_info.ppEnabledExtensionNames = extensions;
-    instance_info.enabledExtensionCount = 3;
+// Counters for host memory the driver allocates through g_vk_allocator. Updated from whatever thread the driver
+// calls back on, hence atomic.
+typedef struct
+{
+    atomic_size_t allocation_count;
+    atomic_size_t live_allocations;
+    atomic_size_t live_bytes;
+    atomic_size_t peak_bytes;
+    atomic_size_t internal_bytes;
+} host_allocation_stats_t;
 
-    VkDebugUtilsMessengerCreateInfoEXT debug_ext_ci = {};
-    debug_ext_ci.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
-    debug_ext_ci.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
-    debug_ext_ci.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
-    debug_ext_ci.pfnUserCallback = vulkan_debug_callback;
+typedef struct
+{
+    void* block;
+    size_t size;
+} tracked_allocation_header_t;
 
-    const char* validation_layers[] = {"VK_LAYER_KHRONOS_validation"};
+static void* VKAPI_CALL tracking_allocation(void* user_data, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    host_allocation_stats_t* stats = user_data;
+
+    // The header sits right before the returned pointer, so it needs at least its own alignment.
+    if (alignment < _Alignof(tracked_allocation_header_t))
+        alignment = _Alignof(tracked_allocation_header_t);
+
+    uint8_t* block = malloc(size + alignment + sizeof(tracked_allocation_header_t));
+    if (block == NULL)
+        return NULL;
+
+    uintptr_t p = (uintptr_t)(block + sizeof(tracked_allocation_header_t));
+    p = (p + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    tracked_allocation_header_t* header = (tracked_allocation_header_t*)p - 1;
+    header->block = block;
+    header->size = size;
+
+    atomic_fetch_add(&stats->allocation_count, 1);
+    atomic_fetch_add(&stats->live_allocations, 1);
+    size_t live_bytes = atomic_fetch_add(&stats->live_bytes, size) + size;
+    size_t peak_bytes = atomic_load(&stats->peak_bytes);
+    while (live_bytes > peak_bytes && !atomic_compare_exchange_weak(&stats->peak_bytes, &peak_bytes, live_bytes))
+        ;
+
+    return (void*)p;
+}
 
-    instance_info.ppEnabledLayerNames = validation_layers;
-    instance_info.enabledLayerCount = 1;
-    instance_info.pNext = &debug_ext_ci;
+static void VKAPI_CALL tracking_free(void* user_data, void* memory)
+{
+    if (memory == NULL)
+        return;
+
+    host_allocation_stats_t* stats = user_data;
+    tracked_allocation_header_t* header = (tracked_allocation_header_t*)memory - 1;
+    atomic_fetch_sub(&stats->live_allocations, 1);
+    atomic_fetch_sub(&stats->live_bytes, header->size);
+    free(header->block);
+}
 
-    VkInstance instance;
-    VkResult res;
-    res = vkCreateInstance(&instance_info, NULL, &instance);
-    assert(res == VK_SUCCESS);
+static void* VKAPI_CALL tracking_reallocation(void* user_data, void* original, size_t size, size_t alignment, VkSystemAllocationScope scope)
+{
+    if (original == NULL)
+        return tracking_allocation(user_data, size, alignment, scope);
 
-    VkDebugUtilsMessengerEXT debug_messenger;
-    typedef VkResult (*func_vkCreateDebugUtilsMessengerEXT)(VkInstance, const VkDebugUtilsMessengerCreateInfoEXT*, const VkAllocationCallbacks*, VkDebugUtilsMessengerEXT*);
-    typedef void (*func_vkDestroyDebugUtilsMessengerEXT)(VkInstance, VkDebugUtilsMessengerEXT, const VkAllocationCallbacks*);
-    func_vkCreateDebugUtilsMessengerEXT vkCreateDebugUtilsMessengerEXT = (func_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
-    func_vkDestroyDebugUtilsMessengerEXT vkDestroyDebugUtilsMessengerEXT = (func_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
-    vkCreateDebugUtilsMessengerEXT(instance, &debug_ext_ci, NULL, &debug_messenger);
+    if (size == 0)
+    {
+        tracking_free(user_data, original);
+        return NULL;
+    }
 
-    uint32_t gpus_count = 0;
-    res = vkEnumeratePhysicalDevices(instance, &gpus_count, NULL);
-    assert(res == VK_SUCCESS);
-    assert(gpus_count == 1);
-    VkPhysicalDevice* gpus = malloc(sizeof(VkPhysicalDevice) * gpus_count);
-    res = vkEnumeratePhysicalDevices(instance, &gpus_count, gpus);
-    assert(res == VK_SUCCESS);
+    void* memory = tracking_allocation(user_data, size, alignment, scope);
+    if (memory == NULL)
+        return NULL;
 
-    VkPhysicalDeviceMemoryProperties memory_properties;
-    VkPhysicalDeviceProperties gpu_properties;
-    vkGetPhysicalDeviceMemoryProperties(gpus[0], &memory_properties);
-    vkGetPhysicalDeviceProperties(gpus[0], &gpu_properties);
+    size_t original_size = ((tracked_allocation_header_t*)original - 1)->size;
+    memcpy(memory, original, original_size < size ? original_size : size);
+    tracking_free(user_data, original);
+    return memory;
+}
 
-    uint32_t queue_family_count = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(gpus[0], &queue_family_count, NULL);
-    VkQueueFamilyProperties* queue_props = malloc(sizeof(VkQueueFamilyProperties) * queue_family_count);
-    vkGetPhysicalDeviceQueueFamilyProperties(gpus[0], &queue_family_count, queue_props);
+static void VKAPI_CALL tracking_internal_allocation(void* user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope)
+{
+    host_allocation_stats_t* stats = user_data;
+    atomic_fetch_add(&stats->internal_bytes, size);
+}
 
-    VkXcbSurfaceCreateInfoKHR xcb_create_info = {};
-    xcb_create_info.sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR;
-    xcb_create_info.connection = c;
-    xcb_create_info.window = win;
+static void VKAPI_CALL tracking_internal_free(void* user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope)
+{
+    host_allocation_stats_t* stats = user_data;
+    atomic_fetch_sub(&stats->internal_bytes, size);
+}
 
-    VkSurfaceKHR surface;
-    res = vkCreateXcbSurfaceKHR(instance, &xcb_create_info, NULL, &surface);
-    assert(res == VK_SUCCESS);
+static host_allocation_stats_t g_vk_host_allocation_stats;
 
-    VkBool32* queue_present_support = malloc(queue_family_count * sizeof(VkBool32));
-    for (uint32_t i = 0; i < queue_family_count; ++i)
+static const VkAllocationCallbacks g_vk_allocator = {
+    &g_vk_host_allocation_stats,
+    tracking_allocation,
+    tracking_reallocation,
+    tracking_free,
+    tracking_internal_allocation,
+    tracking_internal_free
+};
+
+typedef struct
+{
+    char* data;
+    size_t size;
+} file_data_t;
+
+typedef enum { 
+    FILE_LOAD_SUCCESS,
+    FILE_LOAD_DOES_NOT_EXIST,
+    FILE_LOAD_READ_ERROR
+} file_load_success_e;
+
+file_load_success_e file_load(const char* filename, file_data_t* file_data, arena_t* arena)
+{
+    FILE* file_handle = fopen(filename, "rb");
+
+    if (file_handle == NULL)
+        return FILE_LOAD_DOES_NOT_EXIST;
+
+    long filesize = -1;
+    if (fseek(file_handle, 0, SEEK_END) == 0)
+        filesize = ftell(file_handle);
+
+    if (filesize < 0 || fseek(file_handle, 0, SEEK_SET) != 0)
     {
-        VkResult rr = vkGetPhysicalDeviceSurfaceSupportKHR(gpus[0], i, surface, &queue_present_support[i]);
-        assert(rr == VK_SUCCESS);
+        fclose(file_handle);
+        return FILE_LOAD_READ_ERROR;
     }
 
-    uint32_t graphics_queue_idx = -1;
-    uint32_t present_queue_idx = -1;
-    for (uint32_t i = 0; i < queue_family_count; ++i)
-    {
-        if (queue_props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
-        {
-            graphics_queue_idx = i;
+    char* data = arena_alloc(arena, (size_t)filesize, sizeof(uint32_t));
+    size_t read = fread(data, 1, (size_t)filesize, file_handle);
+    fclose(file_handle);
 
-            if (queue_present_support[i] == VK_TRUE)
-            {
-                present_queue_idx = i;
-                break;
-            }
-        }
-    }
+    if (read != (size_t)filesize)
+        return FILE_LOAD_READ_ERROR;
 
-    assert(graphics_queue_idx != -1);
+    file_data->data = data;
+    file_data->size = (size_t)filesize;
+    return FILE_LOAD_SUCCESS;
+}
 
-    if (present_queue_idx == -1)
+int device_extension_supported(VkPhysicalDevice gpu, const char* extension_name, arena_t* scratch)
+{
+    size_t scratch_mark = arena_mark(scratch);
+    uint32_t extension_count = 0;
+    VkResult res = vkEnumerateDeviceExtensionProperties(gpu, NULL, &extension_count, NULL);
+    assert(res == VK_SUCCESS);
+    VkExtensionProperties* extensions = arena_alloc_array(scratch, VkExtensionProperties, extension_count);
+    res = vkEnumerateDeviceExtensionProperties(gpu, NULL, &extension_count, extensions);
+    assert(res == VK_SUCCESS);
+
+    int supported = 0;
+    for (uint32_t i = 0; i < extension_count; ++i)
     {
-        for (uint32_t i = 0; i < queue_family_count; ++i)
+        if (strcmp(extensions[i].extensionName, extension_name) == 0)
         {
-            if (queue_present_support[i] == VK_TRUE)
-            {
-                present_queue_idx = i;
-                break;
-            }
+            supported = 1;
+            break;
         }
     }
 
-    assert(present_queue_idx != -1);
-    free(queue_present_support);
-
-    VkDeviceQueueCreateInfo queue_info = {};
-    queue_info.queueFamilyIndex = graphics_queue_idx;
-    queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_info.queueCount = 1;
-    float queue_priorities[] = {0.0};
-    queue_info.pQueuePriorities = queue_priorities;
+    arena_rewind(scratch, scratch_mark);
+    return supported;
+}
 
-    VkDeviceCreateInfo device_info = {};
-    device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    device_info.queueCreateInfoCount = 1;
-    device_info.pQueueCreateInfos = &queue_info;
-    const char * const device_extensions[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
-    device_info.ppEnabledExtensionNames = device_extensions;
-    device_info.enabledExtensionCount = 1;
+#define FENCE_TIMEOUT 100000000
+#define MAX_FRAMES_IN_FLIGHT 2
+#define QUEUE_TIMELINE_FENCE_COUNT 8
 
+// One monotonically increasing counter per queue. Every submit through queue_timeline_submit signals the next
+// value, so "has the GPU finished X" becomes "is the completed value >= the value X was submitted with". Backed
+// by a timeline semaphore when the device has them, otherwise by a small ring of reused fences, one per value.
+typedef struct
+{
     VkDevice device;
-    res = vkCreateDevice(gpus[0], &device_info, NULL, &device);
-    assert(res == VK_SUCCESS);
+    uint32_t use_timeline_semaphore;
+    VkSemaphore semaphore;
+    VkFence fences[QUEUE_TIMELINE_FENCE_COUNT];
+    uint64_t fence_values[QUEUE_TIMELINE_FENCE_COUNT];
+    uint64_t submitted_value;
+    uint64_t completed_value;
+    PFN_vkWaitSemaphores wait_semaphores;
+    PFN_vkGetSemaphoreCounterValue get_semaphore_counter_value;
+} queue_timeline_t;
+
+void queue_timeline_create(queue_timeline_t* t, VkDevice device, uint32_t use_timeline_semaphore, const char* function_suffix)
+{
+    memset(t, 0, sizeof(queue_timeline_t));
+    t->device = device;
+    t->use_timeline_semaphore = use_timeline_semaphore;
+    VkResult res;
 
-    uint32_t supported_surface_formats_count;
-    res = vkGetPhysicalDeviceSurfaceFormatsKHR(gpus[0], surface, &supported_surface_formats_count, NULL);
-    assert(res == VK_SUCCESS);
-    VkSurfaceFormatKHR* supported_surface_formats = malloc(supported_surface_formats_count * sizeof(VkSurfaceFormatKHR));
-    res = vkGetPhysicalDeviceSurfaceFormatsKHR(gpus[0], surface, &supported_surface_formats_count, supported_surface_formats);
-    assert(res == VK_SUCCESS);
+    if (use_timeline_semaphore)
+    {
+        // Core 1.2 names when function_suffix is "", VK_KHR_timeline_semaphore names when it is "KHR".
+        char name[64];
+        snprintf(name, sizeof(name), "vkWaitSemaphores%s", function_suffix);
+        t->wait_semaphores = (PFN_vkWaitSemaphores)vkGetDeviceProcAddr(device, name);
+        snprintf(name, sizeof(name), "vkGetSemaphoreCounterValue%s", function_suffix);
+        t->get_semaphore_counter_value = (PFN_vkGetSemaphoreCounterValue)vkGetDeviceProcAddr(device, name);
+        assert(t->wait_semaphores && t->get_semaphore_counter_value);
+
+        VkSemaphoreTypeCreateInfo stci = {};
+        stci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        stci.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        stci.initialValue = 0;
+
+        VkSemaphoreCreateInfo sci = {};
+        sci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        sci.pNext = &stci;
+        res = vkCreateSemaphore(device, &sci, &g_vk_allocator, &t->semaphore);
+        assert(res == VK_SUCCESS);
+    }
+    else
+    {
+        VkFenceCreateInfo fci = {};
+        fci.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 
-    VkFormat format;
-    if (supported_surface_formats_count == 1 && supported_surface_formats[0].format == VK_FORMAT_UNDEFINED)
+        for (uint32_t i = 0; i < QUEUE_TIMELINE_FENCE_COUNT; ++i)
+        {
+            res = vkCreateFence(device, &fci, &g_vk_allocator, &t->fences[i]);
+            assert(res == VK_SUCCESS);
+        }
+    }
+}
+
+void queue_timeline_destroy(queue_timeline_t* t)
+{
+    if (t->use_timeline_semaphore)
     {
-        format = VK_FORMAT_R8G8B8A8_UNORM;
+        vkDestroySemaphore(t->device, t->semaphore, &g_vk_allocator);
     }
     else
     {
-        assert(supported_surface_formats_count >= 1);
-        format = supported_surface_formats[0].format;
+        for (uint32_t i = 0; i < QUEUE_TIMELINE_FENCE_COUNT; ++i)
+            vkDestroyFence(t->device, t->fences[i], &g_vk_allocator);
     }
-    free(supported_surface_formats);
+}
 
-    VkSurfaceCapabilitiesKHR surface_capabilities;
-    res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(gpus[0], surface, &surface_capabilities);
-    assert(res == VK_SUCCESS);
+uint64_t queue_timeline_completed(queue_timeline_t* t)
+{
+    if (t->use_timeline_semaphore)
+    {
+        VkResult res = t->get_semaphore_counter_value(t->device, t->semaphore, &t->completed_value);
+        assert(res == VK_SUCCESS);
+        return t->completed_value;
+    }
 
-    VkExtent2D swapchain_extent = surface_capabilities.currentExtent; // check so this isn't 0xFFFFFFFF
-    assert(swapchain_extent.width != 0xFFFFFFFF);
+    while (t->completed_value < t->submitted_value)
+    {
+        uint32_t slot = (t->completed_value + 1) % QUEUE_TIMELINE_FENCE_COUNT;
+        if (vkGetFenceStatus(t->device, t->fences[slot]) != VK_SUCCESS)
+            break;
 
-    VkPresentModeKHR swapchain_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+        ++t->completed_value;
+    }
 
-    uint32_t desired_num_swapchain_images = surface_capabilities.minImageCount;
+    return t->completed_value;
+}
 
-    VkSurfaceTransformFlagBitsKHR pre_transform;
+void queue_timeline_wait(queue_timeline_t* t, uint64_t value)
+{
+    assert(value <= t->submitted_value);
 
-    if (surface_capabilities.supportedTransforms & VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR)
-        pre_transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
-    else
-        pre_transform = surface_capabilities.currentTransform;
+    if (value <= t->completed_value)
+        return;
 
-    VkCompositeAlphaFlagBitsKHR composite_alpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    VkCompositeAlphaFlagBitsKHR composite_alpha_flags[4] = {
-        VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-        VK_COMPOSITE_ALPHA_PRE_MULTIPLIED_BIT_KHR,
-        VK_COMPOSITE_ALPHA_POST_MULTIPLIED_BIT_KHR,
-        VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR,
-    };
+    VkResult res;
 
-    for (uint32_t i = 0; i < sizeof(composite_alpha_flags)/sizeof(composite_alpha_flags[0]); ++i)
+    if (t->use_timeline_semaphore)
     {
-        if (surface_capabilities.supportedCompositeAlpha & composite_alpha_flags[i])
-        {
-            composite_alpha = composite_alpha_flags[i];
-            break;
-        }
+        VkSemaphoreWaitInfo swi = {};
+        swi.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        swi.semaphoreCount = 1;
+        swi.pSemaphores = &t->semaphore;
+        swi.pValues = &value;
+
+        do {
+            res = t->wait_semaphores(t->device, &swi, FENCE_TIMEOUT);
+        } while (res == VK_TIMEOUT);
+        assert(res == VK_SUCCESS);
     }
+    else
+    {
+        VkFence fence = t->fences[value % QUEUE_TIMELINE_FENCE_COUNT];
+        assert(t->fence_values[value % QUEUE_TIMELINE_FENCE_COUNT] == value);
 
-    /*uint32_t present_mode_count;
-    res = vkGetPhysicalDeviceSurfacePresentModesKHR(gpus[0], surface, &present_mode_count, NULL);
-    assert(res == VK_SUCCESS);
-    VkPresentModeKHR* present_modes = malloc(present_mode_count * sizeof(VkPresentModeKHR));
-    res = vkGetPhysicalDeviceSurfacePresentModesKHR(gpus[0], surface, &present_mode_count, present_modes);
-    assert(res == VK_SUCCESS);*/
+        do {
+            res = vkWaitForFences(t->device, 1, &fence, VK_TRUE, FENCE_TIMEOUT);
+        } while (res == VK_TIMEOUT);
+        assert(res == VK_SUCCESS);
+    }
 
-    VkSwapchainCreateInfoKHR scci = {};
-    scci.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-    scci.surface = surface;
-    scci.minImageCount = desired_num_swapchain_images;
-    scci.imageFormat = format;
-    scci.imageExtent = swapchain_extent;
-    scci.preTransform = pre_transform;
-    scci.compositeAlpha = composite_alpha;
-    scci.imageArrayLayers = 1;
-    scci.presentMode = swapchain_present_mode;
-    scci.oldSwapchain = VK_NULL_HANDLE;
-    scci.clipped = 1;
-    scci.imageColorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
-    scci.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-    scci.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    // Submissions on a queue complete in order, so everything before value is done too.
+    t->completed_value = value;
+}
 
-    uint32_t queue_family_indicies[] = {graphics_queue_idx, present_queue_idx};
+// Submits submit_info and signals the next value on the timeline, which is returned. Any wait or signal
+// semaphores in submit_info are expected to be binary semaphores.
+uint64_t queue_timeline_submit(queue_timeline_t* t, VkQueue queue, const VkSubmitInfo* submit_info)
+{
+    uint64_t value = t->submitted_value + 1;
+    VkSubmitInfo si = *submit_info;
+    VkFence fence = VK_NULL_HANDLE;
 
-    if (queue_family_indicies[0] != queue_family_indicies[1])
+    #define MAX_SUBMIT_SEMAPHORES 8
+    VkSemaphore signal_semaphores[MAX_SUBMIT_SEMAPHORES];
+    uint64_t signal_values[MAX_SUBMIT_SEMAPHORES] = {};
+    uint64_t wait_values[MAX_SUBMIT_SEMAPHORES] = {};
+    VkTimelineSemaphoreSubmitInfo tssi = {};
+
+    if (t->use_timeline_semaphore)
     {
-        scci.pQueueFamilyIndices = queue_family_indicies;
-        scci.queueFamilyIndexCount = 2;
-        scci.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+        assert(si.pNext == NULL);
+        assert(si.signalSemaphoreCount < MAX_SUBMIT_SEMAPHORES && si.waitSemaphoreCount <= MAX_SUBMIT_SEMAPHORES);
+
+        for (uint32_t i = 0; i < si.signalSemaphoreCount; ++i)
+            signal_semaphores[i] = si.pSignalSemaphores[i];
+
+        signal_semaphores[si.signalSemaphoreCount] = t->semaphore;
+        signal_values[si.signalSemaphoreCount] = value;
+        si.signalSemaphoreCount++;
+        si.pSignalSemaphores = signal_semaphores;
+
+        // Values for binary semaphores are ignored, but the counts have to match.
+        tssi.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        tssi.waitSemaphoreValueCount = si.waitSemaphoreCount;
+        tssi.pWaitSemaphoreValues = wait_values;
+        tssi.signalSemaphoreValueCount = si.signalSemaphoreCount;
+        tssi.pSignalSemaphoreValues = signal_values;
+        si.pNext = &tssi;
     }
+    else
+    {
+        uint32_t slot = value % QUEUE_TIMELINE_FENCE_COUNT;
 
-    VkQueue graphics_queue;
-    VkQueue present_queue;
-    vkGetDeviceQueue(device, graphics_queue_idx, 0, &graphics_queue);
-    if (graphics_queue_idx == present_queue_idx) {
-        present_queue = graphics_queue;
-    } else {
-        vkGetDeviceQueue(device, present_queue_idx, 0, &present_queue);
-    }
+        if (t->fence_values[slot] != 0)
+        {
+            queue_timeline_wait(t, t->fence_values[slot]);
+            VkResult res = vkResetFences(t->device, 1, &t->fences[slot]);
+            assert(res == VK_SUCCESS);
+        }
 
-    VkSwapchainKHR swapchain;
-    res = vkCreateSwapchainKHR(device, &scci, NULL, &swapchain);
-    assert(res == VK_SUCCESS);
+        t->fence_values[slot] = value;
+        fence = t->fences[slot];
+    }
 
-    uint32_t swapchain_image_count;
-    res = vkGetSwapchainImagesKHR(device, swapchain, &swapchain_image_count, NULL);
-    assert(swapchain_image_count > 0);
-    assert(res == VK_SUCCESS);
-    VkImage* swapchain_images = malloc(swapchain_image_count * sizeof(VkImage));
-    res = vkGetSwapchainImagesKHR(device, swapchain, &swapchain_image_count, swapchain_images);
+    VkResult res = vkQueueSubmit(queue, 1, &si, fence);
     assert(res == VK_SUCCESS);
+    t->submitted_value = value;
+    return value;
+}
 
-    uint32_t num_swapchain_buffers = swapchain_image_count;
-    swapchain_buffer_t* swapchain_buffers = malloc(sizeof(swapchain_buffer_t) * num_swapchain_buffers);
+#define GPU_MEMORY_DEFAULT_BUDGET_PERCENT 80
 
-    for (uint32_t i = 0; i < num_swapchain_buffers; ++i)
+typedef struct
+{
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t type;
+    uint32_t heap;
+} gpu_allocation_t;
+
+// Something that can be thrown out when its heap runs over budget and loaded again later, like a streamed mesh or
+// texture. evict has to destroy whatever is bound to the allocation and must not call back into gpu_memory, the
+// allocation itself is freed afterwards.
+typedef struct gpu_resident_s
+{
+    struct gpu_resident_s* prev;
+    struct gpu_resident_s* next;
+    gpu_allocation_t allocation;
+    uint64_t last_use;
+    void (*evict)(void* data);
+    void* data;
+} gpu_resident_t;
+
+// Device memory use per heap. With VK_EXT_memory_budget the budget and usage come from the driver and include other
+// processes, between queries the usage is estimated from what went through here since. Without it the budget is
+// GPU_MEMORY_DEFAULT_BUDGET_PERCENT of the heap size. Allocations try to stay below budget_fraction of the budget,
+// evicting the least recently used residents of the heap first, then falling back to other memory types.
+// Residents are only evicted once no frame in flight can use them.
+typedef struct
+{
+    VkPhysicalDevice gpu;
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties properties;
+    uint32_t budget_extension;
+    float budget_fraction;
+    pthread_mutex_t mutex;
+    uint64_t frame;
+
+    VkDeviceSize budget[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize queried_usage[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize allocated_at_query[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize allocated[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize peak[VK_MAX_MEMORY_HEAPS];
+    uint32_t allocation_count[VK_MAX_MEMORY_HEAPS];
+
+    // Least recently used first.
+    gpu_resident_t* lru_head;
+    gpu_resident_t* lru_tail;
+    uint64_t evictions;
+    VkDeviceSize evicted_bytes;
+    uint64_t fallbacks;
+} gpu_memory_t;
+
+static void gpu_memory_query_budget(gpu_memory_t* m)
+{
+    if (!m->budget_extension)
     {
-        swapchain_buffers[i].image = swapchain_images[i];
+        for (uint32_t h = 0; h < m->properties.memoryHeapCount; ++h)
+            m->budget[h] = m->properties.memoryHeaps[h].size / 100 * GPU_MEMORY_DEFAULT_BUDGET_PERCENT;
 
-        VkImageViewCreateInfo vci = {};
-        vci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        vci.image = swapchain_buffers[i].image;
-        vci.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        vci.format = format;
-        vci.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-        vci.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-        vci.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-        vci.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-        vci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        vci.subresourceRange.baseMipLevel = 0;
-        vci.subresourceRange.levelCount = 1;
-        vci.subresourceRange.baseArrayLayer = 0;
-        vci.subresourceRange.layerCount = 1;
+        return;
+    }
 
-        res = vkCreateImageView(device, &vci, NULL, &swapchain_buffers[i].view);
-        assert(res == VK_SUCCESS);
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+    budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+    VkPhysicalDeviceMemoryProperties2 properties = {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    properties.pNext = &budget;
+    vkGetPhysicalDeviceMemoryProperties2(m->gpu, &properties);
+
+    for (uint32_t h = 0; h < m->properties.memoryHeapCount; ++h)
+    {
+        m->budget[h] = budget.heapBudget[h];
+        m->queried_usage[h] = budget.heapUsage[h];
+        m->allocated_at_query[h] = m->allocated[h];
     }
+}
 
-    free(swapchain_images);
+// budget_extension needs a 1.1 device with VK_EXT_memory_budget enabled.
+void gpu_memory_init(gpu_memory_t* m, VkPhysicalDevice gpu, VkDevice device, uint32_t budget_extension, float budget_fraction)
+{
+    memset(m, 0, sizeof(gpu_memory_t));
+    m->gpu = gpu;
+    m->device = device;
+    m->budget_extension = budget_extension;
+    m->budget_fraction = budget_fraction;
+    vkGetPhysicalDeviceMemoryProperties(gpu, &m->properties);
+    pthread_mutex_init(&m->mutex, NULL);
+    gpu_memory_query_budget(m);
+}
 
-    VkCommandPoolCreateInfo cmd_pool_info = {};
-    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    cmd_pool_info.queueFamilyIndex = graphics_queue_idx;
+void gpu_memory_destroy(gpu_memory_t* m)
+{
+    assert(m->lru_head == NULL);
+    pthread_mutex_destroy(&m->mutex);
+}
 
-    VkCommandPool cmd_pool;
-    res = vkCreateCommandPool(device, &cmd_pool_info, NULL, &cmd_pool);
-    assert(res == VK_SUCCESS);
+// Call once per frame, after waiting for the frame slot, so frames up to frame - MAX_FRAMES_IN_FLIGHT are done.
+void gpu_memory_begin_frame(gpu_memory_t* m, uint64_t frame)
+{
+    pthread_mutex_lock(&m->mutex);
+    m->frame = frame;
+    gpu_memory_query_budget(m);
+    pthread_mutex_unlock(&m->mutex);
+}
 
-    VkCommandBufferAllocateInfo cmd_info = {};
-    cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmd_info.commandPool = cmd_pool;
-    cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmd_info.commandBufferCount = 1;
+static VkDeviceSize gpu_memory_usage(const gpu_memory_t* m, uint32_t heap)
+{
+    if (!m->budget_extension)
+        return m->allocated[heap];
 
-    VkCommandBuffer cmd;
-    res = vkAllocateCommandBuffers(device, &cmd_info, &cmd);
-    assert(res == VK_SUCCESS);
+    // Other processes may have freed memory since the query, what we freed counts.
+    VkDeviceSize usage = m->queried_usage[heap] + m->allocated[heap];
+    return usage > m->allocated_at_query[heap] ? usage - m->allocated_at_query[heap] : 0;
+}
 
-    VkImageCreateInfo depth_ici = {};
-    const VkFormat depth_format = VK_FORMAT_D16_UNORM;
-    VkFormatProperties depth_format_props;
-    vkGetPhysicalDeviceFormatProperties(gpus[0], depth_format, &depth_format_props);
-    if (depth_format_props.linearTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
-        depth_ici.tiling = VK_IMAGE_TILING_LINEAR;
-    else if (depth_format_props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
-        depth_ici.tiling = VK_IMAGE_TILING_OPTIMAL;
+static uint32_t gpu_memory_has_room(const gpu_memory_t* m, uint32_t heap, VkDeviceSize size)
+{
+    return gpu_memory_usage(m, heap) + size <= (VkDeviceSize)(m->budget[heap] * (double)m->budget_fraction);
+}
+
+static void gpu_memory_unlink(gpu_memory_t* m, gpu_resident_t* r)
+{
+    if (r->prev)
+        r->prev->next = r->next;
     else
-        assert(0 && "VK_FORMAT_D16_UNORM unsupported");
-
-    depth_ici.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    depth_ici.imageType = VK_IMAGE_TYPE_2D;
-    depth_ici.format = depth_format;
-    depth_ici.extent.width = swapchain_extent.width;
-    depth_ici.extent.height = swapchain_extent.height;
-    depth_ici.extent.depth = 1;
-    depth_ici.mipLevels = 1;
-    depth_ici.arrayLayers = 1;
-    
-    #define NUM_SAMPLES VK_SAMPLE_COUNT_1_BIT
-
-    depth_ici.samples = NUM_SAMPLES;
-    depth_ici.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    depth_ici.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-    depth_ici.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    VkMemoryAllocateInfo depth_mem_alloc = {};
-    depth_mem_alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-
-    VkImageViewCreateInfo depth_ivci = {};
-    depth_ivci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    depth_ivci.image = VK_NULL_HANDLE;
-    depth_ivci.format = depth_format;
-    depth_ivci.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-    depth_ivci.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-    depth_ivci.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-    depth_ivci.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-    depth_ivci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-    depth_ivci.subresourceRange.levelCount = 1;
-    depth_ivci.subresourceRange.layerCount = 1;
-    depth_ivci.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    depth_ivci.flags = 0;
-
-    VkMemoryRequirements depth_mem_reqs;
-
-    VkImage depth_image;
-    res = vkCreateImage(device, &depth_ici, NULL, &depth_image);
-    assert(res == VK_SUCCESS);
+        m->lru_head = r->next;
 
-    vkGetImageMemoryRequirements(device, depth_image, &depth_mem_reqs);
-    depth_mem_alloc.allocationSize = depth_mem_reqs.size;
+    if (r->next)
+        r->next->prev = r->prev;
+    else
+        m->lru_tail = r->prev;
 
-    depth_mem_alloc.memoryTypeIndex = memory_type_from_properties(&depth_mem_reqs, &memory_properties, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    r->prev = NULL;
+    r->next = NULL;
+}
 
-    assert(depth_mem_alloc.memoryTypeIndex != -1);
-    VkDeviceMemory depth_mem;
-    res = vkAllocateMemory(device, &depth_mem_alloc, NULL, &depth_mem);
-    assert(res == VK_SUCCESS);
-    res = vkBindImageMemory(device, depth_image, depth_mem, 0);
-    assert(res == VK_SUCCESS);
-    depth_ivci.image = depth_image;
-    VkImageView depth_view;
-    res = vkCreateImageView(device, &depth_ivci, NULL, &depth_view);
-    assert(res == VK_SUCCESS);
+static void gpu_memory_link(gpu_memory_t* m, gpu_resident_t* r)
+{
+    r->prev = m->lru_tail;
+    r->next = NULL;
 
-    mat4_t proj_matrix = create_projection_matrix((float)swapchain_extent.width, (float)swapchain_extent.height);
+    if (m->lru_tail)
+        m->lru_tail->next = r;
+    else
+        m->lru_head = r;
 
-    vec3_t camera_pos = {2.5, -4, 1.5};
-    quat_t camera_rot = {-0.3333, 0, 0.3333, 0.6667};
-    mat4_t camera_matrix = mat4_from_rotation_and_translation(&camera_rot, &camera_pos);
+    m->lru_tail = r;
+}
 
-    mat4_t view_matrix = mat4_inverse(&camera_matrix);
+static void gpu_memory_release(gpu_memory_t* m, gpu_allocation_t* a)
+{
+    vkFreeMemory(m->device, a->memory, &g_vk_allocator);
+    m->allocated[a->heap] -= a->size;
+    --m->allocation_count[a->heap];
+    memset(a, 0, sizeof(gpu_allocation_t));
+}
 
-    mat4_t model_matrix = mat4_identity();
-    mat4_t proj_view_matrix = mat4_mul(&view_matrix, &proj_matrix);
-    mat4_t mvp_matrix = mat4_mul(&proj_view_matrix, &model_matrix);
+// Evicts residents of heap, least recently used first, until size fits in the budget. With size 0 it evicts every
+// resident of the heap the GPU is done with. Returns the number evicted.
+static uint32_t gpu_memory_evict(gpu_memory_t* m, uint32_t heap, VkDeviceSize size)
+{
+    uint32_t evicted = 0;
+    gpu_resident_t* r = m->lru_head;
 
-    VkBufferCreateInfo uniform_ci = {};
-    uniform_ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    uniform_ci.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    uniform_ci.size = sizeof(mvp_matrix);
-    uniform_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    while (r && (size == 0 || !gpu_memory_has_room(m, heap, size)))
+    {
+        gpu_resident_t* next = r->next;
 
-    VkBuffer uniform_buffer;
-    res = vkCreateBuffer(device, &uniform_ci, NULL, &uniform_buffer);
-    assert(res == VK_SUCCESS);
+        // The list is in use order, everything after this was used at least as recently.
+        if (r->last_use + MAX_FRAMES_IN_FLIGHT > m->frame)
+            break;
 
-    VkMemoryRequirements uniform_buffer_mem_reqs;
-    vkGetBufferMemoryRequirements(device, uniform_buffer, &uniform_buffer_mem_reqs);
+        if (r->allocation.heap == heap)
+        {
+            gpu_memory_unlink(m, r);
+            r->evict(r->data);
+            m->evicted_bytes += r->allocation.size;
+            ++m->evictions;
+            gpu_memory_release(m, &r->allocation);
+            ++evicted;
+        }
 
-    VkMemoryAllocateInfo uniform_buffer_mai = {};
-    uniform_buffer_mai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    uniform_buffer_mai.allocationSize = uniform_buffer_mem_reqs.size;
+        r = next;
+    }
 
-    uniform_buffer_mai.memoryTypeIndex = memory_type_from_properties(&uniform_buffer_mem_reqs, &memory_properties, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    assert(uniform_buffer_mai.memoryTypeIndex != -1);
+    return evicted;
+}
 
-    VkDeviceMemory uniform_buffer_mem;
-    res = vkAllocateMemory(device, &uniform_buffer_mai, NULL, &uniform_buffer_mem);
-    assert(res == VK_SUCCESS);
+// Picks among the memory types mr allows that have all of required, the ones with all of preferred first. A type
+// whose heap is over budget is only used after evicting from it, or if no other type is left. Returns the
+// vkAllocateMemory error if every type failed.
+VkResult gpu_memory_alloc(gpu_memory_t* m, const VkMemoryRequirements* mr, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred,
+                          gpu_allocation_t* a)
+{
+    memset(a, 0, sizeof(gpu_allocation_t));
+    uint32_t candidates[VK_MAX_MEMORY_TYPES];
+    uint32_t candidate_count = 0;
 
-    uint8_t* mapped_uniform_data;
-    res = vkMapMemory(device, uniform_buffer_mem, 0, uniform_buffer_mem_reqs.size, 0, (void**)&mapped_uniform_data);
-    assert(res == VK_SUCCESS);
+    for (uint32_t pass = 0; pass < 2; ++pass)
+    {
+        VkMemoryPropertyFlags mask = pass == 0 ? required | preferred : required;
 
-    memcpy(mapped_uniform_data, &mvp_matrix, sizeof(mvp_matrix));
+        for (uint32_t i = 0; i < m->properties.memoryTypeCount; ++i)
+        {
+            VkMemoryPropertyFlags flags = m->properties.memoryTypes[i].propertyFlags;
 
-    vkUnmapMemory(device, uniform_buffer_mem);
+            if ((mr->memoryTypeBits & (1u << i)) && (flags & mask) == mask && (pass == 0 || (flags & preferred) != preferred))
+                candidates[candidate_count++] = i;
+        }
+    }
 
-    res = vkBindBufferMemory(device, uniform_buffer, uniform_buffer_mem, 0);
-    assert(res == VK_SUCCESS);
+    pthread_mutex_lock(&m->mutex);
+    VkResult res = VK_ERROR_OUT_OF_DEVICE_MEMORY;
 
-    VkDescriptorSetLayoutBinding layout_binding = {};
-    layout_binding.binding = 0;
-    layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    layout_binding.descriptorCount = 1;
-    layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    // Over budget types are tried in a second round, a soft budget shouldn't turn into a failure.
+    for (uint32_t over_budget = 0; over_budget < 2 && res != VK_SUCCESS; ++over_budget)
+    {
+        for (uint32_t c = 0; c < candidate_count; ++c)
+        {
+            uint32_t type = candidates[c];
+            uint32_t heap = m->properties.memoryTypes[type].heapIndex;
 
-    VkDescriptorSetLayoutCreateInfo dslci = {};
-    dslci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    dslci.bindingCount = 1;
-    dslci.pBindings = &layout_binding;
+            if (!over_budget && !gpu_memory_has_room(m, heap, mr->size))
+            {
+                gpu_memory_evict(m, heap, mr->size);
 
-    VkDescriptorSetLayout set_layout;
-    res = vkCreateDescriptorSetLayout(device, &dslci, NULL, &set_layout);
+                if (!gpu_memory_has_room(m, heap, mr->size))
+                    continue;
+            }
 
-    VkPipelineLayoutCreateInfo plci = {};
-    plci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    plci.setLayoutCount = 1;
-    plci.pSetLayouts = &set_layout;
+            VkMemoryAllocateInfo mai = {};
+            mai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            mai.allocationSize = mr->size;
+            mai.memoryTypeIndex = type;
+            res = vkAllocateMemory(m->device, &mai, &g_vk_allocator, &a->memory);
 
-    VkPipelineLayout pipeline_layout;
-    res = vkCreatePipelineLayout(device, &plci, NULL, &pipeline_layout);
-    assert(res == VK_SUCCESS);
+            if (res != VK_SUCCESS && gpu_memory_evict(m, heap, 0) > 0)
+                res = vkAllocateMemory(m->device, &mai, &g_vk_allocator, &a->memory);
 
-    VkDescriptorPoolSize dps[1];
-    dps[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    dps[0].descriptorCount = 1;
+            if (res != VK_SUCCESS)
+                continue;
 
-    VkDescriptorPoolCreateInfo dpci = {};
-    dpci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    dpci.maxSets = 1;
-    dpci.poolSizeCount = 1;
-    dpci.pPoolSizes = dps;
+            a->size = mr->size;
+            a->type = type;
+            a->heap = heap;
+            m->allocated[heap] += mr->size;
+            ++m->allocation_count[heap];
 
-    VkDescriptorPool descriptor_pool;
-    res = vkCreateDescriptorPool(device, &dpci, NULL, &descriptor_pool);
-    assert(res == VK_SUCCESS);
+            if (m->allocated[heap] > m->peak[heap])
+                m->peak[heap] = m->allocated[heap];
 
-    VkDescriptorSetAllocateInfo dai[1];
-    dai[0].sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    dai[0].pNext = NULL;
-    dai[0].descriptorPool = descriptor_pool;
-    #define NUM_DESCRIPTOR_SETS 1
-    dai[0].descriptorSetCount = NUM_DESCRIPTOR_SETS;
-    dai[0].pSetLayouts = &set_layout;
+            if (c > 0 || over_budget)
+                ++m->fallbacks;
 
-    VkDescriptorSet descriptor_sets[1];
-    res = vkAllocateDescriptorSets(device, dai, descriptor_sets);
-    assert(res == VK_SUCCESS);
+            break;
+        }
+    }
 
-    VkWriteDescriptorSet writes[1];
-
-    VkDescriptorBufferInfo uniform_buffer_info = {};
-    uniform_buffer_info.buffer = uniform_buffer;
-    uniform_buffer_info.range = sizeof(mvp_matrix);
-
-    memset(writes, 0, sizeof(VkWriteDescriptorSet) * 1);
-    writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writes[0].dstSet = descriptor_sets[0];
-    writes[0].descriptorCount = 1;
-    writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    writes[0].pBufferInfo = &uniform_buffer_info;
-
-    vkUpdateDescriptorSets(device, 1, writes, 0, NULL);
-
-    VkAttachmentDescription attachments[2];
-    memset(attachments, 0, sizeof(VkAttachmentDescription) * 2);
-    attachments[0].format = format;
-    attachments[0].samples = NUM_SAMPLES;
-    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-    attachments[1].format = depth_format;
-    attachments[1].samples = NUM_SAMPLES;
-    attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-    VkAttachmentReference color_reference = {};
-    color_reference.attachment = 0;
-    color_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    pthread_mutex_unlock(&m->mutex);
+    return res;
+}
 
-    VkAttachmentReference depth_reference = {};
-    depth_reference.attachment = 1;
-    depth_reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+void gpu_memory_free(gpu_memory_t* m, gpu_allocation_t* a)
+{
+    if (a->memory == VK_NULL_HANDLE)
+        return;
 
-    VkSubpassDescription subpass = {};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &color_reference;
-    subpass.pDepthStencilAttachment = &depth_reference;
+    pthread_mutex_lock(&m->mutex);
+    gpu_memory_release(m, a);
+    pthread_mutex_unlock(&m->mutex);
+}
 
-    VkRenderPassCreateInfo rpci = {};
-    rpci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    rpci.attachmentCount = 2;
-    rpci.pAttachments = attachments;
-    rpci.subpassCount = 1;
-    rpci.pSubpasses = &subpass;
+// For allocations startup can't do without: prints what res was for and exits if it failed.
+void gpu_memory_check_startup(VkResult res, const char* what)
+{
+    if (res == VK_SUCCESS)
+        return;
 
-    VkRenderPass render_pass;
-    res = vkCreateRenderPass(device, &rpci, NULL, &render_pass);
-    assert(res == VK_SUCCESS);
+    printf("couldn't allocate device memory for %s (VkResult %d)\n", what, res);
+    exit(1);
+}
 
+// Hands an allocation over to r, after which it may be evicted whenever r hasn't been used for a while.
+void gpu_memory_make_resident(gpu_memory_t* m, gpu_resident_t* r, gpu_allocation_t* a, void (*evict)(void*), void* data)
+{
+    pthread_mutex_lock(&m->mutex);
+    r->allocation = *a;
+    r->evict = evict;
+    r->data = data;
+    r->last_use = m->frame;
+    gpu_memory_link(m, r);
+    memset(a, 0, sizeof(gpu_allocation_t));
+    pthread_mutex_unlock(&m->mutex);
+}
 
-    VkPipelineShaderStageCreateInfo shader_stages[2];
-    memset(shader_stages, 0, sizeof(VkPipelineShaderStageCreateInfo) * 2);
+// Call every frame r is used in. Returns 0 if it was evicted and has to be loaded again.
+uint32_t gpu_memory_touch(gpu_memory_t* m, gpu_resident_t* r)
+{
+    pthread_mutex_lock(&m->mutex);
+    uint32_t resident = r->allocation.memory != VK_NULL_HANDLE;
 
-    shader_stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-    shader_stages[0].pName = "main";
+    if (resident)
+    {
+        r->last_use = m->frame;
+        gpu_memory_unlink(m, r);
+        gpu_memory_link(m, r);
+    }
 
-    file_data_t vertex_shader_data;
-    file_load_success_e vs_data_res = file_load("vertex_shader.spv", &vertex_shader_data);
-    assert(vs_data_res == FILE_LOAD_SUCCESS);
+    pthread_mutex_unlock(&m->mutex);
+    return resident;
+}
 
-    VkShaderModuleCreateInfo vertex_mdci = {};
-    vertex_mdci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    vertex_mdci.pCode = (uint32_t*)vertex_shader_data.data;
-    vertex_mdci.codeSize = vertex_shader_data.size;
+// Frees a resident that wasn't evicted, after whatever is bound to it is destroyed.
+void gpu_memory_free_resident(gpu_memory_t* m, gpu_resident_t* r)
+{
+    pthread_mutex_lock(&m->mutex);
 
-    res = vkCreateShaderModule(device, &vertex_mdci, NULL, &shader_stages[0].module);
-    assert(res == VK_SUCCESS);
+    if (r->allocation.memory != VK_NULL_HANDLE)
+    {
+        gpu_memory_unlink(m, r);
+        gpu_memory_release(m, &r->allocation);
+    }
 
-    file_data_t fragment_shader_data;
-    file_load_success_e fs_data_res = file_load("fragment_shader.spv", &fragment_shader_data);
-    assert(fs_data_res == FILE_LOAD_SUCCESS);
+    pthread_mutex_unlock(&m->mutex);
+}
 
-    shader_stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    shader_stages[1].pName = "main";
+void gpu_memory_print(gpu_memory_t* m)
+{
+    pthread_mutex_lock(&m->mutex);
+    gpu_memory_query_budget(m);
 
-    VkShaderModuleCreateInfo fragment_mdci = {};
-    fragment_mdci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    fragment_mdci.pCode = (uint32_t*)fragment_shader_data.data;
-    fragment_mdci.codeSize = fragment_shader_data.size;
+    for (uint32_t h = 0; h < m->properties.memoryHeapCount; ++h)
+    {
+        printf("device memory: heap %u%s, %u allocations, %.1f MB allocated, peak %.1f MB, usage %.1f of %.1f MB budget, heap %.1f MB\n", h,
+               m->properties.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ? " (device local)" : "", m->allocation_count[h],
+               m->allocated[h] / 1048576.0, m->peak[h] / 1048576.0, gpu_memory_usage(m, h) / 1048576.0, m->budget[h] / 1048576.0,
+               m->properties.memoryHeaps[h].size / 1048576.0);
+    }
 
-    res = vkCreateShaderModule(device, &fragment_mdci, NULL, &shader_stages[1].module);
-    assert(res == VK_SUCCESS);
+    printf("device memory: budget %s, %llu evictions (%.1f MB), %llu allocations outside their preferred type or budget\n",
+           m->budget_extension ? "from VK_EXT_memory_budget" : "estimated", (unsigned long long)m->evictions, m->evicted_bytes / 1048576.0,
+           (unsigned long long)m->fallbacks);
+    pthread_mutex_unlock(&m->mutex);
+}
 
-    VkImageView framebuffer_attachments[2];
-    framebuffer_attachments[1] = depth_view;
+typedef enum {
+    DEFERRED_DESTROY_BUFFER,
+    DEFERRED_DESTROY_IMAGE,
+    DEFERRED_DESTROY_IMAGE_VIEW,
+    DEFERRED_DESTROY_MEMORY,
+    DEFERRED_DESTROY_PIPELINE,
+    DEFERRED_DESTROY_FRAMEBUFFER,
+    DEFERRED_DESTROY_SHADER_MODULE,
+    DEFERRED_DESTROY_SEMAPHORE,
+    DEFERRED_DESTROY_SWAPCHAIN
+} deferred_destroy_type_e;
+
+typedef union
+{
+    VkBuffer buffer;
+    VkImage image;
+    VkImageView image_view;
+    gpu_allocation_t memory;
+    VkPipeline pipeline;
+    VkFramebuffer framebuffer;
+    VkShaderModule shader_module;
+    VkSemaphore semaphore;
+    VkSwapchainKHR swapchain;
+} deferred_handle_t;
 
-    VkFramebufferCreateInfo fbci = {};
-    fbci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-    fbci.renderPass = render_pass;
-    fbci.attachmentCount = 2;
-    fbci.pAttachments = framebuffer_attachments;
-    fbci.width = swapchain_extent.width;
-    fbci.height = swapchain_extent.height;
-    fbci.layers = 1;
+typedef struct
+{
+    deferred_destroy_type_e type;
+    deferred_handle_t handle;
+    uint64_t retire_value;
+} deferred_destroy_t;
+
+// Objects that may still be referenced by submitted frames are pushed here instead of being destroyed. Each one
+// is tagged with the last value submitted on the timeline when it was pushed, and is destroyed by
+// deletion_queue_flush once the GPU has passed that value. Values only grow, so the queue stays sorted and a
+// flush just pops from the front.
+typedef struct
+{
+    VkDevice device;
+    gpu_memory_t* memory;
+    queue_timeline_t* timeline;
+    deferred_destroy_t* items;
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+} deletion_queue_t;
+
+void deletion_queue_create(deletion_queue_t* q, VkDevice device, gpu_memory_t* memory, queue_timeline_t* timeline)
+{
+    memset(q, 0, sizeof(deletion_queue_t));
+    q->device = device;
+    q->memory = memory;
+    q->timeline = timeline;
+}
+
+void deletion_queue_push(deletion_queue_t* q, deferred_destroy_type_e type, deferred_handle_t handle)
+{
+    if (q->head + q->count == q->capacity)
+    {
+        if (q->head > 0)
+        {
+            memmove(q->items, q->items + q->head, q->count * sizeof(deferred_destroy_t));
+            q->head = 0;
+        }
+        else
+        {
+            q->capacity = q->capacity ? q->capacity * 2 : 64;
+            q->items = realloc(q->items, q->capacity * sizeof(deferred_destroy_t));
+            assert(q->items);
+        }
+    }
+
+    deferred_destroy_t* item = &q->items[q->head + q->count++];
+    item->type = type;
+    item->handle = handle;
+    item->retire_value = q->timeline->submitted_value;
+}
 
-    VkFramebuffer* framebuffers = malloc(sizeof(VkFramebuffer) * swapchain_image_count);
-    assert(framebuffers);
+static void deferred_destroy(deletion_queue_t* q, deferred_destroy_t* item)
+{
+    VkDevice device = q->device;
 
-    for (uint32_t i = 0; i < swapchain_image_count; ++i)
+    switch (item->type)
     {
-        framebuffer_attachments[0] = swapchain_buffers[i].view;
-        res = vkCreateFramebuffer(device, &fbci, NULL, &framebuffers[i]);
-        assert(res == VK_SUCCESS);
+        case DEFERRED_DESTROY_BUFFER: vkDestroyBuffer(device, item->handle.buffer, &g_vk_allocator); break;
+        case DEFERRED_DESTROY_IMAGE: vkDestroyImage(device, item->handle.image, &g_vk_allocator); break;
+        case DEFERRED_DESTROY_IMAGE_VIEW: vkDestroyImageView(device, item->handle.image_view, &g_vk_allocator); break;
+        case DEFERRED_DESTROY_MEMORY: gpu_memory_free(q->memory, &item->handle.memory); break;
+        case DEFERRED_DESTROY_PIPELINE: vkDestroyPipeline(device, item->handle.pipeline, &g_vk_allocator); break;
+        case DEFERRED_DESTROY_FRAMEBUFFER: vkDestroyFramebuffer(device, item->handle.framebuffer, &g_vk_allocator); break;
+        case DEFERRED_DESTROY_SHADER_MODULE: vkDestroyShaderModule(device, item->handle.shader_module, &g_vk_allocator); break;
+        case DEFERRED_DESTROY_SEMAPHORE: vkDestroySemaphore(device, item->handle.semaphore, &g_vk_allocator); break;
+        case DEFERRED_DESTROY_SWAPCHAIN: vkDestroySwapchainKHR(device, item->handle.swapchain, &g_vk_allocator); break;
     }
+}
 
-    (void)g_vbData;
-    (void)g_vb_solid_face_colors_Data;
-    (void)g_vb_texture_Data;
+// Destroys everything the GPU is done with. Never waits, call once per frame.
+uint32_t deletion_queue_flush(deletion_queue_t* q)
+{
+    if (q->count == 0)
+        return 0;
 
-    VkBufferCreateInfo vertex_bci = {};
-    vertex_bci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    vertex_bci.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    vertex_bci.size = sizeof(g_vb_solid_face_colors_Data);
-    vertex_bci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    uint64_t completed_value = queue_timeline_completed(q->timeline);
+    uint32_t destroyed = 0;
 
-    VkBuffer vertex_buffer;
-    res = vkCreateBuffer(device, &vertex_bci, NULL, &vertex_buffer);
+    while (q->count > 0 && q->items[q->head].retire_value <= completed_value)
+    {
+        deferred_destroy(q, &q->items[q->head]);
+        ++q->head;
+        --q->count;
+        ++destroyed;
+    }
 
-    VkMemoryRequirements vertex_buffer_mr;
-    vkGetBufferMemoryRequirements(device, vertex_buffer, &vertex_buffer_mr);
+    if (q->count == 0)
+        q->head = 0;
 
-    VkMemoryAllocateInfo vertex_buffer_mai = {};
-    vertex_buffer_mai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    vertex_buffer_mai.allocationSize = vertex_buffer_mr.size;
-    vertex_buffer_mai.memoryTypeIndex = memory_type_from_properties(&vertex_buffer_mr, &memory_properties, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    assert(vertex_buffer_mai.memoryTypeIndex != -1);
+    return destroyed;
+}
 
-    VkDeviceMemory vertex_buffer_memory;
-    res = vkAllocateMemory(device, &vertex_buffer_mai, NULL, &vertex_buffer_memory);
-    assert(res == VK_SUCCESS);
+// For shutdown, after the device is idle.
+void deletion_queue_destroy(deletion_queue_t* q)
+{
+    for (uint32_t i = 0; i < q->count; ++i)
+        deferred_destroy(q, &q->items[q->head + i]);
 
-    uint8_t* vertex_buffer_memory_data;
-    res = vkMapMemory(device, vertex_buffer_memory, 0, vertex_buffer_mr.size, 0, (void**)&vertex_buffer_memory_data);
-    assert(res == VK_SUCCESS);
+    free(q->items);
+    memset(q, 0, sizeof(deletion_queue_t));
+}
 
-    memcpy(vertex_buffer_memory_data, g_vb_solid_face_colors_Data, sizeof(g_vb_solid_face_colors_Data));
+uint64_t time_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    vkUnmapMemory(device, vertex_buffer_memory);
+// Chrome trace_event output of CPU zones and GPU passes for finding frame hitches. Build with
+// -DXCB_VULKAN_TRACE (build.py trace) and run with --trace <file>, then open the file in chrome://tracing or
+// Perfetto. Without the define the zone macros compile to nothing.
+#ifdef XCB_VULKAN_TRACE
 
-    res = vkBindBufferMemory(device, vertex_buffer, vertex_buffer_memory, 0);
-    assert(res == VK_SUCCESS);
+#define TRACE_MAX_EVENTS (1 << 20)
+#define TRACE_MAX_THREADS 64
+#define TRACE_GPU_THREAD ((uint32_t)-1)
 
-    VkVertexInputBindingDescription vi_binding = {};
-    VkVertexInputAttributeDescription vi_attribs[2];
-    memset(vi_attribs, 0, sizeof(vi_attribs));
-    vi_binding.binding = 0;
-    vi_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-    vi_binding.stride = sizeof(g_vb_solid_face_colors_Data[0]);
+typedef struct
+{
+    const char* name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint32_t thread;
+} trace_event_t;
+
+// Events are appended lock-free to a fixed array, what doesn't fit is dropped. Threads get an index on their
+// first event, the main thread takes 0 in trace_create.
+typedef struct
+{
+    trace_event_t* events;
+    _Atomic uint32_t count;
+    _Atomic uint32_t thread_count;
+    const char* thread_names[TRACE_MAX_THREADS];
+} trace_t;
 
-    vi_attribs[0].binding = 0;
-    vi_attribs[0].location = 0;
-    vi_attribs[0].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-    vi_attribs[0].offset = 0;
-    vi_attribs[1].binding = 0;
-    vi_attribs[1].location = 1;
-    vi_attribs[1].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-    vi_attribs[1].offset = 16;
+static trace_t g_trace;
+static _Thread_local uint32_t g_trace_thread = -1;
 
-    VkClearValue clear_values[2];
-    clear_values[0].color.float32[0] = 0.0f;
-    clear_values[0].color.float32[1] = 0.0f;
-    clear_values[0].color.float32[2] = 0.0f;
-    clear_values[0].color.float32[3] = 1.0f;
-    clear_values[1].depthStencil.depth = 1.0f;
-    clear_values[1].depthStencil.stencil = 0;
+static uint32_t trace_thread(void)
+{
+    if (g_trace_thread == -1)
+        g_trace_thread = atomic_fetch_add(&g_trace.thread_count, 1);
 
-    VkDynamicState dynamic_state_enables[VK_DYNAMIC_STATE_RANGE_SIZE];
-    memset(dynamic_state_enables, 0, sizeof(dynamic_state_enables));
-    VkPipelineDynamicStateCreateInfo pdsci = {};
-    pdsci.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    pdsci.pDynamicStates = dynamic_state_enables;
+    return g_trace_thread;
+}
 
-    VkPipelineVertexInputStateCreateInfo pvisci = {};
-    pvisci.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    pvisci.vertexBindingDescriptionCount = 1;
-    pvisci.pVertexBindingDescriptions = &vi_binding;
-    pvisci.vertexAttributeDescriptionCount = 2;
-    pvisci.pVertexAttributeDescriptions = vi_attribs;
+void trace_set_thread_name(const char* name)
+{
+    uint32_t thread = trace_thread();
 
-    VkPipelineInputAssemblyStateCreateInfo piasci = {};
-    piasci.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    piasci.primitiveRestartEnable = VK_FALSE;
-    piasci.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    if (thread < TRACE_MAX_THREADS)
+        g_trace.thread_names[thread] = name;
+}
 
-    VkPipelineRasterizationStateCreateInfo prsci = {};
-    prsci.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    prsci.polygonMode = VK_POLYGON_MODE_FILL;
-    prsci.cullMode = VK_CULL_MODE_BACK_BIT;
-    prsci.frontFace = VK_FRONT_FACE_CLOCKWISE;
-    prsci.depthClampEnable = VK_FALSE;
-    prsci.rasterizerDiscardEnable = VK_FALSE;
-    prsci.depthBiasEnable = VK_FALSE;
-    prsci.depthBiasConstantFactor = 0;
-    prsci.depthBiasClamp = 0;
-    prsci.depthBiasSlopeFactor = 0;
-    prsci.lineWidth = 1.0f;
+void trace_create(void)
+{
+    g_trace.events = malloc(TRACE_MAX_EVENTS * sizeof(trace_event_t));
+    assert(g_trace.events);
+    trace_set_thread_name("main");
+}
 
-    VkPipelineColorBlendStateCreateInfo pcbsci = {};
-    pcbsci.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    VkPipelineColorBlendAttachmentState cb_attachment_state[1];
-    memset(cb_attachment_state, 0, sizeof(cb_attachment_state));
-    cb_attachment_state[0].colorWriteMask = 0xf;
-    cb_attachment_state[0].blendEnable = VK_FALSE;
-    cb_attachment_state[0].alphaBlendOp = VK_BLEND_OP_ADD;
-    cb_attachment_state[0].colorBlendOp = VK_BLEND_OP_ADD;
+void trace_add(const char* name, uint32_t thread, uint64_t start_ns, uint64_t end_ns)
+{
+    if (g_trace.events == NULL)
+        return;
+
+    uint32_t i = atomic_fetch_add_explicit(&g_trace.count, 1, memory_order_relaxed);
+
+    if (i >= TRACE_MAX_EVENTS)
+        return;
+
+    trace_event_t* e = &g_trace.events[i];
+    e->name = name;
+    e->thread = thread;
+    e->start_ns = start_ns;
+    e->end_ns = end_ns;
+}
+
+static void trace_write_metadata(FILE* f, uint32_t pid, uint32_t tid, const char* kind, const char* name)
+{
+    fprintf(f, "{\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"name\":\"%s\",\"args\":{\"name\":\"%s\"}},\n", pid, tid, kind, name);
+}
+
+// Times are written in microseconds since origin_ns. Call once every thread that adds events has stopped.
+void trace_write(const char* path, uint64_t origin_ns)
+{
+    FILE* f = fopen(path, "w");
+
+    if (f == NULL)
+    {
+        printf("trace: couldn't write %s\n", path);
+        return;
+    }
+
+    uint32_t count = atomic_load(&g_trace.count);
+    uint32_t written = count < TRACE_MAX_EVENTS ? count : TRACE_MAX_EVENTS;
+    uint32_t thread_count = atomic_load(&g_trace.thread_count);
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    trace_write_metadata(f, 0, 0, "process_name", "CPU");
+    trace_write_metadata(f, 1, 0, "process_name", "GPU");
+    trace_write_metadata(f, 1, 0, "thread_name", "graphics queue");
+
+    for (uint32_t t = 0; t < thread_count && t < TRACE_MAX_THREADS; ++t)
+    {
+        if (g_trace.thread_names[t])
+            trace_write_metadata(f, 0, t, "thread_name", g_trace.thread_names[t]);
+    }
+
+    for (uint32_t i = 0; i < written; ++i)
+    {
+        const trace_event_t* e = &g_trace.events[i];
+        uint32_t gpu = e->thread == TRACE_GPU_THREAD;
+        int64_t start = (int64_t)(e->start_ns - origin_ns);
+        fprintf(f, "{\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f}%s\n", gpu, gpu ? 0 : e->thread, e->name,
+                start / 1e3, (e->end_ns - e->start_ns) / 1e3, i + 1 < written ? "," : "");
+    }
+
+    fprintf(f, "]}\n");
+    fclose(f);
+    printf("trace: %u events written to %s, %u dropped\n", written, path, count - written);
+    free(g_trace.events);
+    g_trace.events = NULL;
+}
+
+#define TRACE_BEGIN(zone) uint64_t zone##_trace_start_ns = time_now_ns()
+#define TRACE_END(zone, name) trace_add((name), trace_thread(), zone##_trace_start_ns, time_now_ns())
+#define TRACE_ADD(name, start_ns, end_ns) trace_add((name), trace_thread(), (start_ns), (end_ns))
+#define TRACE_THREAD_NAME(name) trace_set_thread_name(name)
+
+#else
+
+#define TRACE_BEGIN(zone)
+#define TRACE_END(zone, name)
+#define TRACE_ADD(name, start_ns, end_ns)
+#define TRACE_THREAD_NAME(name)
+
+#endif
+
+#define MAX_TASK_DEPENDENTS 8
+#define THREAD_POOL_MAX_THREADS 16
+#define THREAD_POOL_QUEUE_SIZE 256
+
+typedef void (*task_func_t)(void* data);
+
+// A unit of work for thread_pool_t. It becomes runnable once it has been submitted and every task it depends
+// on has finished. Tasks are owned by the caller and must stay alive until they are done.
+typedef struct task_t
+{
+    const char* name;
+    task_func_t func;
+    void* data;
+    uint32_t unfinished_dependencies;
+    struct task_t* dependents[MAX_TASK_DEPENDENTS];
+    uint32_t dependent_count;
+    uint32_t done;
+    uint32_t thread_index;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} task_t;
+
+typedef struct thread_pool_t thread_pool_t;
+
+typedef struct
+{
+    thread_pool_t* pool;
+    uint32_t thread_index;
+} thread_pool_worker_t;
+
+// Dependency bookkeeping and the ready queue are protected by one mutex. Tasks are coarse (file loads, pipeline
+// creation, chunks of a parallel loop), so contention on it doesn't matter.
+struct thread_pool_t
+{
+    pthread_t threads[THREAD_POOL_MAX_THREADS];
+    thread_pool_worker_t workers[THREAD_POOL_MAX_THREADS];
+    uint32_t thread_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+    pthread_cond_t task_finished;
+    task_t* queue[THREAD_POOL_QUEUE_SIZE];
+    uint32_t queue_head;
+    uint32_t queue_count;
+    uint32_t stopping;
+};
+
+void task_init(task_t* task, const char* name, task_func_t func, void* data)
+{
+    memset(task, 0, sizeof(task_t));
+    task->name = name;
+    task->func = func;
+    task->data = data;
+
+    // Held until the task is submitted, so it can't start while dependencies are still being added.
+    task->unfinished_dependencies = 1;
+}
+
+static void thread_pool_enqueue_locked(thread_pool_t* pool, task_t* task)
+{
+    assert(pool->queue_count < THREAD_POOL_QUEUE_SIZE);
+    pool->queue[(pool->queue_head + pool->queue_count) % THREAD_POOL_QUEUE_SIZE] = task;
+    ++pool->queue_count;
+    pthread_cond_signal(&pool->work_available);
+}
+
+static task_t* thread_pool_dequeue_locked(thread_pool_t* pool)
+{
+    if (pool->queue_count == 0)
+        return NULL;
+
+    task_t* task = pool->queue[pool->queue_head];
+    pool->queue_head = (pool->queue_head + 1) % THREAD_POOL_QUEUE_SIZE;
+    --pool->queue_count;
+    return task;
+}
+
+// Called with the mutex held, returns with it held.
+static void thread_pool_run_locked(thread_pool_t* pool, task_t* task, uint32_t thread_index)
+{
+    pthread_mutex_unlock(&pool->mutex);
+    task->thread_index = thread_index;
+    task->start_ns = time_now_ns();
+    task->func(task->data);
+    task->end_ns = time_now_ns();
+    TRACE_ADD(task->name, task->start_ns, task->end_ns);
+    pthread_mutex_lock(&pool->mutex);
+
+    task->done = 1;
+
+    for (uint32_t i = 0; i < task->dependent_count; ++i)
+    {
+        task_t* dependent = task->dependents[i];
+        if (--dependent->unfinished_dependencies == 0)
+            thread_pool_enqueue_locked(pool, dependent);
+    }
+
+    pthread_cond_broadcast(&pool->task_finished);
+}
+
+static void* thread_pool_worker(void* data)
+{
+    thread_pool_worker_t* worker = data;
+    thread_pool_t* pool = worker->pool;
+    TRACE_THREAD_NAME("worker");
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!pool->stopping)
+    {
+        task_t* task = thread_pool_dequeue_locked(pool);
+
+        if (task)
+            thread_pool_run_locked(pool, task, worker->thread_index);
+        else
+            pthread_cond_wait(&pool->work_available, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// thread_count 0 means one thread less than there are cores, the calling thread helps out in task_wait.
+void thread_pool_create(thread_pool_t* pool, uint32_t thread_count)
+{
+    memset(pool, 0, sizeof(thread_pool_t));
+
+    if (thread_count == 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cores > 1 ? (uint32_t)cores - 1 : 1;
+    }
+
+    if (thread_count > THREAD_POOL_MAX_THREADS)
+        thread_count = THREAD_POOL_MAX_THREADS;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->task_finished, NULL);
+    pool->thread_count = thread_count;
+
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        // Thread index 0 is the main thread.
+        pool->workers[i].pool = pool;
+        pool->workers[i].thread_index = i + 1;
+        int err = pthread_create(&pool->threads[i], NULL, thread_pool_worker, &pool->workers[i]);
+        assert(err == 0);
+    }
+}
+
+void thread_pool_destroy(thread_pool_t* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    assert(pool->queue_count == 0);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < pool->thread_count; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->task_finished);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+// Makes task wait for dependency. Has to be called before task is submitted, dependency may be in any state.
+void task_depends_on(thread_pool_t* pool, task_t* task, task_t* dependency)
+{
+    pthread_mutex_lock(&pool->mutex);
+    assert(task->unfinished_dependencies > 0 && "task already submitted");
+
+    if (!dependency->done)
+    {
+        assert(dependency->dependent_count < MAX_TASK_DEPENDENTS);
+        dependency->dependents[dependency->dependent_count++] = task;
+        ++task->unfinished_dependencies;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_submit(thread_pool_t* pool, task_t* task)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    if (--task->unfinished_dependencies == 0)
+        thread_pool_enqueue_locked(pool, task);
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Blocks until task is done, running queued tasks on the calling thread in the meantime.
+void task_wait(thread_pool_t* pool, task_t* task)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!task->done)
+    {
+        task_t* queued = thread_pool_dequeue_locked(pool);
+
+        if (queued)
+            thread_pool_run_locked(pool, queued, 0);
+        else
+            pthread_cond_wait(&pool->task_finished, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+#define MAX_STARTUP_TIMELINE_ENTRIES 64
+
+typedef struct
+{
+    const char* name;
+    uint32_t thread_index;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} startup_timeline_entry_t;
+
+// Start and end of every startup phase, whether it ran on the main thread or as a task.
+typedef struct
+{
+    uint64_t origin_ns;
+    startup_timeline_entry_t entries[MAX_STARTUP_TIMELINE_ENTRIES];
+    uint32_t count;
+} startup_timeline_t;
+
+uint32_t startup_phase_begin(startup_timeline_t* t, const char* name)
+{
+    assert(t->count < MAX_STARTUP_TIMELINE_ENTRIES);
+    startup_timeline_entry_t* e = &t->entries[t->count];
+    e->name = name;
+    e->thread_index = 0;
+    e->start_ns = time_now_ns();
+    e->end_ns = e->start_ns;
+    return t->count++;
+}
+
+void startup_phase_end(startup_timeline_t* t, uint32_t phase)
+{
+    t->entries[phase].end_ns = time_now_ns();
+    TRACE_ADD(t->entries[phase].name, t->entries[phase].start_ns, t->entries[phase].end_ns);
+}
+
+void startup_timeline_add_task(startup_timeline_t* t, const task_t* task)
+{
+    assert(task->done);
+    assert(t->count < MAX_STARTUP_TIMELINE_ENTRIES);
+    startup_timeline_entry_t* e = &t->entries[t->count++];
+    e->name = task->name;
+    e->thread_index = task->thread_index;
+    e->start_ns = task->start_ns;
+    e->end_ns = task->end_ns;
+}
+
+static int startup_timeline_entry_compare(const void* a, const void* b)
+{
+    const startup_timeline_entry_t* ea = a;
+    const startup_timeline_entry_t* eb = b;
+    return ea->start_ns < eb->start_ns ? -1 : ea->start_ns > eb->start_ns;
+}
+
+void startup_timeline_print(startup_timeline_t* t)
+{
+    qsort(t->entries, t->count, sizeof(startup_timeline_entry_t), startup_timeline_entry_compare);
+    printf("startup timeline (ms since start):\n");
+
+    for (uint32_t i = 0; i < t->count; ++i)
+    {
+        const startup_timeline_entry_t* e = &t->entries[i];
+        printf("  %8.2f - %8.2f  %-7s %-2u %s\n",
+               (e->start_ns - t->origin_ns) / 1e6, (e->end_ns - t->origin_ns) / 1e6,
+               e->thread_index == 0 ? "main" : "worker", e->thread_index, e->name);
+    }
+}
+
+#define MAX_WINDOWS 8
+
+// count windows of the same size on one connection, so a single event loop sees the keys pressed in any of them.
+typedef struct
+{
+    uint16_t width;
+    uint16_t height;
+    uint32_t count;
+    xcb_connection_t* connection;
+    xcb_drawable_t windows[MAX_WINDOWS];
+} x_window_t;
+
+static void open_x_window(void* data)
+{
+    x_window_t* w = data;
+    xcb_connection_t* c = xcb_connect(NULL, NULL);
+    xcb_screen_t* screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+
+    for (uint32_t i = 0; i < w->count; ++i)
+    {
+        xcb_drawable_t win = xcb_generate_id(c);
+
+        uint32_t mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
+        uint32_t values[] = {screen->black_pixel,  XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS};
+        xcb_create_window(
+            c,
+            XCB_COPY_FROM_PARENT,
+            win,
+            screen->root,
+            i * 32, i * 32, w->width, w->height,
+            10,
+            XCB_WINDOW_CLASS_INPUT_OUTPUT,
+            screen->root_visual,
+            mask, values);
+        xcb_map_window(c, win);
+        w->windows[i] = win;
+    }
+
+    xcb_flush(c);
+    w->connection = c;
+}
+
+typedef struct
+{
+    char load_task_name[64];
+    char module_task_name[64];
+    const char* filename;
+    const uint32_t* embedded;
+    size_t embedded_size;
+    char path[256];
+    arena_t arena;
+    file_data_t data;
+    VkDevice device;
+    VkShaderModule module;
+    task_t load_task;
+    task_t module_task;
+} shader_task_t;
+
+static void load_shader_file(void* data)
+{
+    shader_task_t* t = data;
+
+    if (t->path[0] == '\0')
+    {
+        t->data.data = (char*)t->embedded;
+        t->data.size = t->embedded_size;
+        return;
+    }
+
+    file_load_success_e load_res = file_load(t->path, &t->data, &t->arena);
+
+    if (load_res != FILE_LOAD_SUCCESS)
+        printf("couldn't read shader %s\n", t->path);
+
+    assert(load_res == FILE_LOAD_SUCCESS);
+    assert(t->data.size % sizeof(uint32_t) == 0);
+}
+
+static void create_shader_module(void* data)
+{
+    shader_task_t* t = data;
+
+    VkShaderModuleCreateInfo mdci = {};
+    mdci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    mdci.pCode = (uint32_t*)t->data.data;
+    mdci.codeSize = t->data.size;
+
+    VkResult res = vkCreateShaderModule(t->device, &mdci, &g_vk_allocator, &t->module);
+    assert(res == VK_SUCCESS);
+
+    // The SPIR-V isn't needed once the module exists.
+    arena_destroy(&t->arena);
+    memset(&t->data, 0, sizeof(file_data_t));
+}
+
+// The SPIR-V build.py embedded is used unless directory is given, then filename is read from there instead, which
+// is for trying out shaders without rebuilding. The load can start right away, the module task must get a device
+// and be submitted once one exists. Each shader read from a file has its own arena since the load runs off the main
+// thread.
+#define SPIRV_MAGIC 0x07230203
+
+// build.py leaves out a shader it can't compile and has no checked in SPIR-V for, its array is a single zero word
+// then. Whatever depends on it has to do without unless --shader-dir has it.
+int shader_embedded(const uint32_t* spv)
+{
+    return spv[0] == SPIRV_MAGIC;
+}
+
+void shader_task_init(shader_task_t* t, const char* filename, const uint32_t* embedded, size_t embedded_size, const char* directory)
+{
+    memset(t, 0, sizeof(shader_task_t));
+    t->filename = filename;
+    t->embedded = embedded;
+    t->embedded_size = embedded_size;
+
+    if (directory)
+    {
+        snprintf(t->path, sizeof(t->path), "%s/%s", directory, filename);
+        arena_create(&t->arena, 1024 * 1024);
+    }
+
+    snprintf(t->load_task_name, sizeof(t->load_task_name), directory ? "load %s" : "embedded %s", filename);
+    snprintf(t->module_task_name, sizeof(t->module_task_name), "shader module %s", filename);
+    task_init(&t->load_task, t->load_task_name, load_shader_file, t);
+    task_init(&t->module_task, t->module_task_name, create_shader_module, t);
+}
+
+typedef struct
+{
+    VkDevice device;
+    gpu_memory_t* memory;
+    VkCommandBuffer cmd;
+    VkQueue queue;
+    queue_timeline_t* timeline;
+    uint32_t transfer_queue_idx;
+    uint32_t graphics_queue_idx;
+    VkSemaphore upload_complete_semaphore;
+    const void* vertices;
+    VkDeviceSize size;
+    VkBuffer staging_buffer;
+    gpu_allocation_t staging_memory;
+    VkBuffer vertex_buffer;
+    gpu_allocation_t vertex_memory;
+    // Not VK_SUCCESS if a buffer couldn't get memory, nothing was submitted then.
+    VkResult result;
+} vertex_upload_task_t;
+
+// Nothing else submits to the transfer queue (which may be the graphics queue) until this task is done, so it
+// can run on any thread.
+static void upload_vertices(void* data)
+{
+    vertex_upload_task_t* t = data;
+    VkResult res;
+
+    // Vertices go through a host visible staging buffer and are copied into device local memory on the transfer
+    // queue, so the upload runs on the copy engine while the graphics queue does other work.
+    VkBufferCreateInfo staging_bci = {};
+    staging_bci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    staging_bci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    staging_bci.size = t->size;
+    staging_bci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    res = vkCreateBuffer(t->device, &staging_bci, &g_vk_allocator, &t->staging_buffer);
+    assert(res == VK_SUCCESS);
+
+    VkMemoryRequirements staging_buffer_mr;
+    vkGetBufferMemoryRequirements(t->device, t->staging_buffer, &staging_buffer_mr);
+
+    t->result = gpu_memory_alloc(t->memory, &staging_buffer_mr, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, &t->staging_memory);
+    if (t->result != VK_SUCCESS)
+        return;
+
+    uint8_t* staging_buffer_memory_data;
+    res = vkMapMemory(t->device, t->staging_memory.memory, 0, staging_buffer_mr.size, 0, (void**)&staging_buffer_memory_data);
+    assert(res == VK_SUCCESS);
+
+    memcpy(staging_buffer_memory_data, t->vertices, t->size);
+
+    vkUnmapMemory(t->device, t->staging_memory.memory);
+
+    res = vkBindBufferMemory(t->device, t->staging_buffer, t->staging_memory.memory, 0);
+    assert(res == VK_SUCCESS);
+
+    VkBufferCreateInfo vertex_bci = {};
+    vertex_bci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    vertex_bci.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    vertex_bci.size = t->size;
+    vertex_bci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    res = vkCreateBuffer(t->device, &vertex_bci, &g_vk_allocator, &t->vertex_buffer);
+    assert(res == VK_SUCCESS);
+
+    VkMemoryRequirements vertex_buffer_mr;
+    vkGetBufferMemoryRequirements(t->device, t->vertex_buffer, &vertex_buffer_mr);
+
+    // Vertices in system memory are slower to draw, but better than not drawing them when VRAM is full.
+    t->result = gpu_memory_alloc(t->memory, &vertex_buffer_mr, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &t->vertex_memory);
+    if (t->result != VK_SUCCESS)
+        return;
+
+    res = vkBindBufferMemory(t->device, t->vertex_buffer, t->vertex_memory.memory, 0);
+    assert(res == VK_SUCCESS);
+
+    VkCommandBufferBeginInfo transfer_cbbi = {};
+    transfer_cbbi.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    transfer_cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    res = vkBeginCommandBuffer(t->cmd, &transfer_cbbi);
+    assert(res == VK_SUCCESS);
+
+    VkBufferCopy vertex_copy = {};
+    vertex_copy.size = t->size;
+    vkCmdCopyBuffer(t->cmd, t->staging_buffer, t->vertex_buffer, 1, &vertex_copy);
+
+    // Release half of the ownership transfer, the graphics command buffer records the matching acquire.
+    cmd_buffer_ownership_barrier(t->cmd, t->vertex_buffer, t->transfer_queue_idx, t->graphics_queue_idx,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                                 VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+
+    res = vkEndCommandBuffer(t->cmd);
+    assert(res == VK_SUCCESS);
+
+    VkSubmitInfo transfer_si = {};
+    transfer_si.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    transfer_si.commandBufferCount = 1;
+    transfer_si.pCommandBuffers = &t->cmd;
+    transfer_si.signalSemaphoreCount = 1;
+    transfer_si.pSignalSemaphores = &t->upload_complete_semaphore;
+
+    // Submitted right away so the copy overlaps with the rest of startup, graphics only waits for it at
+    // the vertex input stage.
+    queue_timeline_submit(t->timeline, t->queue, &transfer_si);
+}
+
+#define UPLOAD_BATCH_MAX 64
+#define UPLOAD_STAGING_SLOTS 3
+
+typedef enum
+{
+    UPLOAD_QUEUED,
+    UPLOAD_READY,
+    UPLOAD_FAILED
+} upload_state_e;
+
+// Asks upload_service_t for a device local buffer, or with a format other than VK_FORMAT_UNDEFINED a 2D image in
+// SHADER_READ_ONLY_OPTIMAL layout, holding size bytes of data. Owned by the caller, who keeps it and data alive
+// until state isn't UPLOAD_QUEUED any more. The resources are usable on the graphics queue once it is
+// UPLOAD_READY, after which memory belongs to the caller.
+typedef struct upload_request_t
+{
+    struct upload_request_t* _Atomic next;
+    const void* data;
+    VkDeviceSize size;
+    VkBufferUsageFlags buffer_usage;
+    VkFormat format;
+    VkExtent2D extent;
+    VkImageUsageFlags image_usage;
+    VkBuffer buffer;
+    VkImage image;
+    gpu_allocation_t memory;
+    _Atomic uint32_t state;
+} upload_request_t;
+
+// One batch worth of staging memory, reused for as long as it is big enough. value is the transfer timeline value
+// the batch in requests was submitted with, 0 while the slot is free.
+typedef struct
+{
+    VkCommandBuffer cmd;
+    VkBuffer buffer;
+    gpu_allocation_t memory;
+    uint8_t* data;
+    VkDeviceSize capacity;
+    uint64_t value;
+    upload_request_t* requests[UPLOAD_BATCH_MAX];
+    uint32_t request_count;
+} upload_staging_t;
+
+// Any thread can queue requests, a dedicated thread takes whatever has piled up, copies all of it through one
+// staging buffer with one submit on the transfer queue and goes on with the next batch while the copy runs. Up
+// to UPLOAD_STAGING_SLOTS batches are in flight, their requests are marked ready once the timeline has passed
+// them. Nobody waits on the upload thread, the render loop just checks the state of its requests.
+//
+// The request queue is an intrusive lock-free MPSC list: producers swap themselves in at head and then link the
+// previous head to them, the upload thread pops at tail. stub keeps the list from ever being empty. A producer
+// that has swapped but not linked yet is picked up on its semaphore post.
+//
+// Resources are shared concurrently between the transfer and graphics families, so there is no ownership
+// transfer to record on the graphics side. queue_mutex has to be held around every use of the transfer queue if
+// it is also the graphics or present queue, NULL otherwise.
+typedef struct
+{
+    VkDevice device;
+    gpu_memory_t* memory;
+    VkQueue queue;
+    queue_timeline_t* timeline;
+    pthread_mutex_t* queue_mutex;
+    uint32_t queue_families[2];
+    uint32_t queue_family_count;
+    VkCommandPool cmd_pool;
+    upload_staging_t staging[UPLOAD_STAGING_SLOTS];
+    uint32_t next_staging;
+
+    upload_request_t* _Atomic head;
+    upload_request_t* tail;
+    upload_request_t stub;
+    sem_t work_available;
+    _Atomic uint32_t stopping;
+    pthread_t thread;
+
+    // Only touched by the upload thread, read after it has stopped.
+    uint64_t batches;
+    uint64_t requests;
+    VkDeviceSize bytes;
+} upload_service_t;
+
+static void upload_queue_push(upload_service_t* s, upload_request_t* r)
+{
+    atomic_store_explicit(&r->next, NULL, memory_order_relaxed);
+    upload_request_t* prev = atomic_exchange_explicit(&s->head, r, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, r, memory_order_release);
+}
+
+// Returns NULL if the queue is empty or the next request is still being linked in.
+static upload_request_t* upload_queue_pop(upload_service_t* s)
+{
+    upload_request_t* tail = s->tail;
+    upload_request_t* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &s->stub)
+    {
+        if (next == NULL)
+            return NULL;
+
+        s->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next)
+    {
+        s->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&s->head, memory_order_acquire))
+        return NULL;
+
+    // tail is the last request, putting stub back behind it lets it be popped without losing the list.
+    upload_queue_push(s, &s->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (next == NULL)
+        return NULL;
+
+    s->tail = next;
+    return tail;
+}
+
+// Safe to call from any thread.
+void upload_service_enqueue(upload_service_t* s, upload_request_t* r)
+{
+    atomic_store_explicit(&r->state, UPLOAD_QUEUED, memory_order_relaxed);
+    upload_queue_push(s, r);
+    sem_post(&s->work_available);
+}
+
+uint32_t upload_request_state(upload_request_t* r)
+{
+    return atomic_load_explicit(&r->state, memory_order_acquire);
+}
+
+// Destroys whatever r got so far and tells its owner the upload failed.
+static void upload_fail_request(upload_service_t* s, upload_request_t* r)
+{
+    vkDestroyBuffer(s->device, r->buffer, &g_vk_allocator);
+    vkDestroyImage(s->device, r->image, &g_vk_allocator);
+    gpu_memory_free(s->memory, &r->memory);
+    r->buffer = VK_NULL_HANDLE;
+    r->image = VK_NULL_HANDLE;
+    atomic_store_explicit(&r->state, UPLOAD_FAILED, memory_order_release);
+}
+
+// Creates the buffer or image of r and gives it memory. Returns 0 if that failed, r is failed then.
+static int upload_create_resource(upload_service_t* s, upload_request_t* r)
+{
+    VkSharingMode sharing = s->queue_family_count > 1 ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE;
+    VkMemoryRequirements mr;
+    VkResult res;
+
+    if (r->format == VK_FORMAT_UNDEFINED)
+    {
+        VkBufferCreateInfo bci = {};
+        bci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bci.usage = r->buffer_usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        bci.size = r->size;
+        bci.sharingMode = sharing;
+        bci.queueFamilyIndexCount = s->queue_family_count;
+        bci.pQueueFamilyIndices = s->queue_families;
+
+        res = vkCreateBuffer(s->device, &bci, &g_vk_allocator, &r->buffer);
+        assert(res == VK_SUCCESS);
+        vkGetBufferMemoryRequirements(s->device, r->buffer, &mr);
+    }
+    else
+    {
+        VkImageCreateInfo ici = {};
+        ici.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        ici.imageType = VK_IMAGE_TYPE_2D;
+        ici.format = r->format;
+        ici.extent.width = r->extent.width;
+        ici.extent.height = r->extent.height;
+        ici.extent.depth = 1;
+        ici.mipLevels = 1;
+        ici.arrayLayers = 1;
+        ici.samples = VK_SAMPLE_COUNT_1_BIT;
+        ici.tiling = VK_IMAGE_TILING_OPTIMAL;
+        ici.usage = r->image_usage | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        ici.sharingMode = sharing;
+        ici.queueFamilyIndexCount = s->queue_family_count;
+        ici.pQueueFamilyIndices = s->queue_families;
+        ici.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        res = vkCreateImage(s->device, &ici, &g_vk_allocator, &r->image);
+        assert(res == VK_SUCCESS);
+        vkGetImageMemoryRequirements(s->device, r->image, &mr);
+    }
+
+    res = gpu_memory_alloc(s->memory, &mr, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &r->memory);
+
+    if (res == VK_SUCCESS && r->buffer != VK_NULL_HANDLE)
+        res = vkBindBufferMemory(s->device, r->buffer, r->memory.memory, 0);
+    else if (res == VK_SUCCESS)
+        res = vkBindImageMemory(s->device, r->image, r->memory.memory, 0);
+
+    if (res == VK_SUCCESS)
+        return 1;
+
+    upload_fail_request(s, r);
+    return 0;
+}
+
+static void upload_record_image_copy(VkCommandBuffer cmd, const upload_request_t* r, VkDeviceSize staging_offset, VkBuffer staging_buffer)
+{
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = r->image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+
+    VkBufferImageCopy copy = {};
+    copy.bufferOffset = staging_offset;
+    copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    copy.imageSubresource.layerCount = 1;
+    copy.imageExtent.width = r->extent.width;
+    copy.imageExtent.height = r->extent.height;
+    copy.imageExtent.depth = 1;
+    vkCmdCopyBufferToImage(cmd, staging_buffer, r->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+
+    // The graphics queue only uses the image after the host has seen this batch finish.
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+// Makes sure st can hold size bytes, st has to be free. Returns 0 if there was no memory for it.
+static int upload_staging_reserve(upload_service_t* s, upload_staging_t* st, VkDeviceSize size)
+{
+    if (size <= st->capacity)
+        return 1;
+
+    // Grown by at least half so a stream of slightly bigger batches doesn't reallocate every time.
+    VkDeviceSize capacity = size > st->capacity + st->capacity / 2 ? size : st->capacity + st->capacity / 2;
+
+    if (st->buffer != VK_NULL_HANDLE)
+    {
+        vkUnmapMemory(s->device, st->memory.memory);
+        vkDestroyBuffer(s->device, st->buffer, &g_vk_allocator);
+        gpu_memory_free(s->memory, &st->memory);
+        st->buffer = VK_NULL_HANDLE;
+        st->capacity = 0;
+    }
+
+    VkBufferCreateInfo bci = {};
+    bci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bci.size = capacity;
+    bci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkResult res = vkCreateBuffer(s->device, &bci, &g_vk_allocator, &st->buffer);
+    assert(res == VK_SUCCESS);
+
+    VkMemoryRequirements mr;
+    vkGetBufferMemoryRequirements(s->device, st->buffer, &mr);
+
+    res = gpu_memory_alloc(s->memory, &mr, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, &st->memory);
+    if (res != VK_SUCCESS)
+    {
+        vkDestroyBuffer(s->device, st->buffer, &g_vk_allocator);
+        st->buffer = VK_NULL_HANDLE;
+        return 0;
+    }
+
+    res = vkBindBufferMemory(s->device, st->buffer, st->memory.memory, 0);
+    assert(res == VK_SUCCESS);
+
+    // Stays mapped until the slot is reallocated or destroyed.
+    res = vkMapMemory(s->device, st->memory.memory, 0, VK_WHOLE_SIZE, 0, (void**)&st->data);
+    assert(res == VK_SUCCESS);
+    st->capacity = capacity;
+    return 1;
+}
+
+// Marks the requests of every batch the transfer timeline has passed ready and frees their slots.
+static void upload_poll(upload_service_t* s)
+{
+    uint64_t completed = queue_timeline_completed(s->timeline);
+
+    for (uint32_t i = 0; i < UPLOAD_STAGING_SLOTS; ++i)
+    {
+        upload_staging_t* st = &s->staging[i];
+
+        if (st->value == 0 || st->value > completed)
+            continue;
+
+        for (uint32_t j = 0; j < st->request_count; ++j)
+        {
+            s->bytes += st->requests[j]->size;
+            atomic_store_explicit(&st->requests[j]->state, UPLOAD_READY, memory_order_release);
+        }
+
+        s->requests += st->request_count;
+        st->request_count = 0;
+        st->value = 0;
+    }
+}
+
+// Returns the timeline value of the oldest batch still in flight, 0 if there is none.
+static uint64_t upload_oldest_in_flight(const upload_service_t* s)
+{
+    uint64_t oldest = 0;
+
+    for (uint32_t i = 0; i < UPLOAD_STAGING_SLOTS; ++i)
+    {
+        if (s->staging[i].value != 0 && (oldest == 0 || s->staging[i].value < oldest))
+            oldest = s->staging[i].value;
+    }
+
+    return oldest;
+}
+
+static void upload_batch(upload_service_t* s, upload_request_t** batch, uint32_t count)
+{
+    VkDeviceSize offsets[UPLOAD_BATCH_MAX];
+    VkDeviceSize staging_size = 0;
+    uint32_t ready_count = 0;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!upload_create_resource(s, batch[i]))
+            continue;
+
+        // Copies out of a buffer into an image need offsets aligned to the texel size, 16 covers every format.
+        batch[ready_count] = batch[i];
+        offsets[ready_count++] = staging_size;
+        staging_size += (batch[i]->size + 15) & ~(VkDeviceSize)15;
+    }
+
+    if (ready_count == 0)
+        return;
+
+    // Slots are used in turn, so the next one holds the oldest batch. Only when all of them are in flight does
+    // this thread have to wait for the GPU.
+    upload_staging_t* st = &s->staging[s->next_staging];
+
+    if (st->value != 0)
+    {
+        queue_timeline_wait(s->timeline, st->value);
+        upload_poll(s);
+    }
+
+    // Without staging memory the whole batch fails, the next one may still fit.
+    if (!upload_staging_reserve(s, st, staging_size))
+    {
+        for (uint32_t i = 0; i < ready_count; ++i)
+            upload_fail_request(s, batch[i]);
+
+        return;
+    }
+
+    s->next_staging = (s->next_staging + 1) % UPLOAD_STAGING_SLOTS;
+
+    for (uint32_t i = 0; i < ready_count; ++i)
+        memcpy(st->data + offsets[i], batch[i]->data, batch[i]->size);
+
+    VkCommandBufferBeginInfo cbbi = {};
+    cbbi.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VkResult res = vkBeginCommandBuffer(st->cmd, &cbbi);
+    assert(res == VK_SUCCESS);
+
+    for (uint32_t i = 0; i < ready_count; ++i)
+    {
+        if (batch[i]->buffer != VK_NULL_HANDLE)
+        {
+            VkBufferCopy copy = {};
+            copy.srcOffset = offsets[i];
+            copy.size = batch[i]->size;
+            vkCmdCopyBuffer(st->cmd, st->buffer, batch[i]->buffer, 1, &copy);
+        }
+        else
+            upload_record_image_copy(st->cmd, batch[i], offsets[i], st->buffer);
+    }
+
+    res = vkEndCommandBuffer(st->cmd);
+    assert(res == VK_SUCCESS);
+
+    VkSubmitInfo si = {};
+    si.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    si.commandBufferCount = 1;
+    si.pCommandBuffers = &st->cmd;
+
+    if (s->queue_mutex)
+        pthread_mutex_lock(s->queue_mutex);
+
+    st->value = queue_timeline_submit(s->timeline, s->queue, &si);
+
+    if (s->queue_mutex)
+        pthread_mutex_unlock(s->queue_mutex);
+
+    memcpy(st->requests, batch, ready_count * sizeof(upload_request_t*));
+    st->request_count = ready_count;
+    ++s->batches;
+}
+
+static void* upload_thread(void* data)
+{
+    upload_service_t* s = data;
+    TRACE_THREAD_NAME("upload");
+
+    for (;;)
+    {
+        upload_poll(s);
+
+        // With batches in flight and nothing new to copy, sleep on the oldest batch instead, its requests are
+        // the next ones to become ready.
+        if (sem_trywait(&s->work_available) != 0)
+        {
+            uint64_t oldest = upload_oldest_in_flight(s);
+
+            if (oldest != 0)
+            {
+                queue_timeline_wait(s->timeline, oldest);
+                continue;
+            }
+
+            sem_wait(&s->work_available);
+        }
+
+        upload_request_t* batch[UPLOAD_BATCH_MAX];
+        uint32_t count = 0;
+
+        while (count < UPLOAD_BATCH_MAX && (batch[count] = upload_queue_pop(s)))
+            ++count;
+
+        if (count > 0)
+            upload_batch(s, batch, count);
+        else if (atomic_load(&s->stopping))
+        {
+            queue_timeline_wait(s->timeline, s->timeline->submitted_value);
+            upload_poll(s);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Takes over the transfer queue and timeline, nothing else may submit to them until upload_service_destroy.
+void upload_service_create(upload_service_t* s, VkDevice device, gpu_memory_t* memory, VkQueue queue, queue_timeline_t* timeline,
+                           pthread_mutex_t* queue_mutex, uint32_t transfer_queue_idx, uint32_t graphics_queue_idx)
+{
+    memset(s, 0, sizeof(upload_service_t));
+    s->device = device;
+    s->memory = memory;
+    s->queue = queue;
+    s->timeline = timeline;
+    s->queue_mutex = queue_mutex;
+    s->queue_families[0] = transfer_queue_idx;
+    s->queue_families[1] = graphics_queue_idx;
+    s->queue_family_count = transfer_queue_idx == graphics_queue_idx ? 1 : 2;
+
+    VkCommandPoolCreateInfo cpci = {};
+    cpci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cpci.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    cpci.queueFamilyIndex = transfer_queue_idx;
+    VkResult res = vkCreateCommandPool(device, &cpci, &g_vk_allocator, &s->cmd_pool);
+    assert(res == VK_SUCCESS);
+
+    VkCommandBufferAllocateInfo cbai = {};
+    cbai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbai.commandPool = s->cmd_pool;
+    cbai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbai.commandBufferCount = 1;
+
+    for (uint32_t i = 0; i < UPLOAD_STAGING_SLOTS; ++i)
+    {
+        res = vkAllocateCommandBuffers(device, &cbai, &s->staging[i].cmd);
+        assert(res == VK_SUCCESS);
+    }
+
+    atomic_store(&s->head, &s->stub);
+    s->tail = &s->stub;
+    sem_init(&s->work_available, 0, 0);
+    int err = pthread_create(&s->thread, NULL, upload_thread, s);
+    assert(err == 0);
+}
+
+// Finishes everything queued before it.
+void upload_service_destroy(upload_service_t* s)
+{
+    atomic_store(&s->stopping, 1);
+    sem_post(&s->work_available);
+    pthread_join(s->thread, NULL);
+    sem_destroy(&s->work_available);
+
+    for (uint32_t i = 0; i < UPLOAD_STAGING_SLOTS; ++i)
+    {
+        upload_staging_t* st = &s->staging[i];
+
+        if (st->buffer != VK_NULL_HANDLE)
+        {
+            vkUnmapMemory(s->device, st->memory.memory);
+            vkDestroyBuffer(s->device, st->buffer, &g_vk_allocator);
+            gpu_memory_free(s->memory, &st->memory);
+        }
+
+        vkFreeCommandBuffers(s->device, s->cmd_pool, 1, &st->cmd);
+    }
+
+    vkDestroyCommandPool(s->device, s->cmd_pool, &g_vk_allocator);
+}
+
+typedef struct
+{
+    VkDevice device;
+    VkPipelineLayout layout;
+    VkRenderPass render_pass;
+    // Used instead of render_pass when that is VK_NULL_HANDLE, see render_graph_pipeline_rendering.
+    const VkPipelineRenderingCreateInfo* rendering;
+    const shader_task_t* vertex_shader;
+    const shader_task_t* fragment_shader;
+    uint32_t vertex_stride;
+    VkSampleCountFlagBits samples;
+
+    // Depth only pipelines have no fragment stage or color attachment and read a position only vertex stream.
+    uint32_t depth_only;
+    VkCompareOp depth_compare_op;
+    VkBool32 depth_write;
+    VkPipeline pipeline;
+} pipeline_task_t;
+
+static void create_graphics_pipeline(void* data)
+{
+    pipeline_task_t* t = data;
+    VkResult res;
+
+    VkPipelineShaderStageCreateInfo shader_stages[2];
+    memset(shader_stages, 0, sizeof(VkPipelineShaderStageCreateInfo) * 2);
+
+    shader_stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shader_stages[0].pName = "main";
+    shader_stages[0].module = t->vertex_shader->module;
+
+    if (!t->depth_only)
+    {
+        shader_stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        shader_stages[1].pName = "main";
+        shader_stages[1].module = t->fragment_shader->module;
+    }
+
+    VkVertexInputBindingDescription vi_binding = {};
+    VkVertexInputAttributeDescription vi_attribs[2];
+    memset(vi_attribs, 0, sizeof(vi_attribs));
+    vi_binding.binding = 0;
+    vi_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    vi_binding.stride = t->vertex_stride;
+
+    vi_attribs[0].binding = 0;
+    vi_attribs[0].location = 0;
+    vi_attribs[0].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    vi_attribs[0].offset = 0;
+    vi_attribs[1].binding = 0;
+    vi_attribs[1].location = 1;
+    vi_attribs[1].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    vi_attribs[1].offset = 16;
+
+    // The vertex shader still wants a color input, it's fed the position since nothing reads the result.
+    if (t->depth_only)
+        vi_attribs[1].offset = 0;
+
+    VkDynamicState dynamic_state_enables[VK_DYNAMIC_STATE_RANGE_SIZE];
+    memset(dynamic_state_enables, 0, sizeof(dynamic_state_enables));
+    VkPipelineDynamicStateCreateInfo pdsci = {};
+    pdsci.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    pdsci.pDynamicStates = dynamic_state_enables;
+
+    VkPipelineVertexInputStateCreateInfo pvisci = {};
+    pvisci.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    pvisci.vertexBindingDescriptionCount = 1;
+    pvisci.pVertexBindingDescriptions = &vi_binding;
+    pvisci.vertexAttributeDescriptionCount = 2;
+    pvisci.pVertexAttributeDescriptions = vi_attribs;
+
+    VkPipelineInputAssemblyStateCreateInfo piasci = {};
+    piasci.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    piasci.primitiveRestartEnable = VK_FALSE;
+    piasci.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkPipelineRasterizationStateCreateInfo prsci = {};
+    prsci.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    prsci.polygonMode = VK_POLYGON_MODE_FILL;
+    prsci.cullMode = VK_CULL_MODE_BACK_BIT;
+    prsci.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    prsci.depthClampEnable = VK_FALSE;
+    prsci.rasterizerDiscardEnable = VK_FALSE;
+    prsci.depthBiasEnable = VK_FALSE;
+    prsci.depthBiasConstantFactor = 0;
+    prsci.depthBiasClamp = 0;
+    prsci.depthBiasSlopeFactor = 0;
+    prsci.lineWidth = 1.0f;
+
+    VkPipelineColorBlendStateCreateInfo pcbsci = {};
+    pcbsci.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    VkPipelineColorBlendAttachmentState cb_attachment_state[1];
+    memset(cb_attachment_state, 0, sizeof(cb_attachment_state));
+    cb_attachment_state[0].colorWriteMask = 0xf;
+    cb_attachment_state[0].blendEnable = VK_FALSE;
+    cb_attachment_state[0].alphaBlendOp = VK_BLEND_OP_ADD;
+    cb_attachment_state[0].colorBlendOp = VK_BLEND_OP_ADD;
     cb_attachment_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_ZERO;
     cb_attachment_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
     cb_attachment_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
     cb_attachment_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-    pcbsci.attachmentCount = 1;
+    pcbsci.attachmentCount = t->depth_only ? 0 : 1;
     pcbsci.pAttachments = cb_attachment_state;
     pcbsci.logicOpEnable = VK_FALSE;
     pcbsci.logicOp = VK_LOGIC_OP_NO_OP;
@@ -1050,202 +2537,6709 @@ int main()
     pcbsci.blendConstants[3] = 1.0f;
 
 
-    #define NUM_VIEWPORTS 1
-    #define NUM_SCISSORS NUM_VIEWPORTS
-    VkPipelineViewportStateCreateInfo pvpsci = {};
-    pvpsci.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    pvpsci.viewportCount = NUM_VIEWPORTS;
-    dynamic_state_enables[pdsci.dynamicStateCount++] = VK_DYNAMIC_STATE_VIEWPORT;
-    pvpsci.scissorCount = NUM_SCISSORS;
-    dynamic_state_enables[pdsci.dynamicStateCount++] = VK_DYNAMIC_STATE_SCISSOR;
-    pvpsci.pScissors = NULL;
-    pvpsci.pViewports = NULL;
+    #define NUM_VIEWPORTS 1
+    #define NUM_SCISSORS NUM_VIEWPORTS
+    VkPipelineViewportStateCreateInfo pvpsci = {};
+    pvpsci.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    pvpsci.viewportCount = NUM_VIEWPORTS;
+    dynamic_state_enables[pdsci.dynamicStateCount++] = VK_DYNAMIC_STATE_VIEWPORT;
+    pvpsci.scissorCount = NUM_SCISSORS;
+    dynamic_state_enables[pdsci.dynamicStateCount++] = VK_DYNAMIC_STATE_SCISSOR;
+    pvpsci.pScissors = NULL;
+    pvpsci.pViewports = NULL;
+
+    VkPipelineDepthStencilStateCreateInfo pdssci = {};
+    pdssci.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    pdssci.depthTestEnable = VK_TRUE;
+    pdssci.depthWriteEnable = t->depth_write;
+    pdssci.depthCompareOp = t->depth_compare_op;
+    pdssci.depthBoundsTestEnable = VK_FALSE;
+    pdssci.minDepthBounds = 0;
+    pdssci.maxDepthBounds = 0;
+    pdssci.stencilTestEnable = VK_FALSE;
+    pdssci.back.failOp = VK_STENCIL_OP_KEEP;
+    pdssci.back.passOp = VK_STENCIL_OP_KEEP;
+    pdssci.back.compareOp = VK_COMPARE_OP_ALWAYS;
+    pdssci.back.compareMask = 0;
+    pdssci.back.reference = 0;
+    pdssci.back.depthFailOp = VK_STENCIL_OP_KEEP;
+    pdssci.back.writeMask = 0;
+    pdssci.front = pdssci.back;
+    
+    VkPipelineMultisampleStateCreateInfo pmsci = {};
+    pmsci.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    pmsci.rasterizationSamples = t->samples;
+    pmsci.sampleShadingEnable = VK_FALSE;
+    pmsci.alphaToCoverageEnable = VK_FALSE;
+    pmsci.alphaToOneEnable = VK_FALSE;
+    pmsci.minSampleShading = 0.0;
+
+    VkGraphicsPipelineCreateInfo pci = {};
+    pci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pci.layout = t->layout;
+    pci.pVertexInputState = &pvisci;
+    pci.pInputAssemblyState = &piasci;
+    pci.pRasterizationState = &prsci;
+    pci.pColorBlendState = &pcbsci;
+    pci.pTessellationState = NULL;
+    pci.pMultisampleState = &pmsci;
+    pci.pDynamicState = &pdsci;
+    pci.pViewportState = &pvpsci;
+    pci.pDepthStencilState = &pdssci;
+    pci.pStages = shader_stages;
+    pci.stageCount = t->depth_only ? 1 : 2;
+    pci.pNext = t->render_pass == VK_NULL_HANDLE ? t->rendering : NULL;
+    pci.renderPass = t->render_pass;
+    pci.subpass = 0;
+
+    res = vkCreateGraphicsPipelines(t->device, VK_NULL_HANDLE, 1, &pci, &g_vk_allocator, &t->pipeline);
+    assert(res == VK_SUCCESS);
+}
+
+#define MESH_MAX_LODS 8
+
+// Screen space error a LOD may have before the next finer one is used instead.
+#define LOD_MAX_ERROR_PIXELS 1.0f
+
+// The spheres drawn by --lod-instances are cubes with every face split into this many quads per side.
+#define LOD_SPHERE_SUBDIVISIONS 32
+
+typedef struct
+{
+    uint32_t first_index;
+    uint32_t index_count;
+    // Upper bound of how far the simplified surface is from the full detail one, in object space.
+    float error;
+} mesh_lod_t;
+
+// Indexed triangle mesh. All LODs use the same vertices, their index ranges are stored back to back in indices
+// with the full detail one first.
+typedef struct
+{
+    vertex_t* vertices;
+    uint32_t vertex_count;
+    uint32_t* indices;
+    uint32_t index_count;
+    mesh_lod_t lods[MESH_MAX_LODS];
+    uint32_t lod_count;
+    // Bounding sphere around the origin.
+    float radius;
+} mesh_t;
+
+static vec3_t vec3_sub(const vertex_t* a, const vertex_t* b)
+{
+    vec3_t r = {a->x - b->x, a->y - b->y, a->z - b->z};
+    return r;
+}
+
+static vec3_t vec3_cross(vec3_t a, vec3_t b)
+{
+    vec3_t r = {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+    return r;
+}
+
+static float vec3_dot(vec3_t a, vec3_t b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static void mesh_compute_radius(mesh_t* m)
+{
+    m->radius = 0;
+
+    for (uint32_t i = 0; i < m->vertex_count; ++i)
+    {
+        const vertex_t* v = &m->vertices[i];
+        float r = sqrtf(v->x * v->x + v->y * v->y + v->z * v->z);
+
+        if (r > m->radius)
+            m->radius = r;
+    }
+}
+
+// Welds identical vertices of a non-indexed triangle list. The result has a single LOD.
+void mesh_from_triangle_list(mesh_t* m, const vertex_t* vertices, uint32_t vertex_count, arena_t* arena)
+{
+    memset(m, 0, sizeof(mesh_t));
+    m->vertices = arena_alloc_array(arena, vertex_t, vertex_count);
+    m->indices = arena_alloc_array(arena, uint32_t, vertex_count);
+
+    for (uint32_t i = 0; i < vertex_count; ++i)
+    {
+        uint32_t index = -1;
+
+        for (uint32_t j = 0; j < m->vertex_count; ++j)
+        {
+            if (memcmp(&m->vertices[j], &vertices[i], sizeof(vertex_t)) == 0)
+            {
+                index = j;
+                break;
+            }
+        }
+
+        if (index == -1)
+        {
+            index = m->vertex_count++;
+            m->vertices[index] = vertices[i];
+        }
+
+        m->indices[m->index_count++] = index;
+    }
+
+    m->lods[0].index_count = m->index_count;
+    m->lod_count = 1;
+    mesh_compute_radius(m);
+}
+
+// Cube with every face split into subdivisions^2 quads and pushed out onto the unit sphere. Each face keeps the
+// color and winding it has in g_vb_solid_face_colors_Data, so faces don't share vertices.
+void mesh_create_sphere(mesh_t* m, uint32_t subdivisions, arena_t* arena)
+{
+    // Normal, the two axes spanning the face and the color.
+    static const float faces[6][4][3] = {
+        {{0, 0, 1}, {1, 0, 0}, {0, 1, 0}, {1, 0, 0}},
+        {{0, 0, -1}, {1, 0, 0}, {0, 1, 0}, {0, 1, 0}},
+        {{-1, 0, 0}, {0, 1, 0}, {0, 0, 1}, {0, 0, 1}},
+        {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}, {1, 1, 0}},
+        {{0, 1, 0}, {1, 0, 0}, {0, 0, 1}, {1, 0, 1}},
+        {{0, -1, 0}, {1, 0, 0}, {0, 0, 1}, {0, 1, 1}},
+    };
+
+    const uint32_t side = subdivisions + 1;
+    memset(m, 0, sizeof(mesh_t));
+    m->vertices = arena_alloc_array(arena, vertex_t, 6 * side * side);
+    m->indices = arena_alloc_array(arena, uint32_t, 6 * subdivisions * subdivisions * 6);
+
+    for (uint32_t f = 0; f < 6; ++f)
+    {
+        const float (*n)[3] = faces[f];
+        uint32_t first_vertex = m->vertex_count;
+
+        for (uint32_t j = 0; j < side; ++j)
+        {
+            for (uint32_t i = 0; i < side; ++i)
+            {
+                float u = 2.0f * i / subdivisions - 1.0f;
+                float v = 2.0f * j / subdivisions - 1.0f;
+                float p[3];
+
+                for (uint32_t k = 0; k < 3; ++k)
+                    p[k] = n[0][k] + n[1][k] * u + n[2][k] * v;
+
+                float len = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+                vertex_t* out = &m->vertices[m->vertex_count++];
+                out->x = p[0] / len;
+                out->y = p[1] / len;
+                out->z = p[2] / len;
+                out->w = 1.0f;
+                out->r = n[3][0];
+                out->g = n[3][1];
+                out->b = n[3][2];
+                out->a = 1.0f;
+            }
+        }
+
+        for (uint32_t j = 0; j < subdivisions; ++j)
+        {
+            for (uint32_t i = 0; i < subdivisions; ++i)
+            {
+                uint32_t a = first_vertex + j * side + i;
+                uint32_t quad[2][3] = {{a, a + side, a + 1}, {a + 1, a + side, a + side + 1}};
+
+                for (uint32_t t = 0; t < 2; ++t)
+                {
+                    uint32_t* tri = &m->indices[m->index_count];
+                    const vertex_t* v0 = &m->vertices[quad[t][0]];
+                    vec3_t normal = vec3_cross(vec3_sub(&m->vertices[quad[t][1]], v0), vec3_sub(&m->vertices[quad[t][2]], v0));
+                    vec3_t outward = {v0->x, v0->y, v0->z};
+
+                    // The cube data has the geometric normal pointing inwards.
+                    int flip = vec3_dot(normal, outward) > 0;
+                    tri[0] = quad[t][0];
+                    tri[1] = quad[t][flip ? 2 : 1];
+                    tri[2] = quad[t][flip ? 1 : 2];
+                    m->index_count += 3;
+                }
+            }
+        }
+    }
+
+    m->lods[0].index_count = m->index_count;
+    m->lod_count = 1;
+    mesh_compute_radius(m);
+}
+
+// Symmetric 4x4 matrix summing the squared distances to a set of planes: aa ab ac ad bb bc bd cc cd dd.
+typedef struct
+{
+    double q[10];
+} quadric_t;
+
+static void quadric_add_plane(quadric_t* q, double a, double b, double c, double d)
+{
+    q->q[0] += a * a; q->q[1] += a * b; q->q[2] += a * c; q->q[3] += a * d;
+    q->q[4] += b * b; q->q[5] += b * c; q->q[6] += b * d;
+    q->q[7] += c * c; q->q[8] += c * d;
+    q->q[9] += d * d;
+}
+
+static void quadric_add(quadric_t* q, const quadric_t* other)
+{
+    for (uint32_t i = 0; i < 10; ++i)
+        q->q[i] += other->q[i];
+}
+
+static double quadric_error(const quadric_t* q, const vertex_t* v)
+{
+    double x = v->x, y = v->y, z = v->z;
+    const double* m = q->q;
+    double e = x * x * m[0] + 2 * x * y * m[1] + 2 * x * z * m[2] + 2 * x * m[3]
+             + y * y * m[4] + 2 * y * z * m[5] + 2 * y * m[6]
+             + z * z * m[7] + 2 * z * m[8]
+             + m[9];
+    return e > 0 ? e : 0;
+}
+
+typedef struct
+{
+    uint32_t from;
+    uint32_t to;
+    double cost;
+} edge_collapse_t;
+
+static int edge_collapse_compare(const void* a, const void* b)
+{
+    double ca = ((const edge_collapse_t*)a)->cost;
+    double cb = ((const edge_collapse_t*)b)->cost;
+    return ca < cb ? -1 : ca > cb;
+}
+
+static int u64_compare(const void* a, const void* b)
+{
+    uint64_t ua = *(const uint64_t*)a;
+    uint64_t ub = *(const uint64_t*)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+// Vertex to triangle adjacency of the current index list, triangles of vertex v are
+// triangles[offsets[v]] .. triangles[offsets[v + 1]].
+typedef struct
+{
+    uint32_t* offsets;
+    uint32_t* triangles;
+} mesh_adjacency_t;
+
+static void mesh_adjacency_build(mesh_adjacency_t* adj, const uint32_t* indices, uint32_t index_count, uint32_t vertex_count)
+{
+    memset(adj->offsets, 0, sizeof(uint32_t) * (vertex_count + 1));
+
+    for (uint32_t i = 0; i < index_count; ++i)
+        ++adj->offsets[indices[i] + 1];
+
+    for (uint32_t v = 0; v < vertex_count; ++v)
+        adj->offsets[v + 1] += adj->offsets[v];
+
+    // Fill using offsets[v] as cursor, which leaves offsets shifted by one vertex, then shift back.
+    for (uint32_t i = 0; i < index_count; ++i)
+        adj->triangles[adj->offsets[indices[i]]++] = i / 3;
+
+    for (uint32_t v = vertex_count; v > 0; --v)
+        adj->offsets[v] = adj->offsets[v - 1];
+
+    adj->offsets[0] = 0;
+}
+
+// A collapse of from into to is refused if it turns a triangle around from over, or if the two vertices have more
+// than the two neighbors in common that the triangles of the edge give, since that would make the mesh non-manifold.
+static int edge_collapse_valid(const edge_collapse_t* c, const uint32_t* indices, const vertex_t* vertices, const mesh_adjacency_t* adj,
+                               uint32_t* stamps, uint32_t* stamp)
+{
+    uint32_t mark = ++*stamp;
+    uint32_t counted = ++*stamp;
+
+    for (uint32_t i = adj->offsets[c->from]; i < adj->offsets[c->from + 1]; ++i)
+    {
+        const uint32_t* tri = &indices[adj->triangles[i] * 3];
+
+        for (uint32_t k = 0; k < 3; ++k)
+            stamps[tri[k]] = mark;
+    }
+
+    uint32_t shared = 0;
+
+    for (uint32_t i = adj->offsets[c->to]; i < adj->offsets[c->to + 1]; ++i)
+    {
+        const uint32_t* tri = &indices[adj->triangles[i] * 3];
+
+        for (uint32_t k = 0; k < 3; ++k)
+        {
+            if (tri[k] != c->from && tri[k] != c->to && stamps[tri[k]] == mark)
+            {
+                stamps[tri[k]] = counted;
+                ++shared;
+            }
+        }
+    }
+
+    if (shared > 2)
+        return 0;
+
+    for (uint32_t i = adj->offsets[c->from]; i < adj->offsets[c->from + 1]; ++i)
+    {
+        const uint32_t* tri = &indices[adj->triangles[i] * 3];
+
+        if (tri[0] == c->to || tri[1] == c->to || tri[2] == c->to)
+            continue;
+
+        const vertex_t* before[3];
+        const vertex_t* after[3];
+
+        for (uint32_t k = 0; k < 3; ++k)
+        {
+            before[k] = &vertices[tri[k]];
+            after[k] = tri[k] == c->from ? &vertices[c->to] : before[k];
+        }
+
+        vec3_t n0 = vec3_cross(vec3_sub(before[1], before[0]), vec3_sub(before[2], before[0]));
+        vec3_t n1 = vec3_cross(vec3_sub(after[1], after[0]), vec3_sub(after[2], after[0]));
+
+        if (vec3_dot(n0, n1) <= 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+// Edge collapse simplifier. Every vertex gets the quadric of the planes of its triangles, edges are collapsed
+// into one of their end points in order of the quadric error that causes, and the quadrics of collapsed vertices
+// are merged. Vertices are never moved or created, so all LODs can share the vertex buffer. Vertices on open
+// edges, such as the seams between differently colored faces, are locked so the LODs don't crack. Writes at most
+// index_count indices to dst and returns how many, error gets an upper bound of the distance to the input surface.
+uint32_t mesh_simplify(uint32_t* dst, const uint32_t* indices, uint32_t index_count, const vertex_t* vertices, uint32_t vertex_count,
+                       uint32_t target_index_count, float* error, arena_t* scratch)
+{
+    size_t scratch_mark = arena_mark(scratch);
+    quadric_t* quadrics = arena_alloc_array(scratch, quadric_t, vertex_count);
+    uint8_t* locked = arena_alloc_array(scratch, uint8_t, vertex_count);
+    uint8_t* touched = arena_alloc_array(scratch, uint8_t, vertex_count);
+    uint32_t* remap = arena_alloc_array(scratch, uint32_t, vertex_count);
+    uint32_t* stamps = arena_alloc_array(scratch, uint32_t, vertex_count);
+    uint64_t* edges = arena_alloc_array(scratch, uint64_t, index_count);
+    edge_collapse_t* collapses = arena_alloc_array(scratch, edge_collapse_t, index_count);
+    mesh_adjacency_t adj = {};
+    adj.offsets = arena_alloc_array(scratch, uint32_t, vertex_count + 1);
+    adj.triangles = arena_alloc_array(scratch, uint32_t, index_count);
+
+    memset(quadrics, 0, sizeof(quadric_t) * vertex_count);
+    memset(locked, 0, vertex_count);
+    memset(stamps, 0, sizeof(uint32_t) * vertex_count);
+    memcpy(dst, indices, sizeof(uint32_t) * index_count);
+    uint32_t stamp = 0;
+
+    for (uint32_t i = 0; i < index_count; i += 3)
+    {
+        const vertex_t* v0 = &vertices[dst[i]];
+        vec3_t n = vec3_cross(vec3_sub(&vertices[dst[i + 1]], v0), vec3_sub(&vertices[dst[i + 2]], v0));
+        float len = sqrtf(vec3_dot(n, n));
+
+        if (len == 0)
+            continue;
+
+        double a = n.x / len, b = n.y / len, c = n.z / len;
+        double d = -(a * v0->x + b * v0->y + c * v0->z);
+
+        for (uint32_t k = 0; k < 3; ++k)
+            quadric_add_plane(&quadrics[dst[i + k]], a, b, c, d);
+    }
+
+    // An edge is open if no triangle has it the other way around.
+    for (uint32_t i = 0; i < index_count; ++i)
+    {
+        uint32_t next = i % 3 == 2 ? i - 2 : i + 1;
+        edges[i] = (uint64_t)dst[i] << 32 | dst[next];
+    }
+
+    qsort(edges, index_count, sizeof(uint64_t), u64_compare);
+
+    for (uint32_t i = 0; i < index_count; ++i)
+    {
+        uint32_t a = edges[i] >> 32, b = (uint32_t)edges[i];
+        uint64_t reverse = (uint64_t)b << 32 | a;
+
+        if (bsearch(&reverse, edges, index_count, sizeof(uint64_t), u64_compare) == NULL)
+            locked[a] = locked[b] = 1;
+    }
+
+    double max_cost = 0;
+
+    while (index_count > target_index_count)
+    {
+        mesh_adjacency_build(&adj, dst, index_count, vertex_count);
+        uint32_t collapse_count = 0;
+
+        // Edges between unlocked vertices are shared by two triangles in opposite directions, only one of them is
+        // a candidate.
+        for (uint32_t i = 0; i < index_count; ++i)
+        {
+            uint32_t a = dst[i];
+            uint32_t b = dst[i % 3 == 2 ? i - 2 : i + 1];
+
+            if (a > b || (locked[a] && locked[b]))
+                continue;
+
+            quadric_t q = quadrics[a];
+            quadric_add(&q, &quadrics[b]);
+            double a_into_b = locked[a] ? INFINITY : quadric_error(&q, &vertices[b]);
+            double b_into_a = locked[b] ? INFINITY : quadric_error(&q, &vertices[a]);
+
+            edge_collapse_t* c = &collapses[collapse_count++];
+            c->from = a_into_b <= b_into_a ? a : b;
+            c->to = a_into_b <= b_into_a ? b : a;
+            c->cost = a_into_b <= b_into_a ? a_into_b : b_into_a;
+        }
+
+        if (collapse_count == 0)
+            break;
+
+        qsort(collapses, collapse_count, sizeof(edge_collapse_t), edge_collapse_compare);
+
+        for (uint32_t v = 0; v < vertex_count; ++v)
+            remap[v] = v;
+
+        memset(touched, 0, vertex_count);
+
+        // Each collapse of an interior edge removes two triangles.
+        uint32_t triangles_to_remove = (index_count - target_index_count) / 3;
+        uint32_t triangles_removed = 0;
+
+        for (uint32_t i = 0; i < collapse_count && triangles_removed < triangles_to_remove; ++i)
+        {
+            const edge_collapse_t* c = &collapses[i];
+
+            if (touched[c->from] || touched[c->to] || !edge_collapse_valid(c, dst, vertices, &adj, stamps, &stamp))
+                continue;
+
+            // The triangles around from change, so nothing else touching them may collapse before the adjacency
+            // is rebuilt.
+            for (uint32_t t = adj.offsets[c->from]; t < adj.offsets[c->from + 1]; ++t)
+            {
+                const uint32_t* tri = &dst[adj.triangles[t] * 3];
+                touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+            }
+
+            remap[c->from] = c->to;
+            quadric_add(&quadrics[c->to], &quadrics[c->from]);
+
+            if (c->cost > max_cost)
+                max_cost = c->cost;
+
+            triangles_removed += 2;
+        }
+
+        if (triangles_removed == 0)
+            break;
+
+        uint32_t new_index_count = 0;
+
+        for (uint32_t i = 0; i < index_count; i += 3)
+        {
+            uint32_t a = remap[dst[i]], b = remap[dst[i + 1]], c = remap[dst[i + 2]];
+
+            if (a == b || b == c || a == c)
+                continue;
+
+            dst[new_index_count++] = a;
+            dst[new_index_count++] = b;
+            dst[new_index_count++] = c;
+        }
+
+        index_count = new_index_count;
+    }
+
+    arena_rewind(scratch, scratch_mark);
+    *error = (float)sqrt(max_cost);
+    return index_count;
+}
+
+// Adds LODs with half the triangles of the previous one each, until MESH_MAX_LODS or until the simplifier runs
+// out of edges it can collapse. Each LOD is simplified from the previous one, so their errors add up.
+void mesh_build_lods(mesh_t* m, arena_t* arena, arena_t* scratch)
+{
+    // Every LOD has at most 3/4 of the indices of the previous one, so all of them fit in four times the first.
+    uint32_t capacity = m->lods[0].index_count * 4;
+    uint32_t* indices = arena_alloc_array(arena, uint32_t, capacity);
+    memcpy(indices, m->indices + m->lods[0].first_index, sizeof(uint32_t) * m->lods[0].index_count);
+    m->lods[0].first_index = 0;
+    uint32_t used = m->lods[0].index_count;
+
+    while (m->lod_count < MESH_MAX_LODS)
+    {
+        const mesh_lod_t* prev = &m->lods[m->lod_count - 1];
+        assert(used + prev->index_count <= capacity);
+        float error = 0;
+        uint32_t count = mesh_simplify(indices + used, indices + prev->first_index, prev->index_count, m->vertices, m->vertex_count,
+                                       prev->index_count / 6 * 3, &error, scratch);
+
+        // A level that barely removes anything isn't worth having.
+        if (count > prev->index_count / 4 * 3)
+            break;
+
+        mesh_lod_t* lod = &m->lods[m->lod_count++];
+        lod->first_index = used;
+        lod->index_count = count;
+        lod->error = prev->error + error;
+        used += count;
+    }
+
+    m->indices = indices;
+    m->index_count = used;
+}
+
+// Picks the coarsest LOD whose error covers at most LOD_MAX_ERROR_PIXELS when the mesh is distance away from the
+// camera, measured to the closest point of its bounding sphere.
+uint32_t mesh_select_lod(const mesh_t* m, float distance, float bb_height)
+{
+    distance -= m->radius;
+    uint32_t lod = 0;
+
+    for (uint32_t i = 1; i < m->lod_count; ++i)
+    {
+        if (projected_size(m->lods[i].error, distance, bb_height) <= LOD_MAX_ERROR_PIXELS)
+            lod = i;
+    }
+
+    return lod;
+}
+
+// subdivisions is 0 for the plain cube, which has nothing to simplify.
+typedef struct
+{
+    uint32_t subdivisions;
+    arena_t arena;
+    mesh_t mesh;
+} mesh_task_t;
+
+static void build_mesh(void* data)
+{
+    mesh_task_t* t = data;
+    uint32_t vertex_count = t->subdivisions ? 6 * (t->subdivisions + 1) * (t->subdivisions + 1) : 36;
+    uint32_t index_count = t->subdivisions ? 36 * t->subdivisions * t->subdivisions : 36;
+    arena_create(&t->arena, vertex_count * sizeof(vertex_t) + index_count * sizeof(uint32_t) * 5 + 1024);
+
+    if (t->subdivisions == 0)
+    {
+        const uint32_t cube_vertex_count = sizeof(g_vb_solid_face_colors_Data) / sizeof(g_vb_solid_face_colors_Data[0]);
+        mesh_from_triangle_list(&t->mesh, g_vb_solid_face_colors_Data, cube_vertex_count, &t->arena);
+    }
+    else
+        mesh_create_sphere(&t->mesh, t->subdivisions, &t->arena);
+
+    arena_t scratch;
+    arena_create(&scratch, vertex_count * (sizeof(quadric_t) + 16) + index_count * (sizeof(uint64_t) + sizeof(edge_collapse_t) + sizeof(uint32_t)) + 1024);
+    mesh_build_lods(&t->mesh, &t->arena, &scratch);
+    arena_destroy(&scratch);
+}
+
+typedef enum
+{
+    PROCEDURAL_NONE,
+    PROCEDURAL_GRID,
+    PROCEDURAL_CUBE,
+    PROCEDURAL_HEIGHTFIELD
+} procedural_kind_e;
+
+static const char* g_procedural_names[] = {
+    [PROCEDURAL_NONE] = "none",
+    [PROCEDURAL_GRID] = "grid",
+    [PROCEDURAL_CUBE] = "cube",
+    [PROCEDURAL_HEIGHTFIELD] = "heightfield",
+};
+
+// Push constants of procedural_geometry.glsl. The offsets are in 32 bit words, positions_offset is 0 without the
+// depth pre-pass stream.
+typedef struct
+{
+    uint32_t resolution;
+    uint32_t face_count;
+    uint32_t first_axis;
+    uint32_t row_size;
+    uint32_t positions_offset;
+    uint32_t index_offset;
+    float offset;
+    float amplitude;
+    float frequency;
+} procedural_params_t;
+
+#define PROCEDURAL_GROUP_SIZE 64
+
+// Vertices and indices written by a compute shader straight into the buffer they are drawn from, laid out like
+// the uploaded mesh, so nothing goes through host memory. mesh only describes the result, it has no vertices or
+// indices of its own.
+typedef struct
+{
+    VkDevice device;
+    gpu_memory_t* memory;
+    VkQueue queue;
+    uint32_t compute_queue_idx;
+    uint32_t graphics_queue_idx;
+    VkSemaphore complete_semaphore;
+    const shader_task_t* shader;
+    procedural_params_t params;
+    uint32_t group_count[2];
+    VkDeviceSize size;
+    mesh_t mesh;
+    VkCommandPool cmd_pool;
+    VkCommandBuffer cmd;
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet set;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+    VkBuffer buffer;
+    gpu_allocation_t buffer_memory;
+    // Not VK_SUCCESS if the buffer couldn't get memory, nothing was submitted then.
+    VkResult result;
+} procedural_task_t;
+
+static VkDeviceSize procedural_size(uint32_t face_count, uint32_t resolution, uint32_t depth_prepass)
+{
+    VkDeviceSize vertex_count = (VkDeviceSize)face_count * (resolution + 1) * (resolution + 1);
+    VkDeviceSize index_count = (VkDeviceSize)face_count * resolution * resolution * 6;
+    return vertex_count * (sizeof(vertex_t) + (depth_prepass ? sizeof(float) * 4 : 0)) + index_count * sizeof(uint32_t);
+}
+
+// Fills in everything but the Vulkan objects. The resolution, at least 1, is lowered until the whole buffer can be
+// bound as one storage buffer, and the dispatch is spread over y once x runs out of work groups.
+void procedural_describe(procedural_task_t* t, procedural_kind_e kind, uint32_t resolution, uint32_t depth_prepass,
+                         const VkPhysicalDeviceLimits* limits)
+{
+    procedural_params_t* p = &t->params;
+    memset(p, 0, sizeof(procedural_params_t));
+    p->face_count = kind == PROCEDURAL_CUBE ? 6 : 1;
+    p->first_axis = kind == PROCEDURAL_CUBE ? 0 : 2;
+    p->offset = kind == PROCEDURAL_CUBE ? 1.0f : 0.0f;
+    p->amplitude = kind == PROCEDURAL_HEIGHTFIELD ? 0.25f : 0.0f;
+    p->frequency = 6.0f;
+    assert(resolution > 0);
+    p->resolution = resolution;
+
+    while (p->resolution > 1 && procedural_size(p->face_count, p->resolution, depth_prepass) > limits->maxStorageBufferRange)
+        --p->resolution;
+
+    if (p->resolution != resolution)
+        printf("procedural resolution %u doesn't fit in a storage buffer, using %u\n", resolution, p->resolution);
+
+    uint32_t side = p->resolution + 1;
+    mesh_t* m = &t->mesh;
+    memset(m, 0, sizeof(mesh_t));
+    m->vertex_count = p->face_count * side * side;
+    m->index_count = p->face_count * p->resolution * p->resolution * 6;
+    m->lods[0].index_count = m->index_count;
+    m->lod_count = 1;
+    m->radius = sqrtf(p->offset * p->offset + 2.0f) + p->amplitude;
+
+    const uint32_t vertex_words = sizeof(vertex_t) / sizeof(uint32_t);
+    p->positions_offset = depth_prepass ? m->vertex_count * vertex_words : 0;
+    p->index_offset = m->vertex_count * (vertex_words + (depth_prepass ? 4 : 0));
+    t->size = procedural_size(p->face_count, p->resolution, depth_prepass);
+
+    uint32_t groups = (m->vertex_count + PROCEDURAL_GROUP_SIZE - 1) / PROCEDURAL_GROUP_SIZE;
+    t->group_count[0] = groups < limits->maxComputeWorkGroupCount[0] ? groups : limits->maxComputeWorkGroupCount[0];
+    t->group_count[1] = (groups + t->group_count[0] - 1) / t->group_count[0];
+    assert(t->group_count[1] <= limits->maxComputeWorkGroupCount[1]);
+    p->row_size = t->group_count[0] * PROCEDURAL_GROUP_SIZE;
+}
+
+// Same rules as upload_vertices: nothing else submits to the compute queue, which may be the graphics or transfer
+// queue, until this task is done. The shader module must exist before it runs.
+static void generate_geometry(void* data)
+{
+    procedural_task_t* t = data;
+    VkResult res;
+
+    VkBufferCreateInfo bci = {};
+    bci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bci.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    bci.size = t->size;
+    bci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    res = vkCreateBuffer(t->device, &bci, &g_vk_allocator, &t->buffer);
+    assert(res == VK_SUCCESS);
+
+    VkMemoryRequirements mr;
+    vkGetBufferMemoryRequirements(t->device, t->buffer, &mr);
+
+    t->result = gpu_memory_alloc(t->memory, &mr, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &t->buffer_memory);
+    if (t->result != VK_SUCCESS)
+        return;
+
+    res = vkBindBufferMemory(t->device, t->buffer, t->buffer_memory.memory, 0);
+    assert(res == VK_SUCCESS);
+
+    VkDescriptorSetLayoutBinding binding = {};
+    binding.binding = 0;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    binding.descriptorCount = 1;
+    binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutCreateInfo dslci = {};
+    dslci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    dslci.bindingCount = 1;
+    dslci.pBindings = &binding;
+
+    res = vkCreateDescriptorSetLayout(t->device, &dslci, &g_vk_allocator, &t->set_layout);
+    assert(res == VK_SUCCESS);
+
+    VkDescriptorPoolSize dps = {};
+    dps.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    dps.descriptorCount = 1;
+
+    VkDescriptorPoolCreateInfo dpci = {};
+    dpci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    dpci.maxSets = 1;
+    dpci.poolSizeCount = 1;
+    dpci.pPoolSizes = &dps;
+
+    res = vkCreateDescriptorPool(t->device, &dpci, &g_vk_allocator, &t->descriptor_pool);
+    assert(res == VK_SUCCESS);
+
+    VkDescriptorSetAllocateInfo dsai = {};
+    dsai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    dsai.descriptorPool = t->descriptor_pool;
+    dsai.descriptorSetCount = 1;
+    dsai.pSetLayouts = &t->set_layout;
+
+    res = vkAllocateDescriptorSets(t->device, &dsai, &t->set);
+    assert(res == VK_SUCCESS);
+
+    VkDescriptorBufferInfo buffer_info = {};
+    buffer_info.buffer = t->buffer;
+    buffer_info.range = VK_WHOLE_SIZE;
+
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = t->set;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pBufferInfo = &buffer_info;
+    vkUpdateDescriptorSets(t->device, 1, &write, 0, NULL);
+
+    VkPushConstantRange push_range = {};
+    push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_range.size = sizeof(procedural_params_t);
+
+    VkPipelineLayoutCreateInfo plci = {};
+    plci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    plci.setLayoutCount = 1;
+    plci.pSetLayouts = &t->set_layout;
+    plci.pushConstantRangeCount = 1;
+    plci.pPushConstantRanges = &push_range;
+
+    res = vkCreatePipelineLayout(t->device, &plci, &g_vk_allocator, &t->pipeline_layout);
+    assert(res == VK_SUCCESS);
+
+    VkComputePipelineCreateInfo cpci = {};
+    cpci.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    cpci.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    cpci.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    cpci.stage.module = t->shader->module;
+    cpci.stage.pName = "main";
+    cpci.layout = t->pipeline_layout;
+
+    res = vkCreateComputePipelines(t->device, VK_NULL_HANDLE, 1, &cpci, &g_vk_allocator, &t->pipeline);
+    assert(res == VK_SUCCESS);
+
+    VkCommandPoolCreateInfo cpi = {};
+    cpi.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cpi.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    cpi.queueFamilyIndex = t->compute_queue_idx;
+
+    res = vkCreateCommandPool(t->device, &cpi, &g_vk_allocator, &t->cmd_pool);
+    assert(res == VK_SUCCESS);
+
+    VkCommandBufferAllocateInfo cbai = {};
+    cbai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbai.commandPool = t->cmd_pool;
+    cbai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbai.commandBufferCount = 1;
+
+    res = vkAllocateCommandBuffers(t->device, &cbai, &t->cmd);
+    assert(res == VK_SUCCESS);
+
+    VkCommandBufferBeginInfo cbbi = {};
+    cbbi.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    res = vkBeginCommandBuffer(t->cmd, &cbbi);
+    assert(res == VK_SUCCESS);
+
+    vkCmdBindPipeline(t->cmd, VK_PIPELINE_BIND_POINT_COMPUTE, t->pipeline);
+    vkCmdBindDescriptorSets(t->cmd, VK_PIPELINE_BIND_POINT_COMPUTE, t->pipeline_layout, 0, 1, &t->set, 0, NULL);
+    vkCmdPushConstants(t->cmd, t->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(procedural_params_t), &t->params);
+    vkCmdDispatch(t->cmd, t->group_count[0], t->group_count[1], 1);
+
+    // Release half of the ownership transfer like the vertex upload, the first frame records the acquire.
+    cmd_buffer_ownership_barrier(t->cmd, t->buffer, t->compute_queue_idx, t->graphics_queue_idx,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                                 VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+
+    res = vkEndCommandBuffer(t->cmd);
+    assert(res == VK_SUCCESS);
+
+    VkSubmitInfo si = {};
+    si.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    si.commandBufferCount = 1;
+    si.pCommandBuffers = &t->cmd;
+    si.signalSemaphoreCount = 1;
+    si.pSignalSemaphores = &t->complete_semaphore;
+
+    // The first frame waits for the semaphore, the command buffer and pipeline are kept until shutdown.
+    res = vkQueueSubmit(t->queue, 1, &si, VK_NULL_HANDLE);
+    assert(res == VK_SUCCESS);
+}
+
+// Destroys everything but the buffer, the device must be idle.
+void procedural_destroy(procedural_task_t* t)
+{
+    vkDestroyPipeline(t->device, t->pipeline, &g_vk_allocator);
+    vkDestroyPipelineLayout(t->device, t->pipeline_layout, &g_vk_allocator);
+    vkDestroyDescriptorPool(t->device, t->descriptor_pool, &g_vk_allocator);
+    vkDestroyDescriptorSetLayout(t->device, t->set_layout, &g_vk_allocator);
+    vkDestroyCommandPool(t->device, t->cmd_pool, &g_vk_allocator);
+}
+
+#define RG_MAX_RESOURCES 16
+#define RG_MAX_PASSES 16
+#define RG_MAX_PASS_ACCESSES 8
+#define RG_MAX_FRAMEBUFFERS 32
+
+typedef enum
+{
+    RG_ACCESS_COLOR_WRITE,
+    // Multisample resolve target of the pass' color attachment that was used before it.
+    RG_ACCESS_RESOLVE_WRITE,
+    RG_ACCESS_DEPTH_WRITE,
+    RG_ACCESS_DEPTH_READ,
+    RG_ACCESS_SAMPLED,
+    RG_ACCESS_TRANSFER_READ,
+    RG_ACCESS_TRANSFER_WRITE
+} rg_access_e;
+
+typedef struct
+{
+    VkImageLayout layout;
+    VkPipelineStageFlags stage;
+    VkAccessFlags access;
+    VkImageUsageFlags usage;
+    uint32_t write;
+    uint32_t attachment;
+} rg_access_info_t;
+
+static const rg_access_info_t g_rg_access_info[] = {
+    [RG_ACCESS_COLOR_WRITE] = {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                               VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, 1, 1},
+    [RG_ACCESS_RESOLVE_WRITE] = {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, 1, 1},
+    [RG_ACCESS_DEPTH_WRITE] = {VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                               VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, 1, 1},
+    [RG_ACCESS_DEPTH_READ] = {VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                              VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, 0, 1},
+    [RG_ACCESS_SAMPLED] = {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                           VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_USAGE_SAMPLED_BIT, 0, 0},
+    [RG_ACCESS_TRANSFER_READ] = {VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 0, 0},
+    [RG_ACCESS_TRANSFER_WRITE] = {VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                  VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_USAGE_TRANSFER_DST_BIT, 1, 0},
+};
+
+typedef struct
+{
+    const char* name;
+    VkFormat format;
+    VkExtent2D extent;
+    VkImageAspectFlags aspect;
+    VkSampleCountFlagBits samples;
+    VkImageUsageFlags usage;
+    uint32_t imported;
+    uint32_t output;
+    VkImageLayout initial_layout;
+    VkPipelineStageFlags initial_stage;
+    VkImageLayout final_layout;
+    VkImage image;
+    VkImageView view;
+
+    // Transient images only, lifetime in pass indices and the memory block they're bound to.
+    uint32_t first_use;
+    uint32_t last_use;
+    uint32_t memory_block;
+} rg_resource_desc_t;
+
+typedef void (*rg_execute_func_t)(VkCommandBuffer cmd, void* data);
+
+typedef struct
+{
+    const char* name;
+    rg_execute_func_t execute;
+    void* data;
+    uint32_t resources[RG_MAX_PASS_ACCESSES];
+    rg_access_e accesses[RG_MAX_PASS_ACCESSES];
+    uint32_t loads[RG_MAX_PASS_ACCESSES];
+    VkClearValue clear_values[RG_MAX_PASS_ACCESSES];
+    uint32_t access_count;
+    uint32_t has_side_effects;
+    uint32_t culled;
+
+    // See render_graph_set_render_area, zero for the whole attachments.
+    VkExtent2D render_area;
+
+    // Filled in by render_graph_compile. The render pass is only created without dynamic rendering, the
+    // rendering info and color formats only with it.
+    VkRenderPass render_pass;
+    VkAttachmentLoadOp load_ops[RG_MAX_PASS_ACCESSES];
+    VkAttachmentStoreOp store_ops[RG_MAX_PASS_ACCESSES];
+    uint32_t attachment_count;
+    VkFormat color_formats[RG_MAX_PASS_ACCESSES];
+    VkPipelineRenderingCreateInfo rendering;
+    VkImageMemoryBarrier barriers[RG_MAX_PASS_ACCESSES];
+    uint32_t barrier_resources[RG_MAX_PASS_ACCESSES];
+    uint32_t barrier_count;
+    VkPipelineStageFlags barrier_src_stage;
+    VkPipelineStageFlags barrier_dst_stage;
+
+    // Per barrier stages for vkCmdPipelineBarrier2, the 1.0 path waits on the union above.
+    VkPipelineStageFlags barrier_src_stages[RG_MAX_PASS_ACCESSES];
+    VkPipelineStageFlags barrier_dst_stages[RG_MAX_PASS_ACCESSES];
+} rg_pass_t;
+
+typedef struct
+{
+    VkRenderPass render_pass;
+    VkImageView views[RG_MAX_PASS_ACCESSES];
+    VkFramebuffer framebuffer;
+} rg_framebuffer_t;
+
+typedef struct
+{
+    gpu_allocation_t memory;
+    VkDeviceSize size;
+    uint32_t memory_type_bits;
+    uint32_t last_use;
+} rg_memory_block_t;
+
+// Passes declare which images they read and write, render_graph_compile then works out everything that would
+// otherwise be written by hand: which passes contribute to an output at all, the image layout transitions and
+// pipeline barriers between passes, render passes whose load and store ops only keep what a later pass reads, and
+// transient images whose lifetimes don't overlap sharing the same memory. Imported images (the swapchain image)
+// get their handles set every frame with render_graph_set_image.
+//
+// With render_graph_use_dynamic_rendering the passes are recorded with vkCmdBeginRendering and the barriers with
+// vkCmdPipelineBarrier2 instead, so no render pass or framebuffer objects are created at all.
+typedef struct
+{
+    VkDevice device;
+    uint32_t dynamic_rendering;
+    PFN_vkCmdBeginRendering begin_rendering;
+    PFN_vkCmdEndRendering end_rendering;
+    PFN_vkCmdPipelineBarrier2 pipeline_barrier2;
+    gpu_memory_t* memory;
+    rg_resource_desc_t resources[RG_MAX_RESOURCES];
+    uint32_t resource_count;
+    rg_pass_t passes[RG_MAX_PASSES];
+    uint32_t pass_count;
+
+    rg_memory_block_t memory_blocks[RG_MAX_RESOURCES];
+    uint32_t memory_block_count;
+    rg_framebuffer_t framebuffers[RG_MAX_FRAMEBUFFERS];
+    uint32_t framebuffer_count;
+
+    VkImageMemoryBarrier final_barriers[RG_MAX_RESOURCES];
+    uint32_t final_barrier_resources[RG_MAX_RESOURCES];
+    uint32_t final_barrier_count;
+    VkPipelineStageFlags final_src_stage;
+    VkPipelineStageFlags final_src_stages[RG_MAX_RESOURCES];
+
+    // See render_graph_set_timestamps.
+    VkQueryPool timestamp_pool;
+    uint32_t timestamp_first;
+} render_graph_t;
+
+void render_graph_init(render_graph_t* g, VkDevice device, gpu_memory_t* memory)
+{
+    memset(g, 0, sizeof(render_graph_t));
+    g->device = device;
+    g->memory = memory;
+}
+
+// Needs a device created with the core 1.3 dynamicRendering and synchronization2 features, call before
+// render_graph_compile.
+void render_graph_use_dynamic_rendering(render_graph_t* g)
+{
+    g->dynamic_rendering = 1;
+    g->begin_rendering = (PFN_vkCmdBeginRendering)vkGetDeviceProcAddr(g->device, "vkCmdBeginRendering");
+    g->end_rendering = (PFN_vkCmdEndRendering)vkGetDeviceProcAddr(g->device, "vkCmdEndRendering");
+    g->pipeline_barrier2 = (PFN_vkCmdPipelineBarrier2)vkGetDeviceProcAddr(g->device, "vkCmdPipelineBarrier2");
+    assert(g->begin_rendering && g->end_rendering && g->pipeline_barrier2);
+}
+
+static uint32_t render_graph_add_resource(render_graph_t* g, const char* name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect)
+{
+    assert(g->resource_count < RG_MAX_RESOURCES);
+    rg_resource_desc_t* r = &g->resources[g->resource_count];
+    r->name = name;
+    r->format = format;
+    r->extent = extent;
+    r->aspect = aspect;
+    r->samples = VK_SAMPLE_COUNT_1_BIT;
+    r->first_use = -1;
+    r->last_use = -1;
+    r->memory_block = -1;
+    return g->resource_count++;
+}
+
+// An image owned by someone else. initial_stage is where whatever made it available is waited on, for a swapchain
+// image the stage the acquire semaphore waits at. It is left in final_layout at the end of the frame.
+uint32_t render_graph_import_image(render_graph_t* g, const char* name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect,
+                                   VkImageLayout initial_layout, VkPipelineStageFlags initial_stage, VkImageLayout final_layout)
+{
+    uint32_t r = render_graph_add_resource(g, name, format, extent, aspect);
+    g->resources[r].imported = 1;
+    g->resources[r].initial_layout = initial_layout;
+    g->resources[r].initial_stage = initial_stage;
+    g->resources[r].final_layout = final_layout;
+    return r;
+}
+
+// An image that only lives within the frame, created and bound to memory by render_graph_compile.
+uint32_t render_graph_create_image(render_graph_t* g, const char* name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect,
+                                   VkSampleCountFlagBits samples)
+{
+    uint32_t r = render_graph_add_resource(g, name, format, extent, aspect);
+    g->resources[r].samples = samples;
+    return r;
+}
+
+// Passes writing an output are never culled.
+void render_graph_mark_output(render_graph_t* g, uint32_t resource)
+{
+    g->resources[resource].output = 1;
+}
+
+void render_graph_set_image(render_graph_t* g, uint32_t resource, VkImage image, VkImageView view)
+{
+    assert(g->resources[resource].imported);
+    g->resources[resource].image = image;
+    g->resources[resource].view = view;
+}
+
+// Only valid after render_graph_compile for transient images, what render_graph_set_image set for imported ones.
+VkImage render_graph_image(const render_graph_t* g, uint32_t resource)
+{
+    return g->resources[resource].image;
+}
+
+uint32_t render_graph_add_pass(render_graph_t* g, const char* name, rg_execute_func_t execute, void* data)
+{
+    assert(g->pass_count < RG_MAX_PASSES);
+    rg_pass_t* p = &g->passes[g->pass_count];
+    p->name = name;
+    p->execute = execute;
+    p->data = data;
+    return g->pass_count++;
+}
+
+// Limits the attachments a pass renders to the top left extent of them, for the next render_graph_execute on. Loads,
+// clears, stores and resolves only touch that area.
+void render_graph_set_render_area(render_graph_t* g, uint32_t pass, VkExtent2D extent)
+{
+    g->passes[pass].render_area = extent;
+}
+
+// Passes with effects the graph can't see, like copying into a host buffer, are never culled.
+void render_graph_pass_side_effects(render_graph_t* g, uint32_t pass)
+{
+    g->passes[pass].has_side_effects = 1;
+}
+
+// clear is the clear value for an attachment write, NULL keeps the previous contents.
+void render_graph_pass_use(render_graph_t* g, uint32_t pass, uint32_t resource, rg_access_e access, const VkClearValue* clear)
+{
+    rg_pass_t* p = &g->passes[pass];
+    assert(p->access_count < RG_MAX_PASS_ACCESSES);
+    uint32_t i = p->access_count++;
+    p->resources[i] = resource;
+    p->accesses[i] = access;
+    p->loads[i] = clear == NULL;
+
+    if (clear)
+        p->clear_values[i] = *clear;
+
+    g->resources[resource].usage |= g_rg_access_info[access].usage;
+}
+
+// A write that doesn't load reads nothing of the previous contents.
+static int render_graph_access_reads(const rg_pass_t* p, uint32_t i)
+{
+    return !g_rg_access_info[p->accesses[i]].write || p->loads[i];
+}
+
+static void render_graph_cull(render_graph_t* g)
+{
+    uint32_t needed[RG_MAX_RESOURCES] = {};
+
+    for (uint32_t r = 0; r < g->resource_count; ++r)
+        needed[r] = g->resources[r].output;
+
+    for (uint32_t pi = g->pass_count; pi-- > 0;)
+    {
+        rg_pass_t* p = &g->passes[pi];
+        p->culled = !p->has_side_effects;
+
+        for (uint32_t i = 0; i < p->access_count; ++i)
+        {
+            if (g_rg_access_info[p->accesses[i]].write && needed[p->resources[i]])
+                p->culled = 0;
+        }
+
+        if (p->culled)
+            continue;
+
+        // Anything this pass overwrites completely isn't needed from earlier passes, anything it reads is.
+        for (uint32_t i = 0; i < p->access_count; ++i)
+        {
+            if (!render_graph_access_reads(p, i))
+                needed[p->resources[i]] = 0;
+        }
+
+        for (uint32_t i = 0; i < p->access_count; ++i)
+        {
+            if (render_graph_access_reads(p, i))
+                needed[p->resources[i]] = 1;
+        }
+    }
+}
+
+// Transient images are bound to the first memory block whose previous images are all dead by the time this one is
+// first used, so e.g. a shadow map and a post processing target can share memory. Returns the gpu_memory_alloc
+// error if a block couldn't get memory.
+static VkResult render_graph_allocate_transients(render_graph_t* g)
+{
+    uint32_t order[RG_MAX_RESOURCES];
+    uint32_t order_count = 0;
+
+    for (uint32_t r = 0; r < g->resource_count; ++r)
+    {
+        if (!g->resources[r].imported && g->resources[r].first_use != -1)
+            order[order_count++] = r;
+    }
+
+    for (uint32_t i = 1; i < order_count; ++i)
+    {
+        for (uint32_t j = i; j > 0 && g->resources[order[j]].first_use < g->resources[order[j - 1]].first_use; --j)
+        {
+            uint32_t tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    VkMemoryRequirements mem_reqs[RG_MAX_RESOURCES];
+
+    for (uint32_t i = 0; i < order_count; ++i)
+    {
+        rg_resource_desc_t* r = &g->resources[order[i]];
+
+        VkImageCreateInfo ici = {};
+        ici.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        ici.imageType = VK_IMAGE_TYPE_2D;
+        ici.format = r->format;
+        ici.extent.width = r->extent.width;
+        ici.extent.height = r->extent.height;
+        ici.extent.depth = 1;
+        ici.mipLevels = 1;
+        ici.arrayLayers = 1;
+        ici.samples = r->samples;
+        ici.tiling = VK_IMAGE_TILING_OPTIMAL;
+        ici.usage = r->usage;
+        ici.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        ici.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        VkResult res = vkCreateImage(g->device, &ici, &g_vk_allocator, &r->image);
+        assert(res == VK_SUCCESS);
+
+        VkMemoryRequirements* mr = &mem_reqs[order[i]];
+        vkGetImageMemoryRequirements(g->device, r->image, mr);
+
+        for (uint32_t b = 0; b < g->memory_block_count; ++b)
+        {
+            rg_memory_block_t* block = &g->memory_blocks[b];
+
+            if (block->last_use < r->first_use && (block->memory_type_bits & mr->memoryTypeBits))
+            {
+                r->memory_block = b;
+                break;
+            }
+        }
+
+        if (r->memory_block == -1)
+        {
+            r->memory_block = g->memory_block_count++;
+            g->memory_blocks[r->memory_block].memory_type_bits = mr->memoryTypeBits;
+        }
+
+        rg_memory_block_t* block = &g->memory_blocks[r->memory_block];
+        block->memory_type_bits &= mr->memoryTypeBits;
+        block->last_use = r->last_use;
+
+        if (mr->size > block->size)
+            block->size = mr->size;
+    }
+
+    for (uint32_t b = 0; b < g->memory_block_count; ++b)
+    {
+        rg_memory_block_t* block = &g->memory_blocks[b];
+        VkMemoryRequirements block_reqs = {};
+        block_reqs.size = block->size;
+        block_reqs.memoryTypeBits = block->memory_type_bits;
+
+        VkResult res = gpu_memory_alloc(g->memory, &block_reqs, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &block->memory);
+        if (res != VK_SUCCESS)
+            return res;
+    }
+
+    for (uint32_t i = 0; i < order_count; ++i)
+    {
+        rg_resource_desc_t* r = &g->resources[order[i]];
+        VkResult res = vkBindImageMemory(g->device, r->image, g->memory_blocks[r->memory_block].memory.memory, 0);
+        assert(res == VK_SUCCESS);
+
+        VkImageViewCreateInfo ivci = {};
+        ivci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        ivci.image = r->image;
+        ivci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        ivci.format = r->format;
+        ivci.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+        ivci.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+        ivci.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+        ivci.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+        ivci.subresourceRange.aspectMask = r->aspect;
+        ivci.subresourceRange.levelCount = 1;
+        ivci.subresourceRange.layerCount = 1;
+
+        res = vkCreateImageView(g->device, &ivci, &g_vk_allocator, &r->view);
+        assert(res == VK_SUCCESS);
+    }
+
+    return VK_SUCCESS;
+}
+
+// Layouts never change inside a render pass, the transitions are all done by the barriers in front of it. Only
+// attachments read by a later pass or that are outputs get stored.
+static void render_graph_create_render_pass(render_graph_t* g, uint32_t pass, const uint32_t* read_later)
+{
+    rg_pass_t* p = &g->passes[pass];
+    VkAttachmentDescription attachments[RG_MAX_PASS_ACCESSES];
+    VkAttachmentReference color_references[RG_MAX_PASS_ACCESSES];
+    VkAttachmentReference resolve_references[RG_MAX_PASS_ACCESSES];
+    VkAttachmentReference depth_reference = {};
+    VkFormat depth_format = VK_FORMAT_UNDEFINED;
+    uint32_t attachment_count = 0;
+    uint32_t color_count = 0;
+    uint32_t resolve_count = 0;
+    uint32_t has_depth = 0;
+
+    for (uint32_t i = 0; i < p->access_count; ++i)
+    {
+        const rg_access_info_t* info = &g_rg_access_info[p->accesses[i]];
+
+        if (!info->attachment)
+            continue;
+
+        const rg_resource_desc_t* r = &g->resources[p->resources[i]];
+        uint32_t store = r->output || read_later[p->resources[i]];
+
+        p->load_ops[i] = p->loads[i] ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+
+        // Every pixel of a resolve target is written.
+        if (p->accesses[i] == RG_ACCESS_RESOLVE_WRITE)
+            p->load_ops[i] = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+
+        // Read only attachments aren't written by STORE_OP_NONE, where DONT_CARE would count as a write.
+        if (!info->write)
+            p->store_ops[i] = g->dynamic_rendering ? VK_ATTACHMENT_STORE_OP_NONE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        else
+            p->store_ops[i] = store ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+        VkAttachmentDescription* a = &attachments[attachment_count];
+        memset(a, 0, sizeof(VkAttachmentDescription));
+        a->format = r->format;
+        a->samples = r->samples;
+        a->loadOp = p->load_ops[i];
+        a->storeOp = p->store_ops[i];
+        a->stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        a->stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        a->initialLayout = info->layout;
+        a->finalLayout = info->layout;
+
+        if (p->accesses[i] == RG_ACCESS_COLOR_WRITE)
+        {
+            p->color_formats[color_count] = r->format;
+            color_references[color_count].attachment = attachment_count;
+            color_references[color_count].layout = info->layout;
+            ++color_count;
+        }
+        else if (p->accesses[i] == RG_ACCESS_RESOLVE_WRITE)
+        {
+            assert(resolve_count < color_count && r->samples == VK_SAMPLE_COUNT_1_BIT);
+            resolve_references[resolve_count].attachment = attachment_count;
+            resolve_references[resolve_count].layout = info->layout;
+            ++resolve_count;
+        }
+        else
+        {
+            assert(!has_depth);
+            has_depth = 1;
+            depth_format = r->format;
+            depth_reference.attachment = attachment_count;
+            depth_reference.layout = info->layout;
+        }
+
+        ++attachment_count;
+    }
+
+    p->attachment_count = attachment_count;
+
+    if (attachment_count == 0)
+        return;
+
+    // Either all color attachments are resolved or none.
+    assert(resolve_count == 0 || resolve_count == color_count);
+
+    // What pipelines drawing in the pass are created against instead of a render pass.
+    if (g->dynamic_rendering)
+    {
+        p->rendering.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+        p->rendering.colorAttachmentCount = color_count;
+        p->rendering.pColorAttachmentFormats = p->color_formats;
+        p->rendering.depthAttachmentFormat = depth_format;
+        return;
+    }
+
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = color_count;
+    subpass.pColorAttachments = color_references;
+    subpass.pResolveAttachments = resolve_count > 0 ? resolve_references : NULL;
+    subpass.pDepthStencilAttachment = has_depth ? &depth_reference : NULL;
+
+    VkRenderPassCreateInfo rpci = {};
+    rpci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    rpci.attachmentCount = attachment_count;
+    rpci.pAttachments = attachments;
+    rpci.subpassCount = 1;
+    rpci.pSubpasses = &subpass;
+
+    VkResult res = vkCreateRenderPass(g->device, &rpci, &g_vk_allocator, &p->render_pass);
+    assert(res == VK_SUCCESS);
+}
+
+static void render_graph_image_barrier(VkImageMemoryBarrier* b, const rg_resource_desc_t* r, VkImageLayout old_layout, VkAccessFlags src_access,
+                                       VkImageLayout new_layout, VkAccessFlags dst_access)
+{
+    memset(b, 0, sizeof(VkImageMemoryBarrier));
+    b->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    b->srcAccessMask = src_access;
+    b->dstAccessMask = dst_access;
+    b->oldLayout = old_layout;
+    b->newLayout = new_layout;
+    b->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    b->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    b->subresourceRange.aspectMask = r->aspect;
+    b->subresourceRange.levelCount = 1;
+    b->subresourceRange.layerCount = 1;
+}
+
+// Fails only if the transient images couldn't get memory, render_graph_destroy still cleans up then.
+VkResult render_graph_compile(render_graph_t* g)
+{
+    render_graph_cull(g);
+
+    for (uint32_t pi = 0; pi < g->pass_count; ++pi)
+    {
+        rg_pass_t* p = &g->passes[pi];
+
+        if (p->culled)
+            continue;
+
+        for (uint32_t i = 0; i < p->access_count; ++i)
+        {
+            rg_resource_desc_t* r = &g->resources[p->resources[i]];
+
+            if (r->first_use == -1)
+                r->first_use = pi;
+
+            r->last_use = pi;
+        }
+    }
+
+    VkResult res = render_graph_allocate_transients(g);
+    if (res != VK_SUCCESS)
+        return res;
+
+    // How each image is left at the end of the frame. Transient images are reused by the next frame, and images
+    // sharing a memory block by each other, so their first barrier has to wait for that.
+    VkPipelineStageFlags end_stages[RG_MAX_RESOURCES] = {};
+    VkAccessFlags end_accesses[RG_MAX_RESOURCES] = {};
+
+    for (uint32_t pi = 0; pi < g->pass_count; ++pi)
+    {
+        const rg_pass_t* p = &g->passes[pi];
+
+        for (uint32_t i = 0; !p->culled && i < p->access_count; ++i)
+        {
+            const rg_access_info_t* info = &g_rg_access_info[p->accesses[i]];
+
+            if (info->write)
+            {
+                end_stages[p->resources[i]] = info->stage;
+                end_accesses[p->resources[i]] = info->access;
+            }
+            else
+                end_stages[p->resources[i]] |= info->stage;
+        }
+    }
+
+    // Walk the passes in order keeping track of each image's layout and last access, a barrier is needed for
+    // layout changes and whenever a write is involved.
+    VkImageLayout layouts[RG_MAX_RESOURCES];
+    VkPipelineStageFlags stages[RG_MAX_RESOURCES];
+    VkAccessFlags accesses[RG_MAX_RESOURCES];
+    uint32_t written[RG_MAX_RESOURCES];
+
+    for (uint32_t r = 0; r < g->resource_count; ++r)
+    {
+        const rg_resource_desc_t* desc = &g->resources[r];
+        layouts[r] = desc->imported ? desc->initial_layout : VK_IMAGE_LAYOUT_UNDEFINED;
+        stages[r] = desc->imported ? desc->initial_stage : 0;
+        accesses[r] = 0;
+
+        for (uint32_t other = 0; !desc->imported && other < g->resource_count; ++other)
+        {
+            if (!g->resources[other].imported && g->resources[other].memory_block == desc->memory_block)
+            {
+                stages[r] |= end_stages[other];
+                accesses[r] |= end_accesses[other];
+            }
+        }
+
+        if (stages[r] == 0)
+            stages[r] = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+
+        written[r] = accesses[r] != 0;
+    }
+
+    for (uint32_t pi = 0; pi < g->pass_count; ++pi)
+    {
+        rg_pass_t* p = &g->passes[pi];
+
+        if (p->culled)
+            continue;
+
+        for (uint32_t i = 0; i < p->access_count; ++i)
+        {
+            uint32_t r = p->resources[i];
+            const rg_access_info_t* info = &g_rg_access_info[p->accesses[i]];
+
+            if (layouts[r] == info->layout && !written[r] && !info->write)
+            {
+                stages[r] |= info->stage;
+                accesses[r] |= info->access;
+                continue;
+            }
+
+            // Nothing of the old contents is needed when the pass overwrites all of it.
+            VkImageLayout old_layout = render_graph_access_reads(p, i) ? layouts[r] : VK_IMAGE_LAYOUT_UNDEFINED;
+
+            assert(p->barrier_count < RG_MAX_PASS_ACCESSES);
+            render_graph_image_barrier(&p->barriers[p->barrier_count], &g->resources[r], old_layout, written[r] ? accesses[r] : 0,
+                                       info->layout, info->access);
+            p->barrier_src_stages[p->barrier_count] = stages[r];
+            p->barrier_dst_stages[p->barrier_count] = info->stage;
+            p->barrier_resources[p->barrier_count++] = r;
+            p->barrier_src_stage |= stages[r];
+            p->barrier_dst_stage |= info->stage;
+
+            layouts[r] = info->layout;
+            stages[r] = info->stage;
+            accesses[r] = info->access;
+            written[r] = info->write;
+        }
+    }
+
+    for (uint32_t r = 0; r < g->resource_count; ++r)
+    {
+        const rg_resource_desc_t* desc = &g->resources[r];
+
+        if (!desc->imported || desc->first_use == -1 || layouts[r] == desc->final_layout)
+            continue;
+
+        VkImageMemoryBarrier* b = &g->final_barriers[g->final_barrier_count];
+        render_graph_image_barrier(b, desc, layouts[r], written[r] ? accesses[r] : 0, desc->final_layout, 0);
+        g->final_src_stages[g->final_barrier_count] = stages[r];
+        g->final_barrier_resources[g->final_barrier_count++] = r;
+        g->final_src_stage |= stages[r];
+    }
+
+    for (uint32_t pi = 0; pi < g->pass_count; ++pi)
+    {
+        if (g->passes[pi].culled)
+            continue;
+
+        uint32_t read_later[RG_MAX_RESOURCES] = {};
+
+        for (uint32_t later = pi + 1; later < g->pass_count; ++later)
+        {
+            const rg_pass_t* lp = &g->passes[later];
+
+            for (uint32_t i = 0; !lp->culled && i < lp->access_count; ++i)
+            {
+                if (render_graph_access_reads(lp, i))
+                    read_later[lp->resources[i]] = 1;
+            }
+        }
+
+        render_graph_create_render_pass(g, pi, read_later);
+    }
+
+    return VK_SUCCESS;
+}
+
+// One line summary of the compiled graph.
+void render_graph_print(const render_graph_t* g)
+{
+    uint32_t culled = 0;
+    for (uint32_t pi = 0; pi < g->pass_count; ++pi)
+        culled += g->passes[pi].culled;
+
+    uint32_t transient_count = 0;
+    for (uint32_t r = 0; r < g->resource_count; ++r)
+        transient_count += !g->resources[r].imported && g->resources[r].first_use != -1;
+
+    printf("render graph: %u passes (%u culled), %u transient images in %u memory blocks, %s\n",
+           g->pass_count, culled, transient_count, g->memory_block_count,
+           g->dynamic_rendering ? "dynamic rendering" : "render passes");
+}
+
+// Only valid after render_graph_compile, VK_NULL_HANDLE for passes without attachments and with dynamic rendering.
+VkRenderPass render_graph_render_pass(const render_graph_t* g, uint32_t pass)
+{
+    return g->passes[pass].render_pass;
+}
+
+// Only valid after render_graph_compile, chained into the pipelines of a pass when there is no render pass. NULL
+// without dynamic rendering.
+const VkPipelineRenderingCreateInfo* render_graph_pipeline_rendering(const render_graph_t* g, uint32_t pass)
+{
+    return g->dynamic_rendering ? &g->passes[pass].rendering : NULL;
+}
+
+// Synchronization2 keeps the stages with each barrier, TOP_OF_PIPE as source and BOTTOM_OF_PIPE as destination
+// just mean no stage there.
+static void render_graph_barriers2(render_graph_t* g, VkCommandBuffer cmd, const VkImageMemoryBarrier* barriers,
+                                   const VkPipelineStageFlags* src_stages, const VkPipelineStageFlags* dst_stages, uint32_t count)
+{
+    VkImageMemoryBarrier2 barriers2[RG_MAX_RESOURCES];
+    assert(count <= RG_MAX_RESOURCES);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const VkImageMemoryBarrier* b = &barriers[i];
+        VkImageMemoryBarrier2* b2 = &barriers2[i];
+        memset(b2, 0, sizeof(VkImageMemoryBarrier2));
+        b2->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+        b2->srcStageMask = src_stages[i] == VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT ? VK_PIPELINE_STAGE_2_NONE : src_stages[i];
+        b2->srcAccessMask = b->srcAccessMask;
+        b2->dstStageMask = dst_stages[i] == VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT ? VK_PIPELINE_STAGE_2_NONE : dst_stages[i];
+        b2->dstAccessMask = b->dstAccessMask;
+        b2->oldLayout = b->oldLayout;
+        b2->newLayout = b->newLayout;
+        b2->srcQueueFamilyIndex = b->srcQueueFamilyIndex;
+        b2->dstQueueFamilyIndex = b->dstQueueFamilyIndex;
+        b2->image = b->image;
+        b2->subresourceRange = b->subresourceRange;
+    }
+
+    VkDependencyInfo di = {};
+    di.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    di.imageMemoryBarrierCount = count;
+    di.pImageMemoryBarriers = barriers2;
+    g->pipeline_barrier2(cmd, &di);
+}
+
+// The resolve target of the k-th color attachment goes in that attachment's resolve fields.
+static void render_graph_begin_rendering(render_graph_t* g, VkCommandBuffer cmd, const rg_pass_t* p)
+{
+    VkRenderingAttachmentInfo color_attachments[RG_MAX_PASS_ACCESSES];
+    VkRenderingAttachmentInfo depth_attachment = {};
+    uint32_t color_count = 0;
+    uint32_t resolve_count = 0;
+    uint32_t has_depth = 0;
+    VkExtent2D extent = {};
+
+    for (uint32_t i = 0; i < p->access_count; ++i)
+    {
+        const rg_access_info_t* info = &g_rg_access_info[p->accesses[i]];
+
+        if (!info->attachment)
+            continue;
+
+        const rg_resource_desc_t* r = &g->resources[p->resources[i]];
+        extent = r->extent;
+
+        if (p->accesses[i] == RG_ACCESS_RESOLVE_WRITE)
+        {
+            assert(resolve_count < color_count);
+            VkRenderingAttachmentInfo* a = &color_attachments[resolve_count++];
+            a->resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+            a->resolveImageView = r->view;
+            a->resolveImageLayout = info->layout;
+            continue;
+        }
+
+        VkRenderingAttachmentInfo* a = p->accesses[i] == RG_ACCESS_COLOR_WRITE ? &color_attachments[color_count++] : &depth_attachment;
+        memset(a, 0, sizeof(VkRenderingAttachmentInfo));
+        a->sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+        a->imageView = r->view;
+        a->imageLayout = info->layout;
+        a->loadOp = p->load_ops[i];
+        a->storeOp = p->store_ops[i];
+        a->clearValue = p->clear_values[i];
+        has_depth |= a == &depth_attachment;
+    }
+
+    VkRenderingInfo ri = {};
+    ri.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+    ri.renderArea.extent = p->render_area.width > 0 ? p->render_area : extent;
+    ri.layerCount = 1;
+    ri.colorAttachmentCount = color_count;
+    ri.pColorAttachments = color_attachments;
+    ri.pDepthAttachment = has_depth ? &depth_attachment : NULL;
+
+    g->begin_rendering(cmd, &ri);
+}
+
+static VkFramebuffer render_graph_framebuffer(render_graph_t* g, const rg_pass_t* p, VkExtent2D* extent)
+{
+    VkImageView views[RG_MAX_PASS_ACCESSES] = {};
+    uint32_t view_count = 0;
+
+    for (uint32_t i = 0; i < p->access_count; ++i)
+    {
+        if (!g_rg_access_info[p->accesses[i]].attachment)
+            continue;
+
+        const rg_resource_desc_t* r = &g->resources[p->resources[i]];
+        views[view_count++] = r->view;
+        *extent = r->extent;
+    }
+
+    for (uint32_t i = 0; i < g->framebuffer_count; ++i)
+    {
+        rg_framebuffer_t* fb = &g->framebuffers[i];
+
+        if (fb->render_pass == p->render_pass && memcmp(fb->views, views, sizeof(views)) == 0)
+            return fb->framebuffer;
+    }
+
+    assert(g->framebuffer_count < RG_MAX_FRAMEBUFFERS);
+    rg_framebuffer_t* fb = &g->framebuffers[g->framebuffer_count++];
+    fb->render_pass = p->render_pass;
+    memcpy(fb->views, views, sizeof(views));
+
+    VkFramebufferCreateInfo fbci = {};
+    fbci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    fbci.renderPass = p->render_pass;
+    fbci.attachmentCount = view_count;
+    fbci.pAttachments = views;
+    fbci.width = extent->width;
+    fbci.height = extent->height;
+    fbci.layers = 1;
+
+    VkResult res = vkCreateFramebuffer(g->device, &fbci, &g_vk_allocator, &fb->framebuffer);
+    assert(res == VK_SUCCESS);
+    return fb->framebuffer;
+}
+
+// Writes a timestamp before and after every pass the next render_graph_execute records, query first + 2 * pass
+// index and the one after it. The queries have to be reset, culled passes leave theirs unwritten.
+void render_graph_set_timestamps(render_graph_t* g, VkQueryPool pool, uint32_t first)
+{
+    g->timestamp_pool = pool;
+    g->timestamp_first = first;
+}
+
+// GPU time in ms of the passes in the passes bit mask, from the 2 * pass_count timestamps render_graph_set_timestamps
+// had written, read with their availability. Culled passes count as 0, -1 if any other one isn't available.
+double render_graph_passes_ms(const render_graph_t* g, const uint64_t (*timestamps)[2], uint32_t passes, double ns_per_tick,
+                              uint64_t tick_mask)
+{
+    uint64_t ticks = 0;
+
+    for (uint32_t p = 0; p < g->pass_count; ++p)
+    {
+        if (!(passes & (1u << p)) || g->passes[p].culled)
+            continue;
+
+        if (!timestamps[2 * p][1] || !timestamps[2 * p + 1][1])
+            return -1.0;
+
+        ticks += (timestamps[2 * p + 1][0] - timestamps[2 * p][0]) & tick_mask;
+    }
+
+    return ticks * ns_per_tick / 1e6;
+}
+
+static void render_graph_execute_pass(render_graph_t* g, VkCommandBuffer cmd, rg_pass_t* p)
+{
+    if (p->barrier_count > 0)
+    {
+        for (uint32_t i = 0; i < p->barrier_count; ++i)
+            p->barriers[i].image = g->resources[p->barrier_resources[i]].image;
+
+        if (g->dynamic_rendering)
+            render_graph_barriers2(g, cmd, p->barriers, p->barrier_src_stages, p->barrier_dst_stages, p->barrier_count);
+        else
+            vkCmdPipelineBarrier(cmd, p->barrier_src_stage, p->barrier_dst_stage, 0, 0, NULL, 0, NULL, p->barrier_count, p->barriers);
+    }
+
+    if (p->attachment_count == 0)
+    {
+        p->execute(cmd, p->data);
+        return;
+    }
+
+    if (g->dynamic_rendering)
+    {
+        render_graph_begin_rendering(g, cmd, p);
+        p->execute(cmd, p->data);
+        g->end_rendering(cmd);
+        return;
+    }
+
+    VkClearValue clear_values[RG_MAX_PASS_ACCESSES];
+    uint32_t clear_count = 0;
+
+    for (uint32_t i = 0; i < p->access_count; ++i)
+    {
+        if (g_rg_access_info[p->accesses[i]].attachment)
+            clear_values[clear_count++] = p->clear_values[i];
+    }
+
+    VkExtent2D extent = {};
+    VkRenderPassBeginInfo rpbi = {};
+    rpbi.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    rpbi.renderPass = p->render_pass;
+    rpbi.framebuffer = render_graph_framebuffer(g, p, &extent);
+    rpbi.renderArea.extent = p->render_area.width > 0 ? p->render_area : extent;
+    rpbi.clearValueCount = clear_count;
+    rpbi.pClearValues = clear_values;
+
+    vkCmdBeginRenderPass(cmd, &rpbi, VK_SUBPASS_CONTENTS_INLINE);
+    p->execute(cmd, p->data);
+    vkCmdEndRenderPass(cmd);
+}
+
+void render_graph_execute(render_graph_t* g, VkCommandBuffer cmd)
+{
+    for (uint32_t pi = 0; pi < g->pass_count; ++pi)
+    {
+        rg_pass_t* p = &g->passes[pi];
+
+        if (p->culled)
+            continue;
+
+        if (g->timestamp_pool != VK_NULL_HANDLE)
+            vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, g->timestamp_pool, g->timestamp_first + 2 * pi);
+
+        render_graph_execute_pass(g, cmd, p);
+
+        if (g->timestamp_pool != VK_NULL_HANDLE)
+            vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, g->timestamp_pool, g->timestamp_first + 2 * pi + 1);
+    }
+
+    if (g->final_barrier_count > 0)
+    {
+        for (uint32_t i = 0; i < g->final_barrier_count; ++i)
+            g->final_barriers[i].image = g->resources[g->final_barrier_resources[i]].image;
+
+        if (g->dynamic_rendering)
+        {
+            VkPipelineStageFlags dst_stages[RG_MAX_RESOURCES];
+            for (uint32_t i = 0; i < g->final_barrier_count; ++i)
+                dst_stages[i] = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+            render_graph_barriers2(g, cmd, g->final_barriers, g->final_src_stages, dst_stages, g->final_barrier_count);
+        }
+        else
+            vkCmdPipelineBarrier(cmd, g->final_src_stage, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, g->final_barrier_count, g->final_barriers);
+    }
+}
+
+// Hands the framebuffers to q and forgets them, for when image views they were created with go away. They are
+// created again as the passes need them.
+void render_graph_release_framebuffers(render_graph_t* g, deletion_queue_t* q)
+{
+    for (uint32_t i = 0; i < g->framebuffer_count; ++i)
+        deletion_queue_push(q, DEFERRED_DESTROY_FRAMEBUFFER, (deferred_handle_t){.framebuffer = g->framebuffers[i].framebuffer});
+
+    g->framebuffer_count = 0;
+}
+
+// Gives every image the new extent, for a swapchain recreated at another size. The transient images and their
+// memory go to q since frames in flight may still use them, new ones are created and the render passes and
+// barriers stay. Returns the gpu_memory_alloc error if the new images couldn't get memory.
+VkResult render_graph_resize(render_graph_t* g, VkExtent2D extent, deletion_queue_t* q)
+{
+    render_graph_release_framebuffers(g, q);
+
+    for (uint32_t r = 0; r < g->resource_count; ++r)
+    {
+        rg_resource_desc_t* desc = &g->resources[r];
+        desc->extent = extent;
+
+        if (desc->imported || desc->first_use == -1)
+            continue;
+
+        deletion_queue_push(q, DEFERRED_DESTROY_IMAGE_VIEW, (deferred_handle_t){.image_view = desc->view});
+        deletion_queue_push(q, DEFERRED_DESTROY_IMAGE, (deferred_handle_t){.image = desc->image});
+        desc->image = VK_NULL_HANDLE;
+        desc->view = VK_NULL_HANDLE;
+        desc->memory_block = -1;
+    }
+
+    for (uint32_t b = 0; b < g->memory_block_count; ++b)
+        deletion_queue_push(q, DEFERRED_DESTROY_MEMORY, (deferred_handle_t){.memory = g->memory_blocks[b].memory});
+
+    g->memory_block_count = 0;
+    memset(g->memory_blocks, 0, sizeof(g->memory_blocks));
+    return render_graph_allocate_transients(g);
+}
+
+void render_graph_destroy(render_graph_t* g)
+{
+    for (uint32_t i = 0; i < g->framebuffer_count; ++i)
+        vkDestroyFramebuffer(g->device, g->framebuffers[i].framebuffer, &g_vk_allocator);
+
+    for (uint32_t pi = 0; pi < g->pass_count; ++pi)
+    {
+        if (g->passes[pi].render_pass != VK_NULL_HANDLE)
+            vkDestroyRenderPass(g->device, g->passes[pi].render_pass, &g_vk_allocator);
+    }
+
+    for (uint32_t r = 0; r < g->resource_count; ++r)
+    {
+        if (g->resources[r].imported || g->resources[r].first_use == -1)
+            continue;
+
+        vkDestroyImageView(g->device, g->resources[r].view, &g_vk_allocator);
+        vkDestroyImage(g->device, g->resources[r].image, &g_vk_allocator);
+    }
+
+    for (uint32_t b = 0; b < g->memory_block_count; ++b)
+        gpu_memory_free(g->memory, &g->memory_blocks[b].memory);
+}
+
+#ifdef XCB_VULKAN_TRACE
+
+// Begin and end of every render graph pass of the first window come from its timestamps, see view_t. GPU ticks are put on the CPU clock with VK_EXT_calibrated_timestamps when the device has it and
+// CLOCK_MONOTONIC is a calibrateable domain, re-calibrated every frame against drift. Otherwise the offset is
+// estimated: a frame can't start on the GPU before it was submitted, so the offset is the smallest one that keeps
+// every frame after its submit.
+typedef struct
+{
+    VkDevice device;
+    double ns_per_tick;
+    uint64_t tick_mask;
+    PFN_vkGetCalibratedTimestampsEXT get_calibrated_timestamps;
+    uint32_t has_offset;
+    int64_t offset_ns;
+} trace_gpu_t;
+
+void trace_gpu_create(trace_gpu_t* t, VkDevice device, float timestamp_period, uint32_t valid_bits,
+                      PFN_vkGetCalibratedTimestampsEXT get_calibrated_timestamps)
+{
+    memset(t, 0, sizeof(trace_gpu_t));
+    t->device = device;
+    t->ns_per_tick = timestamp_period;
+    t->tick_mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+    t->get_calibrated_timestamps = get_calibrated_timestamps;
+}
+
+static void trace_gpu_calibrate(trace_gpu_t* t)
+{
+    VkCalibratedTimestampInfoEXT infos[2] = {};
+    infos[0].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    infos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+    infos[1].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    infos[1].timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+
+    uint64_t timestamps[2];
+    uint64_t max_deviation;
+    VkResult res = t->get_calibrated_timestamps(t->device, 2, infos, timestamps, &max_deviation);
+
+    if (res != VK_SUCCESS)
+        return;
+
+    t->offset_ns = (int64_t)timestamps[1] - (int64_t)((timestamps[0] & t->tick_mask) * t->ns_per_tick);
+    t->has_offset = 1;
+}
+
+// Adds the passes of a frame submitted at submit_ns, with the timestamps and availability of each as
+// render_graph_set_timestamps wrote them.
+void trace_gpu_collect(trace_gpu_t* t, uint64_t submit_ns, const render_graph_t* g, const uint64_t (*results)[2])
+{
+    uint32_t count = 2 * g->pass_count;
+
+    if (t->get_calibrated_timestamps)
+        trace_gpu_calibrate(t);
+
+    for (uint32_t i = 0; !t->get_calibrated_timestamps && i < count; i += 2)
+    {
+        if (!results[i][1])
+            continue;
+
+        int64_t offset = (int64_t)submit_ns - (int64_t)((results[i][0] & t->tick_mask) * t->ns_per_tick);
+
+        if (!t->has_offset || offset > t->offset_ns)
+            t->offset_ns = offset;
+
+        t->has_offset = 1;
+    }
+
+    for (uint32_t p = 0; t->has_offset && p < g->pass_count; ++p)
+    {
+        if (!results[2 * p][1] || !results[2 * p + 1][1])
+            continue;
+
+        uint64_t start = (uint64_t)((int64_t)((results[2 * p][0] & t->tick_mask) * t->ns_per_tick) + t->offset_ns);
+        uint64_t end = (uint64_t)((int64_t)((results[2 * p + 1][0] & t->tick_mask) * t->ns_per_tick) + t->offset_ns);
+        trace_add(g->passes[p].name, TRACE_GPU_THREAD, start, end);
+    }
+}
+
+#endif
+
+#define READBACK_BUFFER_COUNT 3
+#define CAPTURE_GOLDEN_TOLERANCE 2
+#define STREAM_SHM_SLOT_COUNT 4
+#define STREAM_SHM_MAGIC 0x534b5658 // "XVKS"
+#define STREAM_REPORT_INTERVAL_NS 1000000000ull
+
+typedef enum
+{
+    READBACK_FREE,
+    READBACK_IN_FLIGHT,
+    READBACK_WRITING
+} readback_state_e;
+
+typedef struct
+{
+    VkBuffer buffer;
+    gpu_allocation_t memory;
+    uint8_t* mapped;
+    readback_state_e state;
+    uint64_t timeline_value;
+    uint64_t frame;
+} readback_buffer_t;
+
+// Layout of the shared memory object a stream consumer maps. Frames are tightly packed pixels of the swapchain
+// format, slot i starts at slots_offset + i * slot_size. The producer fills slot write_count % slot_count and then
+// increments write_count, the consumer increments read_count once it's done with a slot. Frames are dropped rather
+// than overwriting a slot the consumer hasn't read yet.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t slot_count;
+    uint32_t slots_offset;
+    uint64_t slot_size;
+    _Atomic uint64_t write_count;
+    _Atomic uint64_t read_count;
+} stream_shm_header_t;
+
+typedef enum
+{
+    CAPTURE_OUTPUT_PPM,
+    CAPTURE_OUTPUT_FD,
+    CAPTURE_OUTPUT_SHM
+} capture_output_e;
+
+typedef struct
+{
+    // PPM files written to directory, or raw frames streamed to stream_target, which is "fd:<n>" for an already
+    // open file descriptor, "shm:<name>" for a POSIX shared memory ring or else a file or named pipe path.
+    const char* directory;
+    const char* golden_directory;
+    const char* stream_target;
+    uint64_t frames_requested; // 0 means until the window is closed
+} capture_config_t;
+
+// Copies presented images into host visible buffers and gets them out of the process. A buffer is only read once
+// the graphics timeline has passed the frame that filled it, it is then handed to the writer thread. The render loop
+// never waits on a capture, if every buffer is still busy the frame is skipped and counted as dropped.
+typedef struct
+{
+    VkDevice device;
+    gpu_memory_t* memory;
+    VkExtent2D extent;
+    VkFormat format;
+    VkDeviceSize size;
+    uint32_t bgr;
+    uint32_t coherent;
+    readback_buffer_t buffers[READBACK_BUFFER_COUNT];
+
+    capture_output_e output;
+    const char* directory;
+    const char* golden_directory;
+    const char* stream_target;
+    uint64_t frames_requested;
+    uint64_t frames_recorded;
+    uint64_t frames_written;
+    uint64_t frames_dropped;
+    uint32_t golden_failures;
+
+    int stream_fd;
+    uint32_t stream_broken;
+    stream_shm_header_t* shm;
+    size_t shm_size;
+    char shm_name[256];
+    uint64_t frames_dropped_by_consumer;
+    uint64_t bytes_streamed;
+    uint64_t stream_start_ns;
+    uint64_t report_ns;
+    uint64_t report_bytes;
+
+    // Set by capture_stop, no more frames are recorded.
+    uint32_t stopped;
+
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+    uint32_t stopping;
+    arena_t writer_arena;
+} frame_capture_t;
+
+// Returns 0 if the format isn't 8 bits per channel RGBA or BGRA, which is all the writer understands.
+int capture_format_supported(VkFormat format, uint32_t* bgr)
+{
+    switch (format)
+    {
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+            *bgr = 0;
+            return 1;
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+            *bgr = 1;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int ppm_write(const char* filename, const uint8_t* rgb, uint32_t width, uint32_t height)
+{
+    FILE* file_handle = fopen(filename, "wb");
+
+    if (file_handle == NULL)
+        return 0;
+
+    fprintf(file_handle, "P6\n%u %u\n255\n", width, height);
+    size_t written = fwrite(rgb, 1, (size_t)width * height * 3, file_handle);
+    fclose(file_handle);
+    return written == (size_t)width * height * 3;
+}
+
+// Points rgb into the loaded file data, returns 0 if it isn't a binary PPM of the given size.
+static int ppm_parse(const file_data_t* file, uint32_t width, uint32_t height, const uint8_t** rgb)
+{
+    // The file data isn't null terminated, the header is short enough to copy out first.
+    char header[64] = {};
+    memcpy(header, file->data, file->size < sizeof(header) - 1 ? file->size : sizeof(header) - 1);
+
+    uint32_t file_width, file_height, max_value;
+    int header_size = 0;
+
+    if (sscanf(header, "P6 %u %u %u%n", &file_width, &file_height, &max_value, &header_size) != 3)
+        return 0;
+
+    // A single whitespace character separates the header from the pixels.
+    size_t pixels_offset = (size_t)header_size + 1;
+
+    if (file_width != width || file_height != height || max_value != 255 || file->size < pixels_offset + (size_t)width * height * 3)
+        return 0;
+
+    *rgb = (const uint8_t*)file->data + pixels_offset;
+    return 1;
+}
+
+static void capture_compare_golden(frame_capture_t* cap, const char* name, const uint8_t* rgb)
+{
+    char golden_filename[512];
+    snprintf(golden_filename, sizeof(golden_filename), "%s/%s", cap->golden_directory, name);
+
+    size_t mark = arena_mark(&cap->writer_arena);
+    file_data_t golden_file = {};
+    const uint8_t* golden = NULL;
+
+    if (file_load(golden_filename, &golden_file, &cap->writer_arena) != FILE_LOAD_SUCCESS
+        || !ppm_parse(&golden_file, cap->extent.width, cap->extent.height, &golden))
+    {
+        printf("capture: %s missing or not a %ux%u PPM\n", golden_filename, cap->extent.width, cap->extent.height);
+        ++cap->golden_failures;
+        arena_rewind(&cap->writer_arena, mark);
+        return;
+    }
+
+    size_t differing_pixels = 0;
+    int max_difference = 0;
+
+    for (size_t i = 0; i < (size_t)cap->extent.width * cap->extent.height; ++i)
+    {
+        int pixel_difference = 0;
+
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            int d = abs((int)rgb[i * 3 + c] - (int)golden[i * 3 + c]);
+
+            if (d > pixel_difference)
+                pixel_difference = d;
+        }
+
+        if (pixel_difference > CAPTURE_GOLDEN_TOLERANCE)
+            ++differing_pixels;
+
+        if (pixel_difference > max_difference)
+            max_difference = pixel_difference;
+    }
+
+    if (differing_pixels > 0)
+    {
+        printf("capture: %s differs from golden in %zu pixels, max channel difference %d\n", name, differing_pixels, max_difference);
+        ++cap->golden_failures;
+    }
+
+    arena_rewind(&cap->writer_arena, mark);
+}
+
+static void capture_write(frame_capture_t* cap, readback_buffer_t* rb)
+{
+    uint32_t width = cap->extent.width;
+    uint32_t height = cap->extent.height;
+    size_t mark = arena_mark(&cap->writer_arena);
+    uint8_t* rgb = arena_alloc(&cap->writer_arena, (size_t)width * height * 3, 1);
+    assert(rgb);
+
+    const uint32_t r = cap->bgr ? 2 : 0;
+    const uint32_t b = cap->bgr ? 0 : 2;
+
+    for (size_t i = 0; i < (size_t)width * height; ++i)
+    {
+        rgb[i * 3 + 0] = rb->mapped[i * 4 + r];
+        rgb[i * 3 + 1] = rb->mapped[i * 4 + 1];
+        rgb[i * 3 + 2] = rb->mapped[i * 4 + b];
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "frame_%05llu.ppm", (unsigned long long)rb->frame);
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s/%s", cap->directory, name);
+
+    if (!ppm_write(filename, rgb, width, height))
+        printf("capture: failed writing %s\n", filename);
+
+    if (cap->golden_directory)
+        capture_compare_golden(cap, name, rgb);
+
+    arena_rewind(&cap->writer_arena, mark);
+}
+
+// Writes straight from the mapped readback buffer, there is no intermediate copy on the host.
+static void stream_write_fd(frame_capture_t* cap, readback_buffer_t* rb)
+{
+    const uint8_t* data = rb->mapped;
+    size_t remaining = cap->size;
+
+    while (remaining > 0 && !cap->stream_broken)
+    {
+        ssize_t written = write(cap->stream_fd, data, remaining);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            printf("stream: write to %s failed (%s), stopping\n", cap->stream_target, strerror(errno));
+            cap->stream_broken = 1;
+            break;
+        }
+
+        data += written;
+        remaining -= written;
+        cap->bytes_streamed += written;
+    }
+}
+
+static void stream_write_shm(frame_capture_t* cap, readback_buffer_t* rb)
+{
+    stream_shm_header_t* h = cap->shm;
+    uint64_t write_count = atomic_load_explicit(&h->write_count, memory_order_relaxed);
+    uint64_t read_count = atomic_load_explicit(&h->read_count, memory_order_acquire);
+
+    if (write_count - read_count >= h->slot_count)
+    {
+        ++cap->frames_dropped_by_consumer;
+        return;
+    }
+
+    // The one copy there is: the readback buffer can't be the shared memory itself without importing host memory.
+    uint8_t* slot = (uint8_t*)h + h->slots_offset + (write_count % h->slot_count) * h->slot_size;
+    memcpy(slot, rb->mapped, cap->size);
+    atomic_store_explicit(&h->write_count, write_count + 1, memory_order_release);
+    cap->bytes_streamed += cap->size;
+}
+
+static void stream_write(frame_capture_t* cap, readback_buffer_t* rb)
+{
+    uint64_t now = time_now_ns();
+
+    if (cap->stream_start_ns == 0)
+    {
+        cap->stream_start_ns = now;
+        cap->report_ns = now;
+    }
+
+    if (cap->output == CAPTURE_OUTPUT_SHM)
+        stream_write_shm(cap, rb);
+    else
+        stream_write_fd(cap, rb);
+
+    now = time_now_ns();
+
+    if (now - cap->report_ns >= STREAM_REPORT_INTERVAL_NS)
+    {
+        printf("stream: %.1f MB/s, %llu frames dropped, %llu dropped by consumer\n",
+               (cap->bytes_streamed - cap->report_bytes) / ((now - cap->report_ns) / 1e9) / (1024.0 * 1024.0),
+               (unsigned long long)cap->frames_dropped, (unsigned long long)cap->frames_dropped_by_consumer);
+        cap->report_ns = now;
+        cap->report_bytes = cap->bytes_streamed;
+    }
+}
+
+// Opens cap->stream_target, returns 0 on failure.
+static int stream_open(frame_capture_t* cap)
+{
+    const char* target = cap->stream_target;
+
+    if (strncmp(target, "shm:", 4) == 0)
+    {
+        cap->output = CAPTURE_OUTPUT_SHM;
+        snprintf(cap->shm_name, sizeof(cap->shm_name), "/%s", target[4] == '/' ? target + 5 : target + 4);
+
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t slot_size = ((size_t)cap->size + page_size - 1) & ~(page_size - 1);
+        cap->shm_size = page_size + slot_size * STREAM_SHM_SLOT_COUNT;
+
+        int fd = shm_open(cap->shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+        if (fd < 0 || ftruncate(fd, cap->shm_size) != 0)
+        {
+            printf("stream: couldn't create shared memory %s (%s)\n", cap->shm_name, strerror(errno));
+
+            if (fd >= 0)
+                close(fd);
+
+            return 0;
+        }
+
+        void* mapping = mmap(NULL, cap->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+        {
+            printf("stream: couldn't map shared memory %s (%s)\n", cap->shm_name, strerror(errno));
+            shm_unlink(cap->shm_name);
+            return 0;
+        }
+
+        cap->shm = mapping;
+        cap->shm->width = cap->extent.width;
+        cap->shm->height = cap->extent.height;
+        cap->shm->format = cap->format;
+        cap->shm->slot_count = STREAM_SHM_SLOT_COUNT;
+        cap->shm->slots_offset = page_size;
+        cap->shm->slot_size = slot_size;
+        atomic_store(&cap->shm->write_count, 0);
+        atomic_store(&cap->shm->read_count, 0);
+
+        // Written last, consumers wait for it before looking at the rest of the header.
+        atomic_thread_fence(memory_order_release);
+        cap->shm->magic = STREAM_SHM_MAGIC;
+        return 1;
+    }
+
+    cap->output = CAPTURE_OUTPUT_FD;
+
+    if (strncmp(target, "fd:", 3) == 0)
+        cap->stream_fd = atoi(target + 3);
+    else
+        cap->stream_fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644); // Blocks until a named pipe has a reader.
+
+    if (cap->stream_fd < 0 || fcntl(cap->stream_fd, F_GETFD) == -1)
+    {
+        printf("stream: couldn't open %s (%s)\n", target, strerror(errno));
+        return 0;
+    }
+
+    // A consumer going away shows up as EPIPE from write instead of killing the process.
+    signal(SIGPIPE, SIG_IGN);
+    return 1;
+}
+
+static void stream_close(frame_capture_t* cap)
+{
+    if (cap->output == CAPTURE_OUTPUT_SHM)
+    {
+        munmap(cap->shm, cap->shm_size);
+        shm_unlink(cap->shm_name);
+    }
+    else if (strncmp(cap->stream_target, "fd:", 3) != 0)
+        close(cap->stream_fd);
+}
+
+static void* capture_writer_thread(void* data)
+{
+    frame_capture_t* cap = data;
+    TRACE_THREAD_NAME("capture writer");
+    pthread_mutex_lock(&cap->mutex);
+
+    for (;;)
+    {
+        // Oldest frame first, so files are written in order.
+        readback_buffer_t* next = NULL;
+
+        for (uint32_t i = 0; i < READBACK_BUFFER_COUNT; ++i)
+        {
+            readback_buffer_t* rb = &cap->buffers[i];
+
+            if (rb->state == READBACK_WRITING && (next == NULL || rb->frame < next->frame))
+                next = rb;
+        }
+
+        if (next == NULL)
+        {
+            if (cap->stopping)
+                break;
+
+            pthread_cond_wait(&cap->work_available, &cap->mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&cap->mutex);
+
+        if (cap->output == CAPTURE_OUTPUT_PPM)
+            capture_write(cap, next);
+        else
+            stream_write(cap, next);
+
+        pthread_mutex_lock(&cap->mutex);
+
+        next->state = READBACK_FREE;
+        ++cap->frames_written;
+    }
+
+    pthread_mutex_unlock(&cap->mutex);
+    return NULL;
+}
+
+// Returns 0 if the stream target couldn't be opened. format must pass capture_format_supported.
+int capture_create(frame_capture_t* cap, VkDevice device, gpu_memory_t* memory, VkExtent2D extent, VkFormat format,
+                   const capture_config_t* config)
+{
+    memset(cap, 0, sizeof(frame_capture_t));
+    cap->device = device;
+    cap->memory = memory;
+    cap->extent = extent;
+    cap->format = format;
+    cap->size = (VkDeviceSize)extent.width * extent.height * 4;
+    capture_format_supported(format, &cap->bgr);
+    cap->output = CAPTURE_OUTPUT_PPM;
+    cap->directory = config->directory;
+    cap->golden_directory = config->golden_directory;
+    cap->stream_target = config->stream_target;
+    cap->frames_requested = config->frames_requested;
+
+    if (cap->stream_target && !stream_open(cap))
+        return 0;
+
+    for (uint32_t i = 0; i < READBACK_BUFFER_COUNT; ++i)
+    {
+        readback_buffer_t* rb = &cap->buffers[i];
+
+        VkBufferCreateInfo bci = {};
+        bci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bci.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        bci.size = cap->size;
+        bci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        VkResult res = vkCreateBuffer(device, &bci, &g_vk_allocator, &rb->buffer);
+        assert(res == VK_SUCCESS);
+
+        VkMemoryRequirements mr;
+        vkGetBufferMemoryRequirements(device, rb->buffer, &mr);
+
+        // The CPU reads every byte, so cached memory is much faster if there is any.
+        res = gpu_memory_alloc(memory, &mr, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT, &rb->memory);
+        if (res != VK_SUCCESS)
+        {
+            printf("capture: no memory for the readback buffers, capture disabled\n");
+
+            for (uint32_t j = 0; j <= i; ++j)
+            {
+                vkDestroyBuffer(device, cap->buffers[j].buffer, &g_vk_allocator);
+                gpu_memory_free(memory, &cap->buffers[j].memory);
+            }
+
+            if (cap->stream_target)
+                stream_close(cap);
+
+            return 0;
+        }
+        cap->coherent = (memory->properties.memoryTypes[rb->memory.type].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+
+        res = vkBindBufferMemory(device, rb->buffer, rb->memory.memory, 0);
+        assert(res == VK_SUCCESS);
+
+        res = vkMapMemory(device, rb->memory.memory, 0, VK_WHOLE_SIZE, 0, (void**)&rb->mapped);
+        assert(res == VK_SUCCESS);
+    }
+
+    arena_create(&cap->writer_arena, 2 * (size_t)extent.width * extent.height * 3 + 4096);
+    pthread_mutex_init(&cap->mutex, NULL);
+    pthread_cond_init(&cap->work_available, NULL);
+    int err = pthread_create(&cap->writer, NULL, capture_writer_thread, cap);
+    assert(err == 0);
+
+    if (cap->output != CAPTURE_OUTPUT_PPM)
+        printf("stream: %ux%u %s frames to %s\n", extent.width, extent.height, cap->bgr ? "bgra" : "rgba", cap->stream_target);
+
+    return 1;
+}
+
+// 1 while capture_record should still be called.
+int capture_wants_frames(const frame_capture_t* cap)
+{
+    return !cap->stopped && (cap->frames_requested == 0 || cap->frames_recorded < cap->frames_requested);
+}
+
+// Records no more frames, for when the captured image stops having the capture's extent. What was already
+// recorded is still written.
+void capture_stop(frame_capture_t* cap)
+{
+    cap->stopped = 1;
+}
+
+// Records copying image, which has to be in transfer source layout, into a free readback buffer. Returns the buffer
+// index to pass to capture_submitted, or -1 if the frame was dropped.
+uint32_t capture_record(frame_capture_t* cap, VkCommandBuffer cmd, VkImage image, uint64_t frame)
+{
+    uint32_t index = -1;
+    pthread_mutex_lock(&cap->mutex);
+
+    for (uint32_t i = 0; i < READBACK_BUFFER_COUNT; ++i)
+    {
+        if (cap->buffers[i].state == READBACK_FREE)
+        {
+            index = i;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&cap->mutex);
+
+    if (index == -1)
+    {
+        ++cap->frames_dropped;
+        return -1;
+    }
+
+    readback_buffer_t* rb = &cap->buffers[index];
+    rb->frame = frame;
+    ++cap->frames_recorded;
+
+    VkBufferImageCopy region = {};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = cap->extent.width;
+    region.imageExtent.height = cap->extent.height;
+    region.imageExtent.depth = 1;
+    vkCmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, rb->buffer, 1, &region);
+
+    VkBufferMemoryBarrier to_host = {};
+    to_host.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    to_host.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    to_host.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    to_host.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    to_host.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    to_host.buffer = rb->buffer;
+    to_host.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1, &to_host, 0, NULL);
+
+    return index;
+}
+
+void capture_submitted(frame_capture_t* cap, uint32_t index, uint64_t timeline_value)
+{
+    if (index == -1)
+        return;
+
+    cap->buffers[index].timeline_value = timeline_value;
+    cap->buffers[index].state = READBACK_IN_FLIGHT;
+}
+
+// Hands every buffer whose copy has finished on the GPU to the writer thread.
+void capture_poll(frame_capture_t* cap, queue_timeline_t* timeline)
+{
+    uint64_t completed = queue_timeline_completed(timeline);
+    pthread_mutex_lock(&cap->mutex);
+
+    for (uint32_t i = 0; i < READBACK_BUFFER_COUNT; ++i)
+    {
+        readback_buffer_t* rb = &cap->buffers[i];
+
+        if (rb->state != READBACK_IN_FLIGHT || rb->timeline_value > completed)
+            continue;
+
+        if (!cap->coherent)
+        {
+            VkMappedMemoryRange range = {};
+            range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+            range.memory = rb->memory.memory;
+            range.size = VK_WHOLE_SIZE;
+            VkResult res = vkInvalidateMappedMemoryRanges(cap->device, 1, &range);
+            assert(res == VK_SUCCESS);
+        }
+
+        rb->state = READBACK_WRITING;
+        pthread_cond_signal(&cap->work_available);
+    }
+
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+// 1 once the requested number of frames has been recorded and written.
+int capture_finished(frame_capture_t* cap)
+{
+    pthread_mutex_lock(&cap->mutex);
+    int finished = cap->frames_requested != 0 && cap->frames_written == cap->frames_requested;
+    pthread_mutex_unlock(&cap->mutex);
+    return finished;
+}
+
+// Expects the device to be idle. Writes whatever is still in flight, returns the number of golden image mismatches.
+uint32_t capture_destroy(frame_capture_t* cap, queue_timeline_t* timeline)
+{
+    capture_poll(cap, timeline);
+
+    pthread_mutex_lock(&cap->mutex);
+    cap->stopping = 1;
+    pthread_cond_signal(&cap->work_available);
+    pthread_mutex_unlock(&cap->mutex);
+    pthread_join(cap->writer, NULL);
+
+    for (uint32_t i = 0; i < READBACK_BUFFER_COUNT; ++i)
+    {
+        vkUnmapMemory(cap->device, cap->buffers[i].memory.memory);
+        vkDestroyBuffer(cap->device, cap->buffers[i].buffer, &g_vk_allocator);
+        gpu_memory_free(cap->memory, &cap->buffers[i].memory);
+    }
+
+    if (cap->output == CAPTURE_OUTPUT_PPM)
+    {
+        printf("capture: %llu frames written to %s, %llu dropped",
+               (unsigned long long)cap->frames_written, cap->directory, (unsigned long long)cap->frames_dropped);
+
+        if (cap->golden_directory)
+            printf(", %u differ from %s", cap->golden_failures, cap->golden_directory);
+
+        printf("\n");
+    }
+    else
+    {
+        double seconds = cap->stream_start_ns ? (time_now_ns() - cap->stream_start_ns) / 1e9 : 0;
+        printf("stream: %llu frames, %.1f MB in %.2f s (%.1f MB/s), %llu dropped, %llu dropped by consumer\n",
+               (unsigned long long)(cap->frames_written - cap->frames_dropped_by_consumer), cap->bytes_streamed / (1024.0 * 1024.0), seconds,
+               seconds > 0 ? cap->bytes_streamed / seconds / (1024.0 * 1024.0) : 0.0,
+               (unsigned long long)cap->frames_dropped, (unsigned long long)cap->frames_dropped_by_consumer);
+        stream_close(cap);
+    }
+
+    pthread_cond_destroy(&cap->work_available);
+    pthread_mutex_destroy(&cap->mutex);
+    arena_destroy(&cap->writer_arena);
+    return cap->golden_failures;
+}
+
+// Below this many changed nodes the update runs on the calling thread, and it is also roughly the smallest piece
+// of work handed to a worker.
+#define TRANSFORM_TASK_MIN_NODES 512
+
+// Nodes [first, first + count), one or more consecutive whole subtrees.
+typedef struct
+{
+    uint32_t first;
+    uint32_t count;
+} transform_range_t;
+
+// Local transforms of a node hierarchy in structure-of-arrays form with the world matrix cached per node. Nodes
+// are stored depth first, every node is followed by its subtree_sizes[i] - 1 descendants, so a parent always comes
+// before its children and a whole subtree is one contiguous range. World matrices are only recomputed for the
+// subtrees of nodes changed since the last transform_update, the cost of an update doesn't depend on how many
+// nodes there are.
+typedef struct
+{
+    vec3_t* positions;
+    quat_t* rotations;
+    vec3_t* scales;
+    uint32_t* parents;
+    uint32_t* subtree_sizes;
+    mat4_t* world;
+    uint8_t* dirty;
+    uint32_t* dirty_nodes;
+    uint32_t dirty_count;
+    uint32_t count;
+    uint32_t capacity;
+} transform_hierarchy_t;
+
+void transform_hierarchy_create(transform_hierarchy_t* h, uint32_t capacity, arena_t* arena)
+{
+    memset(h, 0, sizeof(transform_hierarchy_t));
+    h->capacity = capacity;
+    h->positions = arena_alloc_array(arena, vec3_t, capacity);
+    h->rotations = arena_alloc_array(arena, quat_t, capacity);
+    h->scales = arena_alloc_array(arena, vec3_t, capacity);
+    h->parents = arena_alloc_array(arena, uint32_t, capacity);
+    h->subtree_sizes = arena_alloc_array(arena, uint32_t, capacity);
+    h->world = arena_alloc_array(arena, mat4_t, capacity);
+    h->dirty = arena_alloc_array(arena, uint8_t, capacity);
+    h->dirty_nodes = arena_alloc_array(arena, uint32_t, capacity);
+    assert(h->positions && h->rotations && h->scales && h->parents && h->subtree_sizes && h->world && h->dirty && h->dirty_nodes);
+}
+
+void transform_set(transform_hierarchy_t* h, uint32_t node, const vec3_t* position, const quat_t* rotation, const vec3_t* scale)
+{
+    h->positions[node] = *position;
+    h->rotations[node] = *rotation;
+    h->scales[node] = *scale;
+
+    if (!h->dirty[node])
+    {
+        h->dirty[node] = 1;
+        h->dirty_nodes[h->dirty_count++] = node;
+    }
+}
+
+// Nodes are added depth first: parent is -1 for a new root, otherwise the node added last or one of its ancestors.
+uint32_t transform_add(transform_hierarchy_t* h, uint32_t parent, const vec3_t* position, const quat_t* rotation, const vec3_t* scale)
+{
+    assert(h->count < h->capacity);
+    assert(parent == -1 || (parent < h->count && parent + h->subtree_sizes[parent] == h->count));
+
+    uint32_t node = h->count++;
+    h->parents[node] = parent;
+    h->subtree_sizes[node] = 1;
+    h->dirty[node] = 0;
+
+    for (uint32_t p = parent; p != -1; p = h->parents[p])
+        ++h->subtree_sizes[p];
+
+    transform_set(h, node, position, rotation, scale);
+    return node;
+}
+
+static void transform_update_node(transform_hierarchy_t* h, uint32_t node)
+{
+    mat4_t local = mat4_from_rotation_and_translation(&h->rotations[node], &h->positions[node]);
+    const vec3_t* s = &h->scales[node];
+    local.x.x *= s->x; local.x.y *= s->x; local.x.z *= s->x;
+    local.y.x *= s->y; local.y.y *= s->y; local.y.z *= s->y;
+    local.z.x *= s->z; local.z.y *= s->z; local.z.z *= s->z;
+
+    uint32_t parent = h->parents[node];
+    h->world[node] = parent == -1 ? local : mat4_mul(&local, &h->world[parent]);
+}
+
+typedef struct
+{
+    transform_hierarchy_t* hierarchy;
+    const transform_range_t* ranges;
+    uint32_t range_count;
+} transform_job_t;
+
+static void transform_update_ranges(void* data)
+{
+    transform_job_t* job = data;
+
+    for (uint32_t r = 0; r < job->range_count; ++r)
+    {
+        for (uint32_t i = 0; i < job->ranges[r].count; ++i)
+            transform_update_node(job->hierarchy, job->ranges[r].first + i);
+    }
+}
+
+static int u32_compare(const void* a, const void* b)
+{
+    uint32_t ua = *(const uint32_t*)a;
+    uint32_t ub = *(const uint32_t*)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+// Recomputes the world matrices of every changed node and its descendants, returns the changed ranges (allocated
+// from arena) in node order. Ranges whose parents are up to date don't depend on each other and are spread over
+// the thread pool. Large subtrees are split below their root so a single changed root still runs in parallel.
+uint32_t transform_update(transform_hierarchy_t* h, thread_pool_t* pool, arena_t* arena, transform_range_t** changed)
+{
+    *changed = NULL;
+
+    if (h->dirty_count == 0)
+        return 0;
+
+    qsort(h->dirty_nodes, h->dirty_count, sizeof(uint32_t), u32_compare);
+
+    // Changed nodes inside the subtree of an earlier changed node are covered by its range already, subtrees that
+    // directly follow each other (changed siblings) share one range.
+    transform_range_t* ranges = arena_alloc_array(arena, transform_range_t, h->dirty_count);
+    assert(ranges);
+    uint32_t range_count = 0;
+    uint32_t node_count = 0;
+
+    for (uint32_t i = 0; i < h->dirty_count; ++i)
+    {
+        uint32_t node = h->dirty_nodes[i];
+        h->dirty[node] = 0;
+        node_count += h->subtree_sizes[node];
+
+        if (range_count > 0 && node <= ranges[range_count - 1].first + ranges[range_count - 1].count)
+        {
+            transform_range_t* last = &ranges[range_count - 1];
+
+            if (node == last->first + last->count)
+                last->count += h->subtree_sizes[node];
+            else
+                node_count -= h->subtree_sizes[node];
+
+            continue;
+        }
+
+        ranges[range_count].first = node;
+        ranges[range_count].count = h->subtree_sizes[node];
+        ++range_count;
+    }
+
+    h->dirty_count = 0;
+    *changed = ranges;
+
+    if (node_count < TRANSFORM_TASK_MIN_NODES)
+    {
+        transform_job_t job = {h, ranges, range_count};
+        transform_update_ranges(&job);
+        return range_count;
+    }
+
+    // Splitting a range updates its first node here, the rest of it is whole subtrees whose parents are that node or
+    // outside the range, so they are queued in chunks that don't depend on each other. Every node ends up in at most
+    // one job range, or was updated while splitting.
+    transform_range_t* jobs = arena_alloc_array(arena, transform_range_t, node_count);
+    assert(jobs);
+    memcpy(jobs, ranges, sizeof(transform_range_t) * range_count);
+    uint32_t job_count = range_count;
+    uint32_t split_limit = node_count / (pool->thread_count + 1);
+    if (split_limit < TRANSFORM_TASK_MIN_NODES)
+        split_limit = TRANSFORM_TASK_MIN_NODES;
+
+    for (uint32_t j = 0; j < job_count; ++j)
+    {
+        transform_range_t r = jobs[j];
+
+        if (r.count <= split_limit)
+            continue;
+
+        transform_update_node(h, r.first);
+        jobs[j].count = 0;
+
+        for (uint32_t child = r.first + 1; child < r.first + r.count;)
+        {
+            transform_range_t* chunk = &jobs[job_count++];
+            chunk->first = child;
+            chunk->count = 0;
+
+            while (child < r.first + r.count && (chunk->count == 0 || chunk->count + h->subtree_sizes[child] <= split_limit))
+            {
+                chunk->count += h->subtree_sizes[child];
+                child += h->subtree_sizes[child];
+            }
+        }
+    }
+
+    // Hand out consecutive job ranges in batches of about the same node count, one task per thread.
+    uint32_t task_count = pool->thread_count + 1;
+    task_t* tasks = arena_alloc_array(arena, task_t, task_count);
+    transform_job_t* task_jobs = arena_alloc_array(arena, transform_job_t, task_count);
+    assert(tasks && task_jobs);
+
+    uint32_t remaining_nodes = 0;
+    for (uint32_t j = 0; j < job_count; ++j)
+        remaining_nodes += jobs[j].count;
+
+    uint32_t submitted = 0;
+    uint32_t next_job = 0;
+
+    while (next_job < job_count && submitted < task_count)
+    {
+        uint32_t batch_target = remaining_nodes / (task_count - submitted);
+        transform_job_t* tj = &task_jobs[submitted];
+        tj->hierarchy = h;
+        tj->ranges = &jobs[next_job];
+        tj->range_count = 0;
+        uint32_t batch_nodes = 0;
+
+        while (next_job < job_count && (batch_nodes < batch_target || submitted == task_count - 1))
+        {
+            batch_nodes += jobs[next_job++].count;
+            ++tj->range_count;
+        }
+
+        remaining_nodes -= batch_nodes;
+        task_init(&tasks[submitted], "transform update", transform_update_ranges, tj);
+        thread_pool_submit(pool, &tasks[submitted]);
+        ++submitted;
+    }
+
+    for (uint32_t i = 0; i < submitted; ++i)
+        task_wait(pool, &tasks[i]);
+
+    return range_count;
+}
+
+#define BINDLESS_MAX_STORAGE_BUFFERS 4096
+#define BINDLESS_MAX_SAMPLED_IMAGES 16384
+
+typedef enum
+{
+    BINDLESS_BINDING_STORAGE_BUFFERS,
+    BINDLESS_BINDING_SAMPLED_IMAGES,
+    BINDLESS_BINDING_COUNT
+} bindless_binding_e;
+
+// One descriptor set with large arrays of every storage buffer and sampled image the shaders may use, bound once
+// per pass. Draws pick what they read by index, from push constants or instance data, so the number of objects in
+// the scene doesn't change how many descriptor sets are bound or written. Descriptors are only written when
+// something is added, update after bind allows that while the set is used by frames in flight.
+typedef struct
+{
+    VkDevice device;
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool pool;
+    VkDescriptorSet set;
+    uint32_t max_storage_buffers;
+    uint32_t max_sampled_images;
+    uint32_t storage_buffer_count;
+    uint32_t sampled_image_count;
+} bindless_table_t;
+
+// What the bindless vertex shader gets in push constants, see vertex_shader_bindless.glsl.
+typedef struct
+{
+    uint32_t transform_buffer;
+} bindless_push_t;
+
+void bindless_create(bindless_table_t* t, VkDevice device, const VkPhysicalDeviceDescriptorIndexingProperties* limits)
+{
+    memset(t, 0, sizeof(bindless_table_t));
+    t->device = device;
+
+    t->max_storage_buffers = BINDLESS_MAX_STORAGE_BUFFERS;
+    if (t->max_storage_buffers > limits->maxPerStageDescriptorUpdateAfterBindStorageBuffers)
+        t->max_storage_buffers = limits->maxPerStageDescriptorUpdateAfterBindStorageBuffers;
+    if (t->max_storage_buffers > limits->maxDescriptorSetUpdateAfterBindStorageBuffers)
+        t->max_storage_buffers = limits->maxDescriptorSetUpdateAfterBindStorageBuffers;
+
+    t->max_sampled_images = BINDLESS_MAX_SAMPLED_IMAGES;
+    if (t->max_sampled_images > limits->maxPerStageDescriptorUpdateAfterBindSampledImages)
+        t->max_sampled_images = limits->maxPerStageDescriptorUpdateAfterBindSampledImages;
+    if (t->max_sampled_images > limits->maxDescriptorSetUpdateAfterBindSampledImages)
+        t->max_sampled_images = limits->maxDescriptorSetUpdateAfterBindSampledImages;
+    if (t->max_storage_buffers + t->max_sampled_images > limits->maxPerStageUpdateAfterBindResources)
+        t->max_sampled_images = limits->maxPerStageUpdateAfterBindResources - t->max_storage_buffers;
+
+    assert(t->max_storage_buffers > 0 && t->max_sampled_images > 0);
+
+    VkDescriptorSetLayoutBinding bindings[BINDLESS_BINDING_COUNT] = {};
+    bindings[BINDLESS_BINDING_STORAGE_BUFFERS].binding = BINDLESS_BINDING_STORAGE_BUFFERS;
+    bindings[BINDLESS_BINDING_STORAGE_BUFFERS].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[BINDLESS_BINDING_STORAGE_BUFFERS].descriptorCount = t->max_storage_buffers;
+    bindings[BINDLESS_BINDING_STORAGE_BUFFERS].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    bindings[BINDLESS_BINDING_SAMPLED_IMAGES].binding = BINDLESS_BINDING_SAMPLED_IMAGES;
+    bindings[BINDLESS_BINDING_SAMPLED_IMAGES].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    bindings[BINDLESS_BINDING_SAMPLED_IMAGES].descriptorCount = t->max_sampled_images;
+    bindings[BINDLESS_BINDING_SAMPLED_IMAGES].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    // Most of the array is never written, partially bound makes that valid as long as shaders don't read it.
+    VkDescriptorBindingFlags binding_flags[BINDLESS_BINDING_COUNT];
+    for (uint32_t i = 0; i < BINDLESS_BINDING_COUNT; ++i)
+        binding_flags[i] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo dslbfci = {};
+    dslbfci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    dslbfci.bindingCount = BINDLESS_BINDING_COUNT;
+    dslbfci.pBindingFlags = binding_flags;
+
+    VkDescriptorSetLayoutCreateInfo dslci = {};
+    dslci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    dslci.pNext = &dslbfci;
+    dslci.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    dslci.bindingCount = BINDLESS_BINDING_COUNT;
+    dslci.pBindings = bindings;
+
+    VkResult res = vkCreateDescriptorSetLayout(device, &dslci, &g_vk_allocator, &t->set_layout);
+    assert(res == VK_SUCCESS);
+
+    VkDescriptorPoolSize dps[BINDLESS_BINDING_COUNT];
+    dps[BINDLESS_BINDING_STORAGE_BUFFERS].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    dps[BINDLESS_BINDING_STORAGE_BUFFERS].descriptorCount = t->max_storage_buffers;
+    dps[BINDLESS_BINDING_SAMPLED_IMAGES].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    dps[BINDLESS_BINDING_SAMPLED_IMAGES].descriptorCount = t->max_sampled_images;
+
+    VkDescriptorPoolCreateInfo dpci = {};
+    dpci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    dpci.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    dpci.maxSets = 1;
+    dpci.poolSizeCount = BINDLESS_BINDING_COUNT;
+    dpci.pPoolSizes = dps;
+
+    res = vkCreateDescriptorPool(device, &dpci, &g_vk_allocator, &t->pool);
+    assert(res == VK_SUCCESS);
+
+    VkDescriptorSetAllocateInfo dsai = {};
+    dsai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    dsai.descriptorPool = t->pool;
+    dsai.descriptorSetCount = 1;
+    dsai.pSetLayouts = &t->set_layout;
+
+    res = vkAllocateDescriptorSets(device, &dsai, &t->set);
+    assert(res == VK_SUCCESS);
+}
+
+// Returns the index shaders use to read the buffer.
+uint32_t bindless_add_storage_buffer(bindless_table_t* t, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+{
+    assert(t->storage_buffer_count < t->max_storage_buffers);
+
+    VkDescriptorBufferInfo buffer_info = {};
+    buffer_info.buffer = buffer;
+    buffer_info.offset = offset;
+    buffer_info.range = range;
+
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = t->set;
+    write.dstBinding = BINDLESS_BINDING_STORAGE_BUFFERS;
+    write.dstArrayElement = t->storage_buffer_count;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pBufferInfo = &buffer_info;
+
+    vkUpdateDescriptorSets(t->device, 1, &write, 0, NULL);
+    return t->storage_buffer_count++;
+}
+
+// Returns the index shaders use to read the image.
+uint32_t bindless_add_sampled_image(bindless_table_t* t, VkImageView view, VkImageLayout layout)
+{
+    assert(t->sampled_image_count < t->max_sampled_images);
+
+    VkDescriptorImageInfo image_info = {};
+    image_info.imageView = view;
+    image_info.imageLayout = layout;
+
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = t->set;
+    write.dstBinding = BINDLESS_BINDING_SAMPLED_IMAGES;
+    write.dstArrayElement = t->sampled_image_count;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    write.pImageInfo = &image_info;
+
+    vkUpdateDescriptorSets(t->device, 1, &write, 0, NULL);
+    return t->sampled_image_count++;
+}
+
+void bindless_destroy(bindless_table_t* t)
+{
+    vkDestroyDescriptorPool(t->device, t->pool, &g_vk_allocator);
+    vkDestroyDescriptorSetLayout(t->device, t->set_layout, &g_vk_allocator);
+}
+
+// One copy of the scene mesh, placed by its node in the transform hierarchy. Its MVP matrix is at uniform_offset
+// in each frame's part of the dynamic uniform buffer, or at its own index in the bindless transform buffer.
+typedef struct
+{
+    vec3_t position;
+    uint32_t transform;
+    uint32_t uniform_offset;
+    uint32_t lod;
+} scene_instance_t;
+
+// Picks the LOD of every instance as seen from camera_pos and returns the number of triangles they add up to.
+// changed is set if any instance got a different LOD than it had.
+uint32_t scene_select_lods(scene_instance_t* instances, uint32_t instance_count, const mesh_t* mesh, const vec3_t* camera_pos, float bb_height,
+                           uint32_t* changed)
+{
+    uint32_t triangles = 0;
+    *changed = 0;
+
+    for (uint32_t i = 0; i < instance_count; ++i)
+    {
+        scene_instance_t* inst = &instances[i];
+        float dx = inst->position.x - camera_pos->x;
+        float dy = inst->position.y - camera_pos->y;
+        float dz = inst->position.z - camera_pos->z;
+        uint32_t lod = mesh_select_lod(mesh, sqrtf(dx * dx + dy * dy + dz * dz), bb_height);
+        *changed |= lod != inst->lod;
+        inst->lod = lod;
+        triangles += mesh->lods[inst->lod].index_count / 3;
+    }
+
+    return triangles;
+}
+
+// Writes the MVP matrices of the instances in the changed transform ranges to one frame's copy of them.
+// node_instances maps hierarchy nodes to instances, -1 for nodes without one.
+void scene_write_transforms(uint8_t* dst, const scene_instance_t* instances, const uint32_t* node_instances, const transform_hierarchy_t* h,
+                            const transform_range_t* ranges, uint32_t range_count, const mat4_t* proj_view)
+{
+    for (uint32_t r = 0; r < range_count; ++r)
+    {
+        for (uint32_t node = ranges[r].first; node < ranges[r].first + ranges[r].count; ++node)
+        {
+            uint32_t instance = node_instances[node];
+
+            if (instance == -1)
+                continue;
+
+            mat4_t mvp = mat4_mul(&h->world[node], proj_view);
+            memcpy(dst + instances[instance].uniform_offset, &mvp, sizeof(mvp));
+        }
+    }
+}
+
+// A draw and the state it needs. Keys order packets by pass, then pipeline, then material, which stands for the
+// descriptor sets and vertex buffers, then depth, so that recording them in key order binds each state as few times
+// as possible. Nothing below the pass has to be exact, equal state in different packets is found either way.
+#define DRAW_KEY_PASS_SHIFT 60
+#define DRAW_KEY_PIPELINE_SHIFT 48
+#define DRAW_KEY_MATERIAL_SHIFT 32
+
+typedef struct
+{
+    uint64_t key;
+    VkPipeline pipeline;
+    VkPipelineLayout pipeline_layout;
+    const VkDescriptorSet* descriptor_sets;
+    uint32_t descriptor_set_count;
+    uint32_t dynamic_offset; // -1 if the sets don't have a dynamic buffer
+    VkBuffer vertex_buffer;
+    VkDeviceSize vertex_offset;
+    VkDeviceSize index_offset;
+    uint32_t index_count;
+    uint32_t first_index;
+    uint32_t instance_count;
+    uint32_t first_instance;
+} draw_packet_t;
+
+// Depth is a distance, non-negative floats keep their order when compared as integers.
+uint64_t draw_key(uint32_t pass, uint32_t pipeline, uint32_t material, float depth)
+{
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &depth, sizeof(depth_bits));
+    return (uint64_t)pass << DRAW_KEY_PASS_SHIFT | (uint64_t)(pipeline & 0xfff) << DRAW_KEY_PIPELINE_SHIFT
+           | (uint64_t)(material & 0xffff) << DRAW_KEY_MATERIAL_SHIFT | depth_bits;
+}
+
+typedef enum
+{
+    DRAW_STATE_PIPELINE,
+    DRAW_STATE_DESCRIPTOR_SETS,
+    DRAW_STATE_VERTEX_BUFFER,
+    DRAW_STATE_INDEX_BUFFER,
+    DRAW_STATE_COUNT
+} draw_state_e;
+
+typedef struct
+{
+    uint64_t key;
+    uint32_t packet;
+} draw_sort_t;
+
+// Packets are pushed in any order during a frame, draw_queue_sort orders them and draw_queue_record records one
+// pass of them. The state change counts are what recording in submission order and in sorted order costs, each
+// with redundant binds dropped.
+typedef struct
+{
+    draw_packet_t* packets;
+    draw_sort_t* order;
+    draw_sort_t* scratch;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t submitted_changes[DRAW_STATE_COUNT];
+    uint32_t sorted_changes[DRAW_STATE_COUNT];
+} draw_queue_t;
+
+// The queue lives in arena until it is reset.
+void draw_queue_begin(draw_queue_t* q, uint32_t capacity, arena_t* arena)
+{
+    memset(q, 0, sizeof(draw_queue_t));
+    q->packets = arena_alloc_array(arena, draw_packet_t, capacity);
+    q->order = arena_alloc_array(arena, draw_sort_t, capacity);
+    q->scratch = arena_alloc_array(arena, draw_sort_t, capacity);
+    q->capacity = capacity;
+}
+
+draw_packet_t* draw_queue_push(draw_queue_t* q, uint64_t key)
+{
+    assert(q->count < q->capacity);
+    draw_packet_t* p = &q->packets[q->count];
+    memset(p, 0, sizeof(draw_packet_t));
+    p->key = key;
+    p->dynamic_offset = -1;
+    q->order[q->count].key = key;
+    q->order[q->count].packet = q->count;
+    ++q->count;
+    return p;
+}
+
+// Returns a bit per draw_state_e that differs between prev, NULL at the start of a pass, and p.
+static uint32_t draw_state_changes(const draw_packet_t* prev, const draw_packet_t* p)
+{
+    if (prev == NULL)
+        return (1 << DRAW_STATE_COUNT) - 1;
+
+    uint32_t changes = 0;
+
+    if (p->pipeline != prev->pipeline)
+        changes |= 1 << DRAW_STATE_PIPELINE;
+
+    if (p->pipeline_layout != prev->pipeline_layout || p->descriptor_sets != prev->descriptor_sets
+        || p->descriptor_set_count != prev->descriptor_set_count || p->dynamic_offset != prev->dynamic_offset)
+        changes |= 1 << DRAW_STATE_DESCRIPTOR_SETS;
+
+    if (p->vertex_buffer != prev->vertex_buffer || p->vertex_offset != prev->vertex_offset)
+        changes |= 1 << DRAW_STATE_VERTEX_BUFFER;
+
+    if (p->vertex_buffer != prev->vertex_buffer || p->index_offset != prev->index_offset)
+        changes |= 1 << DRAW_STATE_INDEX_BUFFER;
+
+    return changes;
+}
+
+static void draw_queue_count_changes(const draw_queue_t* q, uint32_t changes[DRAW_STATE_COUNT])
+{
+    const draw_packet_t* prev = NULL;
+
+    for (uint32_t i = 0; i < q->count; ++i)
+    {
+        const draw_packet_t* p = &q->packets[q->order[i].packet];
+
+        if (prev && p->key >> DRAW_KEY_PASS_SHIFT != prev->key >> DRAW_KEY_PASS_SHIFT)
+            prev = NULL;
+
+        uint32_t c = draw_state_changes(prev, p);
+
+        for (uint32_t s = 0; s < DRAW_STATE_COUNT; ++s)
+            changes[s] += (c >> s) & 1;
+
+        prev = p;
+    }
+}
+
+// LSD radix sort on bytes, stable, so packets with equal keys stay in submission order. Bytes that are the same in
+// every key are skipped, which in practice is most of the state part of them.
+void draw_sort_radix(draw_sort_t* keys, draw_sort_t* scratch, uint32_t count)
+{
+    draw_sort_t* src = keys;
+    draw_sort_t* dst = scratch;
+
+    for (uint32_t shift = 0; count > 0 && shift < 64; shift += 8)
+    {
+        uint32_t offsets[256] = {};
+
+        for (uint32_t i = 0; i < count; ++i)
+            ++offsets[(src[i].key >> shift) & 0xff];
+
+        if (offsets[(src[0].key >> shift) & 0xff] == count)
+            continue;
+
+        uint32_t sum = 0;
+        for (uint32_t d = 0; d < 256; ++d)
+        {
+            uint32_t n = offsets[d];
+            offsets[d] = sum;
+            sum += n;
+        }
+
+        for (uint32_t i = 0; i < count; ++i)
+            dst[offsets[(src[i].key >> shift) & 0xff]++] = src[i];
+
+        draw_sort_t* t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != keys)
+        memcpy(keys, src, count * sizeof(draw_sort_t));
+}
+
+void draw_queue_sort(draw_queue_t* q)
+{
+    memset(q->submitted_changes, 0, sizeof(q->submitted_changes));
+    memset(q->sorted_changes, 0, sizeof(q->sorted_changes));
+    draw_queue_count_changes(q, q->submitted_changes);
+    draw_sort_radix(q->order, q->scratch, q->count);
+    draw_queue_count_changes(q, q->sorted_changes);
+}
+
+// Records the packets of one pass, binding only what differs from the packet before.
+void draw_queue_record(const draw_queue_t* q, VkCommandBuffer cmd, uint32_t pass)
+{
+    const draw_packet_t* prev = NULL;
+
+    for (uint32_t i = 0; i < q->count; ++i)
+    {
+        const draw_packet_t* p = &q->packets[q->order[i].packet];
+
+        if (p->key >> DRAW_KEY_PASS_SHIFT != pass)
+            continue;
+
+        uint32_t changes = draw_state_changes(prev, p);
+
+        if (changes & (1 << DRAW_STATE_PIPELINE))
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, p->pipeline);
+
+        if (changes & (1 << DRAW_STATE_DESCRIPTOR_SETS))
+        {
+            uint32_t dynamic = p->dynamic_offset != -1;
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, p->pipeline_layout, 0, p->descriptor_set_count,
+                                    p->descriptor_sets, dynamic, dynamic ? &p->dynamic_offset : NULL);
+        }
+
+        if (changes & (1 << DRAW_STATE_VERTEX_BUFFER))
+            vkCmdBindVertexBuffers(cmd, 0, 1, &p->vertex_buffer, &p->vertex_offset);
+
+        if (changes & (1 << DRAW_STATE_INDEX_BUFFER))
+            vkCmdBindIndexBuffer(cmd, p->vertex_buffer, p->index_offset, VK_INDEX_TYPE_UINT32);
+
+        vkCmdDrawIndexed(cmd, p->index_count, p->instance_count, p->first_index, 0, p->first_instance);
+        prev = p;
+    }
+}
+
+// The indices of all LODs are at index_offset in vertex_buffer. The instance matrices of the frame being recorded
+// start at transform_offset in the dynamic uniform buffer. With bindless the descriptor set is the bindless table
+// and transform_buffer the index of the frame's instance matrices in it. The draws are pushed to draws by
+// scene_queue_draws, under the pass number draw_pass.
+typedef struct
+{
+    VkPipeline pipeline;
+    VkPipelineLayout pipeline_layout;
+    const VkDescriptorSet* descriptor_sets;
+    uint32_t descriptor_set_count;
+    uint32_t bindless;
+    uint32_t transform_buffer;
+    uint32_t transform_offset;
+    VkBuffer vertex_buffer;
+    VkDeviceSize vertex_offset;
+    VkDeviceSize index_offset;
+    const mesh_t* mesh;
+    const scene_instance_t* instances;
+    uint32_t instance_count;
+    VkExtent2D extent;
+    draw_queue_t* draws;
+    uint32_t draw_pass;
+
+    // Queries around the draw when measuring, VK_NULL_HANDLE otherwise. The same index is used in both pools.
+    VkQueryPool occlusion_pool;
+    VkQueryPool statistics_pool;
+    uint32_t query;
+    VkQueryControlFlags occlusion_flags;
+} scene_pass_t;
+
+// pipeline is the pipeline's part of the sort key. Instances are drawn front to back, with bindless as runs of
+// instances with the same LOD, each a single instanced draw starting at the run's first instance, which is where
+// the shader starts reading matrices.
+void scene_queue_draws(const scene_pass_t* scene, uint32_t pipeline, const vec3_t* camera_pos)
+{
+    for (uint32_t i = 0; i < scene->instance_count;)
+    {
+        const scene_instance_t* inst = &scene->instances[i];
+        uint32_t count = 1;
+
+        while (scene->bindless && i + count < scene->instance_count && scene->instances[i + count].lod == inst->lod)
+            ++count;
+
+        float depth = INFINITY;
+
+        for (uint32_t j = i; j < i + count; ++j)
+        {
+            float dx = scene->instances[j].position.x - camera_pos->x;
+            float dy = scene->instances[j].position.y - camera_pos->y;
+            float dz = scene->instances[j].position.z - camera_pos->z;
+            depth = fminf(depth, sqrtf(dx * dx + dy * dy + dz * dz));
+        }
+
+        const mesh_lod_t* lod = &scene->mesh->lods[inst->lod];
+        draw_packet_t* p = draw_queue_push(scene->draws, draw_key(scene->draw_pass, pipeline, 0, depth));
+        p->pipeline = scene->pipeline;
+        p->pipeline_layout = scene->pipeline_layout;
+        p->descriptor_sets = scene->descriptor_sets;
+        p->descriptor_set_count = scene->descriptor_set_count;
+        p->vertex_buffer = scene->vertex_buffer;
+        p->vertex_offset = scene->vertex_offset;
+        p->index_offset = scene->index_offset;
+        p->index_count = lod->index_count;
+        p->first_index = lod->first_index;
+        p->instance_count = count;
+
+        if (scene->bindless)
+            p->first_instance = i;
+        else
+            p->dynamic_offset = scene->transform_offset + inst->uniform_offset;
+
+        i += count;
+    }
+}
+
+static void record_scene_pass(VkCommandBuffer cmd, void* data)
+{
+    const scene_pass_t* scene = data;
+
+    VkViewport viewport = {};
+    viewport.height = scene->extent.height;
+    viewport.width = scene->extent.width;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    viewport.x = 0;
+    viewport.y = 0;
+    vkCmdSetViewport(cmd, 0, NUM_VIEWPORTS, &viewport);
+
+    VkRect2D scissor = {};
+    scissor.extent.width = scene->extent.width;
+    scissor.extent.height = scene->extent.height;
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+    vkCmdSetScissor(cmd, 0, NUM_SCISSORS, &scissor);
+
+    if (scene->occlusion_pool != VK_NULL_HANDLE)
+        vkCmdBeginQuery(cmd, scene->occlusion_pool, scene->query, scene->occlusion_flags);
+
+    if (scene->statistics_pool != VK_NULL_HANDLE)
+        vkCmdBeginQuery(cmd, scene->statistics_pool, scene->query, 0);
+
+    if (scene->bindless)
+    {
+        bindless_push_t push = {};
+        push.transform_buffer = scene->transform_buffer;
+        vkCmdPushConstants(cmd, scene->pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(push), &push);
+    }
+
+    draw_queue_record(scene->draws, cmd, scene->draw_pass);
+
+    if (scene->statistics_pool != VK_NULL_HANDLE)
+        vkCmdEndQuery(cmd, scene->statistics_pool, scene->query);
+
+    if (scene->occlusion_pool != VK_NULL_HANDLE)
+        vkCmdEndQuery(cmd, scene->occlusion_pool, scene->query);
+}
+
+// image and frame are set before every frame is recorded, index is the readback buffer capture_record picked.
+typedef struct
+{
+    frame_capture_t* capture;
+    VkImage image;
+    uint64_t frame;
+    uint32_t index;
+} capture_pass_t;
+
+static void record_capture_pass(VkCommandBuffer cmd, void* data)
+{
+    capture_pass_t* pass = data;
+    pass->index = -1;
+
+    if (capture_wants_frames(pass->capture))
+        pass->index = capture_record(pass->capture, cmd, pass->image, pass->frame);
+}
+
+// The scene is rendered to the top left src_extent of src, then blitted up to all of dst.
+typedef struct
+{
+    VkImage src;
+    VkImage dst;
+    VkExtent2D src_extent;
+    VkExtent2D dst_extent;
+    VkFilter filter;
+} upscale_pass_t;
+
+static void record_upscale_pass(VkCommandBuffer cmd, void* data)
+{
+    const upscale_pass_t* pass = data;
+
+    VkImageBlit blit = {};
+    blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    blit.srcSubresource.layerCount = 1;
+    blit.srcOffsets[1] = (VkOffset3D){(int32_t)pass->src_extent.width, (int32_t)pass->src_extent.height, 1};
+    blit.dstSubresource = blit.srcSubresource;
+    blit.dstOffsets[1] = (VkOffset3D){(int32_t)pass->dst_extent.width, (int32_t)pass->dst_extent.height, 1};
+    vkCmdBlitImage(cmd, pass->src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, pass->dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, pass->filter);
+}
+
+#define DYNAMIC_RESOLUTION_SMOOTHING 0.1f
+#define DYNAMIC_RESOLUTION_SETTLE_FRAMES 16
+#define DYNAMIC_RESOLUTION_LOW 0.75f
+#define DYNAMIC_RESOLUTION_AIM 0.9f
+#define DYNAMIC_RESOLUTION_MAX_STEP_DOWN 0.8f
+#define DYNAMIC_RESOLUTION_MAX_STEP_UP 1.1f
+
+// Picks the render scale from the GPU time of the first window's depth pre-pass and scene pass, the passes that
+// render at the scaled size. The upscale blit always writes the full swapchain image, and with dynamic resolution
+// the wait for the swapchain image lands on it, so it isn't counted. GPU time goes roughly with the pixel count, so
+// a change aims for DYNAMIC_RESOLUTION_AIM of the budget by scaling with the square root of the ratio. Against
+// oscillation the scale is left alone while the smoothed time is between DYNAMIC_RESOLUTION_LOW of the budget and
+// the budget, steps up are smaller than steps down, and after a change the frames still in flight are skipped and
+// DYNAMIC_RESOLUTION_SETTLE_FRAMES are averaged before the next one.
+typedef struct
+{
+    float target_ms;
+    float min_scale;
+    float max_scale;
+    float scale;
+    float gpu_ms;
+    uint32_t samples;
+    uint32_t changes;
+    VkExtent2D full_extent;
+    VkExtent2D extent;
+} dynamic_resolution_t;
+
+static VkExtent2D dynamic_resolution_extent(VkExtent2D full_extent, float scale)
+{
+    VkExtent2D extent;
+    extent.width = (uint32_t)(full_extent.width * scale + 0.5f);
+    extent.height = (uint32_t)(full_extent.height * scale + 0.5f);
+    extent.width = extent.width > 0 ? extent.width : 1;
+    extent.height = extent.height > 0 ? extent.height : 1;
+    return extent;
+}
+
+// Starts at max_scale. The scale bounds are clamped to (0, 1], rendering above the swapchain size isn't supported.
+void dynamic_resolution_create(dynamic_resolution_t* d, VkExtent2D full_extent, float target_ms, float min_scale, float max_scale)
+{
+    memset(d, 0, sizeof(dynamic_resolution_t));
+    d->target_ms = target_ms;
+    d->max_scale = max_scale > 0.0f && max_scale < 1.0f ? max_scale : 1.0f;
+    d->min_scale = min_scale > 0.0f && min_scale < d->max_scale ? min_scale : d->max_scale;
+    d->scale = d->max_scale;
+    d->full_extent = full_extent;
+    d->extent = dynamic_resolution_extent(full_extent, d->scale);
+}
+
+// For a swapchain recreated at another size. The scale stays, the frames in flight and the averaging start over.
+void dynamic_resolution_resize(dynamic_resolution_t* d, VkExtent2D full_extent)
+{
+    d->full_extent = full_extent;
+    d->extent = dynamic_resolution_extent(full_extent, d->scale);
+    d->samples = 0;
+}
+
+// Takes the GPU time in ms of the scaled passes of one frame, in submission order. Returns 1 when the render
+// extent changed.
+uint32_t dynamic_resolution_update(dynamic_resolution_t* d, float ms)
+{
+    uint32_t sample = d->samples++;
+
+    // Frames that were in flight at the last change were recorded at the old scale.
+    if (sample < MAX_FRAMES_IN_FLIGHT)
+        return 0;
+
+    d->gpu_ms = sample == MAX_FRAMES_IN_FLIGHT ? ms : d->gpu_ms + (ms - d->gpu_ms) * DYNAMIC_RESOLUTION_SMOOTHING;
+
+    if (sample < DYNAMIC_RESOLUTION_SETTLE_FRAMES)
+        return 0;
+
+    if (d->gpu_ms <= d->target_ms && d->gpu_ms >= d->target_ms * DYNAMIC_RESOLUTION_LOW)
+        return 0;
+
+    float step = sqrtf(d->target_ms * DYNAMIC_RESOLUTION_AIM / d->gpu_ms);
+    step = fmaxf(DYNAMIC_RESOLUTION_MAX_STEP_DOWN, fminf(step, DYNAMIC_RESOLUTION_MAX_STEP_UP));
+    float scale = fmaxf(d->min_scale, fminf(d->scale * step, d->max_scale));
+    VkExtent2D extent = dynamic_resolution_extent(d->full_extent, scale);
+
+    // Already at a bound.
+    if (extent.width == d->extent.width && extent.height == d->extent.height)
+        return 0;
+
+    d->scale = scale;
+    d->extent = extent;
+    d->samples = 0;
+    ++d->changes;
+    return 1;
+}
+
+#define BENCH_QUERIES_PER_FRAME 2
+#define BENCH_QUERY_PREPASS 0
+#define BENCH_QUERY_COLOR 1
+
+// Results of a pipeline statistics query come back in flag bit order, which is the order of pass_statistics_t.
+#define PIPELINE_STATISTICS_FLAGS (VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT | VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT \
+                                   | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT \
+                                   | VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT)
+#define PIPELINE_STATISTICS_COUNT 5
+
+typedef struct
+{
+    uint64_t input_primitives;
+    uint64_t vertex_invocations;
+    uint64_t clipping_invocations;
+    uint64_t clipping_primitives;
+    uint64_t fragment_invocations;
+    uint64_t samples_passed;
+} pass_statistics_t;
+
+// Collected when running with --bench, printed and optionally written as JSON once the requested number of frames
+// has been rendered. Every draw is wrapped in an occlusion query and, if the device supports it, a pipeline
+// statistics query. Overdraw is the number of samples passing the depth test in the color pass per pixel, with the
+// depth pre-pass that is 1 for every covered pixel no matter how much geometry overlaps. CPU time is what a frame
+// costs outside of waiting for its frame slot, acquiring and presenting, the first frame left out.
+typedef struct
+{
+    uint64_t frames_requested;
+    const char* json_path;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    VkExtent2D extent;
+    VkQueryPool occlusion_pool;
+    VkQueryPool statistics_pool;
+    uint64_t query_frames;
+    pass_statistics_t passes[BENCH_QUERIES_PER_FRAME];
+    uint32_t depth_prepass;
+    uint32_t cached_commands;
+    uint64_t cpu_frames;
+    uint64_t cpu_ns;
+    uint64_t record_ns;
+    uint64_t recorded_frames;
+} bench_t;
+
+// Adds the query results of the frame last recorded in frame_slot, which has to have finished.
+void bench_collect_queries(bench_t* b, VkDevice device, uint32_t frame_slot)
+{
+    uint32_t first = b->depth_prepass ? BENCH_QUERY_PREPASS : BENCH_QUERY_COLOR;
+    uint32_t first_query = frame_slot * BENCH_QUERIES_PER_FRAME + first;
+    uint32_t query_count = BENCH_QUERIES_PER_FRAME - first;
+
+    uint64_t samples[BENCH_QUERIES_PER_FRAME] = {};
+    VkResult res = vkGetQueryPoolResults(device, b->occlusion_pool, first_query, query_count, sizeof(samples), &samples[first],
+                                         sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+    assert(res == VK_SUCCESS);
+
+    uint64_t statistics[BENCH_QUERIES_PER_FRAME][PIPELINE_STATISTICS_COUNT] = {};
+
+    if (b->statistics_pool != VK_NULL_HANDLE)
+    {
+        res = vkGetQueryPoolResults(device, b->statistics_pool, first_query, query_count, sizeof(statistics), &statistics[first],
+                                    sizeof(statistics[0]), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        assert(res == VK_SUCCESS);
+    }
+
+    for (uint32_t i = first; i < BENCH_QUERIES_PER_FRAME; ++i)
+    {
+        pass_statistics_t* p = &b->passes[i];
+        p->input_primitives += statistics[i][0];
+        p->vertex_invocations += statistics[i][1];
+        p->clipping_invocations += statistics[i][2];
+        p->clipping_primitives += statistics[i][3];
+        p->fragment_invocations += statistics[i][4];
+        p->samples_passed += samples[i];
+    }
+
+    ++b->query_frames;
+}
+
+static void bench_write_pass_json(FILE* f, const bench_t* b, const char* name, const pass_statistics_t* p, const char* separator)
+{
+    double frames = b->query_frames ? (double)b->query_frames : 1.0;
+    double pixels = (double)b->extent.width * b->extent.height;
+
+    fprintf(f, "    \"%s\": {\n", name);
+    fprintf(f, "      \"input_primitives\": %.1f,\n", p->input_primitives / frames);
+    fprintf(f, "      \"vertex_shader_invocations\": %.1f,\n", p->vertex_invocations / frames);
+    fprintf(f, "      \"clipping_invocations\": %.1f,\n", p->clipping_invocations / frames);
+    fprintf(f, "      \"clipping_primitives\": %.1f,\n", p->clipping_primitives / frames);
+    fprintf(f, "      \"fragment_shader_invocations\": %.1f,\n", p->fragment_invocations / frames);
+    fprintf(f, "      \"samples_passed\": %.1f,\n", p->samples_passed / frames);
+    fprintf(f, "      \"samples_passed_per_pixel\": %.4f\n", p->samples_passed / frames / pixels);
+    fprintf(f, "    }%s\n", separator);
+}
+
+// Statistics are per frame averages.
+void bench_write_json(const bench_t* b, uint64_t frames)
+{
+    FILE* f = fopen(b->json_path, "w");
+
+    if (f == NULL)
+    {
+        printf("bench: couldn't write %s\n", b->json_path);
+        return;
+    }
+
+    double seconds = (b->end_ns - b->start_ns) / 1e9;
+    fprintf(f, "{\n");
+    fprintf(f, "  \"frames\": %llu,\n", (unsigned long long)frames);
+    fprintf(f, "  \"seconds\": %.6f,\n", seconds);
+    fprintf(f, "  \"ms_per_frame\": %.6f,\n", frames ? seconds * 1000.0 / frames : 0.0);
+    fprintf(f, "  \"width\": %u,\n", b->extent.width);
+    fprintf(f, "  \"height\": %u,\n", b->extent.height);
+    fprintf(f, "  \"depth_prepass\": %s,\n", b->depth_prepass ? "true" : "false");
+    fprintf(f, "  \"pipeline_statistics\": %s,\n", b->statistics_pool != VK_NULL_HANDLE ? "true" : "false");
+    fprintf(f, "  \"cached_commands\": %s,\n", b->cached_commands ? "true" : "false");
+    fprintf(f, "  \"cpu_ms_per_frame\": %.6f,\n", b->cpu_frames ? b->cpu_ns / 1e6 / b->cpu_frames : 0.0);
+    fprintf(f, "  \"record_ms_per_frame\": %.6f,\n", b->cpu_frames ? b->record_ns / 1e6 / b->cpu_frames : 0.0);
+    fprintf(f, "  \"recorded_frames\": %llu,\n", (unsigned long long)b->recorded_frames);
+    fprintf(f, "  \"passes\": {\n");
+
+    if (b->depth_prepass)
+        bench_write_pass_json(f, b, "depth_prepass", &b->passes[BENCH_QUERY_PREPASS], ",");
+
+    bench_write_pass_json(f, b, "scene", &b->passes[BENCH_QUERY_COLOR], "");
+    fprintf(f, "  }\n");
+    fprintf(f, "}\n");
+    fclose(f);
+}
+
+static void bench_print_pass(const bench_t* b, const char* name, const pass_statistics_t* p)
+{
+    double frames = b->query_frames ? (double)b->query_frames : 1.0;
+    double pixels = (double)b->extent.width * b->extent.height;
+
+    printf("bench: %-15s %.3f samples per pixel", name, p->samples_passed / frames / pixels);
+
+    if (b->statistics_pool != VK_NULL_HANDLE)
+    {
+        printf(", per frame %.0f vertex invocations, %.0f primitives out of clipping, %.0f fragment invocations",
+               p->vertex_invocations / frames, p->clipping_primitives / frames, p->fragment_invocations / frames);
+    }
+
+    printf("\n");
+}
+
+void bench_print(const bench_t* b, uint64_t frames)
+{
+    double seconds = (b->end_ns - b->start_ns) / 1e9;
+
+    printf("bench: %llu frames in %.2f s, %.3f ms per frame, depth pre-pass %s\n",
+           (unsigned long long)frames, seconds, frames ? seconds * 1000.0 / frames : 0.0, b->depth_prepass ? "on" : "off");
+
+    double cpu_frames = b->cpu_frames ? (double)b->cpu_frames : 1.0;
+    printf("bench: cpu %.3f ms per frame, %.3f ms of it recording, cached command buffers %s, %llu of %llu frames recorded\n",
+           b->cpu_ns / 1e6 / cpu_frames, b->record_ns / 1e6 / cpu_frames, b->cached_commands ? "on" : "off",
+           (unsigned long long)b->recorded_frames, (unsigned long long)frames);
+
+    if (b->depth_prepass)
+        bench_print_pass(b, "depth pre-pass", &b->passes[BENCH_QUERY_PREPASS]);
+
+    bench_print_pass(b, "scene", &b->passes[BENCH_QUERY_COLOR]);
+
+    if (b->json_path)
+        bench_write_json(b, frames);
+}
+
+#define VIEW_QUERIES_PER_FRAME (2 * RG_MAX_PASSES)
+
+// One window and what is drawn into it. Pipelines, geometry and the instance transforms are shared, every view has
+// its own swapchain, camera, render graph and command buffers, and its own copy of the instances since LOD selection
+// depends on the camera. The first view also gets the capture, dynamic resolution, bench and trace passes and
+// queries, the other views only draw the scene.
+typedef struct
+{
+    xcb_drawable_t window;
+    VkSurfaceKHR surface;
+    VkSwapchainKHR swapchain;
+    VkSwapchainCreateInfoKHR swapchain_info;
+    VkExtent2D extent;
+    uint32_t image_count;
+    uint32_t image_capacity;
+    // Set when an acquire or present said out of date or suboptimal, the swapchain is recreated before the next
+    // acquire.
+    uint32_t swapchain_stale;
+    swapchain_buffer_t* buffers;
+    VkSemaphore image_acquired_semaphores[MAX_FRAMES_IN_FLIGHT];
+    // One per swapchain image rather than per frame, the presentation engine holds on to it until that image
+    // is acquired again.
+    VkSemaphore* render_complete_semaphores;
+    uint32_t current_buffer;
+
+    vec3_t camera_pos;
+    mat4_t proj_view;
+    scene_instance_t* instances;
+    // Frame slots whose matrices were written with an old proj_view, they get all of them written again when
+    // their turn comes.
+    uint32_t stale_transform_slots;
+
+    render_graph_t graph;
+    uint32_t swapchain_image;
+    uint32_t scene_color_image;
+    uint32_t scene_pass;
+    uint32_t prepass_pass;
+    scene_pass_t scene;
+    scene_pass_t prepass;
+    draw_queue_t draws;
+
+    // Where the submit waits for the acquired image, the stage of its first use in the render graph.
+    VkPipelineStageFlags acquire_stage;
+
+    VkCommandBuffer cmds[MAX_FRAMES_IN_FLIGHT];
+    VkCommandBuffer* cached_cmds;
+    uint64_t* cached_versions;
+    uint32_t cached_cmd_count;
+
+    // Timestamps around every render graph pass in each frame slot, VK_NULL_HANDLE when the graphics queue has
+    // none. The GPU time is the sum of the passes in timed_passes rather than the whole command buffer, which
+    // would also count the wait for the swapchain image. pass_timestamps holds the last frame's results with
+    // their availability. GPU and recording time add up over the frames they were measured in.
+    VkQueryPool timestamp_pool;
+    uint32_t timed_passes;
+    uint64_t pass_timestamps[VIEW_QUERIES_PER_FRAME][2];
+    uint64_t gpu_ns;
+    uint64_t gpu_frames;
+    uint64_t record_ns;
+    uint64_t record_frames;
+} view_t;
+
+// Creates a swapchain from swapchain_info with the size, image count and transform the view's surface wants now,
+// replacing the view's current one, which goes to q, and its image views and render complete semaphores. The
+// arrays for them only come out of arena when there are more images than ever before, so recreating doesn't use
+// it up.
+static void view_create_swapchain_images(view_t* v, VkPhysicalDevice gpu, VkDevice device, deletion_queue_t* q, arena_t* arena)
+{
+    VkSurfaceCapabilitiesKHR caps;
+    VkResult res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(gpu, v->surface, &caps);
+    assert(res == VK_SUCCESS);
+    assert(caps.currentExtent.width != 0xFFFFFFFF);
+    assert((caps.supportedUsageFlags & v->swapchain_info.imageUsage) == v->swapchain_info.imageUsage);
+
+    VkSwapchainCreateInfoKHR ci = v->swapchain_info;
+    ci.surface = v->surface;
+    ci.minImageCount = caps.minImageCount;
+    ci.imageExtent = caps.currentExtent;
+    if (!(caps.supportedTransforms & VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR))
+        ci.preTransform = caps.currentTransform;
+    ci.oldSwapchain = v->swapchain;
+
+    res = vkCreateSwapchainKHR(device, &ci, &g_vk_allocator, &v->swapchain);
+    assert(res == VK_SUCCESS);
+    v->extent = caps.currentExtent;
+
+    if (ci.oldSwapchain != VK_NULL_HANDLE)
+        deletion_queue_push(q, DEFERRED_DESTROY_SWAPCHAIN, (deferred_handle_t){.swapchain = ci.oldSwapchain});
+
+    res = vkGetSwapchainImagesKHR(device, v->swapchain, &v->image_count, NULL);
+    assert(v->image_count > 0);
+    assert(res == VK_SUCCESS);
+
+    if (v->image_count > v->image_capacity)
+    {
+        v->buffers = arena_alloc_array(arena, swapchain_buffer_t, v->image_count);
+        v->render_complete_semaphores = arena_alloc_array(arena, VkSemaphore, v->image_count);
+        v->image_capacity = v->image_count;
+    }
+
+    size_t scratch_mark = arena_mark(arena);
+    VkImage* images = arena_alloc_array(arena, VkImage, v->image_count);
+    res = vkGetSwapchainImagesKHR(device, v->swapchain, &v->image_count, images);
+    assert(res == VK_SUCCESS);
+
+    VkSemaphoreCreateInfo sci = {};
+    sci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    for (uint32_t i = 0; i < v->image_count; ++i)
+    {
+        v->buffers[i].image = images[i];
+
+        VkImageViewCreateInfo vci = {};
+        vci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        vci.image = images[i];
+        vci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        vci.format = ci.imageFormat;
+        vci.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+        vci.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+        vci.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+        vci.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+        vci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        vci.subresourceRange.levelCount = 1;
+        vci.subresourceRange.layerCount = 1;
+
+        res = vkCreateImageView(device, &vci, &g_vk_allocator, &v->buffers[i].view);
+        assert(res == VK_SUCCESS);
+
+        res = vkCreateSemaphore(device, &sci, &g_vk_allocator, &v->render_complete_semaphores[i]);
+        assert(res == VK_SUCCESS);
+    }
+
+    arena_rewind(arena, scratch_mark);
+}
+
+// Creates the swapchain from scci, see view_create_swapchain_images, and the view's semaphores. The surface has to
+// take the format and usage the first view picked.
+void view_create_swapchain(view_t* v, VkPhysicalDevice gpu, VkDevice device, const VkSwapchainCreateInfoKHR* scci, arena_t* arena)
+{
+    uint32_t format_count;
+    VkResult res = vkGetPhysicalDeviceSurfaceFormatsKHR(gpu, v->surface, &format_count, NULL);
+    assert(res == VK_SUCCESS);
+    VkSurfaceFormatKHR* formats = arena_alloc_array(arena, VkSurfaceFormatKHR, format_count);
+    res = vkGetPhysicalDeviceSurfaceFormatsKHR(gpu, v->surface, &format_count, formats);
+    assert(res == VK_SUCCESS);
+
+    uint32_t format_supported = format_count == 1 && formats[0].format == VK_FORMAT_UNDEFINED;
+    for (uint32_t i = 0; i < format_count; ++i)
+        format_supported |= formats[i].format == scci->imageFormat;
+    assert(format_supported);
+
+    v->swapchain_info = *scci;
+    v->swapchain = VK_NULL_HANDLE;
+    view_create_swapchain_images(v, gpu, device, NULL, arena);
+
+    VkSemaphoreCreateInfo sci = {};
+    sci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+    {
+        res = vkCreateSemaphore(device, &sci, &g_vk_allocator, &v->image_acquired_semaphores[i]);
+        assert(res == VK_SUCCESS);
+    }
+}
+
+// Replaces an out of date or suboptimal swapchain, its image views and render complete semaphores, and resizes the
+// render graph images if the size changed. Frames in flight may still use the old ones, they go to q along with the
+// render graph framebuffers made from the old image views. The present of the last frame waits on a render complete
+// semaphore too, without VK_EXT_swapchain_maintenance1 there is no telling when it is done with it other than the
+// frame having finished. Returns the render_graph_resize error.
+VkResult view_recreate_swapchain(view_t* v, VkPhysicalDevice gpu, VkDevice device, deletion_queue_t* q, arena_t* arena)
+{
+    VkExtent2D old_extent = v->extent;
+    render_graph_release_framebuffers(&v->graph, q);
+
+    for (uint32_t i = 0; i < v->image_count; ++i)
+    {
+        deletion_queue_push(q, DEFERRED_DESTROY_IMAGE_VIEW, (deferred_handle_t){.image_view = v->buffers[i].view});
+        deletion_queue_push(q, DEFERRED_DESTROY_SEMAPHORE, (deferred_handle_t){.semaphore = v->render_complete_semaphores[i]});
+    }
+
+    view_create_swapchain_images(v, gpu, device, q, arena);
+    v->swapchain_stale = 0;
+
+    if (v->extent.width == old_extent.width && v->extent.height == old_extent.height)
+        return VK_SUCCESS;
+
+    return render_graph_resize(&v->graph, v->extent, q);
+}
+
+// Command buffers for every pair of swapchain image and frame slot, see use_cached_commands in main. Called again
+// when a recreated swapchain has more images than there are command buffers for, the ones there are may be in
+// flight and are kept, only the missing ones are allocated. Every command buffer is recorded again either way.
+void view_allocate_cached_cmds(view_t* v, VkDevice device, VkCommandPool pool, arena_t* arena)
+{
+    uint32_t count = v->image_count * MAX_FRAMES_IN_FLIGHT;
+    VkCommandBuffer* cmds = arena_alloc_array(arena, VkCommandBuffer, count);
+    if (v->cached_cmd_count > 0)
+        memcpy(cmds, v->cached_cmds, v->cached_cmd_count * sizeof(VkCommandBuffer));
+
+    v->cached_versions = arena_alloc_array(arena, uint64_t, count);
+    memset(v->cached_versions, 0, count * sizeof(uint64_t));
+
+    VkCommandBufferAllocateInfo cbai = {};
+    cbai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbai.commandPool = pool;
+    cbai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbai.commandBufferCount = count - v->cached_cmd_count;
+    VkResult res = vkAllocateCommandBuffers(device, &cbai, cmds + v->cached_cmd_count);
+    assert(res == VK_SUCCESS);
+
+    v->cached_cmds = cmds;
+    v->cached_cmd_count = count;
+}
+
+// Looks at the camera from config, turned around the z axis by angle radians, with a projection for the view's
+// extent.
+void view_set_camera(view_t* v, const vec3_t* camera_pos, const quat_t* camera_rot, float angle)
+{
+    const vec3_t origin = {0, 0, 0};
+    const quat_t turn = {0, 0, sinf(angle * 0.5f), cosf(angle * 0.5f)};
+    mat4_t turn_matrix = mat4_from_rotation_and_translation(&turn, &origin);
+    mat4_t local_camera_matrix = mat4_from_rotation_and_translation(camera_rot, camera_pos);
+    mat4_t camera_matrix = mat4_mul(&local_camera_matrix, &turn_matrix);
+    mat4_t view_matrix = mat4_inverse(&camera_matrix);
+    mat4_t proj_matrix = create_projection_matrix((float)v->extent.width, (float)v->extent.height);
+    v->proj_view = mat4_mul(&view_matrix, &proj_matrix);
+    v->camera_pos = (vec3_t){camera_matrix.w.x, camera_matrix.w.y, camera_matrix.w.z};
+}
+
+// Reads the pass timestamps of the view's last frame in frame_slot, which has to have finished, and adds the GPU
+// time of its timed passes. Returns that time in ms, -1 if it isn't available.
+double view_collect_gpu_time(view_t* v, VkDevice device, uint32_t frame_slot, double ns_per_tick, uint64_t tick_mask)
+{
+    VkResult res = vkGetQueryPoolResults(device, v->timestamp_pool, frame_slot * VIEW_QUERIES_PER_FRAME, 2 * v->graph.pass_count,
+                                         sizeof(v->pass_timestamps), v->pass_timestamps, sizeof(v->pass_timestamps[0]),
+                                         VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    assert(res == VK_SUCCESS || res == VK_NOT_READY);
+
+    double ms = render_graph_passes_ms(&v->graph, v->pass_timestamps, v->timed_passes, ns_per_tick, tick_mask);
+
+    if (ms < 0.0)
+        return ms;
+
+    v->gpu_ns += (uint64_t)(ms * 1e6);
+    ++v->gpu_frames;
+    return ms;
+}
+
+// The surface is destroyed by the caller, it outlives the device.
+void view_destroy(view_t* v, VkDevice device)
+{
+    render_graph_destroy(&v->graph);
+
+    if (v->timestamp_pool != VK_NULL_HANDLE)
+        vkDestroyQueryPool(device, v->timestamp_pool, &g_vk_allocator);
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+        vkDestroySemaphore(device, v->image_acquired_semaphores[i], &g_vk_allocator);
+
+    for (uint32_t i = 0; i < v->image_count; ++i)
+    {
+        vkDestroySemaphore(device, v->render_complete_semaphores[i], &g_vk_allocator);
+        vkDestroyImageView(device, v->buffers[i].view, &g_vk_allocator);
+    }
+
+    vkDestroySwapchainKHR(device, v->swapchain, &g_vk_allocator);
+}
+
+// Everything main reads from the command line or a config file. A config file has one option per line, written
+// the same way as on the command line with or without the leading dashes, and # starts a comment.
+typedef struct
+{
+    uint32_t window_width;
+    uint32_t window_height;
+    uint32_t window_count;
+    float fov;
+    float near_plane;
+    float far_plane;
+    uint32_t samples;
+    vec3_t camera_pos;
+    quat_t camera_rot;
+
+    // Validation also turns on the debug messenger, verbose adds verbose messages to it.
+    uint32_t validation;
+    uint32_t validation_verbose;
+
+    // gpu_index -1 picks the highest scoring GPU, see score_physical_device. gpu_type is
+    // VK_PHYSICAL_DEVICE_TYPE_MAX_ENUM when no type is preferred.
+    uint32_t gpu_index;
+    VkPhysicalDeviceType gpu_type;
+
+    uint32_t depth_prepass;
+    uint32_t dynamic_rendering;
+    uint32_t bindless;
+    uint32_t cached_commands;
+    uint32_t lod_instances;
+    float spin;
+    float memory_budget;
+    uint32_t upload_test_buffers;
+    uint64_t bench_frames;
+    const char* bench_json;
+    uint32_t bench_all_gpus;
+    const char* trace;
+    uint32_t verbose;
+    const char* shader_dir;
+    float dynamic_resolution;
+    float resolution_scale[2];
+    procedural_kind_e procedural;
+    uint32_t procedural_resolution;
+    capture_config_t capture;
+} app_config_t;
+
+void config_defaults(app_config_t* c)
+{
+    memset(c, 0, sizeof(app_config_t));
+    c->window_width = 640;
+    c->window_height = 480;
+    c->window_count = 1;
+    c->fov = 75.0f;
+    c->near_plane = 0.01f;
+    c->far_plane = 1000.0f;
+    c->samples = 1;
+    c->camera_pos = (vec3_t){2.5, -4, 1.5};
+    c->camera_rot = (quat_t){-0.3333, 0, 0.3333, 0.6667};
+    c->validation = 1;
+    c->validation_verbose = 1;
+    c->gpu_index = -1;
+    c->gpu_type = VK_PHYSICAL_DEVICE_TYPE_MAX_ENUM;
+    c->dynamic_rendering = 1;
+    c->bindless = 1;
+    c->memory_budget = 0.9f;
+    c->resolution_scale[0] = 0.5f;
+    c->resolution_scale[1] = 1.0f;
+    c->procedural_resolution = 256;
+}
+
+typedef enum
+{
+    CONFIG_U32,
+    CONFIG_U64,
+    CONFIG_FLOAT,
+    CONFIG_STRING,
+    // No value, --name sets it and --no-name clears it.
+    CONFIG_FLAG,
+    CONFIG_GPU_TYPE,
+    CONFIG_PROCEDURAL
+} config_type_e;
+
+typedef struct
+{
+    const char* name;
+    config_type_e type;
+    size_t offset;
+    uint32_t value_count;
+    const char* help;
+} config_option_t;
+
+static const config_option_t g_config_options[] = {
+    {"width", CONFIG_U32, offsetof(app_config_t, window_width), 1, "window width"},
+    {"height", CONFIG_U32, offsetof(app_config_t, window_height), 1, "window height"},
+    {"windows", CONFIG_U32, offsetof(app_config_t, window_count), 1, "open n windows, each with its own swapchain and camera"},
+    {"fov", CONFIG_FLOAT, offsetof(app_config_t, fov), 1, "vertical field of view in degrees"},
+    {"near", CONFIG_FLOAT, offsetof(app_config_t, near_plane), 1, "near plane distance"},
+    {"far", CONFIG_FLOAT, offsetof(app_config_t, far_plane), 1, "far plane distance"},
+    {"samples", CONFIG_U32, offsetof(app_config_t, samples), 1, "MSAA sample count, lowered to what the GPU supports"},
+    {"camera-pos", CONFIG_FLOAT, offsetof(app_config_t, camera_pos), 3, "camera position x y z"},
+    {"camera-rot", CONFIG_FLOAT, offsetof(app_config_t, camera_rot), 4, "camera rotation quaternion x y z w"},
+    {"validation", CONFIG_FLAG, offsetof(app_config_t, validation), 0, "VK_LAYER_KHRONOS_validation and the debug messenger"},
+    {"validation-verbose", CONFIG_FLAG, offsetof(app_config_t, validation_verbose), 0, "verbose validation messages"},
+    {"gpu", CONFIG_U32, offsetof(app_config_t, gpu_index), 1, "index of the GPU to use instead of the highest scoring one"},
+    {"gpu-type", CONFIG_GPU_TYPE, offsetof(app_config_t, gpu_type), 1, "preferred GPU type: discrete, integrated, virtual, cpu or other"},
+    {"depth-prepass", CONFIG_FLAG, offsetof(app_config_t, depth_prepass), 0, "lay down depth first and shade with an EQUAL depth test"},
+    {"dynamic-rendering", CONFIG_FLAG, offsetof(app_config_t, dynamic_rendering), 0, "vkCmdBeginRendering and synchronization2 on 1.3 devices"},
+    {"bindless", CONFIG_FLAG, offsetof(app_config_t, bindless), 0, "one descriptor set with indexed buffer and image arrays on 1.2 devices"},
+    {"cached-commands", CONFIG_FLAG, offsetof(app_config_t, cached_commands), 0, "record command buffers once per swapchain image and frame slot"},
+    {"lod-instances", CONFIG_U32, offsetof(app_config_t, lod_instances), 1, "draw n LOD spheres instead of the cube"},
+    {"spin", CONFIG_FLOAT, offsetof(app_config_t, spin), 1, "turn every instance around the z axis, degrees per second"},
+    {"memory-budget", CONFIG_FLOAT, offsetof(app_config_t, memory_budget), 1, "fraction of each heap's budget to use before evicting or falling back"},
+    {"upload-test", CONFIG_U32, offsetof(app_config_t, upload_test_buffers), 1, "load test the upload service with n buffers from worker threads"},
+    {"bench", CONFIG_U64, offsetof(app_config_t, bench_frames), 1, "render n frames, then print frame time and GPU statistics"},
+    {"bench-json", CONFIG_STRING, offsetof(app_config_t, bench_json), 1, "also write the bench results to this file"},
+    {"bench-all-gpus", CONFIG_FLAG, offsetof(app_config_t, bench_all_gpus), 0, "run the bench on every GPU and compare them"},
+    {"dynamic-resolution", CONFIG_FLOAT, offsetof(app_config_t, dynamic_resolution), 1, "scale the render resolution to keep GPU frame time at n ms"},
+    {"resolution-scale", CONFIG_FLOAT, offsetof(app_config_t, resolution_scale), 2, "lowest and highest scale for --dynamic-resolution"},
+    {"procedural", CONFIG_PROCEDURAL, offsetof(app_config_t, procedural), 1, "generate a grid, cube or heightfield with a compute shader"},
+    {"procedural-resolution", CONFIG_U32, offsetof(app_config_t, procedural_resolution), 1, "quads along each side of a procedural face"},
+    {"shader-dir", CONFIG_STRING, offsetof(app_config_t, shader_dir), 1, "read the .spv files from this directory instead of the embedded SPIR-V"},
+    {"trace", CONFIG_STRING, offsetof(app_config_t, trace), 1, "write a Chrome trace of CPU zones and GPU passes to this file"},
+    {"verbose", CONFIG_FLAG, offsetof(app_config_t, verbose), 0, "print device, feature, memory and per frame diagnostics"},
+    {"capture", CONFIG_STRING, offsetof(app_config_t, capture.directory), 1, "write presented frames to this directory as PPM"},
+    {"capture-frames", CONFIG_U64, offsetof(app_config_t, capture.frames_requested), 1, "exit after capturing n frames"},
+    {"golden", CONFIG_STRING, offsetof(app_config_t, capture.golden_directory), 1, "compare captured frames against this directory"},
+    {"stream", CONFIG_STRING, offsetof(app_config_t, capture.stream_target), 1, "stream raw frames to fd:<n>, a path or shm:<name>"},
+};
+
+#define CONFIG_OPTION_COUNT (sizeof(g_config_options) / sizeof(g_config_options[0]))
+
+static const char* g_gpu_type_names[] = {
+    [VK_PHYSICAL_DEVICE_TYPE_OTHER] = "other",
+    [VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU] = "integrated",
+    [VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU] = "discrete",
+    [VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU] = "virtual",
+    [VK_PHYSICAL_DEVICE_TYPE_CPU] = "cpu",
+};
+
+void config_print_help(void)
+{
+    printf("options, also accepted one per line in a --config file:\n");
+    printf("  --%-20s %s\n", "config <file>", "read options from file");
+
+    for (uint32_t i = 0; i < CONFIG_OPTION_COUNT; ++i)
+    {
+        const config_option_t* o = &g_config_options[i];
+        char name[64];
+        snprintf(name, sizeof(name), o->type == CONFIG_FLAG ? "[no-]%s" : "%s <value>", o->name);
+        printf("  --%-20s %s\n", name, o->help);
+    }
+}
+
+// Applies the option at args[*i] and its values and moves *i to the last argument used. Returns 0 if the option
+// is unknown or its values are missing or malformed.
+static int config_apply_option(app_config_t* c, char** args, int count, int* i)
+{
+    const char* arg = args[*i];
+
+    if (strncmp(arg, "--", 2) == 0)
+        arg += 2;
+
+    uint32_t negated = strncmp(arg, "no-", 3) == 0;
+
+    for (uint32_t oi = 0; oi < CONFIG_OPTION_COUNT; ++oi)
+    {
+        const config_option_t* o = &g_config_options[oi];
+        uint8_t* field = (uint8_t*)c + o->offset;
+
+        if (o->type == CONFIG_FLAG)
+        {
+            if (strcmp(arg + (negated ? 3 : 0), o->name) != 0)
+                continue;
+
+            *(uint32_t*)field = !negated;
+            return 1;
+        }
+
+        if (strcmp(arg, o->name) != 0)
+            continue;
+
+        if (*i + (int)o->value_count >= count)
+            return 0;
+
+        for (uint32_t v = 0; v < o->value_count; ++v)
+        {
+            const char* value = args[++*i];
+            char* end = NULL;
+
+            switch (o->type)
+            {
+                case CONFIG_U32: ((uint32_t*)field)[v] = strtoul(value, &end, 10); break;
+                case CONFIG_U64: ((uint64_t*)field)[v] = strtoull(value, &end, 10); break;
+                case CONFIG_FLOAT: ((float*)field)[v] = strtof(value, &end); break;
+                case CONFIG_STRING: ((const char**)field)[v] = value; break;
+                case CONFIG_GPU_TYPE:
+                {
+                    for (uint32_t t = 0; t < sizeof(g_gpu_type_names) / sizeof(g_gpu_type_names[0]); ++t)
+                    {
+                        if (strcmp(value, g_gpu_type_names[t]) == 0)
+                        {
+                            *(VkPhysicalDeviceType*)field = t;
+                            end = (char*)value + strlen(value);
+                        }
+                    }
+                } break;
+                case CONFIG_PROCEDURAL:
+                {
+                    for (uint32_t k = 0; k < sizeof(g_procedural_names) / sizeof(g_procedural_names[0]); ++k)
+                    {
+                        if (strcmp(value, g_procedural_names[k]) == 0)
+                        {
+                            *(procedural_kind_e*)field = k;
+                            end = (char*)value + strlen(value);
+                        }
+                    }
+                } break;
+                case CONFIG_FLAG: break;
+            }
+
+            if (o->type != CONFIG_STRING && (end == NULL || end == value || *end != '\0'))
+                return 0;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// Config files can include others, a file that includes itself, directly or not, is caught by the depth.
+#define CONFIG_MAX_DEPTH 16
+
+static int config_parse_file(app_config_t* c, const char* filename, arena_t* arena, uint32_t depth);
+
+static int config_parse_tokens(app_config_t* c, char** args, int count, arena_t* arena, uint32_t depth)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        const char* arg = args[i];
+
+        if (strcmp(arg, "--config") == 0 || strcmp(arg, "config") == 0)
+        {
+            if (i + 1 >= count || !config_parse_file(c, args[++i], arena, depth + 1))
+                return 0;
+        }
+        else if (!config_apply_option(c, args, count, &i))
+        {
+            printf("bad or unknown option %s, see --help\n", arg);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Options are applied in order, so anything after --config overrides the file. Strings point into args or into
+// config file text allocated from arena.
+int config_parse_args(app_config_t* c, char** args, int count, arena_t* arena)
+{
+    return config_parse_tokens(c, args, count, arena, 0);
+}
+
+static int config_parse_file(app_config_t* c, const char* filename, arena_t* arena, uint32_t depth)
+{
+    if (depth > CONFIG_MAX_DEPTH)
+    {
+        printf("config files nested more than %u deep at %s, do they include each other?\n", CONFIG_MAX_DEPTH, filename);
+        return 0;
+    }
+
+    file_data_t file;
+
+    if (file_load(filename, &file, arena) != FILE_LOAD_SUCCESS)
+    {
+        printf("couldn't read config file %s\n", filename);
+        return 0;
+    }
+
+    // Tokenized in place into a NUL terminated copy, which stays alive since options keep pointers into it.
+    char* text = arena_alloc(arena, file.size + 1, 1);
+    memcpy(text, file.data, file.size);
+    text[file.size] = '\0';
+
+    uint32_t token_capacity = file.size / 2 + 1;
+    char** tokens = arena_alloc_array(arena, char*, token_capacity);
+    uint32_t token_count = 0;
+    char* p = text;
+
+    while (*p)
+    {
+        if (*p == '#')
+        {
+            while (*p && *p != '\n')
+                *p++ = '\0';
+        }
+        else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            *p++ = '\0';
+        else
+        {
+            assert(token_count < token_capacity);
+            tokens[token_count++] = p;
+
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#')
+                ++p;
+        }
+    }
+
+    return config_parse_tokens(c, tokens, token_count, arena, depth);
+}
+
+// How well a GPU suits this renderer. Usable GPUs support VK_KHR_swapchain, have a graphics queue family and a
+// queue family that can present to the surface.
+typedef struct
+{
+    VkPhysicalDeviceProperties properties;
+    uint32_t usable;
+    VkDeviceSize device_local_bytes;
+    uint32_t dedicated_transfer;
+    uint32_t dedicated_compute;
+    uint32_t feature_count;
+    double score;
+} gpu_score_t;
+
+static const uint32_t g_gpu_type_rank[] = {
+    [VK_PHYSICAL_DEVICE_TYPE_OTHER] = 0,
+    [VK_PHYSICAL_DEVICE_TYPE_CPU] = 1,
+    [VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU] = 2,
+    [VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU] = 3,
+    [VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU] = 4,
+};
+
+// The device type dominates, then the amount of device local memory in MiB, with dedicated transfer and compute
+// queue families and optional features the renderer uses breaking ties. A GPU of the type asked for with
+// --gpu-type beats all others.
+void score_physical_device(gpu_score_t* s, VkPhysicalDevice gpu, VkSurfaceKHR surface, const app_config_t* c, arena_t* scratch)
+{
+    memset(s, 0, sizeof(gpu_score_t));
+    vkGetPhysicalDeviceProperties(gpu, &s->properties);
+
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    vkGetPhysicalDeviceMemoryProperties(gpu, &memory_properties);
+
+    for (uint32_t i = 0; i < memory_properties.memoryHeapCount; ++i)
+    {
+        if (memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            s->device_local_bytes += memory_properties.memoryHeaps[i].size;
+    }
+
+    size_t scratch_mark = arena_mark(scratch);
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queue_family_count, NULL);
+    VkQueueFamilyProperties* queue_props = arena_alloc_array(scratch, VkQueueFamilyProperties, queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queue_family_count, queue_props);
+
+    uint32_t graphics = queue_family_with_flags(queue_props, queue_family_count, VK_QUEUE_GRAPHICS_BIT, 0) != -1;
+    uint32_t present = 0;
+
+    for (uint32_t i = 0; i < queue_family_count; ++i)
+    {
+        VkBool32 supported = VK_FALSE;
+
+        if (vkGetPhysicalDeviceSurfaceSupportKHR(gpu, i, surface, &supported) == VK_SUCCESS && supported)
+            present = 1;
+    }
+
+    s->dedicated_transfer = queue_family_with_flags(queue_props, queue_family_count, VK_QUEUE_TRANSFER_BIT, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT) != -1;
+    s->dedicated_compute = queue_family_with_flags(queue_props, queue_family_count, VK_QUEUE_COMPUTE_BIT, VK_QUEUE_GRAPHICS_BIT) != -1;
+    arena_rewind(scratch, scratch_mark);
+
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(gpu, &features);
+    s->feature_count = features.occlusionQueryPrecise + features.pipelineStatisticsQuery + features.samplerAnisotropy
+                       + features.multiDrawIndirect + (s->properties.apiVersion >= VK_API_VERSION_1_2);
+
+    s->usable = graphics && present && device_extension_supported(gpu, VK_KHR_SWAPCHAIN_EXTENSION_NAME, scratch);
+
+    if (!s->usable)
+        return;
+
+    VkPhysicalDeviceType type = s->properties.deviceType;
+    s->score = (type <= VK_PHYSICAL_DEVICE_TYPE_CPU ? g_gpu_type_rank[type] : 0) * 1e6
+               + s->device_local_bytes / (1024.0 * 1024.0)
+               + s->dedicated_transfer * 1000 + s->dedicated_compute * 500 + s->feature_count * 250;
+
+    if (type == c->gpu_type)
+        s->score += 1e9;
+}
+
+static const char* gpu_type_name(VkPhysicalDeviceType type)
+{
+    return type <= VK_PHYSICAL_DEVICE_TYPE_CPU ? g_gpu_type_names[type] : "unknown";
+}
+
+// The process exits with this when the GPU asked for with --gpu, or every GPU, can't present to the window.
+#define EXIT_GPU_UNUSABLE 2
+
+// The GPU asked for by index, otherwise the usable one with the highest score. Returns -1 if that GPU isn't usable
+// or there is none.
+uint32_t select_physical_device(const VkPhysicalDevice* gpus, uint32_t gpu_count, VkSurfaceKHR surface, const app_config_t* c, arena_t* scratch)
+{
+    size_t scratch_mark = arena_mark(scratch);
+    gpu_score_t* scores = arena_alloc_array(scratch, gpu_score_t, gpu_count);
+    uint32_t best = -1;
+
+    for (uint32_t i = 0; i < gpu_count; ++i)
+    {
+        gpu_score_t* s = &scores[i];
+        score_physical_device(s, gpus[i], surface, c, scratch);
+
+        if (c->verbose)
+            printf("gpu %u: %s (%s), %.0f MiB device local, score %.0f%s\n", i, s->properties.deviceName, gpu_type_name(s->properties.deviceType),
+                   s->device_local_bytes / (1024.0 * 1024.0), s->score, s->usable ? "" : ", can't present to the window");
+
+        if (s->usable && (best == -1 || s->score > scores[best].score))
+            best = i;
+    }
+
+    uint32_t selected = best;
+
+    if (c->gpu_index != -1)
+    {
+        if (c->gpu_index < gpu_count)
+            selected = c->gpu_index;
+        else
+            printf("there is no gpu %u\n", c->gpu_index);
+    }
+
+    if (selected == -1)
+        printf("no gpu can present to the window\n");
+    else if (!scores[selected].usable)
+    {
+        printf("gpu %u: %s can't present to the window, it needs VK_KHR_swapchain, a graphics queue and a queue that "
+               "presents to the surface\n", selected, scores[selected].properties.deviceName);
+        selected = -1;
+    }
+    else if (c->verbose)
+        printf("using gpu %u: %s\n", selected, scores[selected].properties.deviceName);
+
+    arena_rewind(scratch, scratch_mark);
+    return selected;
+}
+
+static double json_number(const char* json, const char* key)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char* p = strstr(json, pattern);
+    return p ? strtod(p + strlen(pattern), NULL) : 0.0;
+}
+
+static void json_write_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+
+        fputc(*s, f);
+    }
+
+    fputc('"', f);
+}
+
+// --bench-all-gpus runs the benchmark once per GPU, each in a child process started with the same arguments plus
+// --gpu <index>, since a process that has created a device can't cleanly start over on another one. Each child
+// writes its own bench JSON, which are collected in a table and, with --bench-json, in one JSON file. Returns the
+// exit code of the process.
+int bench_all_gpus(const app_config_t* c, int argc, char** argv, arena_t* arena)
+{
+    VkApplicationInfo app_info = {};
+    app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    app_info.pApplicationName = "VulkanTest";
+    app_info.apiVersion = VK_API_VERSION_1_0;
+
+    VkInstanceCreateInfo instance_info = {};
+    instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instance_info.pApplicationInfo = &app_info;
+
+    VkInstance instance;
+    VkResult res = vkCreateInstance(&instance_info, &g_vk_allocator, &instance);
+    assert(res == VK_SUCCESS);
+
+    uint32_t gpu_count = 0;
+    res = vkEnumeratePhysicalDevices(instance, &gpu_count, NULL);
+    assert(res == VK_SUCCESS);
+    VkPhysicalDevice* gpus = arena_alloc_array(arena, VkPhysicalDevice, gpu_count);
+    res = vkEnumeratePhysicalDevices(instance, &gpu_count, gpus);
+    assert(res == VK_SUCCESS);
+    VkPhysicalDeviceProperties* props = arena_alloc_array(arena, VkPhysicalDeviceProperties, gpu_count);
+
+    for (uint32_t i = 0; i < gpu_count; ++i)
+        vkGetPhysicalDeviceProperties(gpus[i], &props[i]);
+
+    vkDestroyInstance(instance, &g_vk_allocator);
+
+    const char* base = c->bench_json ? c->bench_json : "bench";
+    int* exit_codes = arena_alloc_array(arena, int, gpu_count);
+    double* ms_per_frame = arena_alloc_array(arena, double, gpu_count);
+    double* samples_per_pixel = arena_alloc_array(arena, double, gpu_count);
+    char** child_argv = arena_alloc_array(arena, char*, argc + 6);
+    double fastest = 0;
+
+    for (uint32_t i = 0; i < gpu_count; ++i)
+    {
+        char gpu_arg[16];
+        char json_path[512];
+        snprintf(gpu_arg, sizeof(gpu_arg), "%u", i);
+        snprintf(json_path, sizeof(json_path), "%s.gpu%u.json", base, i);
+        remove(json_path);
+
+        // Later options override earlier ones, so appending is enough.
+        memcpy(child_argv, argv, sizeof(char*) * argc);
+        child_argv[argc + 0] = "--no-bench-all-gpus";
+        child_argv[argc + 1] = "--gpu";
+        child_argv[argc + 2] = gpu_arg;
+        child_argv[argc + 3] = "--bench-json";
+        child_argv[argc + 4] = json_path;
+        child_argv[argc + 5] = NULL;
+
+        printf("bench: gpu %u, %s\n", i, props[i].deviceName);
+        fflush(stdout);
+        pid_t pid = fork();
+
+        if (pid == 0)
+        {
+            execv("/proc/self/exe", child_argv);
+            _exit(127);
+        }
+
+        int status = 0;
+        exit_codes[i] = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        ms_per_frame[i] = 0;
+        samples_per_pixel[i] = 0;
+
+        size_t mark = arena_mark(arena);
+        file_data_t json;
+
+        if (exit_codes[i] == 0 && file_load(json_path, &json, arena) == FILE_LOAD_SUCCESS)
+        {
+            char* text = arena_alloc(arena, json.size + 1, 1);
+            memcpy(text, json.data, json.size);
+            text[json.size] = '\0';
+            ms_per_frame[i] = json_number(text, "ms_per_frame");
+            const char* scene = strstr(text, "\"scene\"");
+            samples_per_pixel[i] = scene ? json_number(scene, "samples_passed_per_pixel") : 0.0;
+
+            if (ms_per_frame[i] > 0 && (fastest == 0 || ms_per_frame[i] < fastest))
+                fastest = ms_per_frame[i];
+        }
+
+        arena_rewind(arena, mark);
+    }
+
+    printf("bench: %-4s %-40s %-11s %10s %9s %14s\n", "gpu", "name", "type", "ms/frame", "relative", "samples/pixel");
+
+    for (uint32_t i = 0; i < gpu_count; ++i)
+    {
+        if (ms_per_frame[i] > 0)
+        {
+            printf("bench: %-4u %-40s %-11s %10.3f %8.2fx %14.3f\n", i, props[i].deviceName, gpu_type_name(props[i].deviceType),
+                   ms_per_frame[i], ms_per_frame[i] / fastest, samples_per_pixel[i]);
+        }
+        else if (exit_codes[i] == EXIT_GPU_UNUSABLE)
+            printf("bench: %-4u %-40s %-11s skipped, can't present to the window\n", i, props[i].deviceName, gpu_type_name(props[i].deviceType));
+        else
+            printf("bench: %-4u %-40s %-11s failed with exit code %d\n", i, props[i].deviceName, gpu_type_name(props[i].deviceType), exit_codes[i]);
+    }
+
+    if (c->bench_json)
+    {
+        FILE* f = fopen(c->bench_json, "w");
+
+        if (f == NULL)
+        {
+            printf("bench: couldn't write %s\n", c->bench_json);
+            return 1;
+        }
+
+        fprintf(f, "{\n  \"gpus\": [\n");
+
+        for (uint32_t i = 0; i < gpu_count; ++i)
+        {
+            fprintf(f, "    {\"index\": %u, \"name\": ", i);
+            json_write_string(f, props[i].deviceName);
+            fprintf(f, ", \"type\": \"%s\", \"exit_code\": %d, \"ms_per_frame\": %.6f, \"result\": \"%s.gpu%u.json\"}%s\n",
+                    gpu_type_name(props[i].deviceType), exit_codes[i], ms_per_frame[i], base, i, i + 1 < gpu_count ? "," : "");
+        }
+
+        fprintf(f, "  ]\n}\n");
+        fclose(f);
+    }
+
+    // GPUs that can't present to the window aren't failures, there just is nothing to benchmark on them.
+    for (uint32_t i = 0; i < gpu_count; ++i)
+    {
+        if (exit_codes[i] != 0 && exit_codes[i] != EXIT_GPU_UNUSABLE)
+            return 1;
+    }
+
+    return 0;
+}
+
+#define UPLOAD_TEST_BUFFER_SIZE (256 * 1024)
+
+// --upload-test: a load test for the upload service, not part of the scene. Worker threads fill buffers and queue
+// them while frames keep going. Once ready they stay resident without ever being drawn, so they are the first
+// thing evicted when a heap runs over budget.
+typedef struct
+{
+    VkDevice device;
+    upload_request_t request;
+    gpu_resident_t resident;
+    uint32_t done;
+} upload_test_buffer_t;
+
+typedef struct
+{
+    upload_service_t* service;
+    upload_test_buffer_t* buffers;
+    uint8_t* data;
+    uint32_t first;
+    uint32_t count;
+} upload_test_fill_task_t;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t pending;
+    uint32_t task_count;
+    upload_test_buffer_t* buffers;
+    upload_test_fill_task_t* fill_tasks;
+    task_t* tasks;
+    uint8_t* data;
+    uint64_t start_ns;
+} upload_test_t;
+
+static void upload_test_fill(void* data)
+{
+    upload_test_fill_task_t* t = data;
+
+    for (uint32_t i = t->first; i < t->first + t->count; ++i)
+    {
+        uint8_t* d = t->data + (size_t)i * UPLOAD_TEST_BUFFER_SIZE;
+
+        for (uint32_t j = 0; j < UPLOAD_TEST_BUFFER_SIZE; ++j)
+            d[j] = (uint8_t)(i * 31 + j);
+
+        upload_request_t* r = &t->buffers[i].request;
+        r->data = d;
+        r->size = UPLOAD_TEST_BUFFER_SIZE;
+        r->buffer_usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+        upload_service_enqueue(t->service, r);
+    }
+}
+
+static void upload_test_evict(void* data)
+{
+    upload_test_buffer_t* b = data;
+    vkDestroyBuffer(b->device, b->request.buffer, &g_vk_allocator);
+    b->request.buffer = VK_NULL_HANDLE;
+}
+
+// Splits count buffers over at most one fill task per worker thread. A count of 0 leaves the test idle.
+void upload_test_start(upload_test_t* t, uint32_t count, VkDevice device, upload_service_t* service, thread_pool_t* pool, arena_t* arena)
+{
+    memset(t, 0, sizeof(upload_test_t));
+    t->count = count;
+    t->pending = count;
+    t->task_count = count < pool->thread_count ? count : pool->thread_count;
+    t->start_ns = time_now_ns();
+
+    if (count == 0)
+        return;
+
+    t->buffers = arena_alloc_array(arena, upload_test_buffer_t, count);
+    t->fill_tasks = arena_alloc_array(arena, upload_test_fill_task_t, t->task_count);
+    t->tasks = arena_alloc_array(arena, task_t, t->task_count);
+    memset(t->buffers, 0, count * sizeof(upload_test_buffer_t));
+    t->data = malloc((size_t)count * UPLOAD_TEST_BUFFER_SIZE);
+    assert(t->data);
+
+    for (uint32_t i = 0; i < count; ++i)
+        t->buffers[i].device = device;
+
+    for (uint32_t i = 0; i < t->task_count; ++i)
+    {
+        upload_test_fill_task_t* f = &t->fill_tasks[i];
+        f->service = service;
+        f->buffers = t->buffers;
+        f->data = t->data;
+        f->first = (uint64_t)count * i / t->task_count;
+        f->count = (uint64_t)count * (i + 1) / t->task_count - f->first;
+        task_init(&t->tasks[i], "upload test fill", upload_test_fill, f);
+        thread_pool_submit(pool, &t->tasks[i]);
+    }
+}
+
+// Called once per frame, makes finished buffers resident and frees the source data once all of them are done.
+void upload_test_poll(upload_test_t* t, gpu_memory_t* gpu_memory, uint64_t frame_index)
+{
+    if (t->pending == 0)
+        return;
+
+    for (uint32_t i = 0; i < t->count; ++i)
+    {
+        upload_test_buffer_t* b = &t->buffers[i];
+        uint32_t state = upload_request_state(&b->request);
+
+        if (b->done || state == UPLOAD_QUEUED)
+            continue;
+
+        b->done = 1;
+        --t->pending;
+
+        if (state == UPLOAD_READY)
+            gpu_memory_make_resident(gpu_memory, &b->resident, &b->request.memory, upload_test_evict, b);
+    }
+
+    if (t->pending == 0)
+    {
+        printf("upload test: %u buffers, %.1f MB ready after %llu frames, %.2f ms\n", t->count,
+               (double)t->count * UPLOAD_TEST_BUFFER_SIZE / 1048576.0, (unsigned long long)frame_index,
+               (time_now_ns() - t->start_ns) / 1e6);
+        free(t->data);
+        t->data = NULL;
+    }
+}
+
+// The fill tasks enqueue on the upload service, so they have to finish before it is destroyed.
+void upload_test_wait(upload_test_t* t, thread_pool_t* pool)
+{
+    for (uint32_t i = 0; i < t->task_count; ++i)
+        task_wait(pool, &t->tasks[i]);
+}
+
+// The device must be idle.
+void upload_test_destroy(upload_test_t* t, gpu_memory_t* gpu_memory)
+{
+    for (uint32_t i = 0; i < t->count; ++i)
+    {
+        upload_test_buffer_t* b = &t->buffers[i];
+        vkDestroyBuffer(b->device, b->request.buffer, &g_vk_allocator);
+
+        if (b->done)
+            gpu_memory_free_resident(gpu_memory, &b->resident);
+        else
+            gpu_memory_free(gpu_memory, &b->request.memory);
+    }
+
+    free(t->data);
+}
+
+// Highest sample count up to requested that both color and depth attachments support.
+VkSampleCountFlagBits supported_sample_count(const VkPhysicalDeviceLimits* limits, uint32_t requested)
+{
+    VkSampleCountFlags supported = limits->framebufferColorSampleCounts & limits->framebufferDepthSampleCounts;
+    uint32_t samples = VK_SAMPLE_COUNT_64_BIT;
+
+    while (samples > VK_SAMPLE_COUNT_1_BIT && (samples > requested || !(supported & samples)))
+        samples >>= 1;
+
+    return samples;
+}
+
+int main(int argc, char** argv)
+{
+    // Everything allocated during startup that lives until shutdown comes out of startup_arena. Per-frame scratch
+    // comes out of frame_arenas[frame_slot], which is reset when the slot is reused, so scratch data of the
+    // previous frame stays readable for one more frame.
+    #define STARTUP_ARENA_SIZE (4 * 1024 * 1024)
+    #define FRAME_ARENA_SIZE (1024 * 1024)
+    arena_t startup_arena;
+    arena_create(&startup_arena, STARTUP_ARENA_SIZE);
+
+    app_config_t config;
+    config_defaults(&config);
+
+    if (argc > 1 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0))
+    {
+        config_print_help();
+        return 0;
+    }
+
+    if (!config_parse_args(&config, argv + 1, argc - 1, &startup_arena))
+        return 1;
+
+    if (config.capture.directory && config.capture.stream_target)
+    {
+        printf("--capture and --stream can't be combined\n");
+        return 1;
+    }
+
+    if (config.window_width == 0 || config.window_width > UINT16_MAX || config.window_height == 0 || config.window_height > UINT16_MAX
+        || config.near_plane <= 0 || config.far_plane <= config.near_plane || config.fov <= 0 || config.fov >= 180)
+    {
+        printf("bad window size or projection\n");
+        return 1;
+    }
+
+    if (config.window_count == 0 || config.window_count > MAX_WINDOWS)
+    {
+        printf("--windows must be 1 to %u\n", MAX_WINDOWS);
+        return 1;
+    }
+
+    if (config.procedural_resolution == 0)
+    {
+        printf("--procedural-resolution must be at least 1\n");
+        return 1;
+    }
+
+    if (config.bench_all_gpus)
+    {
+        if (config.bench_frames == 0)
+        {
+            printf("--bench-all-gpus needs --bench <n>\n");
+            return 1;
+        }
+
+        return bench_all_gpus(&config, argc, argv, &startup_arena);
+    }
+
+    g_fov = config.fov;
+    g_near_plane = config.near_plane;
+    g_far_plane = config.far_plane;
+
+    const capture_config_t capture_config = config.capture;
+    const uint32_t depth_prepass = config.depth_prepass;
+    const uint32_t lod_instances = config.lod_instances;
+    bench_t bench = {};
+    bench.frames_requested = config.bench_frames;
+    bench.json_path = config.bench_json;
+
+    uint32_t capture_enabled = capture_config.directory || capture_config.stream_target;
+
+    startup_timeline_t startup_timeline = {};
+    startup_timeline.origin_ns = time_now_ns();
+
+#ifdef XCB_VULKAN_TRACE
+    if (config.trace)
+        trace_create();
+#else
+    if (config.trace)
+        printf("--trace needs a build with -DXCB_VULKAN_TRACE, ignored\n");
+#endif
+
+    thread_pool_t thread_pool;
+    thread_pool_create(&thread_pool, 0);
+
+    // Startup work that doesn't need Vulkan objects from the main thread runs as tasks. Reading the SPIR-V, which only
+    // happens with --shader-dir, and connecting to X don't depend on anything, so they start before the instance is
+    // created. Which of the two vertex shaders is used depends on the device, both are read.
+    shader_task_t vertex_shader_task;
+    shader_task_t bindless_vertex_shader_task;
+    shader_task_t fragment_shader_task;
+    shader_task_t procedural_shader_task;
+    shader_task_init(&vertex_shader_task, "vertex_shader.spv", g_vertex_shader_spv, sizeof(g_vertex_shader_spv), config.shader_dir);
+    shader_task_init(&bindless_vertex_shader_task, "vertex_shader_bindless.spv", g_vertex_shader_bindless_spv,
+                     sizeof(g_vertex_shader_bindless_spv), config.shader_dir);
+    shader_task_init(&fragment_shader_task, "fragment_shader.spv", g_fragment_shader_spv, sizeof(g_fragment_shader_spv), config.shader_dir);
+    thread_pool_submit(&thread_pool, &vertex_shader_task.load_task);
+    thread_pool_submit(&thread_pool, &bindless_vertex_shader_task.load_task);
+    thread_pool_submit(&thread_pool, &fragment_shader_task.load_task);
+
+    // build.py leaves the compute shader out when it can't compile it, see shader_embedded.
+    const uint32_t procedural_shader_built = config.shader_dir || shader_embedded(g_procedural_geometry_spv);
+    if (config.procedural != PROCEDURAL_NONE && !procedural_shader_built)
+        printf("procedural: procedural_geometry.spv wasn't built, build.py needs glslangValidator for it, drawing the mesh\n");
+    const procedural_kind_e procedural_kind = procedural_shader_built ? config.procedural : PROCEDURAL_NONE;
+    shader_task_init(&procedural_shader_task, "procedural_geometry.spv", g_procedural_geometry_spv,
+                     sizeof(g_procedural_geometry_spv), config.shader_dir);
+    if (procedural_kind != PROCEDURAL_NONE)
+        thread_pool_submit(&thread_pool, &procedural_shader_task.load_task);
+
+    x_window_t x_window = {};
+    x_window.width = config.window_width;
+    x_window.height = config.window_height;
+    x_window.count = config.window_count;
+    task_t x_window_task;
+    task_init(&x_window_task, "x connection and window", open_x_window, &x_window);
+    thread_pool_submit(&thread_pool, &x_window_task);
+
+    mesh_task_t mesh_task = {};
+    mesh_task.subdivisions = lod_instances > 0 ? LOD_SPHERE_SUBDIVISIONS : 0;
+    task_t build_mesh_task;
+    task_init(&build_mesh_task, "mesh and LODs", build_mesh, &mesh_task);
+    if (procedural_kind == PROCEDURAL_NONE)
+        thread_pool_submit(&thread_pool, &build_mesh_task);
+
+    uint32_t instance_phase = startup_phase_begin(&startup_timeline, "instance");
+
+    VkApplicationInfo app_info = {};
+    app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    app_info.pApplicationName = "VulkanTest";
+    app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+
+    // Ask for up to 1.3 when the loader has it so devices that support it expose timeline semaphores, dynamic
+    // rendering and synchronization2 as core. A 1.0 loader doesn't have vkEnumerateInstanceVersion and may reject
+    // anything above 1.0.
+    uint32_t instance_api_version = VK_API_VERSION_1_0;
+    PFN_vkEnumerateInstanceVersion enumerate_instance_version = (PFN_vkEnumerateInstanceVersion)vkGetInstanceProcAddr(NULL, "vkEnumerateInstanceVersion");
+    if (enumerate_instance_version)
+        enumerate_instance_version(&instance_api_version);
+    app_info.apiVersion = instance_api_version >= VK_API_VERSION_1_3 ? VK_API_VERSION_1_3 : instance_api_version;
+
+    VkInstanceCreateInfo instance_info = {};
+    instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instance_info.pApplicationInfo = &app_info;
+
+    // The validation layer and the debug messenger cost a lot of CPU time per call, so performance runs turn them off
+    // with --no-validation. Asking for a layer that isn't installed fails instance creation, so check first.
+    const char* validation_layers[] = {"VK_LAYER_KHRONOS_validation"};
+    uint32_t validation = config.validation;
+
+    if (validation)
+    {
+        size_t scratch_mark = arena_mark(&startup_arena);
+        uint32_t layer_count = 0;
+        vkEnumerateInstanceLayerProperties(&layer_count, NULL);
+        VkLayerProperties* layers = arena_alloc_array(&startup_arena, VkLayerProperties, layer_count);
+        vkEnumerateInstanceLayerProperties(&layer_count, layers);
+        validation = 0;
+
+        for (uint32_t i = 0; i < layer_count; ++i)
+        {
+            if (strcmp(layers[i].layerName, validation_layers[0]) == 0)
+                validation = 1;
+        }
+
+        if (!validation)
+            printf("%s isn't installed, running without validation\n", validation_layers[0]);
+
+        arena_rewind(&startup_arena, scratch_mark);
+    }
+
+    const char* const extensions[] = {VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_XCB_SURFACE_EXTENSION_NAME, VK_EXT_DEBUG_UTILS_EXTENSION_NAME};
+    instance_info.ppEnabledExtensionNames = extensions;
+    instance_info.enabledExtensionCount = validation ? 3 : 2;
+
+    VkDebugUtilsMessengerCreateInfoEXT debug_ext_ci = {};
+    debug_ext_ci.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+    debug_ext_ci.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+    debug_ext_ci.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+    debug_ext_ci.pfnUserCallback = vulkan_debug_callback;
+
+    if (config.validation_verbose)
+        debug_ext_ci.messageSeverity |= VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT;
+
+    if (validation)
+    {
+        instance_info.ppEnabledLayerNames = validation_layers;
+        instance_info.enabledLayerCount = 1;
+        instance_info.pNext = &debug_ext_ci;
+    }
+
+    VkInstance instance;
+    VkResult res;
+    res = vkCreateInstance(&instance_info, &g_vk_allocator, &instance);
+    assert(res == VK_SUCCESS);
+
+    VkDebugUtilsMessengerEXT debug_messenger = VK_NULL_HANDLE;
+    typedef VkResult (*func_vkCreateDebugUtilsMessengerEXT)(VkInstance, const VkDebugUtilsMessengerCreateInfoEXT*, const VkAllocationCallbacks*, VkDebugUtilsMessengerEXT*);
+    typedef void (*func_vkDestroyDebugUtilsMessengerEXT)(VkInstance, VkDebugUtilsMessengerEXT, const VkAllocationCallbacks*);
+    func_vkCreateDebugUtilsMessengerEXT vkCreateDebugUtilsMessengerEXT = (func_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
+    func_vkDestroyDebugUtilsMessengerEXT vkDestroyDebugUtilsMessengerEXT = (func_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
+
+    if (validation)
+        vkCreateDebugUtilsMessengerEXT(instance, &debug_ext_ci, &g_vk_allocator, &debug_messenger);
+    startup_phase_end(&startup_timeline, instance_phase);
+
+    uint32_t device_phase = startup_phase_begin(&startup_timeline, "physical device and surface");
+
+    uint32_t gpus_count = 0;
+    res = vkEnumeratePhysicalDevices(instance, &gpus_count, NULL);
+    assert(res == VK_SUCCESS);
+    assert(gpus_count > 0);
+    VkPhysicalDevice* gpus = arena_alloc_array(&startup_arena, VkPhysicalDevice, gpus_count);
+    res = vkEnumeratePhysicalDevices(instance, &gpus_count, gpus);
+    assert(res == VK_SUCCESS);
+
+    task_wait(&thread_pool, &x_window_task);
+    xcb_connection_t* c = x_window.connection;
+
+    const uint32_t view_count = x_window.count;
+    view_t* views = arena_alloc_array(&startup_arena, view_t, view_count);
+    memset(views, 0, view_count * sizeof(view_t));
+
+    for (uint32_t i = 0; i < view_count; ++i)
+    {
+        VkXcbSurfaceCreateInfoKHR xcb_create_info = {};
+        xcb_create_info.sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR;
+        xcb_create_info.connection = c;
+        xcb_create_info.window = x_window.windows[i];
+
+        views[i].window = x_window.windows[i];
+        res = vkCreateXcbSurfaceKHR(instance, &xcb_create_info, &g_vk_allocator, &views[i].surface);
+        assert(res == VK_SUCCESS);
+    }
+
+    // Everything about the swapchain is picked for the first window, the others have to be able to do the same.
+    VkSurfaceKHR surface = views[0].surface;
+
+    // Picking the GPU needs the surface, since one that can't present to the window is no use.
+    uint32_t gpu_index = select_physical_device(gpus, gpus_count, surface, &config, &startup_arena);
+    if (gpu_index == -1)
+        return EXIT_GPU_UNUSABLE;
+    VkPhysicalDevice gpu = gpus[gpu_index];
+
+    VkPhysicalDeviceProperties gpu_properties;
+    vkGetPhysicalDeviceProperties(gpu, &gpu_properties);
+
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queue_family_count, NULL);
+    VkQueueFamilyProperties* queue_props = arena_alloc_array(&startup_arena, VkQueueFamilyProperties, queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queue_family_count, queue_props);
+
+    VkBool32* queue_present_support = arena_alloc_array(&startup_arena, VkBool32, queue_family_count);
+    for (uint32_t i = 0; i < queue_family_count; ++i)
+    {
+        VkResult rr = vkGetPhysicalDeviceSurfaceSupportKHR(gpu, i, surface, &queue_present_support[i]);
+        assert(rr == VK_SUCCESS);
+    }
+
+    uint32_t graphics_queue_idx = -1;
+    uint32_t present_queue_idx = -1;
+    for (uint32_t i = 0; i < queue_family_count; ++i)
+    {
+        if (queue_props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
+        {
+            graphics_queue_idx = i;
+
+            if (queue_present_support[i] == VK_TRUE)
+            {
+                present_queue_idx = i;
+                break;
+            }
+        }
+    }
+
+    assert(graphics_queue_idx != -1);
+
+    if (present_queue_idx == -1)
+    {
+        for (uint32_t i = 0; i < queue_family_count; ++i)
+        {
+            if (queue_present_support[i] == VK_TRUE)
+            {
+                present_queue_idx = i;
+                break;
+            }
+        }
+    }
+
+    assert(present_queue_idx != -1);
+
+    // A single vkQueuePresentKHR presents to every window, so they all need the first window's present family.
+    for (uint32_t i = 1; i < view_count; ++i)
+    {
+        VkBool32 supported = VK_FALSE;
+        res = vkGetPhysicalDeviceSurfaceSupportKHR(gpu, present_queue_idx, views[i].surface, &supported);
+        assert(res == VK_SUCCESS);
+        assert(supported == VK_TRUE);
+    }
+
+    // Prefer families that do nothing but transfer / compute, those map to the DMA engines and async compute
+    // units on discrete GPUs. Fall back to anything without graphics, and finally to the graphics family itself.
+    uint32_t transfer_queue_idx = queue_family_with_flags(queue_props, queue_family_count, VK_QUEUE_TRANSFER_BIT, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT);
+    if (transfer_queue_idx == -1)
+        transfer_queue_idx = queue_family_with_flags(queue_props, queue_family_count, VK_QUEUE_TRANSFER_BIT, VK_QUEUE_GRAPHICS_BIT);
+    if (transfer_queue_idx == -1)
+        transfer_queue_idx = graphics_queue_idx;
+
+    uint32_t compute_queue_idx = queue_family_with_flags(queue_props, queue_family_count, VK_QUEUE_COMPUTE_BIT, VK_QUEUE_GRAPHICS_BIT);
+    if (compute_queue_idx == -1)
+        compute_queue_idx = graphics_queue_idx;
+
+    if (config.verbose)
+        printf("queue families: graphics %u, present %u, transfer %u, compute %u\n", graphics_queue_idx, present_queue_idx, transfer_queue_idx, compute_queue_idx);
+
+    uint32_t unique_queue_families[4];
+    uint32_t unique_queue_family_count = 0;
+    uint32_t wanted_queue_families[] = {graphics_queue_idx, present_queue_idx, transfer_queue_idx, compute_queue_idx};
+
+    for (uint32_t i = 0; i < sizeof(wanted_queue_families)/sizeof(wanted_queue_families[0]); ++i)
+    {
+        uint32_t already_added = 0;
+        for (uint32_t j = 0; j < unique_queue_family_count; ++j)
+        {
+            if (unique_queue_families[j] == wanted_queue_families[i])
+                already_added = 1;
+        }
+
+        if (!already_added)
+            unique_queue_families[unique_queue_family_count++] = wanted_queue_families[i];
+    }
+
+    float queue_priorities[] = {0.0};
+    VkDeviceQueueCreateInfo queue_infos[4];
+    memset(queue_infos, 0, sizeof(queue_infos));
+
+    for (uint32_t i = 0; i < unique_queue_family_count; ++i)
+    {
+        queue_infos[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queue_infos[i].queueFamilyIndex = unique_queue_families[i];
+        queue_infos[i].queueCount = 1;
+        queue_infos[i].pQueuePriorities = queue_priorities;
+    }
+
+    VkDeviceCreateInfo device_info = {};
+    device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_info.queueCreateInfoCount = unique_queue_family_count;
+    device_info.pQueueCreateInfos = queue_infos;
+    const char* device_extensions[4] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    device_info.ppEnabledExtensionNames = device_extensions;
+    device_info.enabledExtensionCount = 1;
+
+    VkPhysicalDeviceFeatures supported_features;
+    vkGetPhysicalDeviceFeatures(gpu, &supported_features);
+
+    // Without precise occlusion queries the sample counts used for the overdraw numbers may just be 0 or 1.
+    VkPhysicalDeviceFeatures enabled_features = {};
+    enabled_features.occlusionQueryPrecise = bench.frames_requested > 0 && supported_features.occlusionQueryPrecise;
+    enabled_features.pipelineStatisticsQuery = bench.frames_requested > 0 && supported_features.pipelineStatisticsQuery;
+    device_info.pEnabledFeatures = &enabled_features;
+
+    // Timeline semaphores are core in 1.2 and available as VK_KHR_timeline_semaphore on 1.1. Querying the
+    // feature needs vkGetPhysicalDeviceFeatures2, so 1.0 instances always use the fence fallback.
+    uint32_t use_timeline_semaphores = 0;
+    const char* timeline_function_suffix = "";
+    uint32_t device_api_version = gpu_properties.apiVersion < app_info.apiVersion ? gpu_properties.apiVersion : app_info.apiVersion;
+    uint32_t timeline_semaphore_core = device_api_version >= VK_API_VERSION_1_2;
+    uint32_t timeline_semaphore_extension = !timeline_semaphore_core && device_api_version >= VK_API_VERSION_1_1 && device_extension_supported(gpu, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, &startup_arena);
+
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features = {};
+    timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+
+    if (timeline_semaphore_core || timeline_semaphore_extension)
+    {
+        VkPhysicalDeviceFeatures2 features2 = {};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &timeline_features;
+        vkGetPhysicalDeviceFeatures2(gpu, &features2);
+        use_timeline_semaphores = timeline_features.timelineSemaphore;
+    }
+
+    if (use_timeline_semaphores)
+    {
+        timeline_features.pNext = (void*)device_info.pNext;
+        device_info.pNext = &timeline_features;
+
+        if (timeline_semaphore_extension)
+        {
+            device_extensions[device_info.enabledExtensionCount++] = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+            timeline_function_suffix = "KHR";
+        }
+    }
+
+    if (config.verbose)
+        printf("frame synchronization: %s\n", use_timeline_semaphores ? "timeline semaphores" : "fences");
+
+    // Dynamic rendering and synchronization2 are only used as core 1.3 features, anything older records the
+    // render graph with render passes and vkCmdPipelineBarrier.
+    uint32_t use_dynamic_rendering = 0;
+    VkPhysicalDeviceVulkan13Features vulkan13_features = {};
+    vulkan13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+
+    if (config.dynamic_rendering && device_api_version >= VK_API_VERSION_1_3)
+    {
+        VkPhysicalDeviceFeatures2 features2 = {};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &vulkan13_features;
+        vkGetPhysicalDeviceFeatures2(gpu, &features2);
+        use_dynamic_rendering = vulkan13_features.dynamicRendering && vulkan13_features.synchronization2;
+    }
+
+    if (use_dynamic_rendering)
+    {
+        // Only enable the two features that are used, not everything the query returned.
+        memset(&vulkan13_features, 0, sizeof(vulkan13_features));
+        vulkan13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+        vulkan13_features.dynamicRendering = VK_TRUE;
+        vulkan13_features.synchronization2 = VK_TRUE;
+        vulkan13_features.pNext = (void*)device_info.pNext;
+        device_info.pNext = &vulkan13_features;
+    }
+
+    if (config.verbose)
+        printf("rendering: %s\n", use_dynamic_rendering ? "dynamic rendering, synchronization2" : "render passes");
+
+    // Bindless descriptors use the core 1.2 descriptor indexing features and a vertex shader build.py may have left
+    // out, without them every instance binds the dynamic uniform buffer at its own offset.
+    uint32_t use_bindless = 0;
+    VkPhysicalDeviceDescriptorIndexingFeatures indexing_features = {};
+    indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+    VkPhysicalDeviceDescriptorIndexingProperties indexing_properties = {};
+    indexing_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES;
+
+    uint32_t bindless_shader_built = config.shader_dir || shader_embedded(g_vertex_shader_bindless_spv);
+    if (config.bindless && !bindless_shader_built && config.verbose)
+        printf("bindless: vertex_shader_bindless.spv wasn't built, build.py needs glslangValidator for it\n");
+
+    if (config.bindless && bindless_shader_built && device_api_version >= VK_API_VERSION_1_2)
+    {
+        VkPhysicalDeviceFeatures2 features2 = {};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &indexing_features;
+        vkGetPhysicalDeviceFeatures2(gpu, &features2);
+        use_bindless = supported_features.shaderStorageBufferArrayDynamicIndexing && indexing_features.runtimeDescriptorArray
+                       && indexing_features.descriptorBindingPartiallyBound && indexing_features.descriptorBindingStorageBufferUpdateAfterBind
+                       && indexing_features.descriptorBindingSampledImageUpdateAfterBind;
+    }
+
+    if (use_bindless)
+    {
+        VkPhysicalDeviceProperties2 properties2 = {};
+        properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties2.pNext = &indexing_properties;
+        vkGetPhysicalDeviceProperties2(gpu, &properties2);
+
+        memset(&indexing_features, 0, sizeof(indexing_features));
+        indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+        indexing_features.runtimeDescriptorArray = VK_TRUE;
+        indexing_features.descriptorBindingPartiallyBound = VK_TRUE;
+        indexing_features.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+        indexing_features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+        indexing_features.pNext = (void*)device_info.pNext;
+        device_info.pNext = &indexing_features;
+        enabled_features.shaderStorageBufferArrayDynamicIndexing = VK_TRUE;
+        enabled_features.shaderSampledImageArrayDynamicIndexing = supported_features.shaderSampledImageArrayDynamicIndexing;
+    }
+
+    if (config.verbose)
+        printf("descriptors: %s\n", use_bindless ? "bindless" : "dynamic uniform buffer");
+
+    // The budget is read with vkGetPhysicalDeviceMemoryProperties2, which is core in 1.1.
+    uint32_t use_memory_budget = device_api_version >= VK_API_VERSION_1_1
+                                 && device_extension_supported(gpu, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, &startup_arena);
+
+    if (use_memory_budget)
+        device_extensions[device_info.enabledExtensionCount++] = VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+
+#ifdef XCB_VULKAN_TRACE
+    // GPU pass times are put on the CPU clock with calibrated timestamps when CLOCK_MONOTONIC, what time_now_ns
+    // reads, is one of the domains. Without them trace_gpu_collect estimates the offset.
+    uint32_t use_calibrated_timestamps = 0;
+    uint32_t trace_gpu_enabled = config.trace && queue_props[graphics_queue_idx].timestampValidBits > 0;
+
+    if (trace_gpu_enabled && device_extension_supported(gpu, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME, &startup_arena))
+    {
+        PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT get_time_domains =
+            (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT");
+        uint32_t time_domain_count = 0;
+
+        if (get_time_domains && get_time_domains(gpu, &time_domain_count, NULL) == VK_SUCCESS)
+        {
+            VkTimeDomainEXT* time_domains = arena_alloc_array(&startup_arena, VkTimeDomainEXT, time_domain_count);
+            res = get_time_domains(gpu, &time_domain_count, time_domains);
+            assert(res == VK_SUCCESS || res == VK_INCOMPLETE);
+
+            for (uint32_t i = 0; i < time_domain_count; ++i)
+                use_calibrated_timestamps |= time_domains[i] == VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+        }
+    }
+
+    if (use_calibrated_timestamps)
+        device_extensions[device_info.enabledExtensionCount++] = VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME;
+
+    if (config.trace)
+        printf("trace: %s\n", !trace_gpu_enabled ? "CPU only, no timestamps on the graphics queue"
+                                : use_calibrated_timestamps ? "calibrated GPU timestamps" : "estimated GPU clock offset");
+#endif
+
+    startup_phase_end(&startup_timeline, device_phase);
+
+    uint32_t create_device_phase = startup_phase_begin(&startup_timeline, "create device");
+
+    VkDevice device;
+    res = vkCreateDevice(gpu, &device_info, &g_vk_allocator, &device);
+    assert(res == VK_SUCCESS);
+
+    queue_timeline_t graphics_timeline;
+    queue_timeline_t transfer_timeline;
+    queue_timeline_create(&graphics_timeline, device, use_timeline_semaphores, timeline_function_suffix);
+    queue_timeline_create(&transfer_timeline, device, use_timeline_semaphores, timeline_function_suffix);
+
+    gpu_memory_t gpu_memory;
+    gpu_memory_init(&gpu_memory, gpu, device, use_memory_budget, config.memory_budget);
+
+    deletion_queue_t deletion_queue;
+    deletion_queue_create(&deletion_queue, device, &gpu_memory, &graphics_timeline);
+
+#ifdef XCB_VULKAN_TRACE
+    trace_gpu_t trace_gpu = {};
+
+    if (trace_gpu_enabled)
+    {
+        PFN_vkGetCalibratedTimestampsEXT get_calibrated_timestamps = NULL;
+
+        if (use_calibrated_timestamps)
+            get_calibrated_timestamps = (PFN_vkGetCalibratedTimestampsEXT)vkGetDeviceProcAddr(device, "vkGetCalibratedTimestampsEXT");
+
+        trace_gpu_create(&trace_gpu, device, gpu_properties.limits.timestampPeriod, queue_props[graphics_queue_idx].timestampValidBits,
+                         get_calibrated_timestamps);
+    }
+
+    uint64_t frame_submit_ns[MAX_FRAMES_IN_FLIGHT] = {};
+#endif
+    startup_phase_end(&startup_timeline, create_device_phase);
+
+    shader_task_t* scene_vertex_shader = use_bindless ? &bindless_vertex_shader_task : &vertex_shader_task;
+    shader_task_t* unused_vertex_shader = use_bindless ? &vertex_shader_task : &bindless_vertex_shader_task;
+    scene_vertex_shader->device = device;
+    fragment_shader_task.device = device;
+    task_depends_on(&thread_pool, &scene_vertex_shader->module_task, &scene_vertex_shader->load_task);
+    task_depends_on(&thread_pool, &fragment_shader_task.module_task, &fragment_shader_task.load_task);
+    thread_pool_submit(&thread_pool, &scene_vertex_shader->module_task);
+    thread_pool_submit(&thread_pool, &fragment_shader_task.module_task);
+    task_wait(&thread_pool, &unused_vertex_shader->load_task);
+    arena_destroy(&unused_vertex_shader->arena);
+
+    if (procedural_kind != PROCEDURAL_NONE)
+    {
+        procedural_shader_task.device = device;
+        task_depends_on(&thread_pool, &procedural_shader_task.module_task, &procedural_shader_task.load_task);
+        thread_pool_submit(&thread_pool, &procedural_shader_task.module_task);
+    }
+    else
+        arena_destroy(&procedural_shader_task.arena);
+
+    uint32_t swapchain_phase = startup_phase_begin(&startup_timeline, "swapchain and command pools");
+
+    uint32_t supported_surface_formats_count;
+    res = vkGetPhysicalDeviceSurfaceFormatsKHR(gpu, surface, &supported_surface_formats_count, NULL);
+    assert(res == VK_SUCCESS);
+    VkSurfaceFormatKHR* supported_surface_formats = arena_alloc_array(&startup_arena, VkSurfaceFormatKHR, supported_surface_formats_count);
+    res = vkGetPhysicalDeviceSurfaceFormatsKHR(gpu, surface, &supported_surface_formats_count, supported_surface_formats);
+    assert(res == VK_SUCCESS);
+
+    VkFormat format;
+    if (supported_surface_formats_count == 1 && supported_surface_formats[0].format == VK_FORMAT_UNDEFINED)
+    {
+        format = VK_FORMAT_R8G8B8A8_UNORM;
+    }
+    else
+    {
+        assert(supported_surface_formats_count >= 1);
+        format = supported_surface_formats[0].format;
+    }
+
+    VkSurfaceCapabilitiesKHR surface_capabilities;
+    res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(gpu, surface, &surface_capabilities);
+    assert(res == VK_SUCCESS);
+
+    VkExtent2D swapchain_extent = surface_capabilities.currentExtent; // check so this isn't 0xFFFFFFFF
+    assert(swapchain_extent.width != 0xFFFFFFFF);
+
+    VkPresentModeKHR swapchain_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+
+    uint32_t desired_num_swapchain_images = surface_capabilities.minImageCount;
+
+    VkSurfaceTransformFlagBitsKHR pre_transform;
+
+    if (surface_capabilities.supportedTransforms & VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR)
+        pre_transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+    else
+        pre_transform = surface_capabilities.currentTransform;
+
+    VkCompositeAlphaFlagBitsKHR composite_alpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+    VkCompositeAlphaFlagBitsKHR composite_alpha_flags[4] = {
+        VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+        VK_COMPOSITE_ALPHA_PRE_MULTIPLIED_BIT_KHR,
+        VK_COMPOSITE_ALPHA_POST_MULTIPLIED_BIT_KHR,
+        VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR,
+    };
+
+    for (uint32_t i = 0; i < sizeof(composite_alpha_flags)/sizeof(composite_alpha_flags[0]); ++i)
+    {
+        if (surface_capabilities.supportedCompositeAlpha & composite_alpha_flags[i])
+        {
+            composite_alpha = composite_alpha_flags[i];
+            break;
+        }
+    }
+
+    /*uint32_t present_mode_count;
+    res = vkGetPhysicalDeviceSurfacePresentModesKHR(gpu, surface, &present_mode_count, NULL);
+    assert(res == VK_SUCCESS);
+    VkPresentModeKHR* present_modes = malloc(present_mode_count * sizeof(VkPresentModeKHR));
+    res = vkGetPhysicalDeviceSurfacePresentModesKHR(gpu, surface, &present_mode_count, present_modes);
+    assert(res == VK_SUCCESS);*/
+
+    VkSwapchainCreateInfoKHR scci = {};
+    scci.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+    scci.surface = surface;
+    scci.minImageCount = desired_num_swapchain_images;
+    scci.imageFormat = format;
+    scci.imageExtent = swapchain_extent;
+    scci.preTransform = pre_transform;
+    scci.compositeAlpha = composite_alpha;
+    scci.imageArrayLayers = 1;
+    scci.presentMode = swapchain_present_mode;
+    scci.oldSwapchain = VK_NULL_HANDLE;
+    scci.clipped = 1;
+    scci.imageColorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
+    scci.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+
+    uint32_t capture_bgr = 0;
+    if (capture_enabled)
+    {
+        if (!(surface_capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) || !capture_format_supported(format, &capture_bgr))
+        {
+            printf("capture: swapchain images can't be copied from, capture disabled\n");
+            capture_enabled = 0;
+        }
+        else
+            scci.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
+
+    // Dynamic resolution blits the scene up to the swapchain image, with a linear filter where the format has one.
+    uint32_t use_dynamic_resolution = config.dynamic_resolution > 0.0f;
+    VkFilter upscale_filter = VK_FILTER_NEAREST;
+
+    if (use_dynamic_resolution)
+    {
+        VkFormatProperties format_props;
+        vkGetPhysicalDeviceFormatProperties(gpu, format, &format_props);
+        VkFormatFeatureFlags blit_features = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+
+        if (!(surface_capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+            || (format_props.optimalTilingFeatures & blit_features) != blit_features)
+        {
+            printf("dynamic resolution: swapchain images can't be blitted to, disabled\n");
+            use_dynamic_resolution = 0;
+        }
+        else if (queue_props[graphics_queue_idx].timestampValidBits == 0)
+        {
+            printf("dynamic resolution: no timestamps on the graphics queue, disabled\n");
+            use_dynamic_resolution = 0;
+        }
+        else
+        {
+            scci.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+            if (format_props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)
+                upscale_filter = VK_FILTER_LINEAR;
+        }
+    }
+    scci.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    uint32_t queue_family_indicies[] = {graphics_queue_idx, present_queue_idx};
+
+    if (queue_family_indicies[0] != queue_family_indicies[1])
+    {
+        scci.pQueueFamilyIndices = queue_family_indicies;
+        scci.queueFamilyIndexCount = 2;
+        scci.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+    }
+
+    VkQueue graphics_queue;
+    VkQueue present_queue;
+    vkGetDeviceQueue(device, graphics_queue_idx, 0, &graphics_queue);
+    if (graphics_queue_idx == present_queue_idx) {
+        present_queue = graphics_queue;
+    } else {
+        vkGetDeviceQueue(device, present_queue_idx, 0, &present_queue);
+    }
+
+    VkQueue transfer_queue;
+    VkQueue compute_queue;
+    vkGetDeviceQueue(device, transfer_queue_idx, 0, &transfer_queue);
+    vkGetDeviceQueue(device, compute_queue_idx, 0, &compute_queue);
+
+    // Only the first window is captured from and blitted to.
+    for (uint32_t i = 0; i < view_count; ++i)
+    {
+        view_create_swapchain(&views[i], gpu, device, &scci, &startup_arena);
+        scci.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    }
+
+    dynamic_resolution_t resolution = {};
+    if (use_dynamic_resolution)
+    {
+        dynamic_resolution_create(&resolution, swapchain_extent, config.dynamic_resolution, config.resolution_scale[0],
+                                  config.resolution_scale[1]);
+
+        if (config.verbose)
+        {
+            printf("dynamic resolution: %.2f ms GPU frame time, scale %.2f to %.2f, %s upscale\n", resolution.target_ms,
+                   resolution.min_scale, resolution.max_scale, upscale_filter == VK_FILTER_LINEAR ? "linear" : "nearest");
+        }
+    }
+
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    cmd_pool_info.queueFamilyIndex = graphics_queue_idx;
+
+    VkCommandPool cmd_pool;
+    res = vkCreateCommandPool(device, &cmd_pool_info, &g_vk_allocator, &cmd_pool);
+    assert(res == VK_SUCCESS);
+
+    VkCommandBufferAllocateInfo cmd_info = {};
+    cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_info.commandPool = cmd_pool;
+    cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_info.commandBufferCount = MAX_FRAMES_IN_FLIGHT;
+
+    for (uint32_t i = 0; i < view_count; ++i)
+    {
+        res = vkAllocateCommandBuffers(device, &cmd_info, views[i].cmds);
+        assert(res == VK_SUCCESS);
+    }
+
+    VkCommandPoolCreateInfo transfer_cmd_pool_info = {};
+    transfer_cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    transfer_cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    transfer_cmd_pool_info.queueFamilyIndex = transfer_queue_idx;
+
+    VkCommandPool transfer_cmd_pool;
+    res = vkCreateCommandPool(device, &transfer_cmd_pool_info, &g_vk_allocator, &transfer_cmd_pool);
+    assert(res == VK_SUCCESS);
+
+    VkCommandBufferAllocateInfo transfer_cmd_info = {};
+    transfer_cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    transfer_cmd_info.commandPool = transfer_cmd_pool;
+    transfer_cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    transfer_cmd_info.commandBufferCount = 1;
+
+    VkCommandBuffer transfer_cmd;
+    res = vkAllocateCommandBuffers(device, &transfer_cmd_info, &transfer_cmd);
+    assert(res == VK_SUCCESS);
+    startup_phase_end(&startup_timeline, swapchain_phase);
+
+    const VkFormat depth_format = VK_FORMAT_D16_UNORM;
+    const VkSampleCountFlagBits samples = supported_sample_count(&gpu_properties.limits, config.samples);
+
+    if (samples != config.samples)
+        printf("%u samples requested, using %u\n", config.samples, samples);
+
+    VkSemaphore upload_complete_semaphore;
+    VkSemaphoreCreateInfo ucsci = {};
+    ucsci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    res = vkCreateSemaphore(device, &ucsci, &g_vk_allocator, &upload_complete_semaphore);
+    assert(res == VK_SUCCESS);
+
+    vertex_upload_task_t vertex_upload = {};
+    vertex_upload.device = device;
+    vertex_upload.memory = &gpu_memory;
+    vertex_upload.cmd = transfer_cmd;
+    vertex_upload.queue = transfer_queue;
+    vertex_upload.timeline = &transfer_timeline;
+    vertex_upload.transfer_queue_idx = transfer_queue_idx;
+    vertex_upload.graphics_queue_idx = graphics_queue_idx;
+    vertex_upload.upload_complete_semaphore = upload_complete_semaphore;
+
+    // With --procedural the vertices never exist on the CPU, the compute queue writes them and signals the same
+    // semaphore the upload would have.
+    procedural_task_t procedural = {};
+    procedural.device = device;
+    procedural.memory = &gpu_memory;
+    procedural.queue = compute_queue;
+    procedural.compute_queue_idx = compute_queue_idx;
+    procedural.graphics_queue_idx = graphics_queue_idx;
+    procedural.complete_semaphore = upload_complete_semaphore;
+    procedural.shader = &procedural_shader_task;
+
+    if (procedural_kind != PROCEDURAL_NONE)
+        procedural_describe(&procedural, procedural_kind, config.procedural_resolution, depth_prepass, &gpu_properties.limits);
+    else
+        task_wait(&thread_pool, &build_mesh_task);
+
+    const mesh_t* mesh = procedural_kind != PROCEDURAL_NONE ? &procedural.mesh : &mesh_task.mesh;
+    const uint32_t vertex_source_queue_idx = procedural_kind != PROCEDURAL_NONE ? compute_queue_idx : transfer_queue_idx;
+
+    // The position only stream for the depth pre-pass goes right after the interleaved vertices in the same buffer,
+    // followed by the indices of all LODs.
+    const uint32_t vertex_count = mesh->vertex_count;
+    const VkDeviceSize positions_offset = vertex_count * sizeof(vertex_t);
+    const VkDeviceSize positions_size = depth_prepass ? vertex_count * sizeof(float) * 4 : 0;
+    const VkDeviceSize index_offset = positions_offset + positions_size;
+    const VkDeviceSize index_size = mesh->index_count * sizeof(uint32_t);
+    task_t vertex_upload_task;
+
+    if (procedural_kind != PROCEDURAL_NONE)
+    {
+        assert(procedural.params.index_offset * sizeof(uint32_t) == index_offset);
+        task_init(&vertex_upload_task, "procedural geometry", generate_geometry, &procedural);
+        task_depends_on(&thread_pool, &vertex_upload_task, &procedural_shader_task.module_task);
+    }
+    else
+    {
+        uint8_t* vertex_data = arena_alloc(&startup_arena, index_offset + index_size, 16);
+        assert(vertex_data);
+        memcpy(vertex_data, mesh->vertices, positions_offset);
+        memcpy(vertex_data + index_offset, mesh->indices, index_size);
+
+        for (uint32_t i = 0; depth_prepass && i < vertex_count; ++i)
+        {
+            const vertex_t* v = &mesh->vertices[i];
+            float position[4] = {v->x, v->y, v->z, v->w};
+            memcpy(vertex_data + positions_offset + i * sizeof(position), position, sizeof(position));
+        }
+
+        vertex_upload.vertices = vertex_data;
+        vertex_upload.size = index_offset + index_size;
+        task_init(&vertex_upload_task, "vertex upload", upload_vertices, &vertex_upload);
+    }
+
+    thread_pool_submit(&thread_pool, &vertex_upload_task);
+
+    uint32_t descriptors_phase = startup_phase_begin(&startup_timeline, "uniforms, descriptors and render pass");
+
+    // The first window has the camera from the config, the others look at the scene from evenly spaced angles
+    // around the z axis.
+    vec3_t camera_pos = config.camera_pos;
+    for (uint32_t i = 0; i < view_count; ++i)
+        view_set_camera(&views[i], &config.camera_pos, &config.camera_rot, 2.0f * pi * i / view_count);
+
+    // The plain cube is a single instance at the origin. The LOD spheres start there and go away from the camera,
+    // alternating sides a bit so they don't hide behind each other.
+    const uint32_t instance_count = lod_instances > 0 ? lod_instances : 1;
+    scene_instance_t* instances = arena_alloc_array(&startup_arena, scene_instance_t, instance_count);
+    // A camera at the origin has no direction away from it, the spheres go along x then.
+    float camera_distance = sqrtf(camera_pos.x * camera_pos.x + camera_pos.y * camera_pos.y + camera_pos.z * camera_pos.z);
+    vec3_t away = {1, 0, 0};
+    if (camera_distance > 1e-6f)
+        away = (vec3_t){-camera_pos.x / camera_distance, -camera_pos.y / camera_distance, -camera_pos.z / camera_distance};
+    vec3_t side = {away.y, -away.x, 0};
+
+    // Every instance has its own MVP matrix in the uniform buffer, bound with a dynamic offset. With bindless the
+    // matrices are packed in a storage buffer that the vertex shader indexes with gl_InstanceIndex. Each frame in
+    // flight has its own copy per window, transform_slot_size apart, so matrices can change while earlier frames
+    // still render. The copies of frame slot s start at slot s * view_count.
+    VkDeviceSize uniform_alignment = gpu_properties.limits.minUniformBufferOffsetAlignment;
+    VkDeviceSize uniform_stride = (sizeof(mat4_t) + uniform_alignment - 1) / uniform_alignment * uniform_alignment;
+    if (use_bindless)
+    {
+        uniform_alignment = gpu_properties.limits.minStorageBufferOffsetAlignment;
+        uniform_stride = sizeof(mat4_t);
+    }
+    VkDeviceSize transform_slot_size = (uniform_stride * instance_count + uniform_alignment - 1) / uniform_alignment * uniform_alignment;
+
+    // The instances hang off a single root. Nothing moves them after startup unless they spin.
+    const quat_t no_rotation = {0, 0, 0, 1};
+    const vec3_t unit_scale = {1, 1, 1};
+    const vec3_t origin = {0, 0, 0};
+    transform_hierarchy_t transforms;
+    transform_hierarchy_create(&transforms, instance_count + 1, &startup_arena);
+    uint32_t* node_instances = arena_alloc_array(&startup_arena, uint32_t, instance_count + 1);
+    uint32_t scene_root = transform_add(&transforms, -1, &origin, &no_rotation, &unit_scale);
+    node_instances[scene_root] = -1;
+
+    for (uint32_t i = 0; i < instance_count; ++i)
+    {
+        float offset = 3.0f * i;
+        float sideways = (i % 2 ? 0.5f : -0.5f) * i;
+        instances[i].position.x = away.x * offset + side.x * sideways;
+        instances[i].position.y = away.y * offset + side.y * sideways;
+        instances[i].position.z = away.z * offset + side.z * sideways;
+        instances[i].uniform_offset = i * uniform_stride;
+        instances[i].transform = transform_add(&transforms, scene_root, &instances[i].position, &no_rotation, &unit_scale);
+        node_instances[instances[i].transform] = i;
+    }
+
+    for (uint32_t i = 0; i < view_count; ++i)
+    {
+        views[i].instances = arena_alloc_array(&startup_arena, scene_instance_t, instance_count);
+        memcpy(views[i].instances, instances, instance_count * sizeof(scene_instance_t));
+    }
+
+    transform_range_t* initial_transforms;
+    uint32_t initial_transform_count = transform_update(&transforms, &thread_pool, &startup_arena, &initial_transforms);
+
+    VkBufferCreateInfo uniform_ci = {};
+    uniform_ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    uniform_ci.usage = use_bindless ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT : VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    uniform_ci.size = transform_slot_size * MAX_FRAMES_IN_FLIGHT * view_count;
+    uniform_ci.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkBuffer uniform_buffer;
+    res = vkCreateBuffer(device, &uniform_ci, &g_vk_allocator, &uniform_buffer);
+    assert(res == VK_SUCCESS);
+
+    VkMemoryRequirements uniform_buffer_mem_reqs;
+    vkGetBufferMemoryRequirements(device, uniform_buffer, &uniform_buffer_mem_reqs);
+
+    gpu_allocation_t uniform_buffer_mem;
+    res = gpu_memory_alloc(&gpu_memory, &uniform_buffer_mem_reqs, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, &uniform_buffer_mem);
+    gpu_memory_check_startup(res, "the transforms");
+
+    // Stays mapped, changed matrices are written every frame.
+    uint8_t* mapped_uniform_data;
+    res = vkMapMemory(device, uniform_buffer_mem.memory, 0, uniform_buffer_mem_reqs.size, 0, (void**)&mapped_uniform_data);
+    assert(res == VK_SUCCESS);
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT * view_count; ++i)
+    {
+        scene_write_transforms(mapped_uniform_data + i * transform_slot_size, instances, node_instances, &transforms,
+                               initial_transforms, initial_transform_count, &views[i % view_count].proj_view);
+    }
+
+    res = vkBindBufferMemory(device, uniform_buffer, uniform_buffer_mem.memory, 0);
+    assert(res == VK_SUCCESS);
+
+    #define NUM_DESCRIPTOR_SETS 1
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool = VK_NULL_HANDLE;
+    VkDescriptorSet descriptor_sets[NUM_DESCRIPTOR_SETS];
+    bindless_table_t bindless = {};
+    uint32_t transform_buffers[MAX_FRAMES_IN_FLIGHT * MAX_WINDOWS] = {};
+
+    if (use_bindless)
+    {
+        bindless_create(&bindless, device, &indexing_properties);
+
+        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT * view_count; ++i)
+            transform_buffers[i] = bindless_add_storage_buffer(&bindless, uniform_buffer, i * transform_slot_size, uniform_stride * instance_count);
+
+        set_layout = bindless.set_layout;
+        descriptor_sets[0] = bindless.set;
+    }
+    else
+    {
+        VkDescriptorSetLayoutBinding layout_binding = {};
+        layout_binding.binding = 0;
+        layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        layout_binding.descriptorCount = 1;
+        layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+        VkDescriptorSetLayoutCreateInfo dslci = {};
+        dslci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        dslci.bindingCount = 1;
+        dslci.pBindings = &layout_binding;
+
+        res = vkCreateDescriptorSetLayout(device, &dslci, &g_vk_allocator, &set_layout);
+
+        VkDescriptorPoolSize dps[1];
+        dps[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        dps[0].descriptorCount = 1;
+
+        VkDescriptorPoolCreateInfo dpci = {};
+        dpci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        dpci.maxSets = 1;
+        dpci.poolSizeCount = 1;
+        dpci.pPoolSizes = dps;
+
+        res = vkCreateDescriptorPool(device, &dpci, &g_vk_allocator, &descriptor_pool);
+        assert(res == VK_SUCCESS);
+
+        VkDescriptorSetAllocateInfo dai[1];
+        dai[0].sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        dai[0].pNext = NULL;
+        dai[0].descriptorPool = descriptor_pool;
+        dai[0].descriptorSetCount = NUM_DESCRIPTOR_SETS;
+        dai[0].pSetLayouts = &set_layout;
+
+        res = vkAllocateDescriptorSets(device, dai, descriptor_sets);
+        assert(res == VK_SUCCESS);
+
+        VkWriteDescriptorSet writes[1];
+
+        VkDescriptorBufferInfo uniform_buffer_info = {};
+        uniform_buffer_info.buffer = uniform_buffer;
+        uniform_buffer_info.range = sizeof(mat4_t);
+
+        memset(writes, 0, sizeof(VkWriteDescriptorSet) * 1);
+        writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[0].dstSet = descriptor_sets[0];
+        writes[0].descriptorCount = 1;
+        writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        writes[0].pBufferInfo = &uniform_buffer_info;
+
+        vkUpdateDescriptorSets(device, 1, writes, 0, NULL);
+    }
+
+    VkPipelineLayoutCreateInfo plci = {};
+    plci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    plci.setLayoutCount = 1;
+    plci.pSetLayouts = &set_layout;
+
+    VkPushConstantRange push_range = {};
+    push_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    push_range.size = sizeof(bindless_push_t);
+
+    if (use_bindless)
+    {
+        plci.pushConstantRangeCount = 1;
+        plci.pPushConstantRanges = &push_range;
+    }
+
+    VkPipelineLayout pipeline_layout;
+    res = vkCreatePipelineLayout(device, &plci, &g_vk_allocator, &pipeline_layout);
+    assert(res == VK_SUCCESS);
+
+    startup_phase_end(&startup_timeline, descriptors_phase);
+
+    uint32_t render_graph_phase = startup_phase_begin(&startup_timeline, "render graph");
+
+    frame_capture_t capture;
+    if (capture_enabled && !capture_create(&capture, device, &gpu_memory, swapchain_extent, format, &capture_config))
+        capture_enabled = 0;
+
+    VkClearValue clear_values[2];
+    clear_values[0].color.float32[0] = 0.0f;
+    clear_values[0].color.float32[1] = 0.0f;
+    clear_values[0].color.float32[2] = 0.0f;
+    clear_values[0].color.float32[3] = 1.0f;
+    clear_values[1].depthStencil.depth = 1.0f;
+    clear_values[1].depthStencil.stencil = 0;
+
+    // The scene passes are filled in once the pipeline and vertex upload tasks are done.
+    capture_pass_t capture_pass = {};
+    capture_pass.capture = &capture;
+    capture_pass.index = -1;
+    upscale_pass_t upscale_pass = {};
+    upscale_pass.dst_extent = swapchain_extent;
+    upscale_pass.filter = upscale_filter;
+
+    // Every window has the same passes at its own size, except that only the first is scaled and captured. The
+    // pipelines are created for the first window's passes, the others have compatible render passes since the
+    // formats and sample counts are the same.
+    for (uint32_t vi = 0; vi < view_count; ++vi)
+    {
+        view_t* v = &views[vi];
+        render_graph_t* graph = &v->graph;
+        render_graph_init(graph, device, &gpu_memory);
+        if (use_dynamic_rendering)
+            render_graph_use_dynamic_rendering(graph);
+
+        // With dynamic resolution the scene renders into the top left of a transient image as big as the swapchain
+        // image, so a new scale is only a different render area, and the upscale pass blits that to the swapchain
+        // image. The blit is the first use of the swapchain image then, so the submit waits for it at the transfer
+        // stage and the scaled passes, which the scale is picked from, don't wait for it.
+        uint32_t scale_view = use_dynamic_resolution && vi == 0;
+        v->acquire_stage = scale_view ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        v->swapchain_image = render_graph_import_image(graph, "swapchain", format, v->extent, VK_IMAGE_ASPECT_COLOR_BIT,
+                                                       VK_IMAGE_LAYOUT_UNDEFINED, v->acquire_stage, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+        render_graph_mark_output(graph, v->swapchain_image);
+        uint32_t depth_image = render_graph_create_image(graph, "depth", depth_format, v->extent, VK_IMAGE_ASPECT_DEPTH_BIT, samples);
+
+        uint32_t scene_color_image = v->swapchain_image;
+        if (scale_view)
+            scene_color_image = render_graph_create_image(graph, "scene color", format, v->extent, VK_IMAGE_ASPECT_COLOR_BIT, VK_SAMPLE_COUNT_1_BIT);
+        v->scene_color_image = scene_color_image;
+
+        // With MSAA the scene renders into a multisampled transient image that is resolved into the scene color image.
+        uint32_t msaa_color_image = -1;
+        if (samples != VK_SAMPLE_COUNT_1_BIT)
+            msaa_color_image = render_graph_create_image(graph, "msaa color", format, v->extent, VK_IMAGE_ASPECT_COLOR_BIT, samples);
+
+        v->prepass_pass = -1;
+        if (depth_prepass)
+        {
+            v->prepass_pass = render_graph_add_pass(graph, "depth pre-pass", record_scene_pass, &v->prepass);
+            render_graph_pass_use(graph, v->prepass_pass, depth_image, RG_ACCESS_DEPTH_WRITE, &clear_values[1]);
+        }
+
+        v->scene_pass = render_graph_add_pass(graph, "scene", record_scene_pass, &v->scene);
+
+        // Only the scene passes are timed, the upscale waits for the swapchain image and the capture copy isn't part
+        // of rendering the window.
+        v->timed_passes = 1u << v->scene_pass;
+        if (v->prepass_pass != -1)
+            v->timed_passes |= 1u << v->prepass_pass;
+
+        if (msaa_color_image != -1)
+        {
+            render_graph_pass_use(graph, v->scene_pass, msaa_color_image, RG_ACCESS_COLOR_WRITE, &clear_values[0]);
+            render_graph_pass_use(graph, v->scene_pass, scene_color_image, RG_ACCESS_RESOLVE_WRITE, NULL);
+        }
+        else
+            render_graph_pass_use(graph, v->scene_pass, scene_color_image, RG_ACCESS_COLOR_WRITE, &clear_values[0]);
+
+        if (depth_prepass)
+            render_graph_pass_use(graph, v->scene_pass, depth_image, RG_ACCESS_DEPTH_READ, NULL);
+        else
+            render_graph_pass_use(graph, v->scene_pass, depth_image, RG_ACCESS_DEPTH_WRITE, &clear_values[1]);
+
+        if (scale_view)
+        {
+            uint32_t upscale_pass_index = render_graph_add_pass(graph, "upscale", record_upscale_pass, &upscale_pass);
+            render_graph_pass_use(graph, upscale_pass_index, scene_color_image, RG_ACCESS_TRANSFER_READ, NULL);
 
-    VkPipelineDepthStencilStateCreateInfo pdssci = {};
-    pdssci.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    pdssci.depthTestEnable = VK_TRUE;
-    pdssci.depthWriteEnable = VK_TRUE;
-    pdssci.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-    pdssci.depthBoundsTestEnable = VK_FALSE;
-    pdssci.minDepthBounds = 0;
-    pdssci.maxDepthBounds = 0;
-    pdssci.stencilTestEnable = VK_FALSE;
-    pdssci.back.failOp = VK_STENCIL_OP_KEEP;
-    pdssci.back.passOp = VK_STENCIL_OP_KEEP;
-    pdssci.back.compareOp = VK_COMPARE_OP_ALWAYS;
-    pdssci.back.compareMask = 0;
-    pdssci.back.reference = 0;
-    pdssci.back.depthFailOp = VK_STENCIL_OP_KEEP;
-    pdssci.back.writeMask = 0;
-    pdssci.front = pdssci.back;
-    
-    VkPipelineMultisampleStateCreateInfo pmsci = {};
-    pmsci.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    pmsci.rasterizationSamples = NUM_SAMPLES;
-    pmsci.sampleShadingEnable = VK_FALSE;
-    pmsci.alphaToCoverageEnable = VK_FALSE;
-    pmsci.alphaToOneEnable = VK_FALSE;
-    pmsci.minSampleShading = 0.0;
+            // The blit covers the whole swapchain image, the clear value only says nothing of it is read.
+            render_graph_pass_use(graph, upscale_pass_index, v->swapchain_image, RG_ACCESS_TRANSFER_WRITE, &clear_values[0]);
+        }
 
-    VkGraphicsPipelineCreateInfo pci = {};
-    pci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pci.layout = pipeline_layout;
-    pci.pVertexInputState = &pvisci;
-    pci.pInputAssemblyState = &piasci;
-    pci.pRasterizationState = &prsci;
-    pci.pColorBlendState = &pcbsci;
-    pci.pTessellationState = NULL;
-    pci.pMultisampleState = &pmsci;
-    pci.pDynamicState = &pdsci;
-    pci.pViewportState = &pvpsci;
-    pci.pDepthStencilState = &pdssci;
-    pci.pStages = shader_stages;
-    pci.stageCount = 2;
-    pci.renderPass = render_pass;
-    pci.subpass = 0;
+        if (capture_enabled && vi == 0)
+        {
+            uint32_t capture_pass_index = render_graph_add_pass(graph, "capture", record_capture_pass, &capture_pass);
+            render_graph_pass_use(graph, capture_pass_index, v->swapchain_image, RG_ACCESS_TRANSFER_READ, NULL);
+            render_graph_pass_side_effects(graph, capture_pass_index);
+        }
 
-    VkPipeline pipeline;
-    res = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pci, NULL, &pipeline);
-    assert(res == VK_SUCCESS);
+        gpu_memory_check_startup(render_graph_compile(graph), "the render graph images");
 
+        if (config.verbose && vi == 0)
+            render_graph_print(graph);
 
-    VkSemaphore image_acquired_semaphore;
-    VkSemaphoreCreateInfo iasci = {};
-    iasci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        if (scale_view)
+            upscale_pass.src = render_graph_image(graph, scene_color_image);
+    }
+    startup_phase_end(&startup_timeline, render_graph_phase);
+
+    pipeline_task_t pipeline_create = {};
+    pipeline_create.device = device;
+    pipeline_create.layout = pipeline_layout;
+    pipeline_create.render_pass = render_graph_render_pass(&views[0].graph, views[0].scene_pass);
+    pipeline_create.rendering = render_graph_pipeline_rendering(&views[0].graph, views[0].scene_pass);
+    pipeline_create.vertex_shader = scene_vertex_shader;
+    pipeline_create.fragment_shader = &fragment_shader_task;
+    pipeline_create.vertex_stride = sizeof(g_vb_solid_face_colors_Data[0]);
+    pipeline_create.samples = samples;
+    pipeline_create.depth_compare_op = depth_prepass ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS_OR_EQUAL;
+    pipeline_create.depth_write = !depth_prepass;
+    task_t pipeline_task;
+    task_init(&pipeline_task, "graphics pipeline", create_graphics_pipeline, &pipeline_create);
+    task_depends_on(&thread_pool, &pipeline_task, &scene_vertex_shader->module_task);
+    task_depends_on(&thread_pool, &pipeline_task, &fragment_shader_task.module_task);
+    thread_pool_submit(&thread_pool, &pipeline_task);
+
+    pipeline_task_t prepass_pipeline_create = {};
+    task_t prepass_pipeline_task;
+    task_init(&prepass_pipeline_task, "depth pre-pass pipeline", create_graphics_pipeline, &prepass_pipeline_create);
+
+    if (depth_prepass)
+    {
+        prepass_pipeline_create.device = device;
+        prepass_pipeline_create.layout = pipeline_layout;
+        prepass_pipeline_create.render_pass = render_graph_render_pass(&views[0].graph, views[0].prepass_pass);
+        prepass_pipeline_create.rendering = render_graph_pipeline_rendering(&views[0].graph, views[0].prepass_pass);
+        prepass_pipeline_create.vertex_shader = scene_vertex_shader;
+        prepass_pipeline_create.vertex_stride = sizeof(float) * 4;
+        prepass_pipeline_create.samples = samples;
+        prepass_pipeline_create.depth_only = 1;
+        prepass_pipeline_create.depth_compare_op = VK_COMPARE_OP_LESS_OR_EQUAL;
+        prepass_pipeline_create.depth_write = VK_TRUE;
+        task_depends_on(&thread_pool, &prepass_pipeline_task, &scene_vertex_shader->module_task);
+        thread_pool_submit(&thread_pool, &prepass_pipeline_task);
+    }
 
-    res = vkCreateSemaphore(device, &iasci, NULL, &image_acquired_semaphore);
-    assert(res == VK_SUCCESS);
+    uint32_t sync_phase = startup_phase_begin(&startup_timeline, "sync objects");
 
-    uint32_t current_buffer;
-    res = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, image_acquired_semaphore, VK_NULL_HANDLE, &current_buffer);
-    assert(res >= 0);
+    (void)g_vbData;
+    (void)g_vb_solid_face_colors_Data;
+    (void)g_vb_texture_Data;
 
-    VkCommandBufferBeginInfo cbbi = {};
-    cbbi.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    res = vkBeginCommandBuffer(cmd, &cbbi);
-    assert(res == VK_SUCCESS);
 
-    VkRenderPassBeginInfo rpbi = {};
-    rpbi.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    rpbi.renderPass = render_pass;
-    rpbi.framebuffer = framebuffers[current_buffer];
-    rpbi.renderArea.extent.width = swapchain_extent.width;
-    rpbi.renderArea.extent.height = swapchain_extent.height;
-    rpbi.clearValueCount = 2;
-    rpbi.pClearValues = clear_values;
+    // Graphics timeline value each frame slot was last submitted with, waiting on it before reusing the
+    // slot's command buffer and semaphore is all the frame pacing there is.
+    uint64_t frame_timeline_values[MAX_FRAMES_IN_FLIGHT] = {};
+    uint64_t frame_index = 0;
+
+    // Besides FRAME_ARENA_SIZE of scratch, each frame queues up to two draws per instance and window.
+    size_t frame_arena_size = FRAME_ARENA_SIZE + 2 * (size_t)instance_count * view_count * (sizeof(draw_packet_t) + 2 * sizeof(draw_sort_t));
+    arena_t frame_arenas[MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+        arena_create(&frame_arenas[i], frame_arena_size);
+    startup_phase_end(&startup_timeline, sync_phase);
+
+    uint32_t wait_phase = startup_phase_begin(&startup_timeline, "wait for pipeline and upload");
+    task_wait(&thread_pool, &pipeline_task);
+
+    if (depth_prepass)
+        task_wait(&thread_pool, &prepass_pipeline_task);
+    task_wait(&thread_pool, &vertex_upload_task);
+    gpu_memory_check_startup(procedural_kind != PROCEDURAL_NONE ? procedural.result : vertex_upload.result, "the geometry");
+    startup_phase_end(&startup_timeline, wait_phase);
+
+    // Without a transfer queue of its own the upload thread shares one with the render loop, submits and presents
+    // are then serialized with queue_mutex.
+    pthread_mutex_t queue_mutex;
+    pthread_mutex_init(&queue_mutex, NULL);
+    uint32_t transfer_queue_shared = transfer_queue == graphics_queue || transfer_queue == present_queue;
+    pthread_mutex_t* frame_queue_mutex = transfer_queue_shared ? &queue_mutex : NULL;
+
+    upload_service_t upload_service;
+    upload_service_create(&upload_service, device, &gpu_memory, transfer_queue, &transfer_timeline, frame_queue_mutex,
+                          transfer_queue_idx, graphics_queue_idx);
+
+    upload_test_t upload_test;
+    upload_test_start(&upload_test, config.upload_test_buffers, device, &upload_service, &thread_pool, &startup_arena);
+
+    uint32_t first_frame_phase = startup_phase_begin(&startup_timeline, "first frame");
+
+    VkPipeline pipeline = pipeline_create.pipeline;
+    VkBuffer vertex_buffer = procedural_kind != PROCEDURAL_NONE ? procedural.buffer : vertex_upload.vertex_buffer;
+
+    scene_pass_t scene = {};
+    scene.pipeline = pipeline;
+    scene.pipeline_layout = pipeline_layout;
+    scene.descriptor_sets = descriptor_sets;
+    scene.descriptor_set_count = NUM_DESCRIPTOR_SETS;
+    scene.bindless = use_bindless;
+    scene.vertex_buffer = vertex_buffer;
+    scene.index_offset = index_offset;
+    scene.mesh = mesh;
+    scene.instance_count = instance_count;
+    scene.draw_pass = 1;
+    uint32_t submitted_triangles = 0;
+    uint32_t submitted_draws = -1;
+
+    for (uint32_t i = 0; config.verbose && lod_instances > 0 && i < mesh->lod_count; ++i)
+        printf("lod %u: %u triangles, error %f\n", i, mesh->lods[i].index_count / 3, mesh->lods[i].error);
+
+    scene_pass_t prepass = scene;
+    prepass.pipeline = prepass_pipeline_create.pipeline;
+    prepass.vertex_offset = positions_offset;
+    prepass.draw_pass = 0;
+
+    bench.depth_prepass = depth_prepass;
+    bench.extent = swapchain_extent;
+
+    if (bench.frames_requested > 0)
+    {
+        VkQueryPoolCreateInfo qpci = {};
+        qpci.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        qpci.queryType = VK_QUERY_TYPE_OCCLUSION;
+        qpci.queryCount = MAX_FRAMES_IN_FLIGHT * BENCH_QUERIES_PER_FRAME;
 
-    vkCmdBeginRenderPass(cmd, &rpbi, VK_SUBPASS_CONTENTS_INLINE);
+        res = vkCreateQueryPool(device, &qpci, &g_vk_allocator, &bench.occlusion_pool);
+        assert(res == VK_SUCCESS);
 
-    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        if (enabled_features.pipelineStatisticsQuery)
+        {
+            qpci.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+            qpci.pipelineStatistics = PIPELINE_STATISTICS_FLAGS;
+            res = vkCreateQueryPool(device, &qpci, &g_vk_allocator, &bench.statistics_pool);
+            assert(res == VK_SUCCESS);
+        }
+        else
+            printf("bench: pipelineStatisticsQuery not supported, only occlusion queries are used\n");
+    }
 
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, NUM_DESCRIPTOR_SETS,
-                            descriptor_sets, 0, NULL);
+    // The bench only measures the first window's passes.
+    for (uint32_t i = 0; i < view_count; ++i)
+    {
+        view_t* v = &views[i];
+        v->scene = scene;
+        v->scene.instances = v->instances;
+        v->scene.extent = v->extent;
+        v->scene.draws = &v->draws;
+        v->prepass = prepass;
+        v->prepass.instances = v->instances;
+        v->prepass.extent = v->extent;
+        v->prepass.draws = &v->draws;
+
+        if (i == 0 && bench.occlusion_pool != VK_NULL_HANDLE)
+        {
+            v->scene.occlusion_pool = bench.occlusion_pool;
+            v->scene.statistics_pool = bench.statistics_pool;
+            v->scene.occlusion_flags = enabled_features.occlusionQueryPrecise ? VK_QUERY_CONTROL_PRECISE_BIT : 0;
+            v->prepass.occlusion_pool = v->scene.occlusion_pool;
+            v->prepass.statistics_pool = v->scene.statistics_pool;
+            v->prepass.occlusion_flags = v->scene.occlusion_flags;
+        }
+    }
 
-    const VkDeviceSize offsets[1] = {0};
-    vkCmdBindVertexBuffers(cmd, 0, 1, &vertex_buffer, offsets);
+    // Each window's passes are timed, for the per window GPU times printed at exit. The first window's timestamps
+    // also drive dynamic resolution and go into the trace.
+    const uint32_t view_timestamp_bits = queue_props[graphics_queue_idx].timestampValidBits;
+    const uint64_t view_tick_mask = view_timestamp_bits >= 64 ? ~0ull : (1ull << view_timestamp_bits) - 1;
 
-    VkViewport viewport = {};
-    viewport.height = swapchain_extent.height;
-    viewport.width = swapchain_extent.width;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-    viewport.x = 0;
-    viewport.y = 0;
-    vkCmdSetViewport(cmd, 0, NUM_VIEWPORTS, &viewport);
+    for (uint32_t i = 0; i < view_count && view_timestamp_bits > 0; ++i)
+    {
+        VkQueryPoolCreateInfo qpci = {};
+        qpci.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        qpci.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        qpci.queryCount = VIEW_QUERIES_PER_FRAME * MAX_FRAMES_IN_FLIGHT;
+        res = vkCreateQueryPool(device, &qpci, &g_vk_allocator, &views[i].timestamp_pool);
+        assert(res == VK_SUCCESS);
+    }
 
+    // With --cached-commands every window's pairs of swapchain image and frame slot get a command buffer that is
+    // recorded once and submitted again until something baked into it changes: pipelines, geometry, LOD selection
+    // or the swapchain, each of which bumps commands_version. The slot is part of the key since its query indices
+    // and its part of the transform buffer are. What changes every frame, like the instance matrices, only goes
+    // through that part of the transform buffer. Capturing copies to a different readback buffer every frame,
+    // so it keeps recording.
+    uint32_t use_cached_commands = config.cached_commands && !capture_enabled;
+    VkCommandPool cached_cmd_pool = VK_NULL_HANDLE;
+    uint64_t commands_version = 1;
+
+    if (use_cached_commands)
+    {
+        res = vkCreateCommandPool(device, &cmd_pool_info, &g_vk_allocator, &cached_cmd_pool);
+        assert(res == VK_SUCCESS);
 
-    VkRect2D scissor = {};
-    scissor.extent.width = swapchain_extent.width;
-    scissor.extent.height = swapchain_extent.height;
-    scissor.offset.x = 0;
-    scissor.offset.y = 0;
-    vkCmdSetScissor(cmd, 0, NUM_SCISSORS, &scissor);
+        for (uint32_t i = 0; i < view_count; ++i)
+            view_allocate_cached_cmds(&views[i], device, cached_cmd_pool, &startup_arena);
+    }
+    else if (config.cached_commands && config.verbose)
+        printf("commands: capturing, command buffers are recorded every frame\n");
 
-    vkCmdDraw(cmd, 12 * 3, 1, 0, 0);
+    bench.cached_commands = use_cached_commands;
 
-    vkCmdEndRenderPass(cmd);
+    transform_range_t* changed_transforms[MAX_FRAMES_IN_FLIGHT] = {};
+    uint32_t changed_transform_counts[MAX_FRAMES_IN_FLIGHT] = {};
 
-    res = vkEndCommandBuffer(cmd);
-    assert(res == VK_SUCCESS);
+    uint32_t run = 1;
+    while (run)
+    {
+        TRACE_BEGIN(frame);
+        TRACE_BEGIN(events);
+        xcb_generic_event_t* evt;
+        while ((evt = xcb_poll_for_event(c)))
+        {
+            switch(evt->response_type & ~0x80)
+            {
+                case XCB_KEY_PRESS: {
+                    if (((xcb_key_press_event_t*)evt)->detail == 9)
+                        run = 0;
+                } break;
+            }
+            free(evt);
+        }
+        TRACE_END(events, "events");
 
-    VkFenceCreateInfo fci = {};
-    VkFence fence;
-    fci.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    vkCreateFence(device, &fci, NULL, &fence);
+        if (!run)
+            break;
 
-    VkPipelineStageFlags psf = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    VkSubmitInfo si = {}; // can be mupltiple!!
-    si.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    si.pWaitDstStageMask = &psf;
-    si.commandBufferCount = 1;
-    si.pCommandBuffers = &cmd;
+        if (bench.frames_requested > 0 && frame_index == bench.frames_requested)
+            break;
 
-    #define FENCE_TIMEOUT 100000000
+        uint32_t frame_slot = frame_index % MAX_FRAMES_IN_FLIGHT;
+        TRACE_BEGIN(wait);
+        queue_timeline_wait(&graphics_timeline, frame_timeline_values[frame_slot]);
+        TRACE_END(wait, "wait for frame slot");
+        gpu_memory_begin_frame(&gpu_memory, frame_index);
 
-    res = vkQueueSubmit(graphics_queue, 1, &si, fence);
-    assert(res == VK_SUCCESS);
+        double scaled_gpu_ms = -1.0;
+
+        for (uint32_t i = 0; i < view_count && frame_index >= MAX_FRAMES_IN_FLIGHT; ++i)
+        {
+            if (views[i].timestamp_pool == VK_NULL_HANDLE)
+                continue;
+
+            double ms = view_collect_gpu_time(&views[i], device, frame_slot, gpu_properties.limits.timestampPeriod, view_tick_mask);
+
+            if (i == 0)
+                scaled_gpu_ms = ms;
+        }
+
+#ifdef XCB_VULKAN_TRACE
+        if (trace_gpu_enabled && frame_index >= MAX_FRAMES_IN_FLIGHT)
+            trace_gpu_collect(&trace_gpu, frame_submit_ns[frame_slot], &views[0].graph, views[0].pass_timestamps);
+#endif
+
+        // The render area, viewport and blit are baked into cached command buffers.
+        if (use_dynamic_resolution && scaled_gpu_ms >= 0.0 && dynamic_resolution_update(&resolution, (float)scaled_gpu_ms))
+        {
+            if (config.verbose)
+            {
+                printf("dynamic resolution: %ux%u, scale %.2f at %.2f ms\n", resolution.extent.width, resolution.extent.height,
+                       resolution.scale, resolution.gpu_ms);
+            }
+
+            ++commands_version;
+        }
+
+        upload_test_poll(&upload_test, &gpu_memory, frame_index);
+
+        uint64_t frame_start_ns = time_now_ns();
+
+        if (bench.occlusion_pool != VK_NULL_HANDLE && frame_index >= MAX_FRAMES_IN_FLIGHT)
+            bench_collect_queries(&bench, device, frame_slot);
+        deletion_queue_flush(&deletion_queue);
+        arena_reset(&frame_arenas[frame_slot]);
+
+        if (config.spin != 0.0f)
+        {
+            float angle = config.spin * pi / 180.0f * (time_now_ns() - startup_timeline.origin_ns) / 1e9f;
+            quat_t spin_rotation = {0, 0, sinf(angle * 0.5f), cosf(angle * 0.5f)};
+
+            for (uint32_t i = 0; i < instance_count; ++i)
+                transform_set(&transforms, instances[i].transform, &instances[i].position, &spin_rotation, &unit_scale);
+        }
+
+        // This slot's matrices were last written MAX_FRAMES_IN_FLIGHT frames ago, so they get what changed in this
+        // frame's update and in those of the frames in between. Their ranges live in the other frame arenas.
+        changed_transform_counts[frame_slot] = transform_update(&transforms, &thread_pool, &frame_arenas[frame_slot], &changed_transforms[frame_slot]);
+
+        for (uint32_t vi = 0; vi < view_count; ++vi)
+        {
+            view_t* v = &views[vi];
+            uint32_t transform_slot = frame_slot * view_count + vi;
 
-    do {
-        res = vkWaitForFences(device, 1, &fence, VK_TRUE, FENCE_TIMEOUT);
-    } while (res == VK_TIMEOUT);
+            if (v->stale_transform_slots & (1u << frame_slot))
+            {
+                transform_range_t all_nodes = {0, transforms.count};
+                scene_write_transforms(mapped_uniform_data + transform_slot * transform_slot_size, instances, node_instances, &transforms,
+                                       &all_nodes, 1, &v->proj_view);
+                v->stale_transform_slots &= ~(1u << frame_slot);
+            }
+
+            for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+            {
+                scene_write_transforms(mapped_uniform_data + transform_slot * transform_slot_size, instances, node_instances, &transforms,
+                                       changed_transforms[i], changed_transform_counts[i], &v->proj_view);
+            }
+
+            v->scene.transform_offset = transform_slot * transform_slot_size;
+            v->scene.transform_buffer = transform_buffers[transform_slot];
+            v->prepass.transform_offset = v->scene.transform_offset;
+            v->prepass.transform_buffer = v->scene.transform_buffer;
+        }
+
+        if (capture_enabled)
+        {
+            capture_poll(&capture, &graphics_timeline);
+
+            if (capture_finished(&capture))
+                break;
+        }
+
+        // A window whose swapchain went out of date, here or at an earlier present, gets a new one at the surface's
+        // current size first. Its old images, semaphores and render graph images go to the deletion queue, frames in
+        // flight keep using them. Only that window's matrices, command buffers and, for the first window, the scaled
+        // size and blit depend on the size. This frame slot's matrices are no longer read by the GPU and are written
+        // right away, the other slots' when their frames come up.
+        uint64_t acquire_start_ns = time_now_ns();
+        for (uint32_t i = 0; i < view_count && run; ++i)
+        {
+            view_t* v = &views[i];
+
+            do
+            {
+                if (v->swapchain_stale)
+                {
+                    VkExtent2D old_extent = v->extent;
+                    res = view_recreate_swapchain(v, gpu, device, &deletion_queue, &startup_arena);
+
+                    if (res != VK_SUCCESS)
+                    {
+                        printf("couldn't allocate device memory for the render graph images of window %u at %ux%u (VkResult %d)\n",
+                               i, v->extent.width, v->extent.height, res);
+                        run = 0;
+                        break;
+                    }
+
+                    if (config.verbose)
+                        printf("swapchain: window %u recreated at %ux%u\n", i, v->extent.width, v->extent.height);
+
+                    if (v->extent.width != old_extent.width || v->extent.height != old_extent.height)
+                    {
+                        view_set_camera(v, &config.camera_pos, &config.camera_rot, 2.0f * pi * i / view_count);
+                        transform_range_t all_nodes = {0, transforms.count};
+                        scene_write_transforms(mapped_uniform_data + (frame_slot * view_count + i) * transform_slot_size, instances,
+                                               node_instances, &transforms, &all_nodes, 1, &v->proj_view);
+                        v->stale_transform_slots = ((1u << MAX_FRAMES_IN_FLIGHT) - 1) & ~(1u << frame_slot);
+
+                        if (i == 0)
+                        {
+                            upscale_pass.dst_extent = v->extent;
+                            bench.extent = v->extent;
+
+                            if (use_dynamic_resolution)
+                            {
+                                dynamic_resolution_resize(&resolution, v->extent);
+                                upscale_pass.src = render_graph_image(&v->graph, v->scene_color_image);
+                            }
+
+                            if (capture_enabled && capture_wants_frames(&capture))
+                            {
+                                printf("capture: window resized, stopped after %llu frames\n", (unsigned long long)capture.frames_recorded);
+                                capture_stop(&capture);
+                            }
+                        }
+                    }
+
+                    if (use_cached_commands && v->image_count * MAX_FRAMES_IN_FLIGHT > v->cached_cmd_count)
+                        view_allocate_cached_cmds(v, device, cached_cmd_pool, &startup_arena);
+
+                    ++commands_version;
+                }
+
+                res = vkAcquireNextImageKHR(device, v->swapchain, UINT64_MAX, v->image_acquired_semaphores[frame_slot], VK_NULL_HANDLE,
+                                            &v->current_buffer);
+                v->swapchain_stale = res == VK_SUBOPTIMAL_KHR || res == VK_ERROR_OUT_OF_DATE_KHR;
+            } while (res == VK_ERROR_OUT_OF_DATE_KHR);
+
+            assert(res >= 0 || !run);
+        }
+        uint64_t acquire_end_ns = time_now_ns();
+        TRACE_ADD("acquire", acquire_start_ns, acquire_end_ns);
+
+        if (!run)
+            break;
+
+        VkExtent2D render_extent = use_dynamic_resolution ? resolution.extent : views[0].extent;
+
+        if (frame_index == 0)
+            bench.start_ns = acquire_end_ns;
+
+        // The cameras don't move yet, but the selection is cheap enough to redo every frame.
+        uint32_t lods_changed = 0;
+        uint32_t triangles = 0;
+
+        for (uint32_t i = 0; i < view_count; ++i)
+        {
+            uint32_t view_lods_changed;
+            float bb_height = (float)(i == 0 ? render_extent.height : views[i].extent.height);
+            triangles += scene_select_lods(views[i].instances, instance_count, mesh, &views[i].camera_pos, bb_height, &view_lods_changed);
+            lods_changed |= view_lods_changed;
+        }
+
+        if (lods_changed)
+            ++commands_version;
+
+        if (config.verbose && lod_instances > 0 && triangles != submitted_triangles)
+        {
+            printf("lod: %u instances, %u triangles submitted per pass, %u at full detail\n", instance_count * view_count, triangles,
+                   instance_count * view_count * mesh->lods[0].index_count / 3);
+            submitted_triangles = triangles;
+        }
+
+        // The first frame also takes the vertex buffer over from the transfer queue, so it is never cached. The
+        // first window's command buffer does that, it comes first in the submit.
+        uint64_t record_start_ns = time_now_ns();
+        VkCommandBuffer cmds[MAX_WINDOWS];
+        uint32_t recorded = 0;
+
+        for (uint32_t vi = 0; vi < view_count; ++vi)
+        {
+            view_t* v = &views[vi];
+            uint64_t view_record_start_ns = time_now_ns();
+            VkCommandBuffer cmd = v->cmds[frame_slot];
+            uint32_t record = 1;
+
+            if (use_cached_commands && frame_index > 0)
+            {
+                uint32_t cached_index = v->current_buffer * MAX_FRAMES_IN_FLIGHT + frame_slot;
+                cmd = v->cached_cmds[cached_index];
+                record = v->cached_versions[cached_index] != commands_version;
+                v->cached_versions[cached_index] = commands_version;
+            }
+
+            cmds[vi] = cmd;
+
+            if (!record)
+                continue;
+
+            draw_queue_begin(&v->draws, 2 * instance_count, &frame_arenas[frame_slot]);
+
+            if (depth_prepass)
+                scene_queue_draws(&v->prepass, 1, &v->camera_pos);
+
+            scene_queue_draws(&v->scene, 0, &v->camera_pos);
+            draw_queue_sort(&v->draws);
+
+            if (config.verbose && vi == 0 && v->draws.count != submitted_draws)
+            {
+                uint32_t submitted_changes = 0;
+                uint32_t sorted_changes = 0;
+
+                for (uint32_t i = 0; i < DRAW_STATE_COUNT; ++i)
+                {
+                    submitted_changes += v->draws.submitted_changes[i];
+                    sorted_changes += v->draws.sorted_changes[i];
+                }
+
+                printf("draws: %u, state changes %u in submission order, %u sorted (pipeline %u, descriptor sets %u, vertex buffer %u, index buffer %u)\n",
+                       v->draws.count, submitted_changes, sorted_changes, v->draws.sorted_changes[DRAW_STATE_PIPELINE],
+                       v->draws.sorted_changes[DRAW_STATE_DESCRIPTOR_SETS], v->draws.sorted_changes[DRAW_STATE_VERTEX_BUFFER],
+                       v->draws.sorted_changes[DRAW_STATE_INDEX_BUFFER]);
+                submitted_draws = v->draws.count;
+            }
+
+            VkCommandBufferBeginInfo cbbi = {};
+            cbbi.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            cbbi.flags = cmd == v->cmds[frame_slot] ? VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT : 0;
+            res = vkBeginCommandBuffer(cmd, &cbbi);
+            assert(res == VK_SUCCESS);
+
+            if (v->timestamp_pool != VK_NULL_HANDLE)
+            {
+                vkCmdResetQueryPool(cmd, v->timestamp_pool, frame_slot * VIEW_QUERIES_PER_FRAME, VIEW_QUERIES_PER_FRAME);
+                render_graph_set_timestamps(&v->graph, v->timestamp_pool, frame_slot * VIEW_QUERIES_PER_FRAME);
+            }
+
+            const swapchain_buffer_t* buffer = &v->buffers[v->current_buffer];
+            VkExtent2D extent = v->extent;
+
+            if (vi == 0)
+            {
+                if (use_dynamic_resolution)
+                {
+                    render_graph_set_render_area(&v->graph, v->scene_pass, render_extent);
+
+                    if (v->prepass_pass != -1)
+                        render_graph_set_render_area(&v->graph, v->prepass_pass, render_extent);
+                }
+
+                extent = render_extent;
+                upscale_pass.src_extent = render_extent;
+                upscale_pass.dst = buffer->image;
+
+                if (bench.occlusion_pool != VK_NULL_HANDLE)
+                {
+                    vkCmdResetQueryPool(cmd, bench.occlusion_pool, frame_slot * BENCH_QUERIES_PER_FRAME, BENCH_QUERIES_PER_FRAME);
+
+                    if (bench.statistics_pool != VK_NULL_HANDLE)
+                        vkCmdResetQueryPool(cmd, bench.statistics_pool, frame_slot * BENCH_QUERIES_PER_FRAME, BENCH_QUERIES_PER_FRAME);
+
+                    v->prepass.query = frame_slot * BENCH_QUERIES_PER_FRAME + BENCH_QUERY_PREPASS;
+                    v->scene.query = frame_slot * BENCH_QUERIES_PER_FRAME + BENCH_QUERY_COLOR;
+                }
+
+                if (frame_index == 0)
+                {
+                    cmd_buffer_ownership_barrier(cmd, vertex_buffer, vertex_source_queue_idx, graphics_queue_idx,
+                                                 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+                                                 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT);
+                }
+
+                capture_pass.image = buffer->image;
+                capture_pass.frame = frame_index;
+            }
+
+            v->scene.extent = extent;
+            v->prepass.extent = extent;
+            render_graph_set_image(&v->graph, v->swapchain_image, buffer->image, buffer->view);
+            render_graph_execute(&v->graph, cmd);
+
+            res = vkEndCommandBuffer(cmd);
+            assert(res == VK_SUCCESS);
+
+            ++recorded;
+            v->record_ns += time_now_ns() - view_record_start_ns;
+            ++v->record_frames;
+        }
+
+        uint64_t record_end_ns = time_now_ns();
+        TRACE_ADD(recorded ? "record" : "cached commands", record_start_ns, record_end_ns);
+
+        // All windows go into one submit, which waits for each of their images and signals one semaphore per
+        // window for the present. Only the first frame has to wait for the vertex upload.
+        VkSemaphore wait_semaphores[MAX_WINDOWS + 1];
+        VkPipelineStageFlags psf[MAX_WINDOWS + 1];
+        VkSemaphore render_complete_semaphores[MAX_WINDOWS];
+        VkSwapchainKHR swapchains[MAX_WINDOWS];
+        uint32_t image_indices[MAX_WINDOWS];
+        VkResult present_results[MAX_WINDOWS];
+
+        for (uint32_t i = 0; i < view_count; ++i)
+        {
+            wait_semaphores[i] = views[i].image_acquired_semaphores[frame_slot];
+            psf[i] = views[i].acquire_stage;
+            render_complete_semaphores[i] = views[i].render_complete_semaphores[views[i].current_buffer];
+            swapchains[i] = views[i].swapchain;
+            image_indices[i] = views[i].current_buffer;
+        }
+
+        wait_semaphores[view_count] = upload_complete_semaphore;
+        psf[view_count] = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+
+        VkSubmitInfo si = {};
+        si.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        si.waitSemaphoreCount = frame_index == 0 ? view_count + 1 : view_count;
+        si.pWaitSemaphores = wait_semaphores;
+        si.pWaitDstStageMask = psf;
+        si.commandBufferCount = view_count;
+        si.pCommandBuffers = cmds;
+        si.signalSemaphoreCount = view_count;
+        si.pSignalSemaphores = render_complete_semaphores;
+
+        if (frame_queue_mutex)
+            pthread_mutex_lock(frame_queue_mutex);
+
+        frame_timeline_values[frame_slot] = queue_timeline_submit(&graphics_timeline, graphics_queue, &si);
+
+        if (frame_queue_mutex)
+            pthread_mutex_unlock(frame_queue_mutex);
+        uint64_t submit_end_ns = time_now_ns();
+        TRACE_ADD("submit", record_end_ns, submit_end_ns);
+#ifdef XCB_VULKAN_TRACE
+        frame_submit_ns[frame_slot] = submit_end_ns;
+#endif
+
+        bench.recorded_frames += recorded > 0;
+
+        if (frame_index > 0)
+        {
+            bench.cpu_ns += (acquire_start_ns - frame_start_ns) + (submit_end_ns - acquire_end_ns);
+            bench.record_ns += record_end_ns - record_start_ns;
+            ++bench.cpu_frames;
+        }
+
+        if (capture_enabled)
+            capture_submitted(&capture, capture_pass.index, frame_timeline_values[frame_slot]);
+
+        if (frame_index == 0 && procedural_kind == PROCEDURAL_NONE)
+        {
+            // This frame waited on the upload, once it retires the staging copy is done too.
+            deletion_queue_push(&deletion_queue, DEFERRED_DESTROY_BUFFER, (deferred_handle_t){.buffer = vertex_upload.staging_buffer});
+            deletion_queue_push(&deletion_queue, DEFERRED_DESTROY_MEMORY, (deferred_handle_t){.memory = vertex_upload.staging_memory});
+        }
+
+        VkPresentInfoKHR pi = {};
+        pi.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        pi.waitSemaphoreCount = view_count;
+        pi.pWaitSemaphores = render_complete_semaphores;
+        pi.swapchainCount = view_count;
+        pi.pSwapchains = swapchains;
+        pi.pImageIndices = image_indices;
+        pi.pResults = present_results;
+
+        TRACE_BEGIN(present);
+
+        if (frame_queue_mutex)
+            pthread_mutex_lock(frame_queue_mutex);
+
+        res = vkQueuePresentKHR(present_queue, &pi);
+
+        if (frame_queue_mutex)
+            pthread_mutex_unlock(frame_queue_mutex);
+
+        // An out of date swapchain didn't present, it and a suboptimal one are recreated at the next acquire.
+        assert(res >= 0 || res == VK_ERROR_OUT_OF_DATE_KHR);
+        for (uint32_t i = 0; i < view_count; ++i)
+        {
+            assert(present_results[i] >= 0 || present_results[i] == VK_ERROR_OUT_OF_DATE_KHR);
+            views[i].swapchain_stale |= present_results[i] != VK_SUCCESS;
+        }
+        TRACE_END(present, "present");
+
+        if (frame_index == 0)
+        {
+            startup_phase_end(&startup_timeline, first_frame_phase);
+            startup_timeline_add_task(&startup_timeline, &x_window_task);
+            if (procedural_kind != PROCEDURAL_NONE)
+                startup_timeline_add_task(&startup_timeline, &procedural_shader_task.module_task);
+            else
+                startup_timeline_add_task(&startup_timeline, &build_mesh_task);
+            startup_timeline_add_task(&startup_timeline, &scene_vertex_shader->load_task);
+            startup_timeline_add_task(&startup_timeline, &fragment_shader_task.load_task);
+            startup_timeline_add_task(&startup_timeline, &scene_vertex_shader->module_task);
+            startup_timeline_add_task(&startup_timeline, &fragment_shader_task.module_task);
+            startup_timeline_add_task(&startup_timeline, &vertex_upload_task);
+            startup_timeline_add_task(&startup_timeline, &pipeline_task);
+            if (depth_prepass)
+                startup_timeline_add_task(&startup_timeline, &prepass_pipeline_task);
+
+            if (config.verbose)
+            {
+                startup_timeline_print(&startup_timeline);
+                printf("time to first frame: %.2f ms\n", (time_now_ns() - startup_timeline.origin_ns) / 1e6);
+            }
+        }
+
+        TRACE_END(frame, "frame");
+        ++frame_index;
+    }
+
+    // The upload thread has to be gone before vkDeviceWaitIdle, which needs every queue to itself.
+    upload_test_wait(&upload_test, &thread_pool);
+
+    upload_service_destroy(&upload_service);
+    pthread_mutex_destroy(&queue_mutex);
+    if (config.verbose)
+        printf("upload: %llu requests in %llu batches, %.1f MB\n", (unsigned long long)upload_service.requests,
+               (unsigned long long)upload_service.batches, upload_service.bytes / 1048576.0);
+
+    res = vkDeviceWaitIdle(device);
     assert(res == VK_SUCCESS);
 
-    vkDestroyFence(device, fence, NULL);
+    upload_test_destroy(&upload_test, &gpu_memory);
+
+    if (bench.occlusion_pool != VK_NULL_HANDLE)
+    {
+        bench.end_ns = time_now_ns();
 
-    VkPresentInfoKHR pi = {};
-    pi.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    pi.swapchainCount = 1;
-    pi.pSwapchains = &swapchain;
-    pi.pImageIndices = &current_buffer;
+        for (uint64_t i = frame_index > MAX_FRAMES_IN_FLIGHT ? frame_index - MAX_FRAMES_IN_FLIGHT : 0; i < frame_index; ++i)
+            bench_collect_queries(&bench, device, i % MAX_FRAMES_IN_FLIGHT);
 
-    res = vkQueuePresentKHR(present_queue, &pi);
+        bench_print(&bench, frame_index);
+        vkDestroyQueryPool(device, bench.occlusion_pool, &g_vk_allocator);
 
-    xcb_generic_event_t* evt;
-    uint32_t run = 1;
-    while (run && (evt = xcb_wait_for_event(c)))
+        if (bench.statistics_pool != VK_NULL_HANDLE)
+            vkDestroyQueryPool(device, bench.statistics_pool, &g_vk_allocator);
+    }
+
+    if (config.verbose)
+        gpu_memory_print(&gpu_memory);
+
+    if (use_dynamic_resolution && config.verbose)
+    {
+        printf("dynamic resolution: ended at %ux%u, scale %.2f, %.2f ms of %.2f ms, %u changes\n", resolution.extent.width,
+               resolution.extent.height, resolution.scale, resolution.gpu_ms, resolution.target_ms, resolution.changes);
+    }
+
+    for (uint32_t v = 0; v < view_count; ++v)
     {
-        switch(evt->response_type & ~0x80)
+        for (uint64_t i = frame_index > MAX_FRAMES_IN_FLIGHT ? frame_index - MAX_FRAMES_IN_FLIGHT : 0;
+             views[v].timestamp_pool != VK_NULL_HANDLE && i < frame_index; ++i)
+        {
+            view_collect_gpu_time(&views[v], device, i % MAX_FRAMES_IN_FLIGHT, gpu_properties.limits.timestampPeriod, view_tick_mask);
+
+#ifdef XCB_VULKAN_TRACE
+            if (trace_gpu_enabled && v == 0)
+                trace_gpu_collect(&trace_gpu, frame_submit_ns[i % MAX_FRAMES_IN_FLIGHT], &views[0].graph, views[0].pass_timestamps);
+#endif
+        }
+
+        if (config.verbose && view_count > 1)
         {
-            case XCB_KEY_PRESS: {
-                if (((xcb_key_press_event_t*)evt)->detail == 9)
-                    run = 0;
-            } break;
+            printf("window %u: %ux%u, %.3f ms recording per frame, %.3f ms GPU per frame\n", v, views[v].extent.width,
+                   views[v].extent.height, views[v].record_frames ? views[v].record_ns / 1e6 / views[v].record_frames : 0.0,
+                   views[v].gpu_frames ? views[v].gpu_ns / 1e6 / views[v].gpu_frames : 0.0);
         }
-        free(evt);
     }
-    
-    for (uint32_t i = 0; i < swapchain_image_count; i++) {
-        vkDestroyFramebuffer(device, framebuffers[i], NULL);
-    }
-    free(framebuffers);
-    vkDestroyPipeline(device, pipeline, NULL);
-    vkDestroyBuffer(device, vertex_buffer, NULL);
-    vkFreeMemory(device, vertex_buffer_memory, NULL);
-    vkDestroyShaderModule(device, shader_stages[0].module, NULL);
-    vkDestroyShaderModule(device, shader_stages[1].module, NULL);
-    vkDestroyRenderPass(device, render_pass, NULL);
-    vkDestroySemaphore(device, image_acquired_semaphore, NULL);
-    vkDestroyDescriptorPool(device, descriptor_pool, NULL);
-    vkDestroyDescriptorSetLayout(device, set_layout, NULL);
-    vkDestroyPipelineLayout(device, pipeline_layout, NULL);
-    vkDestroyBuffer(device, uniform_buffer, NULL);
-    vkFreeMemory(device, uniform_buffer_mem, NULL);
-    vkDestroyImageView(device, depth_view, NULL);
-    vkDestroyImage(device, depth_image, NULL);
-    vkFreeMemory(device, depth_mem, NULL);
-    VkCommandBuffer bufs_to_free[1] = {cmd};
-    vkFreeCommandBuffers(device, cmd_pool, 1, bufs_to_free);
-    vkDestroyCommandPool(device, cmd_pool, NULL);
-    for (uint32_t i = 0; i < swapchain_image_count; i++) {
-        vkDestroyImageView(device, swapchain_buffers[i].view, NULL);
-    }
-    vkDestroySwapchainKHR(device, swapchain, NULL);
-    vkDestroyDevice(device, NULL);
-    free(gpus);
-    free(queue_props);
-    vkDestroyDebugUtilsMessengerEXT(instance, debug_messenger, NULL);
-    vkDestroyInstance(instance, NULL);
+
+    // Closed before the first frame, so the staging buffer never made it into the deletion queue.
+    if (frame_index == 0 && procedural_kind == PROCEDURAL_NONE)
+    {
+        vkDestroyBuffer(device, vertex_upload.staging_buffer, &g_vk_allocator);
+        gpu_memory_free(&gpu_memory, &vertex_upload.staging_memory);
+    }
+
+    deletion_queue_destroy(&deletion_queue);
+
+    uint32_t golden_failures = 0;
+    if (capture_enabled)
+        golden_failures = capture_destroy(&capture, &graphics_timeline);
+
+    for (uint32_t i = 0; i < view_count; ++i)
+        view_destroy(&views[i], device);
+    vkDestroyPipeline(device, pipeline, &g_vk_allocator);
+    if (depth_prepass)
+        vkDestroyPipeline(device, prepass.pipeline, &g_vk_allocator);
+    vkDestroyBuffer(device, vertex_buffer, &g_vk_allocator);
+    gpu_memory_free(&gpu_memory, procedural_kind != PROCEDURAL_NONE ? &procedural.buffer_memory : &vertex_upload.vertex_memory);
+    if (procedural_kind != PROCEDURAL_NONE)
+    {
+        procedural_destroy(&procedural);
+        vkDestroyShaderModule(device, procedural_shader_task.module, &g_vk_allocator);
+    }
+    vkDestroyShaderModule(device, scene_vertex_shader->module, &g_vk_allocator);
+    vkDestroyShaderModule(device, fragment_shader_task.module, &g_vk_allocator);
+    vkDestroySemaphore(device, upload_complete_semaphore, &g_vk_allocator);
+    queue_timeline_destroy(&graphics_timeline);
+    queue_timeline_destroy(&transfer_timeline);
+    if (use_bindless)
+        bindless_destroy(&bindless);
+    else
+    {
+        vkDestroyDescriptorPool(device, descriptor_pool, &g_vk_allocator);
+        vkDestroyDescriptorSetLayout(device, set_layout, &g_vk_allocator);
+    }
+    vkDestroyPipelineLayout(device, pipeline_layout, &g_vk_allocator);
+    vkDestroyBuffer(device, uniform_buffer, &g_vk_allocator);
+    vkUnmapMemory(device, uniform_buffer_mem.memory);
+    gpu_memory_free(&gpu_memory, &uniform_buffer_mem);
+    for (uint32_t i = 0; i < view_count; ++i)
+        vkFreeCommandBuffers(device, cmd_pool, MAX_FRAMES_IN_FLIGHT, views[i].cmds);
+    vkDestroyCommandPool(device, cmd_pool, &g_vk_allocator);
+    if (use_cached_commands)
+    {
+        for (uint32_t i = 0; i < view_count; ++i)
+            vkFreeCommandBuffers(device, cached_cmd_pool, views[i].cached_cmd_count, views[i].cached_cmds);
+        vkDestroyCommandPool(device, cached_cmd_pool, &g_vk_allocator);
+    }
+    vkFreeCommandBuffers(device, transfer_cmd_pool, 1, &transfer_cmd);
+    vkDestroyCommandPool(device, transfer_cmd_pool, &g_vk_allocator);
+    gpu_memory_destroy(&gpu_memory);
+    vkDestroyDevice(device, &g_vk_allocator);
+    if (debug_messenger != VK_NULL_HANDLE)
+        vkDestroyDebugUtilsMessengerEXT(instance, debug_messenger, &g_vk_allocator);
+    for (uint32_t i = 0; i < view_count; ++i)
+        vkDestroySurfaceKHR(instance, views[i].surface, &g_vk_allocator);
+    vkDestroyInstance(instance, &g_vk_allocator);
     xcb_disconnect(c);
+    thread_pool_destroy(&thread_pool);
 
-    return 0;
+#ifdef XCB_VULKAN_TRACE
+    if (config.trace)
+        trace_write(config.trace, startup_timeline.origin_ns);
+#endif
+
+    size_t frame_arena_high_water = 0;
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+    {
+        if (frame_arenas[i].high_water > frame_arena_high_water)
+            frame_arena_high_water = frame_arenas[i].high_water;
+
+        arena_destroy(&frame_arenas[i]);
+    }
+
+    if (config.verbose)
+    {
+        printf("host memory: startup arena %zu of %zu bytes, frame arena high water %zu of %zu bytes\n",
+               startup_arena.high_water, startup_arena.capacity, frame_arena_high_water, frame_arena_size);
+        printf("host memory: vulkan %zu allocations, peak %zu bytes, %zu allocations (%zu bytes) not freed, %zu internal bytes\n",
+               atomic_load(&g_vk_host_allocation_stats.allocation_count), atomic_load(&g_vk_host_allocation_stats.peak_bytes),
+               atomic_load(&g_vk_host_allocation_stats.live_allocations), atomic_load(&g_vk_host_allocation_stats.live_bytes),
+               atomic_load(&g_vk_host_allocation_stats.internal_bytes));
+    }
+
+    arena_destroy(&mesh_task.arena);
+    arena_destroy(&startup_arena);
+
+    return golden_failures > 0;
 }